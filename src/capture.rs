@@ -0,0 +1,270 @@
+//! Packet capture and replay.
+//!
+//! A capture file holds the datagrams an endpoint received, each with its arrival
+//! time and source address, so the traffic can be fed through the same code again.
+//! The receiving thread only copies each datagram into a ring; a background thread
+//! drains the ring to the file. Neither side locks, and when the writer falls
+//! behind datagrams are dropped from the capture and counted rather than stalling
+//! the receiver.
+//!
+//! The file starts with an 8 byte magic and the capture's start time as Unix
+//! microseconds (u64). Each record is [offset_us u64][port u16][family u8]
+//! [address 16 bytes][length u16][datagram], little endian, where offset_us counts
+//! from the start and IPv4 addresses fill the first 4 address bytes.
+
+use std::cell::UnsafeCell;
+use std::fs::File;
+use std::io::{BufReader, Error, ErrorKind, Read, Write};
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr};
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant, SystemTime};
+
+pub const CAPTURE_MAGIC: [u8; 8] = *b"NEONCAP1";
+pub const FILE_HEADER_SIZE: usize = 16;
+pub const RECORD_HEADER_SIZE: usize = 29;
+/// Ring size used by `CaptureWriter::create`, a few seconds of a busy relay
+pub const DEFAULT_RING_SIZE: usize = 8 * 1024 * 1024;
+/// How long the writer sleeps when the ring is empty
+const WRITER_IDLE: Duration = Duration::from_millis(2);
+
+struct Shared {
+    ring: Box<[UnsafeCell<u8>]>,
+    /// Bytes recorded and bytes written out, both counting up forever
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    closed: AtomicBool,
+    dropped: AtomicU64,
+}
+
+// Bytes between tail and head belong to the writer thread, the rest to the recorder
+unsafe impl Sync for Shared {}
+unsafe impl Send for Shared {}
+
+impl Shared {
+    fn base(&self) -> *mut u8 {
+        UnsafeCell::raw_get(self.ring.as_ptr())
+    }
+}
+
+/// Recording end of a capture, owned by the thread receiving datagrams
+pub struct CaptureWriter {
+    shared: Arc<Shared>,
+    head: usize,
+    start: Instant,
+    writer: Option<JoinHandle<Result<(), Error>>>,
+}
+
+impl CaptureWriter {
+    /// Start a capture at `path`, replacing any file there
+    pub fn create(path: impl AsRef<Path>) -> Result<Self, Error> {
+        Self::with_ring_size(path, DEFAULT_RING_SIZE)
+    }
+
+    /// Start a capture whose ring holds up to `ring_size` bytes of records
+    pub fn with_ring_size(path: impl AsRef<Path>, ring_size: usize) -> Result<Self, Error> {
+        let mut file = File::create(path)?;
+        let unix_us = SystemTime::now()
+            .duration_since(SystemTime::UNIX_EPOCH)
+            .unwrap_or_default()
+            .as_micros() as u64;
+        let mut header = [0u8; FILE_HEADER_SIZE];
+        header[..8].copy_from_slice(&CAPTURE_MAGIC);
+        header[8..].copy_from_slice(&unix_us.to_le_bytes());
+        file.write_all(&header)?;
+
+        let shared = Arc::new(Shared {
+            ring: (0..ring_size.max(RECORD_HEADER_SIZE + u16::MAX as usize)).map(|_| UnsafeCell::new(0)).collect(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            closed: AtomicBool::new(false),
+            dropped: AtomicU64::new(0),
+        });
+        let writer = {
+            let shared = Arc::clone(&shared);
+            std::thread::Builder::new()
+                .name("neon-capture".into())
+                .spawn(move || write_out(&shared, file))?
+        };
+
+        Ok(CaptureWriter { shared, head: 0, start: Instant::now(), writer: Some(writer) })
+    }
+
+    /// Record a datagram that arrived from `addr` at `at`. Returns false if it was
+    /// dropped because the ring is full.
+    pub fn record(&mut self, at: Instant, addr: SocketAddr, datagram: &[u8]) -> bool {
+        let shared = &*self.shared;
+        let len = RECORD_HEADER_SIZE + datagram.len();
+        let free = shared.ring.len() - (self.head - shared.tail.load(Ordering::Acquire));
+        if datagram.len() > u16::MAX as usize || len > free {
+            shared.dropped.fetch_add(1, Ordering::Relaxed);
+            log_limited!(crate::log::Level::Warn, 1, "Capture ring full, dropping datagram");
+            return false;
+        }
+
+        let mut header = [0u8; RECORD_HEADER_SIZE];
+        let offset_us = at.saturating_duration_since(self.start).as_micros() as u64;
+        header[..8].copy_from_slice(&offset_us.to_le_bytes());
+        header[8..10].copy_from_slice(&addr.port().to_le_bytes());
+        match addr.ip() {
+            IpAddr::V4(ip) => {
+                header[10] = 4;
+                header[11..15].copy_from_slice(&ip.octets());
+            }
+            IpAddr::V6(ip) => {
+                header[10] = 6;
+                header[11..27].copy_from_slice(&ip.octets());
+            }
+        }
+        header[27..29].copy_from_slice(&(datagram.len() as u16).to_le_bytes());
+
+        self.copy_in(&header);
+        self.copy_in(datagram);
+        self.shared.head.store(self.head, Ordering::Release);
+        true
+    }
+
+    /// Datagrams left out of the capture because the writer fell behind
+    pub fn dropped(&self) -> u64 {
+        self.shared.dropped.load(Ordering::Relaxed)
+    }
+
+    fn copy_in(&mut self, bytes: &[u8]) {
+        let size = self.shared.ring.len();
+        let offset = self.head % size;
+        let first = bytes.len().min(size - offset);
+        unsafe {
+            let base = self.shared.base();
+            std::ptr::copy_nonoverlapping(bytes.as_ptr(), base.add(offset), first);
+            std::ptr::copy_nonoverlapping(bytes[first..].as_ptr(), base, bytes.len() - first);
+        }
+        self.head += bytes.len();
+    }
+}
+
+impl Drop for CaptureWriter {
+    /// Write out everything recorded so far before returning
+    fn drop(&mut self) {
+        self.shared.closed.store(true, Ordering::Release);
+        if let Some(writer) = self.writer.take() {
+            match writer.join() {
+                Ok(Ok(())) => {}
+                Ok(Err(e)) => log_warn!("Capture writer failed: {}", e),
+                Err(_) => log_warn!("Capture writer panicked"),
+            }
+        }
+    }
+}
+
+/// Background half of a capture: move recorded bytes from the ring to the file
+fn write_out(shared: &Shared, mut file: File) -> Result<(), Error> {
+    let size = shared.ring.len();
+    let mut tail = 0;
+    loop {
+        // Read closed first so a record published just before it isn't missed
+        let closed = shared.closed.load(Ordering::Acquire);
+        let head = shared.head.load(Ordering::Acquire);
+        if head == tail {
+            if closed {
+                return file.flush();
+            }
+            std::thread::sleep(WRITER_IDLE);
+            continue;
+        }
+
+        let offset = tail % size;
+        let first = (head - tail).min(size - offset);
+        let (front, wrapped) = unsafe {
+            let base = shared.base();
+            (
+                std::slice::from_raw_parts(base.add(offset), first),
+                std::slice::from_raw_parts(base, head - tail - first),
+            )
+        };
+        file.write_all(front)?;
+        file.write_all(wrapped)?;
+        tail = head;
+        shared.tail.store(tail, Ordering::Release);
+    }
+}
+
+/// One datagram read back from a capture
+#[derive(Debug, Clone, Copy)]
+pub struct CaptureRecord {
+    /// Arrival time, counted from the start of the capture
+    pub offset: Duration,
+    pub addr: SocketAddr,
+}
+
+/// Reads a capture file record by record
+pub struct CaptureReader {
+    file: BufReader<File>,
+    /// When the capture started, as Unix microseconds
+    start_unix_us: u64,
+}
+
+impl CaptureReader {
+    pub fn open(path: impl AsRef<Path>) -> Result<Self, Error> {
+        let mut file = BufReader::new(File::open(path)?);
+        let mut header = [0u8; FILE_HEADER_SIZE];
+        file.read_exact(&mut header)?;
+        if header[..8] != CAPTURE_MAGIC {
+            return Err(Error::new(ErrorKind::InvalidData, "Not a Project Neon capture"));
+        }
+        let start_unix_us = u64::from_le_bytes(header[8..].try_into().unwrap());
+        Ok(CaptureReader { file, start_unix_us })
+    }
+
+    /// When the capture started, as microseconds since the Unix epoch
+    pub fn start_unix_us(&self) -> u64 {
+        self.start_unix_us
+    }
+
+    /// Read the next datagram into `datagram`, None at the end of the capture.
+    /// A record cut short by a capture that didn't finish counts as the end.
+    pub fn next_record(&mut self, datagram: &mut Vec<u8>) -> Result<Option<CaptureRecord>, Error> {
+        let mut header = [0u8; RECORD_HEADER_SIZE];
+        match self.file.read_exact(&mut header) {
+            Ok(()) => {}
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e),
+        }
+
+        let offset = Duration::from_micros(u64::from_le_bytes(header[..8].try_into().unwrap()));
+        let port = u16::from_le_bytes([header[8], header[9]]);
+        let ip: IpAddr = match header[10] {
+            4 => Ipv4Addr::from(<[u8; 4]>::try_from(&header[11..15]).unwrap()).into(),
+            6 => Ipv6Addr::from(<[u8; 16]>::try_from(&header[11..27]).unwrap()).into(),
+            _ => return Err(Error::new(ErrorKind::InvalidData, "Capture record has an unknown address family")),
+        };
+        let len = u16::from_le_bytes([header[27], header[28]]) as usize;
+
+        datagram.resize(len, 0);
+        match self.file.read_exact(datagram) {
+            Ok(()) => Ok(Some(CaptureRecord { offset, addr: SocketAddr::new(ip, port) })),
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => Ok(None),
+            Err(e) => Err(e),
+        }
+    }
+}
+
+/// How fast a capture is fed back
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ReplayPace {
+    /// Keep the gaps between datagrams as they were recorded
+    Original,
+    /// Feed every datagram as soon as the previous one is handled
+    Max,
+}
+
+/// What a replay fed through and what came out of it
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ReplayStats {
+    pub datagrams_in: u64,
+    pub bytes_in: u64,
+    pub datagrams_out: u64,
+    pub bytes_out: u64,
+    pub elapsed: Duration,
+}
@@ -0,0 +1,713 @@
+use std::collections::{HashMap, VecDeque};
+use std::io::{Error, ErrorKind};
+use std::time::{Duration, Instant};
+
+use crate::codec::PACKET_HEADER_SIZE;
+use crate::pacing::{shed_error, LinkStats, Pacer, Priority};
+use crate::pool::BufferPool;
+
+/// Packet type carrying channel data, the inner game packet type travels in the channel header
+pub const CHANNEL_DATA_PACKET_TYPE: u8 = 0x0F;
+/// Packet type of a standalone acknowledgement
+pub const ACK_PACKET_TYPE: u8 = 0x0E;
+
+/// Bytes in front of the game payload of every channel packet:
+/// channel (0x80 set when an ack follows, 0x40 when the payload is compressed, 0x20
+/// for a skip), inner packet type, ack sequence u16, ack bits u32
+pub const CHANNEL_HEADER_SIZE: usize = 8;
+const ACK_PRESENT: u8 = 0x80;
+/// Set in the channel byte when the payload is compressed
+const COMPRESSED: u8 = 0x40;
+/// Set in the channel byte of an empty ordered frame standing in for a packet the
+/// sender gave up on, so the receiver moves past its sequence
+const SKIP: u8 = 0x20;
+
+/// Most sequences a reliable channel keeps in flight. Matches the ack bitfield so a
+/// receiver can always tell a retransmit from a packet it has never seen.
+const WINDOW: u16 = 32;
+/// RFC 6298 starting point, until the first ack gives a real sample
+const INITIAL_RTO: Duration = Duration::from_secs(1);
+const MIN_RTO: Duration = Duration::from_millis(50);
+const MAX_RTO: Duration = Duration::from_secs(2);
+/// Send attempts before a reliable packet is given up on and the peer presumed gone.
+/// An ordered packet is replaced by a skip, which gets as many attempts again.
+const MAX_ATTEMPTS: u8 = 10;
+/// Reliable packets a channel holds for a peer that isn't acknowledging before
+/// `send` refuses more
+const MAX_BACKLOG: usize = 256;
+
+/// Delivery guarantees for game packets sent through a channel
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub enum Channel {
+    /// Latest wins: late packets are dropped, nothing is resent
+    UnreliableSequenced = 1,
+    /// Every packet arrives exactly once, in any order
+    ReliableUnordered = 2,
+    /// Every packet arrives exactly once, in send order
+    ReliableOrdered = 3,
+}
+
+impl Channel {
+    pub fn from_u8(value: u8) -> Option<Self> {
+        match value {
+            1 => Some(Channel::UnreliableSequenced),
+            2 => Some(Channel::ReliableUnordered),
+            3 => Some(Channel::ReliableOrdered),
+            _ => None,
+        }
+    }
+
+    fn is_reliable(self) -> bool {
+        self != Channel::UnreliableSequenced
+    }
+
+    fn index(self) -> usize {
+        self as usize - 1
+    }
+}
+
+const CHANNEL_COUNT: usize = 3;
+
+/// True when `a` comes after `b`, allowing for wraparound
+pub fn sequence_newer(a: u16, b: u16) -> bool {
+    a != b && a.wrapping_sub(b) < 0x8000
+}
+
+struct InFlight {
+    sequence: u16,
+    bytes: Vec<u8>,
+    sent_at: Instant,
+    attempts: u8,
+}
+
+#[derive(Default)]
+struct SendChannel {
+    next_sequence: u16,
+    in_flight: VecDeque<InFlight>,
+    /// Packets waiting for room in the window, already framed apart from their sequence
+    backlog: VecDeque<Vec<u8>>,
+}
+
+impl SendChannel {
+    fn has_room(&self) -> bool {
+        self.in_flight
+            .front()
+            .is_none_or(|oldest| self.next_sequence.wrapping_sub(oldest.sequence) < WINDOW)
+    }
+}
+
+#[derive(Default)]
+struct ReceiveChannel {
+    /// Latest sequence seen and which of the 32 before it arrived
+    latest: Option<u16>,
+    ack_bits: u32,
+    ack_pending: bool,
+    /// Next sequence an ordered channel may deliver, and what arrived ahead of it;
+    /// None for a sequence the sender skipped
+    next_expected: u16,
+    out_of_order: HashMap<u16, Option<(u8, Vec<u8>)>>,
+}
+
+impl ReceiveChannel {
+    /// Record `sequence` in the ack state, returning false if it was already received
+    fn record(&mut self, sequence: u16) -> bool {
+        self.ack_pending = true;
+
+        let Some(latest) = self.latest else {
+            self.latest = Some(sequence);
+            self.ack_bits = 0;
+            return true;
+        };
+
+        if sequence_newer(sequence, latest) {
+            let shift = sequence.wrapping_sub(latest) as u32;
+            self.ack_bits = if shift > 32 { 0 } else { (self.ack_bits << (shift - 1) << 1) | (1 << (shift - 1)) };
+            self.latest = Some(sequence);
+            return true;
+        }
+
+        let distance = latest.wrapping_sub(sequence) as u32;
+        if distance == 0 || distance > 32 {
+            return false;
+        }
+        let bit = 1 << (distance - 1);
+        let fresh = self.ack_bits & bit == 0;
+        self.ack_bits |= bit;
+        fresh
+    }
+
+    fn write_ack(&self, frame: &mut [u8]) {
+        match self.latest {
+            Some(latest) => {
+                frame[0] |= ACK_PRESENT;
+                frame[2..4].copy_from_slice(&latest.to_le_bytes());
+                frame[4..8].copy_from_slice(&self.ack_bits.to_le_bytes());
+            }
+            None => {
+                frame[0] &= !ACK_PRESENT;
+                frame[2..8].fill(0);
+            }
+        }
+    }
+}
+
+struct PeerChannels {
+    send: [SendChannel; CHANNEL_COUNT],
+    receive: [ReceiveChannel; CHANNEL_COUNT],
+    srtt: Option<Duration>,
+    rttvar: Duration,
+    rto: Duration,
+    pacer: Pacer,
+}
+
+impl PeerChannels {
+    fn new() -> Self {
+        PeerChannels {
+            send: Default::default(),
+            receive: Default::default(),
+            srtt: None,
+            rttvar: Duration::ZERO,
+            rto: INITIAL_RTO,
+            pacer: Pacer::new(),
+        }
+    }
+
+    /// Fold an RTT sample into the retransmit timeout (RFC 6298)
+    fn sample_rtt(&mut self, rtt: Duration) {
+        match self.srtt {
+            None => {
+                self.srtt = Some(rtt);
+                self.rttvar = rtt / 2;
+            }
+            Some(srtt) => {
+                let delta = if srtt > rtt { srtt - rtt } else { rtt - srtt };
+                self.rttvar = (self.rttvar * 3 + delta) / 4;
+                self.srtt = Some((srtt * 7 + rtt) / 8);
+            }
+        }
+        self.rto = (self.srtt.unwrap() + self.rttvar * 4).clamp(MIN_RTO, MAX_RTO);
+    }
+}
+
+/// Timeout for a packet already sent `attempts` times, doubling per retry
+fn backoff(rto: Duration, attempts: u8) -> Duration {
+    (rto * (1 << attempts.saturating_sub(1).min(5))).min(MAX_RTO)
+}
+
+/// Sends a datagram to a peer: (packet_type, destination_id, sequence, payload)
+pub type Transmit<'a> = dyn FnMut(u8, u8, u16, &[u8]) -> Result<(), Error> + 'a;
+
+/// Per-peer channel state for one endpoint. The owner moves bytes on and off
+/// the socket, this only decides what to send, resend, acknowledge and deliver.
+pub struct ChannelSet {
+    peers: HashMap<u8, PeerChannels>,
+    /// Storage for frames held until acked and ordered packets held until their turn
+    pool: BufferPool,
+}
+
+impl ChannelSet {
+    pub fn new() -> Self {
+        ChannelSet { peers: HashMap::new(), pool: BufferPool::default() }
+    }
+
+    /// Drop everything held for a peer that left, returning its buffers to the pool
+    pub fn remove_peer(&mut self, peer_id: u8) {
+        let Some(peer) = self.peers.remove(&peer_id) else {
+            return;
+        };
+        for channel in peer.send {
+            for packet in channel.in_flight {
+                self.pool.put(packet.bytes);
+            }
+            for frame in channel.backlog {
+                self.pool.put(frame);
+            }
+        }
+        for channel in peer.receive {
+            for (_, payload) in channel.out_of_order.into_values().flatten() {
+                self.pool.put(payload);
+            }
+        }
+    }
+
+    /// Retransmit timeout currently used for `peer_id`
+    pub fn rto(&self, peer_id: u8) -> Duration {
+        self.peers.get(&peer_id).map_or(INITIAL_RTO, |peer| peer.rto)
+    }
+
+    /// Feed an RTT measured outside the channels, such as a setup packet's ack
+    pub fn observe_rtt(&mut self, peer_id: u8, rtt: Duration) {
+        self.peers.entry(peer_id).or_insert_with(PeerChannels::new).sample_rtt(rtt);
+    }
+
+    /// Smoothed round trip time to `peer_id`, once a sample exists
+    pub fn rtt(&self, peer_id: u8) -> Option<Duration> {
+        self.peers.get(&peer_id).and_then(|peer| peer.srtt)
+    }
+
+    /// Charge a packet sent to `peer_id` outside the channels to its pacer,
+    /// returning false if it should be shed
+    pub fn admit(&mut self, peer_id: u8, bytes: usize, priority: Priority) -> bool {
+        let peer = self.peers.entry(peer_id).or_insert_with(PeerChannels::new);
+        peer.pacer.admit(Instant::now(), bytes, priority)
+    }
+
+    /// Round trip, loss and bandwidth estimates for `peer_id`
+    pub fn link_stats(&self, peer_id: u8) -> Option<LinkStats> {
+        self.peers.get(&peer_id).map(|peer| peer.pacer.stats(peer.srtt))
+    }
+
+    /// Send a game packet on `channel`. Reliable packets that do not fit in the
+    /// window, or that the peer's pacer has no room for, are queued and go out as
+    /// earlier ones are acknowledged and the pacer refills, up to MAX_BACKLOG per
+    /// channel. Unreliable packets of `priority` are shed instead when the link is
+    /// congested, returning `shed_error`. `compressed` marks a payload already
+    /// compressed, which the receiver inflates before delivery.
+    pub fn send(
+        &mut self,
+        peer_id: u8,
+        channel: Channel,
+        packet_type: u8,
+        payload: &[u8],
+        compressed: bool,
+        priority: Priority,
+        transmit: &mut Transmit<'_>,
+    ) -> Result<(), Error> {
+        let now = Instant::now();
+        let peer = self.peers.entry(peer_id).or_insert_with(PeerChannels::new);
+        if !channel.is_reliable() && !peer.pacer.admit(now, PACKET_HEADER_SIZE + CHANNEL_HEADER_SIZE + payload.len(), priority) {
+            return Err(shed_error());
+        }
+        if peer.send[channel.index()].backlog.len() >= MAX_BACKLOG {
+            return Err(Error::new(ErrorKind::WouldBlock, "Channel backlog full, the peer isn't acknowledging"));
+        }
+
+        let flags = if compressed { COMPRESSED } else { 0 };
+        let mut frame = self.pool.take();
+        frame.extend_from_slice(&[channel as u8 | flags, packet_type, 0, 0, 0, 0, 0, 0]);
+        frame.extend_from_slice(payload);
+
+        let send = &mut peer.send[channel.index()];
+        if channel.is_reliable() && (!send.has_room() || !send.backlog.is_empty() || !peer.pacer.has_tokens(now)) {
+            send.backlog.push_back(frame);
+            return Ok(());
+        }
+
+        Self::send_frame(peer, &mut self.pool, peer_id, channel, frame, transmit)
+    }
+
+    fn send_frame(
+        peer: &mut PeerChannels,
+        pool: &mut BufferPool,
+        peer_id: u8,
+        channel: Channel,
+        mut frame: Vec<u8>,
+        transmit: &mut Transmit<'_>,
+    ) -> Result<(), Error> {
+        let receive = &mut peer.receive[channel.index()];
+        receive.write_ack(&mut frame);
+        receive.ack_pending = false;
+
+        let send = &mut peer.send[channel.index()];
+        let sequence = send.next_sequence;
+        send.next_sequence = send.next_sequence.wrapping_add(1);
+
+        let result = transmit(CHANNEL_DATA_PACKET_TYPE, peer_id, sequence, &frame);
+
+        // A reliable frame that failed to go out still owns its sequence, so it's
+        // kept and resent on its timer like any other
+        if channel.is_reliable() {
+            if result.is_ok() {
+                peer.pacer.admit(Instant::now(), PACKET_HEADER_SIZE + frame.len(), Priority::Reliable);
+            }
+            send.in_flight.push_back(InFlight {
+                sequence,
+                bytes: frame,
+                sent_at: Instant::now(),
+                attempts: 1,
+            });
+        } else {
+            pool.put(frame);
+        }
+        result
+    }
+
+    /// Handle a channel data packet, calling `deliver(packet_type, payload)` for
+    /// each game packet that is ready. Ordered channels may release several at once.
+    pub fn receive(
+        &mut self,
+        peer_id: u8,
+        sequence: u16,
+        data: &[u8],
+        deliver: &mut dyn FnMut(u8, &[u8]),
+    ) {
+        if data.len() < CHANNEL_HEADER_SIZE {
+            return;
+        }
+        let Some(channel) = Channel::from_u8(data[0] & !(ACK_PRESENT | COMPRESSED | SKIP)) else {
+            return;
+        };
+        let peer = self.peers.entry(peer_id).or_insert_with(PeerChannels::new);
+
+        if data[0] & ACK_PRESENT != 0 {
+            let ack = u16::from_le_bytes([data[2], data[3]]);
+            let ack_bits = u32::from_le_bytes([data[4], data[5], data[6], data[7]]);
+            Self::apply_ack(peer, &mut self.pool, channel, ack, ack_bits);
+        }
+
+        let packet_type = data[1];
+        let payload = &data[CHANNEL_HEADER_SIZE..];
+        let receive = &mut peer.receive[channel.index()];
+
+        if data[0] & SKIP != 0 {
+            if channel == Channel::ReliableOrdered {
+                Self::accept_ordered(receive, &mut self.pool, sequence, None, deliver);
+            }
+            return;
+        }
+        if data[0] & COMPRESSED == 0 {
+            Self::accept(receive, &mut self.pool, channel, sequence, packet_type, payload, deliver);
+            return;
+        }
+        let mut inflated = self.pool.take();
+        if crate::compress::decompress(payload, &mut inflated) {
+            Self::accept(receive, &mut self.pool, channel, sequence, packet_type, &inflated, deliver);
+        }
+        self.pool.put(inflated);
+    }
+
+    fn accept(
+        receive: &mut ReceiveChannel,
+        pool: &mut BufferPool,
+        channel: Channel,
+        sequence: u16,
+        packet_type: u8,
+        payload: &[u8],
+        deliver: &mut dyn FnMut(u8, &[u8]),
+    ) {
+        match channel {
+            Channel::UnreliableSequenced => {
+                if receive.latest.is_none_or(|latest| sequence_newer(sequence, latest)) {
+                    receive.latest = Some(sequence);
+                    deliver(packet_type, payload);
+                }
+                // Nothing to acknowledge on an unreliable channel
+                receive.ack_pending = false;
+            }
+            Channel::ReliableUnordered => {
+                if receive.record(sequence) {
+                    deliver(packet_type, payload);
+                }
+            }
+            Channel::ReliableOrdered => {
+                Self::accept_ordered(receive, pool, sequence, Some((packet_type, payload)), deliver);
+            }
+        }
+    }
+
+    /// Deliver an ordered packet, or a skip when `packet` is None, once everything
+    /// before it has been, along with whatever it releases
+    fn accept_ordered(
+        receive: &mut ReceiveChannel,
+        pool: &mut BufferPool,
+        sequence: u16,
+        packet: Option<(u8, &[u8])>,
+        deliver: &mut dyn FnMut(u8, &[u8]),
+    ) {
+        // The sender never has a window's worth past the oldest sequence this side
+        // still waits for, so anything further ahead isn't held
+        if sequence_newer(sequence, receive.next_expected) && sequence.wrapping_sub(receive.next_expected) >= WINDOW {
+            return;
+        }
+        if !receive.record(sequence) {
+            return;
+        }
+        if sequence != receive.next_expected {
+            if sequence_newer(sequence, receive.next_expected) {
+                let held = packet.map(|(packet_type, payload)| (packet_type, pool.copy_of(payload)));
+                if let Some(Some((_, replaced))) = receive.out_of_order.insert(sequence, held) {
+                    pool.put(replaced);
+                }
+            }
+            return;
+        }
+
+        if let Some((packet_type, payload)) = packet {
+            deliver(packet_type, payload);
+        }
+        receive.next_expected = receive.next_expected.wrapping_add(1);
+        while let Some(held) = receive.out_of_order.remove(&receive.next_expected) {
+            if let Some((packet_type, payload)) = held {
+                deliver(packet_type, &payload);
+                pool.put(payload);
+            }
+            receive.next_expected = receive.next_expected.wrapping_add(1);
+        }
+    }
+
+    /// Handle a standalone ack for one of `peer_id`'s channels
+    pub fn handle_ack(&mut self, peer_id: u8, channel: u8, sequence: u16, ack_bits: u32) {
+        let (Some(channel), Some(peer)) = (Channel::from_u8(channel), self.peers.get_mut(&peer_id)) else {
+            return;
+        };
+        Self::apply_ack(peer, &mut self.pool, channel, sequence, ack_bits);
+    }
+
+    fn apply_ack(peer: &mut PeerChannels, pool: &mut BufferPool, channel: Channel, sequence: u16, ack_bits: u32) {
+        let now = Instant::now();
+        // At most a window's worth can be acked at once, so the samples fit on the stack
+        let mut samples = [Duration::ZERO; WINDOW as usize];
+        let mut count = 0;
+
+        peer.send[channel.index()].in_flight.retain_mut(|packet| {
+            let distance = sequence.wrapping_sub(packet.sequence) as u32;
+            let acked = distance == 0 || (distance <= 32 && ack_bits & (1 << (distance - 1)) != 0);
+            if !acked {
+                return true;
+            }
+            // Karn's rule: only first transmissions give an unambiguous RTT
+            if packet.attempts == 1 && count < samples.len() {
+                samples[count] = now.duration_since(packet.sent_at);
+                count += 1;
+            }
+            pool.put(std::mem::take(&mut packet.bytes));
+            false
+        });
+
+        for &rtt in &samples[..count] {
+            peer.sample_rtt(rtt);
+        }
+        peer.pacer.on_delivered(count);
+    }
+
+    /// Resend timed-out packets, release backlogged ones that now fit in the
+    /// window and send standalone acks for anything not yet acknowledged by piggyback
+    pub fn update(&mut self, transmit: &mut Transmit<'_>) -> Result<(), Error> {
+        let now = Instant::now();
+
+        // A failed transmit doesn't hold up the peers after it, the first error is
+        // returned once every peer has had its turn
+        let mut error = None;
+        let pool = &mut self.pool;
+        for (&peer_id, peer) in &mut self.peers {
+            for channel in [Channel::ReliableUnordered, Channel::ReliableOrdered] {
+                let index = channel.index();
+
+                let rto = peer.rto;
+                let (srtt, pacer) = (peer.srtt, &mut peer.pacer);
+                let receive = &peer.receive[index];
+
+                peer.send[index].in_flight.retain_mut(|packet| {
+                    if now.duration_since(packet.sent_at) < backoff(rto, packet.attempts) {
+                        return true;
+                    }
+                    // Give up on packets the peer never acknowledged. The ordered
+                    // receiver would wait for this sequence forever, so it gets a skip.
+                    if packet.attempts >= MAX_ATTEMPTS {
+                        if channel != Channel::ReliableOrdered || packet.bytes[0] & SKIP != 0 {
+                            pool.put(std::mem::take(&mut packet.bytes));
+                            return false;
+                        }
+                        packet.bytes.truncate(CHANNEL_HEADER_SIZE);
+                        packet.bytes[0] = channel as u8 | SKIP;
+                        packet.bytes[1] = 0;
+                        packet.attempts = 0;
+                    }
+                    pacer.on_lost(now, srtt);
+                    receive.write_ack(&mut packet.bytes);
+                    if let Err(e) = transmit(CHANNEL_DATA_PACKET_TYPE, peer_id, packet.sequence, &packet.bytes) {
+                        error.get_or_insert(e);
+                    }
+                    pacer.admit(now, PACKET_HEADER_SIZE + packet.bytes.len(), Priority::Reliable);
+                    packet.sent_at = now;
+                    packet.attempts += 1;
+                    true
+                });
+
+                while peer.send[index].has_room() && peer.pacer.has_tokens(now) {
+                    let Some(frame) = peer.send[index].backlog.pop_front() else {
+                        break;
+                    };
+                    if let Err(e) = Self::send_frame(peer, pool, peer_id, channel, frame, transmit) {
+                        error.get_or_insert(e);
+                        break;
+                    }
+                }
+
+                let receive = &mut peer.receive[index];
+                if receive.ack_pending {
+                    if let Some(latest) = receive.latest {
+                        let mut ack = [0; 7];
+                        ack[0] = channel as u8;
+                        ack[1..3].copy_from_slice(&latest.to_le_bytes());
+                        ack[3..7].copy_from_slice(&receive.ack_bits.to_le_bytes());
+                        if let Err(e) = transmit(ACK_PACKET_TYPE, peer_id, 0, &ack) {
+                            error.get_or_insert(e);
+                        }
+                    }
+                    receive.ack_pending = false;
+                }
+            }
+        }
+        error.map_or(Ok(()), Err)
+    }
+
+    /// Earliest moment `update` has work to do
+    pub fn next_deadline(&self) -> Option<Instant> {
+        let mut deadline: Option<Instant> = None;
+
+        for peer in self.peers.values() {
+            for index in 0..CHANNEL_COUNT {
+                if peer.receive[index].ack_pending {
+                    return Some(Instant::now());
+                }
+                for packet in &peer.send[index].in_flight {
+                    let due = packet.sent_at + backoff(peer.rto, packet.attempts);
+                    deadline = Some(deadline.map_or(due, |d| d.min(due)));
+                }
+                // A backlog held back by the pacer can go once it refills
+                if !peer.send[index].backlog.is_empty() && peer.send[index].has_room() {
+                    if let Some(due) = peer.pacer.ready_at() {
+                        deadline = Some(deadline.map_or(due, |d| d.min(due)));
+                    }
+                }
+            }
+        }
+        deadline
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Datagrams a ChannelSet sent: (packet_type, sequence, bytes)
+    type Wire = Vec<(u8, u16, Vec<u8>)>;
+
+    fn capture(wire: &mut Wire) -> impl FnMut(u8, u8, u16, &[u8]) -> Result<(), Error> + '_ {
+        |packet_type, _, sequence, bytes| {
+            wire.push((packet_type, sequence, bytes.to_vec()));
+            Ok(())
+        }
+    }
+
+    /// Hand `wire` to `to`, which knows the sender as `from`, dropping what `lose` picks
+    fn carry(wire: &mut Wire, from: u8, to: &mut ChannelSet, delivered: &mut Vec<Vec<u8>>, lose: impl Fn(u16, &[u8]) -> bool) {
+        for (packet_type, sequence, bytes) in wire.drain(..) {
+            if lose(sequence, &bytes) {
+                continue;
+            }
+            if packet_type == ACK_PACKET_TYPE {
+                to.handle_ack(from, bytes[0], u16::from_le_bytes([bytes[1], bytes[2]]), u32::from_le_bytes(bytes[3..7].try_into().unwrap()));
+            } else {
+                to.receive(from, sequence, &bytes, &mut |_, payload| delivered.push(payload.to_vec()));
+            }
+        }
+    }
+
+    #[test]
+    fn ordered_delivery_moves_past_a_packet_given_up_on() {
+        let (mut sender, mut receiver) = (ChannelSet::new(), ChannelSet::new());
+        let (mut wire, mut delivered, mut acks) = (Wire::new(), Vec::new(), Wire::new());
+        let lost = |sequence: u16, bytes: &[u8]| sequence == 1 && bytes[0] & SKIP == 0;
+
+        for i in 0..5u8 {
+            sender.send(2, Channel::ReliableOrdered, 0x20, &[i], false, Priority::Reliable, &mut capture(&mut wire)).unwrap();
+        }
+        carry(&mut wire, 1, &mut receiver, &mut delivered, lost);
+        assert_eq!(delivered, vec![vec![0]]);
+
+        // Sequence 1 never arrives; age it through every attempt
+        for _ in 0..2 * MAX_ATTEMPTS {
+            receiver.update(&mut capture(&mut acks)).unwrap();
+            carry(&mut acks, 2, &mut sender, &mut Vec::new(), |_, _| false);
+            age(&mut sender, 2, Channel::ReliableOrdered);
+            sender.update(&mut capture(&mut wire)).unwrap();
+            carry(&mut wire, 1, &mut receiver, &mut delivered, lost);
+        }
+        assert_eq!(delivered, vec![vec![0], vec![2], vec![3], vec![4]]);
+
+        receiver.update(&mut capture(&mut acks)).unwrap();
+        carry(&mut acks, 2, &mut sender, &mut Vec::new(), |_, _| false);
+        assert!(sender.peers[&2].send[Channel::ReliableOrdered.index()].in_flight.is_empty());
+
+        sender.send(2, Channel::ReliableOrdered, 0x20, &[5], false, Priority::Reliable, &mut capture(&mut wire)).unwrap();
+        carry(&mut wire, 1, &mut receiver, &mut delivered, lost);
+        assert_eq!(delivered.last(), Some(&vec![5]));
+    }
+
+    #[test]
+    fn ordered_receiver_holds_at_most_a_window() {
+        let mut receiver = ChannelSet::new();
+        let mut frame = vec![Channel::ReliableOrdered as u8, 0x20, 0, 0, 0, 0, 0, 0, 7];
+        let mut delivered = 0;
+        for sequence in 1..=WINDOW + 100 {
+            frame[8] = sequence as u8;
+            receiver.receive(1, sequence, &frame, &mut |_, _| delivered += 1);
+        }
+        assert_eq!(delivered, 0);
+        assert_eq!(receiver.peers[&1].receive[Channel::ReliableOrdered.index()].out_of_order.len(), WINDOW as usize - 1);
+    }
+
+    fn age(set: &mut ChannelSet, peer_id: u8, channel: Channel) {
+        for packet in &mut set.peers.get_mut(&peer_id).unwrap().send[channel.index()].in_flight {
+            packet.sent_at -= MAX_RTO * 2;
+        }
+    }
+
+    #[test]
+    fn update_carries_on_past_a_failed_transmit() {
+        let mut sender = ChannelSet::new();
+        let mut wire = Wire::new();
+        for peer_id in [2, 3, 4] {
+            sender.send(peer_id, Channel::ReliableUnordered, 0x20, &[peer_id], false, Priority::Reliable, &mut capture(&mut wire)).unwrap();
+            age(&mut sender, peer_id, Channel::ReliableUnordered);
+        }
+
+        // Whatever order the peers come in, the one that fails holds up no other
+        let mut resent = Vec::new();
+        let result = sender.update(&mut |_, peer_id, _, _| {
+            if peer_id == 3 {
+                return Err(Error::from(ErrorKind::WouldBlock));
+            }
+            resent.push(peer_id);
+            Ok(())
+        });
+        assert_eq!(result.unwrap_err().kind(), ErrorKind::WouldBlock);
+        resent.sort();
+        assert_eq!(resent, [2, 4]);
+    }
+
+    #[test]
+    fn reliable_frame_that_failed_to_send_is_resent() {
+        let (mut sender, mut receiver) = (ChannelSet::new(), ChannelSet::new());
+        let (mut wire, mut delivered) = (Wire::new(), Vec::new());
+        let result = sender.send(2, Channel::ReliableOrdered, 0x20, &[0], false, Priority::Reliable, &mut |_, _, _, _| {
+            Err(Error::from(ErrorKind::WouldBlock))
+        });
+        assert!(result.is_err());
+        sender.send(2, Channel::ReliableOrdered, 0x20, &[1], false, Priority::Reliable, &mut capture(&mut wire)).unwrap();
+
+        age(&mut sender, 2, Channel::ReliableOrdered);
+        sender.update(&mut capture(&mut wire)).unwrap();
+        carry(&mut wire, 1, &mut receiver, &mut delivered, |_, _| false);
+        assert_eq!(delivered, vec![vec![0], vec![1]]);
+    }
+
+    #[test]
+    fn backlog_for_a_silent_peer_is_capped() {
+        let mut sender = ChannelSet::new();
+        let mut wire = Wire::new();
+        for i in 0..WINDOW as usize + MAX_BACKLOG {
+            sender.send(2, Channel::ReliableOrdered, 0x20, &[i as u8], false, Priority::Reliable, &mut capture(&mut wire)).unwrap();
+        }
+        let result = sender.send(2, Channel::ReliableOrdered, 0x20, &[0], false, Priority::Reliable, &mut capture(&mut wire));
+        assert_eq!(result.unwrap_err().kind(), ErrorKind::WouldBlock);
+        assert_eq!(sender.peers[&2].send[Channel::ReliableOrdered.index()].backlog.len(), MAX_BACKLOG);
+
+        // Other channels and peers still take packets
+        sender.send(2, Channel::ReliableUnordered, 0x20, &[0], false, Priority::Reliable, &mut capture(&mut wire)).unwrap();
+        sender.send(3, Channel::ReliableOrdered, 0x20, &[0], false, Priority::Reliable, &mut capture(&mut wire)).unwrap();
+    }
+}
@@ -1,101 +1,459 @@
 use std::net::SocketAddr;
 use std::io::{Error, ErrorKind};
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::mpsc::{self, Receiver, SyncSender, TryRecvError, TrySendError};
+use std::sync::Arc;
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
 use super::types::*;
+use crate::capture::CaptureWriter;
+use crate::channel::ChannelSet;
+use crate::events::*;
+use crate::jitter::{Arrival, JitterBuffer};
+use crate::registry::{registry_version, PacketTypeTable};
+use crate::replication::SnapshotReceiver;
+use super::outgoing::send_registry_request;
 
 pub struct NeonSocket {
     pub socket: std::net::UdpSocket,
+    send_buf: Vec<u8>,
+    recv_buf: Vec<u8>,
+    max_packet_size: usize,
+    /// Messages coalesced into one datagram while bundling is enabled
+    bundle: Vec<u8>,
+    bundling: bool,
+    /// Background reader, when started; datagrams then come from it instead of the socket
+    receive_thread: Option<ReceiveThread>,
+    /// Datagram taken from the receive thread while waiting, handed out next
+    waiting: Option<Datagram>,
+    /// Records every datagram handed out, when capturing
+    capture: Option<CaptureWriter>,
+}
+
+struct Datagram {
+    data: Vec<u8>,
+    len: usize,
+    addr: SocketAddr,
+    arrival: Arrival,
+}
+
+/// Reads the socket as datagrams arrive, so they're timestamped on arrival and the
+/// kernel buffer keeps draining while the game thread is busy
+struct ReceiveThread {
+    datagrams: Receiver<Datagram>,
+    /// Buffers handed back for the thread to reuse
+    recycle: SyncSender<Vec<u8>>,
+    max_packet_size: Arc<AtomicUsize>,
+    stop: Arc<AtomicBool>,
+    handle: Option<JoinHandle<()>>,
+}
+
+impl ReceiveThread {
+    /// How long the thread sleeps in poll before checking whether it should stop
+    const STOP_CHECK: Duration = Duration::from_millis(50);
+    /// Datagrams queued for the game thread before new ones are dropped. Both queues
+    /// are bounded so their storage is allocated once up front, not per datagram.
+    const QUEUE_DEPTH: usize = 1024;
+
+    fn spawn(socket: std::net::UdpSocket, max_packet_size: usize) -> Result<Self, Error> {
+        let (datagrams_tx, datagrams) = mpsc::sync_channel(Self::QUEUE_DEPTH);
+        let (recycle, recycle_rx) = mpsc::sync_channel::<Vec<u8>>(Self::QUEUE_DEPTH);
+        let max_packet_size = Arc::new(AtomicUsize::new(max_packet_size));
+        let stop = Arc::new(AtomicBool::new(false));
+
+        let thread_max = max_packet_size.clone();
+        let thread_stop = stop.clone();
+        let handle = std::thread::Builder::new()
+            .name("neon-client-recv".into())
+            .spawn(move || {
+                let mut buffer = Vec::new();
+                while !thread_stop.load(Ordering::Relaxed) {
+                    match crate::reactor::wait_readable(&socket, Some(Self::STOP_CHECK)) {
+                        Ok(true) => {}
+                        Ok(false) => continue,
+                        Err(e) => {
+                            log_error!("[Client] Receive thread stopping: {}", e);
+                            return;
+                        }
+                    }
+
+                    loop {
+                        if buffer.is_empty() {
+                            buffer = recycle_rx.try_recv().unwrap_or_default();
+                        }
+                        // One spare byte, as in set_max_packet_size
+                        buffer.resize(thread_max.load(Ordering::Relaxed) + 1, 0);
+
+                        match socket.recv_from(&mut buffer) {
+                            Ok((len, addr)) => {
+                                let datagram = Datagram { data: std::mem::take(&mut buffer), len, addr, arrival: Arrival::now() };
+                                match datagrams_tx.try_send(datagram) {
+                                    Ok(()) => {}
+                                    Err(TrySendError::Full(datagram)) => {
+                                        log_limited!(crate::log::Level::Warn, 1, "[Client] Receive queue full, dropping datagram");
+                                        buffer = datagram.data;
+                                    }
+                                    Err(TrySendError::Disconnected(_)) => return,
+                                }
+                            }
+                            Err(e) if e.kind() == ErrorKind::WouldBlock => break,
+                            Err(e) => {
+                                log_limited!(crate::log::Level::Warn, 10, "[Client] Receive failed: {}", e);
+                                break;
+                            }
+                        }
+                    }
+                }
+            })?;
+
+        Ok(Self { datagrams, recycle, max_packet_size, stop, handle: Some(handle) })
+    }
+}
+
+impl Drop for ReceiveThread {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(handle) = self.handle.take() {
+            let _ = handle.join();
+        }
+    }
 }
 
 impl NeonSocket {
     pub fn new(bind_addr: &str) -> Result<Self, Error> {
         let socket = std::net::UdpSocket::bind(bind_addr)?;
         socket.set_nonblocking(true)?;
-        Ok(Self { socket })
+        Ok(Self {
+            socket,
+            send_buf: Vec::with_capacity(DEFAULT_MAX_PACKET_SIZE),
+            recv_buf: vec![0; DEFAULT_MAX_PACKET_SIZE + 1],
+            max_packet_size: DEFAULT_MAX_PACKET_SIZE,
+            bundle: Vec::with_capacity(DEFAULT_MAX_PACKET_SIZE),
+            bundling: false,
+            receive_thread: None,
+            waiting: None,
+            capture: None,
+        })
+    }
+
+    /// Swap in a new socket on the same local address with a fresh port, as when
+    /// the network changed under the old one. A receive thread is restarted on it,
+    /// and datagrams still queued from the old socket are dropped.
+    pub fn rebind(&mut self) -> Result<(), Error> {
+        let local = self.socket.local_addr()?;
+        let socket = std::net::UdpSocket::bind(SocketAddr::new(local.ip(), 0))?;
+        socket.set_nonblocking(true)?;
+
+        let threaded = self.receive_thread.take().is_some();
+        self.waiting = None;
+        self.socket = socket;
+        if threaded {
+            self.start_receive_thread()?;
+        }
+        Ok(())
+    }
+
+    /// Start recording received datagrams, or stop with None
+    pub fn set_capture(&mut self, capture: Option<CaptureWriter>) {
+        self.capture = capture;
+    }
+
+    /// Move receiving onto a background thread. Sends stay on the caller's thread.
+    pub fn start_receive_thread(&mut self) -> Result<(), Error> {
+        if self.receive_thread.is_none() {
+            self.receive_thread = Some(ReceiveThread::spawn(self.socket.try_clone()?, self.max_packet_size)?);
+        }
+        Ok(())
     }
 
-    pub fn send_packet(&self, packet: &NeonPacket, addr: SocketAddr) -> Result<(), Error> {
-    let header = PacketHeader {
-            magic: 0x4E45,
-            version: 1,
-            packet_type: packet.packet_type,
-            sequence: packet.sequence,
-            client_id: packet.client_id,
-            destination_id: packet.destination_id,
+    /// Block until a datagram is ready to receive or `timeout` elapses
+    pub fn wait(&mut self, timeout: Option<Duration>) -> Result<(), Error> {
+        let Some(thread) = &self.receive_thread else {
+            return crate::reactor::wait_readable(&self.socket, timeout).map(|_| ());
         };
-        let mut bytes = header.to_bytes();
-        bytes.extend(packet.payload.to_bytes());
-        self.socket.send_to(&bytes, addr)?;
+        if self.waiting.is_some() {
+            return Ok(());
+        }
+
+        let datagram = match timeout {
+            Some(timeout) => match thread.datagrams.recv_timeout(timeout) {
+                Ok(datagram) => datagram,
+                Err(mpsc::RecvTimeoutError::Timeout) => return Ok(()),
+                Err(mpsc::RecvTimeoutError::Disconnected) => return Err(receive_thread_stopped()),
+            },
+            None => thread.datagrams.recv().map_err(|_| receive_thread_stopped())?,
+        };
+        self.waiting = Some(datagram);
         Ok(())
     }
 
-    pub fn receive_packet(&self) -> Result<(NeonPacket, SocketAddr), Error> {
-        let mut buf = [0; 1024];
-    let (size, addr) = self.socket.recv_from(&mut buf)?;
-    let header = PacketHeader::from_bytes(&buf[..8])?;
-    let payload = PacketPayload::from_bytes(header.packet_type, &buf[8..size])?;
-        Ok((NeonPacket {
-            packet_type: header.packet_type,
-            sequence: header.sequence,
-            client_id: header.client_id,
-            destination_id: header.destination_id,
-            payload,
-        }, addr))
+    /// Coalesce send_raw messages into bundles instead of sending each on its own
+    pub fn set_bundling(&mut self, enabled: bool) {
+        self.bundling = enabled;
+    }
+
+    /// Largest datagram, header included, this socket sends or accepts
+    pub fn max_packet_size(&self) -> usize {
+        self.max_packet_size
+    }
+
+    /// Change the packet size limit and resize the receive buffer to match.
+    /// The size is clamped to what a session can negotiate.
+    pub fn set_max_packet_size(&mut self, size: usize) {
+        let size = size.clamp(MIN_PACKET_SIZE, MAX_DATAGRAM_SIZE);
+        self.max_packet_size = size;
+        // One spare byte tells an oversized datagram apart from one that fits exactly
+        self.recv_buf.resize(size + 1, 0);
+        if let Some(thread) = &self.receive_thread {
+            thread.max_packet_size.store(size, Ordering::Relaxed);
+        }
+    }
+
+    /// Encode a packet into the reusable send buffer and send it
+    pub fn send_packet(&mut self, packet: &NeonPacket, addr: SocketAddr) -> Result<(), Error> {
+        self.send_buf.clear();
+        packet.write_to(&mut self.send_buf);
+        self.socket.send_to(&self.send_buf, addr)?;
+        Ok(())
+    }
+
+    /// Send a game packet by writing the header and payload into the reusable send buffer.
+    /// While bundling, the message is appended to the pending bundle instead, which is
+    /// sent first if the message would push it past the max packet size.
+    pub fn send_raw(&mut self, header: &PacketHeader, payload: &[u8], addr: SocketAddr) -> Result<(), Error> {
+        if PACKET_HEADER_SIZE + payload.len() > self.max_packet_size {
+            return Err(Error::new(ErrorKind::InvalidInput, "Packet exceeds maximum packet size"));
+        }
+
+        let entry_len = BUNDLE_ENTRY_HEADER_SIZE + payload.len();
+        if self.bundling && PACKET_HEADER_SIZE + entry_len <= self.max_packet_size {
+            if self.bundle.len() + entry_len > self.max_packet_size {
+                self.flush(addr)?;
+            }
+            if self.bundle.is_empty() {
+                // The relay splits bundles by entry destination, so the outer header has none
+                PacketHeader {
+                    magic: 0x4E45,
+                    version: PROTOCOL_VERSION,
+                    packet_type: PacketType::Bundle as u8,
+                    sequence: 0,
+                    client_id: header.client_id,
+                    destination_id: 0,
+                }.write_to(&mut self.bundle);
+            }
+            self.bundle.push(header.destination_id);
+            self.bundle.push(header.packet_type);
+            self.bundle.extend(&header.sequence.to_le_bytes());
+            self.bundle.extend(&(payload.len() as u16).to_le_bytes());
+            self.bundle.extend_from_slice(payload);
+            return Ok(());
+        }
+
+        // Keep ordering with anything already bundled
+        self.flush(addr)?;
+
+        self.send_buf.clear();
+        header.write_to(&mut self.send_buf);
+        self.send_buf.extend_from_slice(payload);
+        self.socket.send_to(&self.send_buf, addr)?;
+        Ok(())
+    }
+
+    /// Send a multicast packet: the peer set and inner packet type go in front of the
+    /// payload. Multicasts are never bundled since the relay rewrites them per target.
+    pub fn send_multicast(&mut self, header: &PacketHeader, targets: &[u8; PEER_SET_SIZE], packet_type: u8, payload: &[u8], addr: SocketAddr) -> Result<(), Error> {
+        if PACKET_HEADER_SIZE + PEER_SET_SIZE + 1 + payload.len() > self.max_packet_size {
+            return Err(Error::new(ErrorKind::InvalidInput, "Packet exceeds maximum packet size"));
+        }
+
+        self.flush(addr)?;
+
+        self.send_buf.clear();
+        header.write_to(&mut self.send_buf);
+        self.send_buf.extend_from_slice(targets);
+        self.send_buf.push(packet_type);
+        self.send_buf.extend_from_slice(payload);
+        self.socket.send_to(&self.send_buf, addr)?;
+        Ok(())
+    }
+
+    /// Send the pending bundle, if any
+    pub fn flush(&mut self, addr: SocketAddr) -> Result<(), Error> {
+        if self.bundle.is_empty() {
+            return Ok(());
+        }
+        let result = self.socket.send_to(&self.bundle, addr);
+        self.bundle.clear();
+        result.map(|_| ())
+    }
+
+    /// Receive a datagram into the socket's buffer and return its header plus a
+    /// borrowed view of the payload. Datagrams larger than the negotiated packet
+    /// size are dropped rather than handed over truncated.
+    pub fn receive_raw(&mut self) -> Result<(PacketHeader, &[u8], SocketAddr, Arrival), Error> {
+        loop {
+            let (size, addr, arrival) = match &self.receive_thread {
+                Some(thread) => {
+                    let datagram = match self.waiting.take() {
+                        Some(datagram) => datagram,
+                        None => thread.datagrams.try_recv().map_err(|e| match e {
+                            TryRecvError::Empty => Error::from(ErrorKind::WouldBlock),
+                            TryRecvError::Disconnected => receive_thread_stopped(),
+                        })?,
+                    };
+                    // Swap buffers rather than copy, the old one goes back to the thread
+                    let buffer = std::mem::replace(&mut self.recv_buf, datagram.data);
+                    let _ = thread.recycle.try_send(buffer);
+                    (datagram.len, datagram.addr, datagram.arrival)
+                }
+                None => {
+                    let (size, addr) = self.socket.recv_from(&mut self.recv_buf)?;
+                    (size, addr, Arrival::now())
+                }
+            };
+            if let Some(capture) = &mut self.capture {
+                capture.record(arrival.at, addr, &self.recv_buf[..size]);
+            }
+            if size > self.max_packet_size {
+                continue;
+            }
+
+            let header = PacketHeader::from_bytes(&self.recv_buf[..size])?;
+            return Ok((header, &self.recv_buf[PACKET_HEADER_SIZE..size], addr, arrival));
+        }
+    }
+}
+
+fn receive_thread_stopped() -> Error {
+    Error::new(ErrorKind::BrokenPipe, "Receive thread stopped")
+}
+
+/// Host's answer to a ConnectRequest
+pub enum ConnectResponse {
+    Accepted(ConnectAccept),
+    Denied(String),
+}
+
+/// Drain the socket looking for the answer to the ConnectRequest sent with `nonce`,
+/// skipping anything else that arrives first, answers to earlier attempts included.
+/// Returns None once the socket is empty.
+pub fn poll_connect_response(socket: &mut NeonSocket, nonce: u32) -> Result<Option<ConnectResponse>, Error> {
+    loop {
+        match socket.receive_raw() {
+            // Its answer can't be decoded, but it can only be about this request
+            Ok((header, _, _, _)) if !header.is_compatible() => {
+                return Ok(Some(ConnectResponse::Denied(format!(
+                    "Protocol version mismatch: the relay speaks version {}, this client {}",
+                    header.version, PROTOCOL_VERSION
+                ))));
+            }
+            Ok((header, data, _, _)) => match PacketPayload::from_bytes(header.packet_type, data) {
+                Ok(PacketPayload::ConnectAccept(accept)) if accept.request_nonce == nonce => {
+                    return Ok(Some(ConnectResponse::Accepted(accept)));
+                }
+                Ok(PacketPayload::ConnectDeny(deny)) if deny.request_nonce == nonce => {
+                    return Ok(Some(ConnectResponse::Denied(deny.reason)));
+                }
+                Ok(_) => {}
+                Err(e) if e.kind() == ErrorKind::InvalidData => {}
+                Err(e) => return Err(e),
+            },
+            Err(e) if e.kind() == ErrorKind::WouldBlock => return Ok(None),
+            Err(e) if e.kind() == ErrorKind::InvalidData => {}
+            Err(e) => return Err(e),
+        }
     }
 }
 
 pub fn process_incoming_packets(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     client_id: u8,
+    channels: &mut ChannelSet,
+    inflated: &mut Vec<u8>,
+    packet_types: &mut PacketTypeTable,
     on_pong: &mut Option<Box<dyn FnMut(u64, u64) + Send>>,
     on_session_config: &mut Option<Box<dyn FnMut(u8, u16, u16) + Send>>,
-    on_packet_type_registry: &mut Option<Box<dyn FnMut(Vec<(u8, String, String)>) + Send>>,
+    on_packet_type_registry: &mut Option<Box<dyn FnMut(&PacketTypeTable) + Send>>,
+    on_game_packet: &mut Option<Box<dyn FnMut(u8, u8, &[u8]) + Send>>,
     on_unhandled_packet: &mut Option<Box<dyn FnMut(u8, u8) + Send>>,
     on_wrong_destination: &mut Option<Box<dyn FnMut(u8, u8) + Send>>,
+    events: &mut Option<EventSender>,
+    jitter: &mut Option<JitterBuffer>,
+    replication: &mut Option<SnapshotReceiver>,
+    on_entity_update: &mut Option<Box<dyn FnMut(u16, Option<&[u8]>) + Send>>,
 ) -> Result<(), Error> {
     loop {
-        match socket.receive_packet() {
-            Ok((packet, _)) => {
-                if packet.destination_id == client_id {
-                    match packet.payload {
-                        PacketPayload::Pong(pong) => {
-                            let pong_time = std::time::SystemTime::now()
-                                .duration_since(std::time::SystemTime::UNIX_EPOCH)
-                                .unwrap()
-                                .as_millis() as u64;
-                            let response_time = pong_time - pong.original_timestamp;
-                            
-                            if let Some(callback) = on_pong {
-                                callback(response_time, pong_time);
-                            }
+        match socket.receive_raw() {
+            Ok((header, data, _, arrival)) => {
+                if header.destination_id != client_id && header.destination_id != BROADCAST_ID {
+                    wrong_destination(client_id, header.destination_id, on_wrong_destination, events);
+                    continue;
+                }
+
+                if header.packet_type == PacketType::Bundle as u8 {
+                    for (entry, payload) in bundle_entries(&header, data) {
+                        if entry.destination_id != client_id && entry.destination_id != BROADCAST_ID {
+                            wrong_destination(client_id, entry.destination_id, on_wrong_destination, events);
+                            continue;
                         }
-                        PacketPayload::SessionConfig(config) => {
-                            send_ack(socket, relay_addr, client_id, packet.sequence)?;
+                        dispatch_raw(&entry, payload, arrival, channels, inflated, jitter, replication, on_entity_update, on_game_packet, on_unhandled_packet, events);
+                    }
+                    continue;
+                }
 
-                            if let Some(callback) = on_session_config {
-                                callback(config.version, config.tick_rate, config.max_packet_size);
-                            }
+                if dispatch_raw(&header, data, arrival, channels, inflated, jitter, replication, on_entity_update, on_game_packet, on_unhandled_packet, events) {
+                    continue;
+                }
+
+                match PayloadView::parse(header.packet_type, data)? {
+                    PayloadView::Pong(pong) => {
+                        // Measured at arrival, so time spent before processing doesn't count
+                        let pong_time = arrival.unix_ms;
+                        let response_time = pong_time.saturating_sub(pong.original_timestamp);
+                        channels.observe_rtt(header.client_id, Duration::from_millis(response_time));
+                        
+                        if let Some(events) = events {
+                            events.push(NeonEvent {
+                                kind: EVENT_PONG,
+                                response_time_ms: response_time,
+                                timestamp: pong_time,
+                                ..Default::default()
+                            }, &[]);
+                        } else if let Some(callback) = on_pong {
+                            callback(response_time, pong_time);
                         }
-                        PacketPayload::PacketTypeRegistry(registry) => {
-                            let entries: Vec<(u8, String, String)> = registry.entries
-                                .into_iter()
-                                .map(|e| (e.packet_id, e.name, e.description))
-                                .collect();
-                            
-                            if let Some(callback) = on_packet_type_registry {
-                                callback(entries);
-                            }
+                    }
+                    PayloadView::SessionConfig(config) => {
+                        send_ack(socket, relay_addr, client_id, header.sequence)?;
+                        socket.set_max_packet_size(config.max_packet_size as usize);
+
+                        if let Some(events) = events {
+                            events.push(NeonEvent {
+                                kind: EVENT_SESSION_CONFIG,
+                                from_client_id: header.client_id,
+                                version: config.version,
+                                tick_rate: config.tick_rate,
+                                max_packet_size: config.max_packet_size,
+                                ..Default::default()
+                            }, &[]);
+                        } else if let Some(callback) = on_session_config {
+                            callback(config.version, config.tick_rate, config.max_packet_size);
                         }
-                        _ => {
-                            if let Some(callback) = on_unhandled_packet {
-                                callback(packet.packet_type, packet.client_id);
-                            }
+
+                        // Version 0 means the host hasn't described any packet types
+                        if config.registry_version != 0 && config.registry_version == packet_types.version() {
+                            registry_known(packet_types, on_packet_type_registry, events);
+                        } else if config.registry_version != 0 && packet_types.start_request(config.registry_version) {
+                            send_registry_request(socket, relay_addr, client_id)?;
                         }
                     }
-                } else {
-                    if let Some(callback) = on_wrong_destination {
-                        callback(client_id, packet.destination_id);
+                    PayloadView::PacketTypeRegistry(registry) => {
+                        packet_types.replace(registry, registry_version(data));
+
+                        registry_known(packet_types, on_packet_type_registry, events);
                     }
+                    _ => unhandled_packet(header.packet_type, header.client_id, on_unhandled_packet, events),
                 }
             }
             Err(e) if e.kind() == ErrorKind::WouldBlock => {
@@ -104,11 +462,159 @@ pub fn process_incoming_packets(
             Err(e) => return Err(e),
         }
     }
+
+    if let Some(jitter) = jitter {
+        jitter.release(Instant::now(), &mut |from_client_id, packet_type, sequence, arrival, payload| {
+            game_packet(packet_type, from_client_id, sequence, arrival, payload, on_game_packet, on_unhandled_packet, events);
+        });
+    }
     Ok(())
 }
 
+/// Handle the messages that can also arrive inside a bundle: game packets,
+/// compressed game packets, channel data and channel acks. Returns false for anything else.
+fn dispatch_raw(
+    header: &PacketHeader,
+    data: &[u8],
+    arrival: Arrival,
+    channels: &mut ChannelSet,
+    inflated: &mut Vec<u8>,
+    jitter: &mut Option<JitterBuffer>,
+    replication: &mut Option<SnapshotReceiver>,
+    on_entity_update: &mut Option<Box<dyn FnMut(u16, Option<&[u8]>) + Send>>,
+    on_game_packet: &mut Option<Box<dyn FnMut(u8, u8, &[u8]) + Send>>,
+    on_unhandled_packet: &mut Option<Box<dyn FnMut(u8, u8) + Send>>,
+    events: &mut Option<EventSender>,
+) -> bool {
+    // Compressed game packets are inflated, then handled as if they had arrived plain
+    if header.packet_type == PacketType::Compressed as u8 {
+        let mut buffer = std::mem::take(inflated);
+        if let Some(packet_type) = crate::compress::unwrap(data, &mut buffer) {
+            let inner = PacketHeader { packet_type, ..*header };
+            dispatch_raw(&inner, &buffer, arrival, channels, inflated, jitter, replication, on_entity_update, on_game_packet, on_unhandled_packet, events);
+        }
+        *inflated = buffer;
+        return true;
+    }
+
+    // Snapshots are sequenced on their own, so they skip the jitter buffer
+    if let Some(replication) = replication.as_mut().filter(|r| r.packet_type() == header.packet_type) {
+        replication.receive(data, &mut |entity_id, state| {
+            if let Some(callback) = on_entity_update {
+                callback(entity_id, state);
+            }
+        });
+        return true;
+    }
+
+    // Game packets are handed over as a view into the receive buffer, never decoded,
+    // unless the jitter buffer has to hold on to them
+    if header.packet_type >= PacketType::GamePacket as u8 {
+        match jitter {
+            Some(jitter) => {
+                jitter.push(header.client_id, header.packet_type, header.sequence, data, arrival);
+            }
+            None => game_packet(header.packet_type, header.client_id, header.sequence, arrival, data, on_game_packet, on_unhandled_packet, events),
+        }
+        return true;
+    }
+
+    // Channel data is unwrapped by the channel layer, which delivers it in order
+    // (and only once) when the channel asks for that
+    if header.packet_type == PacketType::ChannelData as u8 {
+        channels.receive(header.client_id, header.sequence, data, &mut |packet_type, payload| {
+            game_packet(packet_type, header.client_id, header.sequence, arrival, payload, on_game_packet, on_unhandled_packet, events);
+        });
+        return true;
+    }
+
+    if header.packet_type == PacketType::Ack as u8 {
+        if let Ok(PayloadView::Ack(ack)) = PayloadView::parse(header.packet_type, data) {
+            channels.handle_ack(header.client_id, ack.channel, ack.sequence, ack.ack_bits);
+        }
+        return true;
+    }
+
+    false
+}
+
+// Each event goes to the event queue when one is enabled, otherwise to its callback
+
+fn game_packet(
+    packet_type: u8,
+    from_client_id: u8,
+    sequence: u16,
+    arrival: Arrival,
+    payload: &[u8],
+    on_game_packet: &mut Option<Box<dyn FnMut(u8, u8, &[u8]) + Send>>,
+    on_unhandled_packet: &mut Option<Box<dyn FnMut(u8, u8) + Send>>,
+    events: &mut Option<EventSender>,
+) {
+    if let Some(events) = events {
+        events.push(NeonEvent {
+            kind: EVENT_GAME_PACKET,
+            packet_type,
+            from_client_id,
+            sequence,
+            timestamp: arrival.unix_ms,
+            ..Default::default()
+        }, payload);
+    } else if let Some(callback) = on_game_packet {
+        callback(packet_type, from_client_id, payload);
+    } else if let Some(callback) = on_unhandled_packet {
+        callback(packet_type, from_client_id);
+    }
+}
+
+fn unhandled_packet(
+    packet_type: u8,
+    from_client_id: u8,
+    on_unhandled_packet: &mut Option<Box<dyn FnMut(u8, u8) + Send>>,
+    events: &mut Option<EventSender>,
+) {
+    if let Some(events) = events {
+        events.push(NeonEvent {
+            kind: EVENT_UNHANDLED_PACKET,
+            packet_type,
+            from_client_id,
+            ..Default::default()
+        }, &[]);
+    } else if let Some(callback) = on_unhandled_packet {
+        callback(packet_type, from_client_id);
+    }
+}
+
+fn wrong_destination(
+    client_id: u8,
+    destination_id: u8,
+    on_wrong_destination: &mut Option<Box<dyn FnMut(u8, u8) + Send>>,
+    events: &mut Option<EventSender>,
+) {
+    if let Some(events) = events {
+        events.push(NeonEvent {
+            kind: EVENT_WRONG_DESTINATION,
+            destination_id,
+            ..Default::default()
+        }, &[]);
+    } else if let Some(callback) = on_wrong_destination {
+        callback(client_id, destination_id);
+    }
+}
+
+fn registry_known(
+    packet_types: &PacketTypeTable,
+    on_packet_type_registry: &mut Option<Box<dyn FnMut(&PacketTypeTable) + Send>>,
+    events: &mut Option<EventSender>,
+) {
+    if let Some(events) = events {
+        events.push(NeonEvent { kind: EVENT_PACKET_TYPE_REGISTRY, ..Default::default() }, &[]);
+    } else if let Some(callback) = on_packet_type_registry {
+        callback(packet_types);
+    }
+}
+
 fn send_ack(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     client_id: u8,
     sequence: u16,
@@ -119,7 +625,9 @@ fn send_ack(
         client_id,
         destination_id: 1,
         payload: PacketPayload::Ack(Ack {
-            acknowledged_sequences: vec![sequence],
+            channel: 0,
+            sequence,
+            ack_bits: 0,
         }),
     };
     socket.send_packet(&ack_packet, relay_addr)
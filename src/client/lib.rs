@@ -5,33 +5,88 @@ mod outgoing;
 use std::net::SocketAddr;
 use std::io::{Error, ErrorKind};
 use std::time::{Instant, Duration};
-use std::thread::sleep;
 
 pub use types::{PacketPayload, NeonPacket};
-use incoming::{NeonSocket, process_incoming_packets};
+pub use crate::channel::Channel;
+use crate::capture::CaptureWriter;
+use crate::channel::{ChannelSet, CHANNEL_HEADER_SIZE};
+use crate::compress::PayloadCompression;
+pub use crate::pacing::{shed_error, LinkStats, Priority};
+use crate::jitter::JitterBuffer;
+use crate::replication::{EntityId, SnapshotReceiver};
+use crate::timer::TimerWheel;
+pub use crate::registry::{PacketTypeInfo, PacketTypeTable};
+pub use crate::events::*;
+use incoming::{NeonSocket, ConnectResponse, poll_connect_response, process_incoming_packets};
 use outgoing::*;
 
 pub type PongCallback = Box<dyn FnMut(u64, u64) + Send>; // (response_time_ms, timestamp)
 pub type SessionConfigCallback = Box<dyn FnMut(u8, u16, u16) + Send>; // (version, tick_rate, max_packet_size)
-pub type PacketTypeRegistryCallback = Box<dyn FnMut(Vec<(u8, String, String)>) + Send>; // Vec<(id, name, description)>
+pub type PacketTypeRegistryCallback = Box<dyn FnMut(&PacketTypeTable) + Send>; // (cached registry)
+pub type GamePacketCallback = Box<dyn FnMut(u8, u8, &[u8]) + Send>; // (packet_type, from_client_id, payload)
 pub type UnhandledPacketCallback = Box<dyn FnMut(u8, u8) + Send>; // (packet_type, from_client_id)
 pub type WrongDestinationCallback = Box<dyn FnMut(u8, u8) + Send>; // (my_id, packet_destination_id)
+pub type ConnectResultCallback = Box<dyn FnMut(bool, u8, u32, String) + Send>; // (success, client_id, session_id, reason)
+pub type EntityUpdateCallback = Box<dyn FnMut(EntityId, Option<&[u8]>) + Send>; // (entity_id, state, None when removed)
+
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(10);
+/// The relay answers a resume itself, so it gets one round trip plus slack
+const RESUME_TIMEOUT: Duration = Duration::from_secs(2);
+const TIMER_TICK: Duration = Duration::from_millis(1);
+
+/// What a client timer is for
+#[derive(Debug, Clone, Copy)]
+enum ClientTimer {
+    Ping,
+}
+
+/// Progress of joining a session
+enum ConnectState {
+    Disconnected,
+    /// `nonce` is sent with the request and answers carrying another one are ignored.
+    /// `resuming` is set when the client already holds an id and only its address moves.
+    Connecting { session_id: u32, nonce: u32, deadline: Instant, resuming: bool },
+    Connected,
+}
 
 pub struct NeonClient {
     socket: NeonSocket,
     relay_addr: Option<SocketAddr>,
     client_id: Option<u8>,
     session_id: Option<u32>,
+    /// From the host's ConnectAccept, presented to the relay to resume; 0 for none
+    resume_token: u64,
     name: String,
     auto_ping: bool,
     ping_interval: Duration,
-    last_ping: Option<Instant>,
+    timers: TimerWheel<ClientTimer>,
+    /// Whether a Ping timer is on the wheel
+    ping_scheduled: bool,
+    send_sequence: u16,
+    channels: ChannelSet,
+    /// Compresses payloads of the types the host flagged, and holds inflated ones
+    compression: PayloadCompression,
+    inflated: Vec<u8>,
+    /// How readily each game packet type is shed when a peer's link is congested
+    priorities: [Priority; 256],
+    connect_state: ConnectState,
+    /// Kept across sessions so a host with the same registry doesn't have to resend it
+    packet_types: PacketTypeTable,
     
     on_pong: Option<PongCallback>,
     on_session_config: Option<SessionConfigCallback>,
     on_packet_type_registry: Option<PacketTypeRegistryCallback>,
+    on_game_packet: Option<GamePacketCallback>,
     on_unhandled_packet: Option<UnhandledPacketCallback>,
     on_wrong_destination: Option<WrongDestinationCallback>,
+    on_connect_result: Option<ConnectResultCallback>,
+    /// Replaces the callbacks above, except the connect result, once enabled
+    events: Option<EventSender>,
+    /// Holds game packets for reordering when enabled
+    jitter: Option<JitterBuffer>,
+    /// Entities replicated by the host, once enabled
+    replication: Option<SnapshotReceiver>,
+    on_entity_update: Option<EntityUpdateCallback>,
 }
 
 impl NeonClient {
@@ -42,15 +97,30 @@ impl NeonClient {
             relay_addr: None,
             client_id: None,
             session_id: None,
+            resume_token: 0,
             name,
             auto_ping: true,
             ping_interval: Duration::from_secs(5),
-            last_ping: None,
+            timers: TimerWheel::new(TIMER_TICK),
+            ping_scheduled: false,
+            send_sequence: 0,
+            channels: ChannelSet::new(),
+            compression: PayloadCompression::default(),
+            inflated: Vec::new(),
+            priorities: [Priority::Reliable; 256],
+            connect_state: ConnectState::Disconnected,
+            packet_types: PacketTypeTable::new(),
             on_pong: None,
             on_session_config: None,
             on_packet_type_registry: None,
+            on_game_packet: None,
             on_unhandled_packet: None,
             on_wrong_destination: None,
+            on_connect_result: None,
+            events: None,
+            jitter: None,
+            replication: None,
+            on_entity_update: None,
         })
     }
 
@@ -70,14 +140,34 @@ impl NeonClient {
         self.on_session_config = Some(Box::new(callback));
     }
 
-    /// Set callback for when packet type registry is received
+    /// Set callback for when the session's packet type registry is known, either
+    /// received from the host or already cached from an earlier session
     pub fn on_packet_type_registry<F>(&mut self, callback: F)
     where
-        F: FnMut(Vec<(u8, String, String)>) + Send + 'static,
+        F: FnMut(&PacketTypeTable) + Send + 'static,
     {
         self.on_packet_type_registry = Some(Box::new(callback));
     }
 
+    /// Packet types described by the host, kept from the last registry received
+    pub fn packet_types(&self) -> &PacketTypeTable {
+        &self.packet_types
+    }
+
+    /// Look up a packet type in the cached registry
+    pub fn packet_type(&self, packet_id: u8) -> Option<&PacketTypeInfo> {
+        self.packet_types.get(packet_id)
+    }
+
+    /// Set callback for game packets (0x10+)
+    /// The payload slice points into the receive buffer and is only valid for the duration of the call
+    pub fn on_game_packet<F>(&mut self, callback: F)
+    where
+        F: FnMut(u8, u8, &[u8]) + Send + 'static,
+    {
+        self.on_game_packet = Some(Box::new(callback));
+    }
+
     /// Set callback for unhandled packets
     pub fn on_unhandled_packet<F>(&mut self, callback: F)
     where
@@ -94,6 +184,73 @@ impl NeonClient {
         self.on_wrong_destination = Some(Box::new(callback));
     }
 
+    /// Queue incoming events for the returned receiver instead of calling the callbacks.
+    /// Packets keep being processed wherever process_packets is called; the receiver
+    /// can drain them from another thread. The connect result stays a callback.
+    pub fn enable_event_queue(&mut self, capacity: usize, slab_size: usize) -> EventReceiver {
+        let (sender, receiver) = event_queue(capacity, slab_size);
+        self.events = Some(sender);
+        receiver
+    }
+
+    /// Read the socket on a background thread from now on. Datagrams are timestamped
+    /// as they arrive and wait for process_packets, which still does all the handling.
+    pub fn start_receive_thread(&mut self) -> Result<(), Error> {
+        self.socket.start_receive_thread()
+    }
+
+    /// Record every datagram received from now on to a capture file at `path`,
+    /// replacing any capture in progress
+    pub fn start_capture(&mut self, path: &str) -> Result<(), Error> {
+        self.socket.set_capture(Some(CaptureWriter::create(path)?));
+        Ok(())
+    }
+
+    /// Finish the capture in progress, writing out everything recorded
+    pub fn stop_capture(&mut self) {
+        self.socket.set_capture(None);
+    }
+
+    /// Hold game packets for `delay` and deliver each source's packets in sequence
+    /// order, dropping any that arrive after a newer one was delivered. None turns it off.
+    /// Channel packets are unaffected, channels already order what needs ordering.
+    pub fn set_jitter_buffer(&mut self, delay: Option<Duration>) {
+        self.jitter = delay.map(JitterBuffer::new);
+    }
+
+    /// Apply the host's entity snapshots, sent as game packet type `packet_type`, instead
+    /// of delivering them as game packets. Must match the host's enable_replication.
+    pub fn enable_replication(&mut self, packet_type: u8) -> Result<(), Error> {
+        if packet_type < types::PacketType::GamePacket as u8 {
+            return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+        }
+        self.replication = Some(SnapshotReceiver::new(packet_type));
+        Ok(())
+    }
+
+    /// Set callback for replicated entities: called with the new state of each entity
+    /// that changed, or None when the host removed it. Not queued by the event queue.
+    pub fn on_entity_update<F>(&mut self, callback: F)
+    where
+        F: FnMut(EntityId, Option<&[u8]>) + Send + 'static,
+    {
+        self.on_entity_update = Some(Box::new(callback));
+    }
+
+    /// Current state of a replicated entity
+    pub fn entity(&self, entity_id: EntityId) -> Option<&[u8]> {
+        self.replication.as_ref().and_then(|replication| replication.entity(entity_id))
+    }
+
+    /// Set callback for when a connect attempt succeeds or fails
+    /// On failure the client ID is 0 and the reason describes what went wrong
+    pub fn on_connect_result<F>(&mut self, callback: F)
+    where
+        F: FnMut(bool, u8, u32, String) + Send + 'static,
+    {
+        self.on_connect_result = Some(Box::new(callback));
+    }
+
     /// Set whether to automatically send pings (default: true)
     pub fn set_auto_ping(&mut self, enabled: bool) {
         self.auto_ping = enabled;
@@ -119,80 +276,390 @@ impl NeonClient {
         &self.name
     }
 
-    /// Connect to a session
+    /// Get the largest packet size, header included, negotiated with the host
+    pub fn max_packet_size(&self) -> u16 {
+        self.socket.max_packet_size() as u16
+    }
+
+    /// Check whether a connect attempt is still waiting for the host
+    pub fn is_connecting(&self) -> bool {
+        matches!(self.connect_state, ConnectState::Connecting { .. })
+    }
+
+    /// Connect to a session, blocking until the host answers or the attempt times out
     pub fn connect(&mut self, session_id: u32, relay_addr: &str) -> Result<(), Error> {
+        self.connect_async(session_id, relay_addr)?;
+        self.wait_connect()
+    }
+
+    fn wait_connect(&mut self) -> Result<(), Error> {
+        loop {
+            if let Some(outcome) = self.poll_connect() {
+                return outcome;
+            }
+            self.socket.wait(self.connect_deadline()
+                .map(|deadline| deadline.saturating_duration_since(Instant::now())))?;
+        }
+    }
+
+    /// Start connecting to a session without blocking
+    /// The attempt advances in process_packets and ends with the connect result callback
+    pub fn connect_async(&mut self, session_id: u32, relay_addr: &str) -> Result<(), Error> {
         let relay_addr = relay_addr.parse()
             .map_err(|_| Error::new(ErrorKind::InvalidInput, "Invalid relay address"))?;
         
         self.relay_addr = Some(relay_addr);
-        self.socket.socket.set_nonblocking(false)?;
+        self.client_id = None;
+        self.session_id = None;
+        self.resume_token = 0;
+        self.channels = ChannelSet::new();
+        // A new session starts from the default until its SessionConfig arrives
+        self.socket.set_max_packet_size(types::DEFAULT_MAX_PACKET_SIZE);
+        // Keep the cached registry, but ask again if this session's host doesn't match it
+        self.packet_types.clear_request();
 
-        send_connect_request(&self.socket, relay_addr, &self.name, session_id)?;
+        let nonce = rand::random::<u32>().max(1);
+        send_connect_request(&mut self.socket, relay_addr, &self.name, session_id, nonce)?;
 
-        let (assigned_client_id, received_session_id) = wait_for_connect_response(&self.socket, Duration::from_secs(10))?;
-        
-        self.socket.socket.set_nonblocking(true)?;
-        
-        if received_session_id != session_id {
+        self.connect_state = ConnectState::Connecting {
+            session_id,
+            nonce,
+            deadline: Instant::now() + CONNECT_TIMEOUT,
+            resuming: false,
+        };
+        Ok(())
+    }
+
+    /// Move the current session to a fresh local socket, blocking until the relay
+    /// answers. Meant for after the client's address changed, such as a switch of
+    /// network, and takes one round trip to the relay instead of a full connect.
+    pub fn resume(&mut self) -> Result<(), Error> {
+        self.resume_async()?;
+        self.wait_connect()
+    }
+
+    /// Start resuming the current session without blocking. The client keeps its id,
+    /// its channels and the SessionConfig and registry it was sent. The attempt ends
+    /// with the connect result callback; if it fails the client is disconnected and
+    /// has to connect again.
+    pub fn resume_async(&mut self) -> Result<(), Error> {
+        let (Some(relay_addr), Some(client_id), Some(session_id)) = (self.relay_addr, self.client_id, self.session_id) else {
+            return Err(Error::new(ErrorKind::NotConnected, "Client not connected"));
+        };
+        if self.resume_token == 0 {
+            return Err(Error::new(ErrorKind::Unsupported, "The host didn't issue a resume token"));
+        }
+
+        self.socket.rebind()?;
+        let nonce = rand::random::<u32>().max(1);
+        send_resume(&mut self.socket, relay_addr, client_id, session_id, nonce, self.resume_token)?;
+
+        self.connect_state = ConnectState::Connecting {
+            session_id,
+            nonce,
+            deadline: Instant::now() + RESUME_TIMEOUT,
+            resuming: true,
+        };
+        Ok(())
+    }
+
+    /// Leave the current session, telling the host so it can reuse this client's id.
+    /// A connect attempt still in progress is abandoned.
+    pub fn disconnect(&mut self) -> Result<(), Error> {
+        let notice = match (self.relay_addr, self.client_id) {
+            (Some(relay_addr), Some(client_id)) => send_disconnect_notice(&mut self.socket, relay_addr, client_id),
+            _ => Ok(()),
+        };
+
+        self.client_id = None;
+        self.session_id = None;
+        self.resume_token = 0;
+        self.connect_state = ConnectState::Disconnected;
+        self.channels = ChannelSet::new();
+        notice
+    }
+
+    fn connect_deadline(&self) -> Option<Instant> {
+        match self.connect_state {
+            ConnectState::Connecting { deadline, .. } => Some(deadline),
+            _ => None,
+        }
+    }
+
+    /// Advance a pending connect attempt, returning its outcome once it is decided
+    fn poll_connect(&mut self) -> Option<Result<(), Error>> {
+        let ConnectState::Connecting { session_id, nonce, deadline, resuming } = self.connect_state else {
+            return None;
+        };
+
+        let outcome = match poll_connect_response(&mut self.socket, nonce) {
+            Ok(Some(ConnectResponse::Accepted(accept))) if resuming => self.complete_resume(session_id, accept),
+            Ok(Some(ConnectResponse::Accepted(accept))) => self.complete_connect(session_id, accept),
+            Ok(Some(ConnectResponse::Denied(reason))) => Err(Error::new(ErrorKind::ConnectionRefused, reason)),
+            Ok(None) if Instant::now() >= deadline => {
+                Err(Error::new(ErrorKind::TimedOut, "Timed out waiting for the host to accept"))
+            }
+            Ok(None) => return None,
+            Err(e) => Err(e),
+        };
+
+        self.connect_state = match outcome {
+            Ok(()) => ConnectState::Connected,
+            Err(_) => ConnectState::Disconnected,
+        };
+        if outcome.is_err() && resuming {
+            self.client_id = None;
+            self.session_id = None;
+            self.resume_token = 0;
+            self.channels = ChannelSet::new();
+        }
+
+        if let Some(callback) = &mut self.on_connect_result {
+            match &outcome {
+                Ok(()) => callback(true, self.client_id.unwrap_or(0), session_id, String::new()),
+                Err(e) => callback(false, 0, session_id, e.to_string()),
+            }
+        }
+
+        Some(outcome)
+    }
+
+    fn complete_connect(&mut self, session_id: u32, accept: types::ConnectAccept) -> Result<(), Error> {
+        if accept.session_id != session_id {
             return Err(Error::new(ErrorKind::ConnectionRefused, 
-                format!("Session ID mismatch: requested {}, got {}", session_id, received_session_id)));
+                format!("Session ID mismatch: requested {}, got {}", session_id, accept.session_id)));
         }
-        
+
+        let (assigned_client_id, received_session_id) = (accept.assigned_client_id, accept.session_id);
+        send_connect_accept_confirmation(&mut self.socket, self.relay_addr.unwrap(), assigned_client_id, accept)?;
+
         self.client_id = Some(assigned_client_id);
         self.session_id = Some(received_session_id);
+        self.resume_token = accept.resume_token;
+        if let Some(jitter) = &mut self.jitter {
+            jitter.clear();
+        }
+        if let Some(replication) = &mut self.replication {
+            replication.clear();
+        }
+        Ok(())
+    }
 
-        let accept = types::ConnectAccept {
-            assigned_client_id,
-            session_id: received_session_id,
-        };
-        send_connect_accept_confirmation(&self.socket, relay_addr, assigned_client_id, accept)?;
-
+    /// The relay moved this client to its new address; the session carries on as it was
+    fn complete_resume(&mut self, session_id: u32, accept: types::ConnectAccept) -> Result<(), Error> {
+        if accept.session_id != session_id || Some(accept.assigned_client_id) != self.client_id {
+            return Err(Error::new(ErrorKind::ConnectionRefused, "The relay resumed a different client"));
+        }
+        log_info!("[Client] Resumed session {} as client {}", session_id, accept.assigned_client_id);
         Ok(())
     }
 
     /// Manually send a ping
-    pub fn send_ping(&self) -> Result<(), Error> {
+    pub fn send_ping(&mut self) -> Result<(), Error> {
         if let (Some(relay_addr), Some(client_id)) = (self.relay_addr, self.client_id) {
-            send_ping(&self.socket, relay_addr, client_id)
+            send_ping(&mut self.socket, relay_addr, client_id)
         } else {
             Err(Error::new(ErrorKind::NotConnected, "Client not connected"))
         }
     }
 
+    /// Send a game packet (type 0x10+) to another peer in the session.
+    /// Destination BROADCAST_ID (0) reaches every other peer, copied by the relay.
+    /// Packets of a type given a sheddable priority, sent to a single peer whose
+    /// link is congested, are shed and return `shed_error`.
+    pub fn send_game_packet(&mut self, packet_type: u8, destination_id: u8, payload: &[u8]) -> Result<(), Error> {
+        if let (Some(relay_addr), Some(client_id)) = (self.relay_addr, self.client_id) {
+            let wrapped = if self.packet_types.is_compressed(packet_type) { self.compression.wrap(packet_type, payload) } else { None };
+            // Broadcasts aren't paced, there is no single link to measure them against
+            let priority = self.priorities[packet_type as usize];
+            let wire_len = types::PACKET_HEADER_SIZE + wrapped.map_or(payload.len(), <[u8]>::len);
+            if destination_id != types::BROADCAST_ID && !self.channels.admit(destination_id, wire_len, priority) {
+                return Err(shed_error());
+            }
+            let sequence = self.send_sequence;
+            self.send_sequence = self.send_sequence.wrapping_add(1);
+            send_game_packet(&mut self.socket, relay_addr, client_id, packet_type, destination_id, sequence, payload, wrapped)
+        } else {
+            Err(Error::new(ErrorKind::NotConnected, "Client not connected"))
+        }
+    }
+
+    /// Send one game packet (type 0x10+) that the relay copies to every listed peer
+    pub fn send_multicast(&mut self, packet_type: u8, targets: &[u8], payload: &[u8]) -> Result<(), Error> {
+        if let (Some(relay_addr), Some(client_id)) = (self.relay_addr, self.client_id) {
+            let sequence = self.send_sequence;
+            self.send_sequence = self.send_sequence.wrapping_add(1);
+            let compression = self.packet_types.is_compressed(packet_type).then_some(&mut self.compression);
+            send_multicast_packet(&mut self.socket, relay_addr, client_id, packet_type, targets, sequence, payload, compression)
+        } else {
+            Err(Error::new(ErrorKind::NotConnected, "Client not connected"))
+        }
+    }
+
+    /// Send a game packet (type 0x10+) on a channel with the given delivery guarantee
+    /// Reliable packets are resent until acknowledged; acks ride along on channel traffic.
+    /// On a congested link reliable packets wait for the pacer, unreliable ones are shed by priority.
+    pub fn send_on_channel(&mut self, channel: Channel, packet_type: u8, destination_id: u8, payload: &[u8]) -> Result<(), Error> {
+        let (Some(relay_addr), Some(client_id)) = (self.relay_addr, self.client_id) else {
+            return Err(Error::new(ErrorKind::NotConnected, "Client not connected"));
+        };
+        if packet_type < types::PacketType::GamePacket as u8 {
+            return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+        }
+        if destination_id == types::BROADCAST_ID {
+            return Err(Error::new(ErrorKind::InvalidInput, "Channels need a single destination"));
+        }
+
+        let compressed = if self.packet_types.is_compressed(packet_type) { self.compression.compress(payload) } else { None };
+        let sent = compressed.unwrap_or(payload);
+        if types::PACKET_HEADER_SIZE + CHANNEL_HEADER_SIZE + sent.len() > self.socket.max_packet_size() {
+            return Err(Error::new(ErrorKind::InvalidInput, "Packet exceeds maximum packet size"));
+        }
+
+        let socket = &mut self.socket;
+        let priority = self.priorities[packet_type as usize];
+        self.channels.send(destination_id, channel, packet_type, sent, compressed.is_some(), priority, &mut |packet_type, destination_id, sequence, bytes| {
+            send_raw_packet(socket, relay_addr, client_id, packet_type, destination_id, sequence, bytes)
+        })
+    }
+
+    /// Coalesce game, channel and ack messages into bundles of up to max_packet_size
+    /// bytes. Bundled messages wait until flush, which should be called once per
+    /// tick; disabling bundling flushes immediately.
+    pub fn set_bundling(&mut self, enabled: bool) -> Result<(), Error> {
+        let flushed = if enabled { Ok(()) } else { self.flush() };
+        self.socket.set_bundling(enabled);
+        flushed
+    }
+
+    /// Send any messages waiting in the pending bundle
+    pub fn flush(&mut self) -> Result<(), Error> {
+        match self.relay_addr {
+            Some(relay_addr) => self.socket.flush(relay_addr),
+            None => Ok(()),
+        }
+    }
+
+    /// Get the smoothed round trip time to a peer, measured from channel acks and,
+    /// for the host, pongs
+    pub fn rtt(&self, peer_id: u8) -> Option<Duration> {
+        self.channels.rtt(peer_id)
+    }
+
+    /// Round trip, loss and bandwidth estimates for the link to a peer, None
+    /// until something has been sent to or received from it
+    pub fn link_stats(&self, peer_id: u8) -> Option<LinkStats> {
+        self.channels.link_stats(peer_id)
+    }
+
+    /// Set how readily packets of a game type are shed when a peer's link is congested.
+    /// Types default to Priority::Reliable and are never shed; nor are reliable
+    /// channel packets, whatever their type's priority.
+    pub fn set_packet_priority(&mut self, packet_type: u8, priority: Priority) {
+        self.priorities[packet_type as usize] = priority;
+    }
+
+    /// Resend unacknowledged channel packets and send any acks still owed
+    fn update_channels(&mut self) -> Result<(), Error> {
+        let (Some(relay_addr), Some(client_id)) = (self.relay_addr, self.client_id) else {
+            return Ok(());
+        };
+
+        let socket = &mut self.socket;
+        self.channels.update(&mut |packet_type, destination_id, sequence, bytes| {
+            send_raw_packet(socket, relay_addr, client_id, packet_type, destination_id, sequence, bytes)
+        })
+    }
+
     /// Process incoming packets once
+    /// While a connect attempt is pending this only checks for the host's answer
     pub fn process_packets(&mut self) -> Result<(), Error> {
+        self.poll_connect();
+
+        if self.is_connecting() {
+            return Ok(());
+        }
+
         if let Some(client_id) = self.client_id {
-            if self.auto_ping {
-                let should_ping = self.last_ping
-                    .map(|t| t.elapsed() >= self.ping_interval)
-                    .unwrap_or(true);
-                
-                if should_ping {
-                    self.send_ping()?;
-                    self.last_ping = Some(Instant::now());
-                }
-            }
+            self.run_timers()?;
 
             process_incoming_packets(
-                &self.socket,
+                &mut self.socket,
                 self.relay_addr.unwrap(),
                 client_id,
+                &mut self.channels,
+                &mut self.inflated,
+                &mut self.packet_types,
                 &mut self.on_pong,
                 &mut self.on_session_config,
                 &mut self.on_packet_type_registry,
+                &mut self.on_game_packet,
                 &mut self.on_unhandled_packet,
                 &mut self.on_wrong_destination,
-            )
+                &mut self.events,
+                &mut self.jitter,
+                &mut self.replication,
+                &mut self.on_entity_update,
+            )?;
+
+            // Ack the newest snapshot applied, which becomes the host's next baseline
+            if let Some(replication) = &mut self.replication {
+                if let Some(ack) = replication.take_ack() {
+                    let packet_type = replication.packet_type();
+                    // A shed ack is fine, the next snapshot is acked in its place
+                    match self.send_game_packet(packet_type, types::HOST_ID, &ack) {
+                        Err(e) if e.kind() != ErrorKind::WouldBlock => return Err(e),
+                        _ => {}
+                    }
+                }
+            }
+
+            self.update_channels()
         } else {
             Err(Error::new(ErrorKind::NotConnected, "Client not connected"))
         }
     }
 
+    /// Send the auto-ping when it's due. A ping is sent right away after
+    /// connecting or enabling auto-ping, then every ping_interval.
+    fn run_timers(&mut self) -> Result<(), Error> {
+        let now = Instant::now();
+        if self.auto_ping && !self.ping_scheduled {
+            self.timers.schedule(now, ClientTimer::Ping);
+            self.ping_scheduled = true;
+        }
+
+        while let Some(timer) = self.timers.pop_expired(now) {
+            match timer {
+                ClientTimer::Ping => {
+                    self.ping_scheduled = false;
+                    if self.auto_ping {
+                        self.send_ping()?;
+                        self.timers.schedule(now + self.ping_interval, ClientTimer::Ping);
+                        self.ping_scheduled = true;
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+
     /// Run the client in a loop (blocks)
+    /// Wakes when a datagram arrives or the next timer is due
     pub fn run(&mut self) -> Result<(), Error> {
         loop {
             self.process_packets()?;
-            sleep(Duration::from_millis(10));
+            self.flush()?;
+
+            let deadline = match self.connect_deadline() {
+                Some(deadline) => Some(deadline),
+                None => [
+                    self.timers.next_deadline(),
+                    self.channels.next_deadline(),
+                    self.jitter.as_ref().and_then(|jitter| jitter.next_deadline()),
+                ].into_iter().flatten().min(),
+            };
+            self.socket.wait(deadline.map(|deadline| deadline.saturating_duration_since(Instant::now())))?;
         }
     }
 }
\ No newline at end of file
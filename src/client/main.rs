@@ -58,10 +58,10 @@ fn main() {
                  version, tick_rate, max_packet_size);
     });
 
-    client.on_packet_type_registry(|entries| {
+    client.on_packet_type_registry(|packet_types| {
         println!("Received PacketTypeRegistry:");
-        for (id, name, description) in entries {
-            println!("  0x{:02X}: {} - {}", id, name, description);
+        for (id, info) in packet_types.iter() {
+            println!("  0x{:02X}: {} - {}", id, info.name(), info.description());
         }
     });
 
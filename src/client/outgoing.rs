@@ -1,20 +1,23 @@
 use std::net::SocketAddr;
 use std::io::{Error, ErrorKind};
-use std::time::{SystemTime, Duration};
+use std::time::SystemTime;
 use super::types::*;
 use super::incoming::NeonSocket;
+use crate::compress::PayloadCompression;
 
 pub fn send_connect_request(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     client_name: &str,
     target_session_id: u32,
+    request_nonce: u32,
 ) -> Result<(), Error> {
     let connect_req = ConnectRequest {
-        client_version: 1,
+        client_version: PROTOCOL_VERSION,
         desired_name: client_name.to_string(),
         target_session_id,
         game_identifier: 0,
+        request_nonce,
     };
     
     let connect_packet = NeonPacket {
@@ -25,13 +28,13 @@ pub fn send_connect_request(
         payload: PacketPayload::ConnectRequest(connect_req),
     };
 
-    println!("Attempting to connect to session {} via relay...", target_session_id);
+    log_info!("[Client] Connecting to session {} via relay...", target_session_id);
     socket.send_packet(&connect_packet, relay_addr)?;
     Ok(())
 }
 
 pub fn send_connect_accept_confirmation(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     client_id: u8,
     accept: ConnectAccept,
@@ -47,8 +50,46 @@ pub fn send_connect_accept_confirmation(
     Ok(())
 }
 
+/// Ask the relay to move this client's session membership to the address the
+/// packet arrives from
+pub fn send_resume(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    client_id: u8,
+    session_id: u32,
+    request_nonce: u32,
+    resume_token: u64,
+) -> Result<(), Error> {
+    let packet = NeonPacket {
+        packet_type: PacketType::Resume as u8,
+        sequence: 0,
+        client_id,
+        destination_id: 1,
+        payload: PacketPayload::Resume(Resume { session_id, request_nonce, resume_token }),
+    };
+
+    log_info!("[Client] Resuming session {} as client {}...", session_id, client_id);
+    socket.send_packet(&packet, relay_addr)
+}
+
+/// Ask the host for its packet type registry; an empty registry packet is the request
+pub fn send_registry_request(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    client_id: u8,
+) -> Result<(), Error> {
+    let request = NeonPacket {
+        packet_type: PacketType::PacketTypeRegistry as u8,
+        sequence: 0,
+        client_id,
+        destination_id: 1,
+        payload: PacketPayload::None,
+    };
+    socket.send_packet(&request, relay_addr)
+}
+
 pub fn send_ping(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     client_id: u8,
 ) -> Result<(), Error> {
@@ -68,21 +109,98 @@ pub fn send_ping(
     socket.send_packet(&packet, relay_addr)
 }
 
-pub fn wait_for_connect_response(
-    socket: &NeonSocket,
-    timeout: Duration,
-) -> Result<(u8, u32), Error> {
-    socket.socket.set_read_timeout(Some(timeout))?;
-    
-    let (response, _) = socket.receive_packet()?;
-    
-    socket.socket.set_read_timeout(None)?;
-
-    if let PacketPayload::ConnectAccept(accept) = response.payload {
-        Ok((accept.assigned_client_id, accept.session_id))
-    } else if let PacketPayload::ConnectDeny(deny) = response.payload {
-        Err(Error::new(ErrorKind::ConnectionRefused, deny.reason))
-    } else {
-        Err(Error::new(ErrorKind::ConnectionAborted, "Invalid ConnectAccept response"))
+/// Tell the host this client is leaving so it can release the client's id
+pub fn send_disconnect_notice(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    client_id: u8,
+) -> Result<(), Error> {
+    let packet = NeonPacket {
+        packet_type: PacketType::DisconnectNotice as u8,
+        sequence: 0,
+        client_id,
+        destination_id: 1,
+        payload: PacketPayload::None,
+    };
+
+    socket.send_packet(&packet, relay_addr)
+}
+
+/// Send a game packet, or in its place the Compressed packet `wrapped` built for it
+/// by `PayloadCompression::wrap`
+pub fn send_game_packet(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    client_id: u8,
+    packet_type: u8,
+    destination_id: u8,
+    sequence: u16,
+    payload: &[u8],
+    wrapped: Option<&[u8]>,
+) -> Result<(), Error> {
+    if packet_type < PacketType::GamePacket as u8 {
+        return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+    }
+
+    if let Some(wrapped) = wrapped {
+        return send_raw_packet(socket, relay_addr, client_id, PacketType::Compressed as u8, destination_id, sequence, wrapped);
     }
-}
\ No newline at end of file
+    send_raw_packet(socket, relay_addr, client_id, packet_type, destination_id, sequence, payload)
+}
+
+/// Send one game packet that the relay copies to each client id in `targets`
+pub fn send_multicast_packet(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    client_id: u8,
+    packet_type: u8,
+    targets: &[u8],
+    sequence: u16,
+    payload: &[u8],
+    compression: Option<&mut PayloadCompression>,
+) -> Result<(), Error> {
+    if packet_type < PacketType::GamePacket as u8 {
+        return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+    }
+
+    let mut peer_set = [0u8; PEER_SET_SIZE];
+    for &target in targets {
+        peer_set[target as usize / 8] |= 1 << (target % 8);
+    }
+
+    let header = PacketHeader {
+        magic: 0x4E45,
+        version: PROTOCOL_VERSION,
+        packet_type: PacketType::Multicast as u8,
+        sequence,
+        client_id: client_id,
+        destination_id: BROADCAST_ID,
+    };
+
+    match compression.and_then(|compression| compression.wrap(packet_type, payload)) {
+        Some(wrapped) => socket.send_multicast(&header, &peer_set, PacketType::Compressed as u8, wrapped, relay_addr),
+        None => socket.send_multicast(&header, &peer_set, packet_type, payload, relay_addr),
+    }
+}
+
+/// Send an already-encoded payload under a fresh header, used for channel data and acks
+pub fn send_raw_packet(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    client_id: u8,
+    packet_type: u8,
+    destination_id: u8,
+    sequence: u16,
+    payload: &[u8],
+) -> Result<(), Error> {
+    let header = PacketHeader {
+        magic: 0x4E45,
+        version: PROTOCOL_VERSION,
+        packet_type,
+        sequence,
+        client_id,
+        destination_id,
+    };
+
+    socket.send_raw(&header, payload, relay_addr)
+}
@@ -0,0 +1,697 @@
+//! Wire format shared by the client, host and relay.
+//!
+//! Encoding writes into a caller's buffer and decoding hands out views that
+//! borrow from the datagram, so neither allocates. The owned `PacketPayload`
+//! sits on top for code that keeps packets around after the buffer is reused.
+
+use std::convert::TryInto;
+use std::io::{Error, ErrorKind};
+
+/// First two bytes of every packet, "NE" little endian
+pub const PACKET_MAGIC: u16 = 0x4E45;
+/// Raised whenever a payload the header's version guards changes layout.
+/// 2 added request nonces to the handshake, and the resume token to ConnectAccept
+/// along with the Resume packet it is presented in.
+pub const PROTOCOL_VERSION: u8 = 2;
+pub const PACKET_HEADER_SIZE: usize = 8;
+/// Bytes in front of each message inside a bundle: destination, packet type, sequence u16, length u16
+pub const BUNDLE_ENTRY_HEADER_SIZE: usize = 6;
+/// Destination id that addresses every other peer in the session
+pub const BROADCAST_ID: u8 = 0;
+/// Client id of the host in every session
+pub const HOST_ID: u8 = 1;
+/// Bytes in the peer set at the front of a multicast payload, one bit per client id
+pub const PEER_SET_SIZE: usize = 32;
+/// Packet size a session uses until the host's SessionConfig says otherwise
+pub const DEFAULT_MAX_PACKET_SIZE: usize = 1024;
+/// Smallest packet size a session can negotiate
+pub const MIN_PACKET_SIZE: usize = 512;
+/// Largest UDP payload that fits in a single IPv4 datagram
+pub const MAX_DATAGRAM_SIZE: usize = 65507;
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+#[repr(u8)]
+pub enum PacketType {
+    ConnectRequest = 0x01,
+    ConnectAccept = 0x02,
+    ConnectDeny = 0x03,
+    SessionConfig = 0x04,
+    PacketTypeRegistry = 0x05,
+    Bundle = 0x06,
+    Multicast = 0x07,
+    /// Batch of frames between two meshed relays, never seen by clients or hosts
+    RelayLink = 0x08,
+    /// Game packet whose payload is compressed: [packet_type u8][original length u16][LZ4 block]
+    Compressed = 0x09,
+    /// Client asking the relay to move its session membership to the address it sends from
+    Resume = 0x0A,
+    Ping = 0x0B,
+    Pong = 0x0C,
+    DisconnectNotice = 0x0D,
+    Ack = 0x0E,
+    ChannelData = 0x0F,
+    GamePacket = 0x10,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct PacketHeader {
+    pub magic: u16,
+    pub version: u8,
+    pub packet_type: u8,
+    pub sequence: u16,
+    pub client_id: u8,
+    pub destination_id: u8,
+}
+
+#[derive(Debug, Clone)]
+pub enum PacketPayload {
+    None,
+    Ping(Ping),
+    Pong(Pong),
+    ConnectRequest(ConnectRequest),
+    ConnectAccept(ConnectAccept),
+    ConnectDeny(ConnectDeny),
+    Resume(Resume),
+    SessionConfig(SessionConfig),
+    PacketTypeRegistry(PacketTypeRegistry),
+    Ack(Ack),
+    GamePacket(Vec<u8>),
+}
+
+#[derive(Debug, Clone)]
+pub struct NeonPacket {
+    pub packet_type: u8,
+    pub sequence: u16,
+    pub client_id: u8,
+    pub destination_id: u8,
+    pub payload: PacketPayload,
+}
+
+#[derive(Debug, Clone)]
+pub struct ConnectRequest {
+    pub client_version: u8,
+    pub desired_name: String,
+    pub target_session_id: u32,
+    /// 0 when the client doesn't name a game
+    pub game_identifier: u32,
+    /// Echoed in the host's answer, so the answer can be matched to this request
+    pub request_nonce: u32,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct ConnectAccept {
+    pub assigned_client_id: u8,
+    pub session_id: u32,
+    /// Only meaningful when the host registers: how long the relay keeps a silent
+    /// client of this session, in milliseconds. 0 leaves it to the relay.
+    pub peer_timeout_ms: u32,
+    /// Nonce of the ConnectRequest being accepted, 0 for a host registration
+    pub request_nonce: u32,
+    /// Issued by the host with each accepted client; presenting it in a Resume
+    /// moves the client to a new address without joining again. 0 for none.
+    pub resume_token: u64,
+}
+
+#[derive(Debug, Clone)]
+pub struct ConnectDeny {
+    /// Nonce of the ConnectRequest being denied
+    pub request_nonce: u32,
+    pub reason: String,
+}
+
+/// Sent by a client whose address changed, with the client id it holds in the header
+#[derive(Debug, Clone, Copy)]
+pub struct Resume {
+    pub session_id: u32,
+    /// Echoed in the relay's ConnectAccept or ConnectDeny
+    pub request_nonce: u32,
+    /// Token from the client's ConnectAccept
+    pub resume_token: u64,
+}
+
+#[derive(Debug, Clone)]
+pub struct PacketTypeRegistry {
+    pub entries: Vec<PacketTypeEntry>,
+}
+
+/// Registry entry flag: senders compress payloads of this type when that saves bytes
+pub const PACKET_TYPE_COMPRESSED: u8 = 0x01;
+
+#[derive(Debug, Clone)]
+pub struct PacketTypeEntry {
+    pub packet_id: u8,
+    /// PACKET_TYPE_* flags
+    pub flags: u8,
+    pub name: String,
+    pub description: String,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct Ping {
+    pub timestamp: u64,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct Pong {
+    pub original_timestamp: u64,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct SessionConfig {
+    pub version: u8,
+    pub tick_rate: u16,
+    pub max_packet_size: u16,
+    /// Version of the host's packet type registry, 0 if it has none
+    pub registry_version: u32,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct Ack {
+    /// 0 for connection setup packets, otherwise the channel being acknowledged
+    pub channel: u8,
+    /// Latest sequence received
+    pub sequence: u16,
+    /// Bit n set means `sequence - (n + 1)` was received too
+    pub ack_bits: u32,
+}
+
+impl Ack {
+    /// Whether this ack covers `sequence`, either directly or through the bitfield
+    pub fn acknowledges(&self, sequence: u16) -> bool {
+        let distance = self.sequence.wrapping_sub(sequence) as u32;
+        distance == 0 || (distance <= 32 && self.ack_bits & (1 << (distance - 1)) != 0)
+    }
+}
+
+/// Destination for encoded bytes: a growable Vec or a fixed `Writer`
+trait Output {
+    fn put(&mut self, bytes: &[u8]) -> Result<(), Error>;
+
+    fn put_u8(&mut self, value: u8) -> Result<(), Error> {
+        self.put(&[value])
+    }
+}
+
+impl Output for Vec<u8> {
+    fn put(&mut self, bytes: &[u8]) -> Result<(), Error> {
+        self.extend_from_slice(bytes);
+        Ok(())
+    }
+}
+
+/// Cursor that encodes into a fixed buffer, failing rather than growing it
+pub struct Writer<'a> {
+    buf: &'a mut [u8],
+    len: usize,
+}
+
+impl<'a> Writer<'a> {
+    pub fn new(buf: &'a mut [u8]) -> Self {
+        Self { buf, len: 0 }
+    }
+
+    /// Bytes written so far
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+}
+
+impl Output for Writer<'_> {
+    fn put(&mut self, bytes: &[u8]) -> Result<(), Error> {
+        let end = self.len + bytes.len();
+        let Some(dest) = self.buf.get_mut(self.len..end) else {
+            return Err(Error::new(ErrorKind::WriteZero, "Buffer too small for packet"));
+        };
+        dest.copy_from_slice(bytes);
+        self.len = end;
+        Ok(())
+    }
+}
+
+/// Cursor over a received payload. Reads return None past the end.
+pub struct Reader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    pub fn new(data: &'a [u8]) -> Self {
+        Self { data }
+    }
+
+    pub fn take(&mut self, len: usize) -> Option<&'a [u8]> {
+        if self.data.len() < len {
+            return None;
+        }
+        let (head, tail) = self.data.split_at(len);
+        self.data = tail;
+        Some(head)
+    }
+
+    pub fn u8(&mut self) -> Option<u8> {
+        self.take(1).map(|b| b[0])
+    }
+
+    pub fn u16(&mut self) -> Option<u16> {
+        self.take(2).map(|b| u16::from_le_bytes(b.try_into().unwrap()))
+    }
+
+    pub fn u32(&mut self) -> Option<u32> {
+        self.take(4).map(|b| u32::from_le_bytes(b.try_into().unwrap()))
+    }
+
+    pub fn u64(&mut self) -> Option<u64> {
+        self.take(8).map(|b| u64::from_le_bytes(b.try_into().unwrap()))
+    }
+
+    /// `len` bytes that must be valid UTF-8
+    pub fn str(&mut self, len: usize) -> Option<&'a str> {
+        self.take(len).and_then(|b| std::str::from_utf8(b).ok())
+    }
+
+    /// Everything left, consuming the reader
+    pub fn rest(&mut self) -> &'a [u8] {
+        std::mem::take(&mut self.data)
+    }
+}
+
+fn invalid(message: &'static str) -> Error {
+    Error::new(ErrorKind::InvalidData, message)
+}
+
+/// Longest prefix of `s` that fits a u8 length on a char boundary
+fn short_str(s: &str) -> &str {
+    let mut end = s.len().min(u8::MAX as usize);
+    while !s.is_char_boundary(end) {
+        end -= 1;
+    }
+    &s[..end]
+}
+
+impl PacketHeader {
+    /// Header with the current magic and version
+    pub fn new(packet_type: u8, sequence: u16, client_id: u8, destination_id: u8) -> Self {
+        Self {
+            magic: PACKET_MAGIC,
+            version: PROTOCOL_VERSION,
+            packet_type,
+            sequence,
+            client_id,
+            destination_id,
+        }
+    }
+
+    pub fn to_bytes(&self) -> [u8; PACKET_HEADER_SIZE] {
+        let [m0, m1] = self.magic.to_le_bytes();
+        let [s0, s1] = self.sequence.to_le_bytes();
+        [m0, m1, self.version, self.packet_type, s0, s1, self.client_id, self.destination_id]
+    }
+
+    /// Append the encoded header to an existing buffer without allocating a new one
+    pub fn write_to(&self, bytes: &mut Vec<u8>) {
+        bytes.extend_from_slice(&self.to_bytes());
+    }
+
+    /// Encode into the front of `out`, returning the bytes written
+    pub fn encode(&self, out: &mut [u8]) -> Result<usize, Error> {
+        let Some(dest) = out.get_mut(..PACKET_HEADER_SIZE) else {
+            return Err(Error::new(ErrorKind::WriteZero, "Buffer too small for packet header"));
+        };
+        dest.copy_from_slice(&self.to_bytes());
+        Ok(PACKET_HEADER_SIZE)
+    }
+
+    /// Whether the payload can be decoded here. Connection management and relay
+    /// link payloads change layout between protocol versions, so one from a peer on
+    /// another version is refused rather than misparsed; everything else passes.
+    pub fn is_compatible(&self) -> bool {
+        !matches!(self.packet_type, 0x01..=0x03 | 0x08 | 0x0A) || self.version == PROTOCOL_VERSION
+    }
+
+    pub fn from_bytes(data: &[u8]) -> Result<PacketHeader, Error> {
+        if data.len() < PACKET_HEADER_SIZE {
+            return Err(invalid("Data too short"));
+        }
+
+        let magic = u16::from_le_bytes([data[0], data[1]]);
+        if magic != PACKET_MAGIC {
+            return Err(invalid("Invalid magic number"));
+        }
+
+        Ok(PacketHeader {
+            magic,
+            version: data[2],
+            packet_type: data[3],
+            sequence: u16::from_le_bytes([data[4], data[5]]),
+            client_id: data[6],
+            destination_id: data[7],
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct ConnectRequestView<'a> {
+    pub client_version: u8,
+    pub desired_name: &'a str,
+    pub target_session_id: u32,
+    pub game_identifier: u32,
+    pub request_nonce: u32,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct ConnectDenyView<'a> {
+    pub request_nonce: u32,
+    pub reason: &'a str,
+}
+
+/// Registry entries still encoded in the datagram. They were checked when the
+/// payload was parsed, so iterating can't fail.
+#[derive(Debug, Clone, Copy)]
+pub struct RegistryView<'a> {
+    count: usize,
+    data: &'a [u8],
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct PacketTypeEntryView<'a> {
+    pub packet_id: u8,
+    pub flags: u8,
+    pub name: &'a str,
+    pub description: &'a str,
+}
+
+impl<'a> RegistryView<'a> {
+    fn parse(data: &'a [u8]) -> Result<Self, Error> {
+        let mut reader = Reader::new(data);
+        // An empty payload is an empty registry
+        let count = reader.u8().unwrap_or(0) as usize;
+        let view = RegistryView { count, data: reader.rest() };
+
+        let mut entries = Reader::new(view.data);
+        for _ in 0..count {
+            read_registry_entry(&mut entries).ok_or_else(|| invalid("PacketTypeRegistry malformed"))?;
+        }
+        Ok(view)
+    }
+
+    pub fn len(&self) -> usize {
+        self.count
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.count == 0
+    }
+
+    pub fn entries(&self) -> impl Iterator<Item = PacketTypeEntryView<'a>> {
+        let mut reader = Reader::new(self.data);
+        (0..self.count).map_while(move |_| read_registry_entry(&mut reader))
+    }
+}
+
+fn read_registry_entry<'a>(reader: &mut Reader<'a>) -> Option<PacketTypeEntryView<'a>> {
+    let packet_id = reader.u8()?;
+    let flags = reader.u8()?;
+    let name_len = reader.u8()? as usize;
+    let name = reader.str(name_len)?;
+    let desc_len = reader.u8()? as usize;
+    let description = reader.str(desc_len)?;
+    Some(PacketTypeEntryView { packet_id, flags, name, description })
+}
+
+/// A decoded payload borrowing its strings and game data from the datagram
+#[derive(Debug, Clone, Copy)]
+pub enum PayloadView<'a> {
+    None,
+    Ping(Ping),
+    Pong(Pong),
+    ConnectRequest(ConnectRequestView<'a>),
+    ConnectAccept(ConnectAccept),
+    ConnectDeny(ConnectDenyView<'a>),
+    Resume(Resume),
+    SessionConfig(SessionConfig),
+    PacketTypeRegistry(RegistryView<'a>),
+    Ack(Ack),
+    GamePacket(&'a [u8]),
+}
+
+impl<'a> PayloadView<'a> {
+    pub fn parse(packet_type: u8, data: &'a [u8]) -> Result<Self, Error> {
+        let mut reader = Reader::new(data);
+        match packet_type {
+            x if x == PacketType::Ping as u8 => {
+                let timestamp = reader.u64().ok_or_else(|| invalid("Ping too short"))?;
+                Ok(PayloadView::Ping(Ping { timestamp }))
+            }
+            x if x == PacketType::Pong as u8 => {
+                let original_timestamp = reader.u64().ok_or_else(|| invalid("Pong too short"))?;
+                Ok(PayloadView::Pong(Pong { original_timestamp }))
+            }
+            x if x == PacketType::ConnectRequest as u8 => {
+                let (Some(client_version), Some(target_session_id), Some(game_identifier), Some(request_nonce)) =
+                    (reader.u8(), reader.u32(), reader.u32(), reader.u32())
+                else {
+                    return Err(invalid("ConnectRequest too short"));
+                };
+                let desired_name = std::str::from_utf8(reader.rest())
+                    .map_err(|_| invalid("ConnectRequest name is not UTF-8"))?;
+                Ok(PayloadView::ConnectRequest(ConnectRequestView {
+                    client_version,
+                    desired_name,
+                    target_session_id,
+                    game_identifier,
+                    request_nonce,
+                }))
+            }
+            x if x == PacketType::ConnectAccept as u8 => {
+                let (Some(assigned_client_id), Some(session_id)) = (reader.u8(), reader.u32()) else {
+                    return Err(invalid("ConnectAccept too short"));
+                };
+                let peer_timeout_ms = reader.u32().unwrap_or(0);
+                let request_nonce = reader.u32().unwrap_or(0);
+                let resume_token = reader.u64().unwrap_or(0);
+                Ok(PayloadView::ConnectAccept(ConnectAccept {
+                    assigned_client_id,
+                    session_id,
+                    peer_timeout_ms,
+                    request_nonce,
+                    resume_token,
+                }))
+            }
+            x if x == PacketType::ConnectDeny as u8 => {
+                let request_nonce = reader.u32().ok_or_else(|| invalid("ConnectDeny too short"))?;
+                let reason = std::str::from_utf8(reader.rest()).map_err(|_| invalid("ConnectDeny reason is not UTF-8"))?;
+                Ok(PayloadView::ConnectDeny(ConnectDenyView { request_nonce, reason }))
+            }
+            x if x == PacketType::Resume as u8 => {
+                let (Some(session_id), Some(request_nonce), Some(resume_token)) = (reader.u32(), reader.u32(), reader.u64()) else {
+                    return Err(invalid("Resume too short"));
+                };
+                Ok(PayloadView::Resume(Resume { session_id, request_nonce, resume_token }))
+            }
+            x if x == PacketType::SessionConfig as u8 => {
+                let (Some(version), Some(tick_rate), Some(max_packet_size)) = (reader.u8(), reader.u16(), reader.u16()) else {
+                    return Err(invalid("SessionConfig too short"));
+                };
+                // Missing on hosts without a registry
+                let registry_version = reader.u32().unwrap_or(0);
+                Ok(PayloadView::SessionConfig(SessionConfig { version, tick_rate, max_packet_size, registry_version }))
+            }
+            x if x == PacketType::PacketTypeRegistry as u8 => {
+                Ok(PayloadView::PacketTypeRegistry(RegistryView::parse(data)?))
+            }
+            x if x == PacketType::Ack as u8 => {
+                let (Some(channel), Some(sequence), Some(ack_bits)) = (reader.u8(), reader.u16(), reader.u32()) else {
+                    return Err(invalid("Ack too short"));
+                };
+                Ok(PayloadView::Ack(Ack { channel, sequence, ack_bits }))
+            }
+            x if x >= PacketType::GamePacket as u8 => Ok(PayloadView::GamePacket(data)),
+            _ => Ok(PayloadView::None),
+        }
+    }
+
+    /// Copy the borrowed parts out so the payload outlives the receive buffer
+    pub fn into_owned(self) -> PacketPayload {
+        match self {
+            PayloadView::None => PacketPayload::None,
+            PayloadView::Ping(ping) => PacketPayload::Ping(ping),
+            PayloadView::Pong(pong) => PacketPayload::Pong(pong),
+            PayloadView::ConnectRequest(req) => PacketPayload::ConnectRequest(ConnectRequest {
+                client_version: req.client_version,
+                desired_name: req.desired_name.to_string(),
+                target_session_id: req.target_session_id,
+                game_identifier: req.game_identifier,
+                request_nonce: req.request_nonce,
+            }),
+            PayloadView::ConnectAccept(accept) => PacketPayload::ConnectAccept(accept),
+            PayloadView::ConnectDeny(deny) => PacketPayload::ConnectDeny(ConnectDeny {
+                request_nonce: deny.request_nonce,
+                reason: deny.reason.to_string(),
+            }),
+            PayloadView::Resume(resume) => PacketPayload::Resume(resume),
+            PayloadView::SessionConfig(config) => PacketPayload::SessionConfig(config),
+            PayloadView::PacketTypeRegistry(registry) => PacketPayload::PacketTypeRegistry(PacketTypeRegistry {
+                entries: registry
+                    .entries()
+                    .map(|entry| PacketTypeEntry {
+                        packet_id: entry.packet_id,
+                        flags: entry.flags,
+                        name: entry.name.to_string(),
+                        description: entry.description.to_string(),
+                    })
+                    .collect(),
+            }),
+            PayloadView::Ack(ack) => PacketPayload::Ack(ack),
+            PayloadView::GamePacket(data) => PacketPayload::GamePacket(data.to_vec()),
+        }
+    }
+}
+
+impl PacketPayload {
+    fn emit(&self, out: &mut impl Output) -> Result<(), Error> {
+        match self {
+            PacketPayload::None => Ok(()),
+            PacketPayload::Ping(ping) => out.put(&ping.timestamp.to_le_bytes()),
+            PacketPayload::Pong(pong) => out.put(&pong.original_timestamp.to_le_bytes()),
+            PacketPayload::ConnectRequest(req) => {
+                out.put_u8(req.client_version)?;
+                out.put(&req.target_session_id.to_le_bytes())?;
+                out.put(&req.game_identifier.to_le_bytes())?;
+                out.put(&req.request_nonce.to_le_bytes())?;
+                out.put(req.desired_name.as_bytes())
+            }
+            PacketPayload::ConnectAccept(accept) => {
+                out.put_u8(accept.assigned_client_id)?;
+                out.put(&accept.session_id.to_le_bytes())?;
+                out.put(&accept.peer_timeout_ms.to_le_bytes())?;
+                out.put(&accept.request_nonce.to_le_bytes())?;
+                out.put(&accept.resume_token.to_le_bytes())
+            }
+            PacketPayload::ConnectDeny(deny) => {
+                out.put(&deny.request_nonce.to_le_bytes())?;
+                out.put(deny.reason.as_bytes())
+            }
+            PacketPayload::Resume(resume) => {
+                out.put(&resume.session_id.to_le_bytes())?;
+                out.put(&resume.request_nonce.to_le_bytes())?;
+                out.put(&resume.resume_token.to_le_bytes())
+            }
+            PacketPayload::SessionConfig(config) => {
+                out.put_u8(config.version)?;
+                out.put(&config.tick_rate.to_le_bytes())?;
+                out.put(&config.max_packet_size.to_le_bytes())?;
+                out.put(&config.registry_version.to_le_bytes())
+            }
+            PacketPayload::PacketTypeRegistry(registry) => registry.emit(out),
+            PacketPayload::Ack(ack) => {
+                out.put_u8(ack.channel)?;
+                out.put(&ack.sequence.to_le_bytes())?;
+                out.put(&ack.ack_bits.to_le_bytes())
+            }
+            PacketPayload::GamePacket(data) => out.put(data),
+        }
+    }
+
+    /// Append the encoded payload to an existing buffer
+    pub fn write_to(&self, bytes: &mut Vec<u8>) {
+        // Writing to a Vec can't fail
+        let _ = self.emit(bytes);
+    }
+
+    /// Encode into the front of `out`, returning the bytes written
+    pub fn encode(&self, out: &mut [u8]) -> Result<usize, Error> {
+        let mut writer = Writer::new(out);
+        self.emit(&mut writer)?;
+        Ok(writer.len())
+    }
+
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut bytes = Vec::new();
+        self.write_to(&mut bytes);
+        bytes
+    }
+
+    pub fn from_bytes(packet_type: u8, data: &[u8]) -> Result<Self, Error> {
+        PayloadView::parse(packet_type, data).map(PayloadView::into_owned)
+    }
+}
+
+impl PacketTypeRegistry {
+    fn emit(&self, out: &mut impl Output) -> Result<(), Error> {
+        let entries = &self.entries[..self.entries.len().min(u8::MAX as usize)];
+        out.put_u8(entries.len() as u8)?;
+        for entry in entries {
+            let (name, description) = (short_str(&entry.name), short_str(&entry.description));
+            out.put_u8(entry.packet_id)?;
+            out.put_u8(entry.flags)?;
+            out.put_u8(name.len() as u8)?;
+            out.put(name.as_bytes())?;
+            out.put_u8(description.len() as u8)?;
+            out.put(description.as_bytes())?;
+        }
+        Ok(())
+    }
+
+    /// Append the encoded registry to an existing buffer
+    pub fn write_to(&self, bytes: &mut Vec<u8>) {
+        let _ = self.emit(bytes);
+    }
+}
+
+impl NeonPacket {
+    pub fn header(&self) -> PacketHeader {
+        PacketHeader::new(self.packet_type, self.sequence, self.client_id, self.destination_id)
+    }
+
+    /// Append the header and payload to an existing buffer
+    pub fn write_to(&self, bytes: &mut Vec<u8>) {
+        self.header().write_to(bytes);
+        self.payload.write_to(bytes);
+    }
+}
+
+/// Walk the messages in a bundle, yielding each one's header (sender taken from
+/// the bundle header) and payload. Stops at a truncated entry.
+pub fn bundle_entries<'a>(bundle: &PacketHeader, data: &'a [u8]) -> impl Iterator<Item = (PacketHeader, &'a [u8])> {
+    let bundle = *bundle;
+    raw_bundle_entries(data).map(move |(_, entry)| {
+        let header = PacketHeader {
+            packet_type: entry[1],
+            sequence: u16::from_le_bytes([entry[2], entry[3]]),
+            destination_id: entry[0],
+            ..bundle
+        };
+        (header, &entry[BUNDLE_ENTRY_HEADER_SIZE..])
+    })
+}
+
+/// Copy an encoded ConnectRequest payload that has been parsed to `out`, with its
+/// request nonce replaced by `nonce`
+pub fn write_connect_request_with_nonce(payload: &[u8], nonce: u32, out: &mut Vec<u8>) {
+    // client_version u8, target_session_id u32, game_identifier u32, then the nonce
+    const NONCE_OFFSET: usize = 9;
+    out.extend_from_slice(&payload[..NONCE_OFFSET]);
+    out.extend_from_slice(&nonce.to_le_bytes());
+    out.extend_from_slice(&payload[NONCE_OFFSET + 4..]);
+}
+
+/// Walk the messages in a bundle payload, yielding each destination and the
+/// message's encoded bytes (entry header included). Stops at a truncated entry.
+pub fn raw_bundle_entries(data: &[u8]) -> impl Iterator<Item = (u8, &[u8])> {
+    let mut rest = data;
+    std::iter::from_fn(move || {
+        if rest.len() < BUNDLE_ENTRY_HEADER_SIZE {
+            return None;
+        }
+        let len = BUNDLE_ENTRY_HEADER_SIZE + u16::from_le_bytes([rest[4], rest[5]]) as usize;
+        if rest.len() < len {
+            return None;
+        }
+        let (entry, tail) = rest.split_at(len);
+        rest = tail;
+        Some((entry[0], entry))
+    })
+}
@@ -0,0 +1,369 @@
+//! Payload compression for packet types the host flags as compressed.
+//!
+//! Payloads are encoded in the LZ4 block format, which decodes at memory speed
+//! and needs no shared state. A compressed payload travels as
+//! [original length u16][LZ4 block]. The sender keeps the plain payload whenever
+//! compression wouldn't make it smaller, so flagging a type never grows traffic.
+
+/// Shortest match the format can express
+const MIN_MATCH: usize = 4;
+/// Matches must start this far before the end of the input
+const MATCH_LIMIT: usize = 12;
+/// The last bytes of the input are always literals
+const LAST_LITERALS: usize = 5;
+const MAX_OFFSET: usize = u16::MAX as usize;
+const HASH_BITS: u32 = 12;
+/// Payloads shorter than this don't have room for a match worth its token
+pub const MIN_COMPRESS_SIZE: usize = 32;
+/// Bytes in front of the LZ4 block
+pub const COMPRESSED_HEADER_SIZE: usize = 2;
+
+/// Compression state an endpoint keeps across packets, so compressing doesn't allocate
+pub struct Compressor {
+    /// Last position seen for each hash of 4 input bytes, offset by `base`
+    table: Box<[u32; 1 << HASH_BITS]>,
+    /// Added to every position stored, so entries from earlier inputs are out of reach
+    base: u32,
+}
+
+impl Default for Compressor {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Compressor {
+    pub fn new() -> Self {
+        Compressor { table: Box::new([0; 1 << HASH_BITS]), base: 1 }
+    }
+
+    /// Append `payload` to `out` as [original length u16][LZ4 block]. Returns false,
+    /// with `out` restored, when that wouldn't be smaller than the payload itself.
+    pub fn compress(&mut self, payload: &[u8], out: &mut Vec<u8>) -> bool {
+        if payload.len() < MIN_COMPRESS_SIZE || payload.len() > u16::MAX as usize {
+            return false;
+        }
+
+        let start = out.len();
+        out.extend_from_slice(&(payload.len() as u16).to_le_bytes());
+        self.encode_block(payload, out);
+        if out.len() - start >= payload.len() {
+            out.truncate(start);
+            return false;
+        }
+        true
+    }
+
+    fn encode_block(&mut self, input: &[u8], out: &mut Vec<u8>) {
+        // Jump past everything the table holds, starting over before the positions overflow
+        if self.base > u32::MAX - 2 * (MAX_OFFSET as u32 + 1) {
+            self.table.fill(0);
+            self.base = 1;
+        }
+        let base = self.base;
+        self.base += input.len() as u32 + MAX_OFFSET as u32 + 1;
+
+        let mut anchor = 0;
+        let mut i = 0;
+        if input.len() > MATCH_LIMIT {
+            let match_limit = input.len() - MATCH_LIMIT;
+            let match_end_limit = input.len() - LAST_LITERALS;
+            while i < match_limit {
+                let sequence = read_u32(input, i);
+                let slot = &mut self.table[hash(sequence)];
+                let candidate = *slot;
+                *slot = base + i as u32;
+
+                let in_reach = candidate >= base && (base + i as u32 - candidate) as usize <= MAX_OFFSET;
+                if !in_reach || read_u32(input, (candidate - base) as usize) != sequence {
+                    i += 1;
+                    continue;
+                }
+
+                let mut source = (candidate - base) as usize;
+                let mut position = i;
+                while position > anchor && source > 0 && input[position - 1] == input[source - 1] {
+                    position -= 1;
+                    source -= 1;
+                }
+                let mut length = MIN_MATCH + (i - position);
+                while position + length < match_end_limit && input[source + length] == input[position + length] {
+                    length += 1;
+                }
+
+                write_sequence(out, &input[anchor..position], position - source, length);
+                i = position + length;
+                anchor = i;
+            }
+        }
+
+        write_literals(out, &input[anchor..]);
+    }
+}
+
+/// Compressor plus the buffer compressed payloads are built in, one per endpoint
+#[derive(Default)]
+pub struct PayloadCompression {
+    compressor: Compressor,
+    buffer: Vec<u8>,
+}
+
+impl PayloadCompression {
+    /// The payload of a Compressed packet carrying `payload` of `packet_type`, or
+    /// None when compressing wouldn't save anything
+    pub fn wrap(&mut self, packet_type: u8, payload: &[u8]) -> Option<&[u8]> {
+        self.buffer.clear();
+        self.buffer.push(packet_type);
+        self.compressor.compress(payload, &mut self.buffer).then_some(&self.buffer[..])
+    }
+
+    /// `payload` compressed on its own, for channel frames that carry the packet
+    /// type in their header, or None when compressing wouldn't save anything
+    pub fn compress(&mut self, payload: &[u8]) -> Option<&[u8]> {
+        self.buffer.clear();
+        self.compressor.compress(payload, &mut self.buffer).then_some(&self.buffer[..])
+    }
+}
+
+/// Decode a Compressed packet's payload into `out`, returning the game packet type
+/// it carries. None if it's malformed or doesn't carry a game packet.
+pub fn unwrap(data: &[u8], out: &mut Vec<u8>) -> Option<u8> {
+    let (&packet_type, compressed) = data.split_first()?;
+    (packet_type >= crate::codec::PacketType::GamePacket as u8 && decompress(compressed, out)).then_some(packet_type)
+}
+
+/// Decode a payload written by `Compressor::compress` into `out`, replacing its
+/// contents. Returns false for anything malformed, never reading or writing out of bounds.
+pub fn decompress(data: &[u8], out: &mut Vec<u8>) -> bool {
+    out.clear();
+    let Some((header, block)) = data.split_first_chunk::<COMPRESSED_HEADER_SIZE>() else {
+        return false;
+    };
+    let expected = u16::from_le_bytes(*header) as usize;
+    out.reserve(expected);
+    decode_block(block, out, expected).is_some() && out.len() == expected
+}
+
+fn decode_block(block: &[u8], out: &mut Vec<u8>, expected: usize) -> Option<()> {
+    let mut position = 0;
+    loop {
+        let token = *block.get(position)?;
+        position += 1;
+
+        let literals = read_length(block, &mut position, (token >> 4) as usize)?;
+        let literal_bytes = block.get(position..position.checked_add(literals)?)?;
+        if out.len() + literals > expected {
+            return None;
+        }
+        out.extend_from_slice(literal_bytes);
+        position += literals;
+
+        // The last sequence has literals only
+        if position == block.len() {
+            return Some(());
+        }
+
+        let offset = u16::from_le_bytes([*block.get(position)?, *block.get(position + 1)?]) as usize;
+        position += 2;
+        if offset == 0 || offset > out.len() {
+            return None;
+        }
+        let length = read_length(block, &mut position, (token & 0x0F) as usize)? + MIN_MATCH;
+        if out.len() + length > expected {
+            return None;
+        }
+
+        // Matches may overlap what they produce, so copy in step with the output
+        let source = out.len() - offset;
+        for k in 0..length {
+            let byte = out[source + k];
+            out.push(byte);
+        }
+    }
+}
+
+/// Finish a length whose token nibble was 15 with the 255-continued bytes after it
+fn read_length(block: &[u8], position: &mut usize, nibble: usize) -> Option<usize> {
+    let mut length = nibble;
+    if nibble == 15 {
+        loop {
+            let byte = *block.get(*position)?;
+            *position += 1;
+            length += byte as usize;
+            if byte != 255 {
+                break;
+            }
+        }
+    }
+    Some(length)
+}
+
+fn write_sequence(out: &mut Vec<u8>, literals: &[u8], offset: usize, length: usize) {
+    let match_nibble = (length - MIN_MATCH).min(15);
+    out.push(((literals.len().min(15) as u8) << 4) | match_nibble as u8);
+    write_length(out, literals.len());
+    out.extend_from_slice(literals);
+    out.extend_from_slice(&(offset as u16).to_le_bytes());
+    write_length(out, length - MIN_MATCH);
+}
+
+fn write_literals(out: &mut Vec<u8>, literals: &[u8]) {
+    out.push((literals.len().min(15) as u8) << 4);
+    write_length(out, literals.len());
+    out.extend_from_slice(literals);
+}
+
+/// Bytes after the token for a length of 15 or more
+fn write_length(out: &mut Vec<u8>, length: usize) {
+    if length < 15 {
+        return;
+    }
+    let mut rest = length - 15;
+    while rest >= 255 {
+        out.push(255);
+        rest -= 255;
+    }
+    out.push(rest as u8);
+}
+
+fn read_u32(input: &[u8], at: usize) -> u32 {
+    u32::from_le_bytes(input[at..at + 4].try_into().unwrap())
+}
+
+fn hash(sequence: u32) -> usize {
+    (sequence.wrapping_mul(2_654_435_761) >> (32 - HASH_BITS)) as usize
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Bytes that don't repeat within any window a match could use
+    fn noise(len: usize, mut seed: u32) -> Vec<u8> {
+        (0..len)
+            .map(|_| {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                seed as u8
+            })
+            .collect()
+    }
+
+    fn round_trip(compressor: &mut Compressor, payload: &[u8]) -> Vec<u8> {
+        let mut compressed = Vec::new();
+        assert!(compressor.compress(payload, &mut compressed), "{} bytes didn't compress", payload.len());
+        let mut out = Vec::new();
+        assert!(decompress(&compressed, &mut out));
+        assert_eq!(out, payload);
+        compressed
+    }
+
+    /// A payload declaring `expected` bytes with `block` after the header
+    fn block(expected: u16, block: &[u8]) -> Vec<u8> {
+        [&expected.to_le_bytes()[..], block].concat()
+    }
+
+    #[test]
+    fn round_trips_overlapping_matches() {
+        let mut compressor = Compressor::new();
+        // A run is one literal, then a match at offset 1 far longer than its offset
+        let run = vec![7; 1000];
+        let compressed = round_trip(&mut compressor, &run);
+        assert_eq!(compressed[COMPRESSED_HEADER_SIZE..COMPRESSED_HEADER_SIZE + 4], [0x1F, 7, 1, 0]);
+        round_trip(&mut compressor, &b"abc".repeat(100));
+
+        // Hand-built: 'a', then 9 bytes copied from 1 back
+        let mut out = Vec::new();
+        assert!(decompress(&block(10, &[0x15, b'a', 1, 0, 0x00]), &mut out));
+        assert_eq!(out, [b'a'; 10]);
+    }
+
+    #[test]
+    fn round_trips_lengths_with_continuation_bytes() {
+        let mut compressor = Compressor::new();
+        // 600 literals and a match of about 600, both past 15 + 255
+        let payload = [noise(600, 1), vec![0; 600]].concat();
+        let compressed = round_trip(&mut compressor, &payload);
+        assert_eq!(compressed[COMPRESSED_HEADER_SIZE], 0xFF);
+        assert_eq!(compressed[COMPRESSED_HEADER_SIZE + 1..COMPRESSED_HEADER_SIZE + 3], [255, 255]);
+
+        // The same compressor again, with stale table entries from the last payload
+        round_trip(&mut compressor, &[vec![1; 300], noise(300, 2), vec![1; 300]].concat());
+    }
+
+    #[test]
+    fn incompressible_payloads_stay_plain() {
+        let mut compressor = Compressor::new();
+        let payload = noise(1200, 3);
+        let mut out = vec![9];
+        assert!(!compressor.compress(&payload, &mut out));
+        assert_eq!(out, [9]);
+        assert!(!compressor.compress(&payload[..MIN_COMPRESS_SIZE - 1], &mut out));
+
+        // Its block is all literals and still decodes
+        let mut encoded = (payload.len() as u16).to_le_bytes().to_vec();
+        compressor.encode_block(&payload, &mut encoded);
+        let mut decoded = Vec::new();
+        assert!(decompress(&encoded, &mut decoded));
+        assert_eq!(decoded, payload);
+    }
+
+    #[test]
+    fn rejects_offsets_before_the_output() {
+        let mut out = Vec::new();
+        assert!(!decompress(&block(8, &[0x10, b'a', 2, 0, 0x00]), &mut out));
+        assert!(!decompress(&block(8, &[0x10, b'a', 0, 0, 0x00]), &mut out));
+        assert!(!decompress(&block(8, &[0x00, 1, 0, 0x00]), &mut out));
+    }
+
+    #[test]
+    fn rejects_truncated_input() {
+        let mut out = Vec::new();
+        // Each declares the size it would decode to if it were complete
+        for (expected, truncated) in [
+            (0, &[][..]),                    // no token
+            (15, &[0xF0]),                   // literal length run missing
+            (270, &[0xF0, 255]),             // literal length run cut short
+            (3, &[0x30, b'a', b'b']),        // literals cut short
+            (9, &[0x14, b'a', 1]),           // offset cut short
+            (20, &[0x1F, b'a', 1, 0]),       // match length run missing
+            (275, &[0x1F, b'a', 1, 0, 255]), // match length run cut short
+            (5, &[0x10, b'a', 1, 0]),        // no final literals token
+        ] {
+            assert!(!decompress(&block(expected, truncated), &mut out), "accepted {truncated:?}");
+        }
+        assert!(!decompress(&[1], &mut out));
+    }
+
+    #[test]
+    fn rejects_output_past_the_declared_size() {
+        let mut out = Vec::new();
+        // Literals past it, a match past it, and less than it
+        assert!(!decompress(&block(2, &[0x30, b'a', b'b', b'c']), &mut out));
+        assert!(!decompress(&block(5, &[0x15, b'a', 1, 0, 0x00]), &mut out));
+        assert!(out.len() <= 5);
+        assert!(!decompress(&block(10, &[0x30, b'a', b'b', b'c']), &mut out));
+
+        // A match length that would decode well past the largest size a header can declare
+        let mut huge = vec![0x1F, b'a', 1, 0];
+        huge.extend(std::iter::repeat_n(255, 300));
+        huge.extend([0, 0x00]);
+        assert!(!decompress(&block(u16::MAX, &huge), &mut out));
+        assert!(out.len() <= u16::MAX as usize);
+    }
+
+    #[test]
+    fn unwrap_only_yields_game_packets() {
+        let mut compression = PayloadCompression::default();
+        let payload = vec![4; 100];
+        let wrapped = compression.wrap(0x10, &payload).unwrap().to_vec();
+        let mut out = Vec::new();
+        assert_eq!(unwrap(&wrapped, &mut out), Some(0x10));
+        assert_eq!(out, payload);
+
+        let mut core = wrapped;
+        core[0] = 0x01;
+        assert_eq!(unwrap(&core, &mut out), None);
+    }
+}
@@ -0,0 +1,173 @@
+//! Single-producer/single-consumer event queue.
+//!
+//! The thread processing packets pushes fixed-size `NeonEvent`s into a ring and
+//! copies their payloads into a byte slab; the game thread drains them in batches.
+//! Neither side locks: each owns one end of the ring and publishes it with an atomic.
+
+use std::cell::UnsafeCell;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::Arc;
+
+pub const EVENT_GAME_PACKET: u8 = 1;
+pub const EVENT_PONG: u8 = 2;
+pub const EVENT_SESSION_CONFIG: u8 = 3;
+pub const EVENT_PACKET_TYPE_REGISTRY: u8 = 4;
+pub const EVENT_UNHANDLED_PACKET: u8 = 5;
+pub const EVENT_WRONG_DESTINATION: u8 = 6;
+
+/// One received event, laid out for C. Which fields are meaningful depends on `kind`:
+/// packets fill packet_type/from_client_id/sequence and the payload (game packets also
+/// their arrival time in timestamp), a pong fills
+/// response_time_ms/timestamp, a session config fills version/tick_rate/max_packet_size,
+/// and a wrong destination fills destination_id.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct NeonEvent {
+    pub kind: u8,
+    pub packet_type: u8,
+    pub from_client_id: u8,
+    pub destination_id: u8,
+    pub sequence: u16,
+    pub tick_rate: u16,
+    pub max_packet_size: u16,
+    pub version: u8,
+    pub reserved: u8,
+    /// Payload position in the queue's slab, see `EventReceiver::payload`
+    pub payload_offset: u32,
+    pub payload_len: u32,
+    pub response_time_ms: u64,
+    pub timestamp: u64,
+}
+
+struct Slot {
+    event: NeonEvent,
+    /// Slab position just past this event's payload, released once the consumer is done with it
+    slab_end: usize,
+}
+
+struct Shared {
+    slots: Box<[UnsafeCell<Slot>]>,
+    slab: Box<[UnsafeCell<u8>]>,
+    /// Events pushed and events taken, both counting up forever
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    /// Slab bytes the consumer has released
+    slab_tail: AtomicUsize,
+    dropped: AtomicU64,
+}
+
+// Slots between tail and head belong to the consumer, the rest to the producer
+unsafe impl Sync for Shared {}
+unsafe impl Send for Shared {}
+
+/// Create a queue holding up to `capacity` events and `slab_size` bytes of payload
+pub fn event_queue(capacity: usize, slab_size: usize) -> (EventSender, EventReceiver) {
+    let capacity = capacity.max(1);
+    let shared = Arc::new(Shared {
+        slots: (0..capacity)
+            .map(|_| UnsafeCell::new(Slot { event: NeonEvent::default(), slab_end: 0 }))
+            .collect(),
+        slab: (0..slab_size.max(1)).map(|_| UnsafeCell::new(0)).collect(),
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+        slab_tail: AtomicUsize::new(0),
+        dropped: AtomicU64::new(0),
+    });
+    (
+        EventSender { shared: shared.clone(), slab_head: 0 },
+        EventReceiver { shared, released: 0 },
+    )
+}
+
+/// Producer end, owned by whoever processes packets
+pub struct EventSender {
+    shared: Arc<Shared>,
+    slab_head: usize,
+}
+
+impl EventSender {
+    /// Queue an event, copying `payload` into the slab. When the ring or the slab
+    /// is full the event is dropped and counted rather than blocking the producer.
+    pub fn push(&mut self, mut event: NeonEvent, payload: &[u8]) -> bool {
+        let shared = &*self.shared;
+        let head = shared.head.load(Ordering::Relaxed);
+        if head - shared.tail.load(Ordering::Acquire) == shared.slots.len() {
+            return self.drop_event();
+        }
+
+        // Payloads are contiguous, so one that won't fit before the end of the slab starts over at 0
+        let slab_size = shared.slab.len();
+        let mut start = self.slab_head;
+        if !payload.is_empty() && start % slab_size + payload.len() > slab_size {
+            start += slab_size - start % slab_size;
+        }
+        let end = start + payload.len();
+        if end - shared.slab_tail.load(Ordering::Acquire) > slab_size {
+            return self.drop_event();
+        }
+
+        let offset = start % slab_size;
+        unsafe {
+            let slab = UnsafeCell::raw_get(shared.slab.as_ptr());
+            std::ptr::copy_nonoverlapping(payload.as_ptr(), slab.add(offset), payload.len());
+        }
+        event.payload_offset = offset as u32;
+        event.payload_len = payload.len() as u32;
+        unsafe {
+            *shared.slots[head % shared.slots.len()].get() = Slot { event, slab_end: end };
+        }
+        self.slab_head = end;
+        shared.head.store(head + 1, Ordering::Release);
+        true
+    }
+
+    fn drop_event(&self) -> bool {
+        self.shared.dropped.fetch_add(1, Ordering::Relaxed);
+        log_limited!(crate::log::Level::Warn, 1, "Event queue full, dropping event");
+        false
+    }
+}
+
+/// Consumer end, drained by the game thread
+pub struct EventReceiver {
+    shared: Arc<Shared>,
+    /// Slab position up to which the last batch's payloads reach
+    released: usize,
+}
+
+impl EventReceiver {
+    /// Copy up to `out.len()` queued events into `out` and return how many were copied.
+    /// Payloads of the previous batch are released, so `payload` borrows can't outlive this call.
+    pub fn poll(&mut self, out: &mut [NeonEvent]) -> usize {
+        let shared = &*self.shared;
+        shared.slab_tail.store(self.released, Ordering::Release);
+
+        let tail = shared.tail.load(Ordering::Relaxed);
+        let count = (shared.head.load(Ordering::Acquire) - tail).min(out.len());
+        for (i, event) in out[..count].iter_mut().enumerate() {
+            let slot = unsafe { &*shared.slots[(tail + i) % shared.slots.len()].get() };
+            *event = slot.event;
+            self.released = slot.slab_end;
+        }
+        shared.tail.store(tail + count, Ordering::Release);
+        count
+    }
+
+    /// Payload bytes of an event returned by the last poll
+    pub fn payload(&self, event: &NeonEvent) -> &[u8] {
+        let start = event.payload_offset as usize;
+        let end = (start + event.payload_len as usize).min(self.shared.slab.len());
+        if start >= end {
+            return &[];
+        }
+        unsafe {
+            let slab = UnsafeCell::raw_get(self.shared.slab.as_ptr());
+            std::slice::from_raw_parts(slab.add(start), end - start)
+        }
+    }
+
+    /// Events lost because the queue was full
+    pub fn dropped(&self) -> u64 {
+        self.shared.dropped.load(Ordering::Relaxed)
+    }
+}
@@ -1,9 +1,16 @@
+use std::cell::UnsafeCell;
 use std::ffi::{CStr, CString};
 use std::os::raw::c_char;
 use std::ptr;
+use std::sync::Arc;
+use std::time::Duration;
 
-use crate::client::NeonClient;
-use crate::host::NeonHost;
+use crate::channel::Channel;
+use crate::client::{EventReceiver, NeonClient, NeonEvent};
+use crate::codec::{PacketHeader, PACKET_HEADER_SIZE};
+use crate::host::{HostStatus, NeonHost};
+use crate::log::{self, Level};
+use crate::pacing::{LinkStats, Priority};
 
 #[repr(C)]
 pub struct NeonClientHandle {
@@ -15,17 +22,95 @@ pub struct NeonHostHandle {
     _private: [u8; 0],
 }
 
+/// What a NeonClientHandle points to. The event receiver is kept apart from the
+/// client so one thread can drain events while another processes packets.
+struct ClientHandle {
+    events: UnsafeCell<Option<EventReceiver>>,
+    client: UnsafeCell<NeonClient>,
+}
+
+/// The client itself, for calls made by the thread that processes packets
+unsafe fn client_mut<'a>(handle: *mut NeonClientHandle) -> &'a mut NeonClient {
+    unsafe { &mut *(*(handle as *const ClientHandle)).client.get() }
+}
+
+/// The event receiver, for the thread that polls events
+unsafe fn client_events<'a>(handle: *mut NeonClientHandle) -> &'a mut Option<EventReceiver> {
+    unsafe { &mut *(*(handle as *const ClientHandle)).events.get() }
+}
+
+/// What a NeonHostHandle points to. Queries read `status`, so they are safe while
+/// another thread is inside neon_host_start or neon_host_poll.
+struct HostHandle {
+    status: Arc<HostStatus>,
+    host: UnsafeCell<NeonHost>,
+}
+
+/// The host itself, for calls made by the thread that drives it
+unsafe fn host_mut<'a>(handle: *mut NeonHostHandle) -> &'a mut NeonHost {
+    unsafe { &mut *(*(handle as *const HostHandle)).host.get() }
+}
+
+unsafe fn host_status<'a>(handle: *mut NeonHostHandle) -> &'a HostStatus {
+    unsafe { &(*(handle as *const HostHandle)).status }
+}
+
+/// C layout of `PacketHeader`
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct NeonPacketHeader {
+    pub magic: u16,
+    pub version: u8,
+    pub packet_type: u8,
+    pub sequence: u16,
+    pub client_id: u8,
+    pub destination_id: u8,
+}
+
+/// Link estimates for one peer, see neon_client_get_link_stats
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct NeonLinkStats {
+    pub rtt_us: u32,
+    pub loss: f32,
+    pub send_rate: u32,
+    pub reserved: u32,
+    pub bytes_sent: u64,
+    pub shed_state: u64,
+    pub shed_cosmetic: u64,
+}
+
+impl From<LinkStats> for NeonLinkStats {
+    fn from(stats: LinkStats) -> Self {
+        NeonLinkStats {
+            rtt_us: stats.rtt.map_or(0, |rtt| rtt.as_micros().clamp(1, u32::MAX as u128) as u32),
+            loss: stats.loss,
+            send_rate: stats.send_rate,
+            reserved: 0,
+            bytes_sent: stats.bytes_sent,
+            shed_state: stats.shed_state,
+            shed_cosmetic: stats.shed_cosmetic,
+        }
+    }
+}
+
 pub type PongCallbackC = extern "C" fn(response_time_ms: u64, timestamp: u64);
 pub type SessionConfigCallbackC = extern "C" fn(version: u8, tick_rate: u16, max_packet_size: u16);
 pub type PacketTypeRegistryCallbackC = extern "C" fn(count: usize, ids: *const u8, names: *const *const c_char, descriptions: *const *const c_char);
+pub type GamePacketCallbackC = extern "C" fn(packet_type: u8, from_client_id: u8, payload: *const u8, len: usize);
 pub type UnhandledPacketCallbackC = extern "C" fn(packet_type: u8, from_client_id: u8);
 pub type WrongDestinationCallbackC = extern "C" fn(my_id: u8, packet_destination_id: u8);
+pub type ConnectResultCallbackC = extern "C" fn(success: bool, client_id: u8, session_id: u32, reason: *const c_char);
+pub type EntityUpdateCallbackC = extern "C" fn(entity_id: u16, state: *const u8, len: usize);
 
 pub type ClientConnectCallbackC = extern "C" fn(client_id: u8, name: *const c_char, session_id: u32);
 pub type ClientDenyCallbackC = extern "C" fn(name: *const c_char, reason: *const c_char);
+pub type ClientDisconnectCallbackC = extern "C" fn(client_id: u8, name: *const c_char);
 pub type PingReceivedCallbackC = extern "C" fn(from_client_id: u8);
 pub type HostUnhandledPacketCallbackC = extern "C" fn(packet_type: u8, from_client_id: u8);
 
+pub type LogCallbackC = extern "C" fn(level: u8, message: *const c_char);
+
 /// Create a new Neon client
 /// Returns null on failure
 #[unsafe(no_mangle)]
@@ -41,7 +126,10 @@ pub extern "C" fn neon_client_new(name: *const c_char) -> *mut NeonClientHandle
     };
 
     match NeonClient::new(name_str) {
-        Ok(client) => Box::into_raw(Box::new(client)) as *mut NeonClientHandle,
+        Ok(client) => {
+            let handle = ClientHandle { events: UnsafeCell::new(None), client: UnsafeCell::new(client) };
+            Box::into_raw(Box::new(handle)) as *mut NeonClientHandle
+        }
         Err(_) => ptr::null_mut(),
     }
 }
@@ -56,7 +144,7 @@ pub extern "C" fn neon_client_set_pong_callback(
         return;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
+    let client = unsafe { client_mut(client) };
     client.on_pong(move |response_time, timestamp| {
         callback(response_time, timestamp);
     });
@@ -72,13 +160,15 @@ pub extern "C" fn neon_client_set_session_config_callback(
         return;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
+    let client = unsafe { client_mut(client) };
     client.on_session_config(move |version, tick_rate, max_packet_size| {
         callback(version, tick_rate, max_packet_size);
     });
 }
 
 /// Set callback for packet type registry events
+/// The arrays and strings point into the client's cached registry and stay valid
+/// until the next registry arrives or the client is freed
 #[unsafe(no_mangle)]
 pub extern "C" fn neon_client_set_packet_type_registry_callback(
     client: *mut NeonClientHandle,
@@ -88,32 +178,57 @@ pub extern "C" fn neon_client_set_packet_type_registry_callback(
         return;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
-    
-    client.on_packet_type_registry(move |entries| {
-        let count = entries.len();
-        let ids: Vec<u8> = entries.iter().map(|(id, _, _)| *id).collect();
-        
-        let names: Vec<*const c_char> = entries.iter()
-            .map(|(_, name, _)| {
-                CString::new(name.as_str()).unwrap().into_raw() as *const c_char
-            })
-            .collect();
-        
-        let descriptions: Vec<*const c_char> = entries.iter()
-            .map(|(_, _, desc)| {
-                CString::new(desc.as_str()).unwrap().into_raw() as *const c_char
-            })
-            .collect();
-        
-        callback(count, ids.as_ptr(), names.as_ptr(), descriptions.as_ptr());
-        
-        for name in names {
-            unsafe { CString::from_raw(name as *mut c_char) };
-        }
-        for desc in descriptions {
-            unsafe { CString::from_raw(desc as *mut c_char) };
+    let client = unsafe { client_mut(client) };
+
+    client.on_packet_type_registry(move |table| {
+        callback(table.len(), table.ids().as_ptr(), table.c_names().as_ptr(), table.c_descriptions().as_ptr());
+    });
+}
+
+/// Look up a packet type in the cached registry
+/// Either output may be null; the strings stay valid until the next registry arrives
+/// Returns false if the host hasn't described this packet type
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_lookup_packet_type(
+    client: *mut NeonClientHandle,
+    packet_type: u8,
+    name: *mut *const c_char,
+    description: *mut *const c_char,
+) -> bool {
+    if client.is_null() {
+        return false;
+    }
+
+    let client = unsafe { &*client_mut(client) };
+    let Some(info) = client.packet_type(packet_type) else {
+        return false;
+    };
+
+    unsafe {
+        if !name.is_null() {
+            *name = info.name_c().as_ptr();
         }
+        if !description.is_null() {
+            *description = info.description_c().as_ptr();
+        }
+    }
+    true
+}
+
+/// Set callback for game packet events (0x10+)
+/// The payload pointer is only valid for the duration of the callback
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_set_game_packet_callback(
+    client: *mut NeonClientHandle,
+    callback: GamePacketCallbackC,
+) {
+    if client.is_null() {
+        return;
+    }
+
+    let client = unsafe { client_mut(client) };
+    client.on_game_packet(move |packet_type, from_client_id, payload| {
+        callback(packet_type, from_client_id, payload.as_ptr(), payload.len());
     });
 }
 
@@ -127,7 +242,7 @@ pub extern "C" fn neon_client_set_unhandled_packet_callback(
         return;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
+    let client = unsafe { client_mut(client) };
     client.on_unhandled_packet(move |packet_type, from_client_id| {
         callback(packet_type, from_client_id);
     });
@@ -143,238 +258,1231 @@ pub extern "C" fn neon_client_set_wrong_destination_callback(
         return;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
+    let client = unsafe { client_mut(client) };
     client.on_wrong_destination(move |my_id, packet_destination_id| {
         callback(my_id, packet_destination_id);
     });
 }
 
-/// Connect the client to a session
-/// Returns true on success, false on failure
+/// Set callback for the outcome of a connect attempt
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_connect(
+pub extern "C" fn neon_client_set_connect_result_callback(
     client: *mut NeonClientHandle,
-    session_id: u32,
-    relay_addr: *const c_char,
-) -> bool {
-    if client.is_null() || relay_addr.is_null() {
+    callback: ConnectResultCallbackC,
+) {
+    if client.is_null() {
+        return;
+    }
+
+    let client = unsafe { client_mut(client) };
+    client.on_connect_result(move |success, client_id, session_id, reason| {
+        let c_reason = CString::new(reason.as_str()).unwrap_or_default();
+        callback(success, client_id, session_id, c_reason.as_ptr());
+    });
+}
+
+/// Read the client's socket on a background thread
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_start_receive_thread(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
         return false;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
-    let c_str = unsafe { CStr::from_ptr(relay_addr) };
-    let addr = match c_str.to_str() {
+    let client = unsafe { client_mut(client) };
+    match client.start_receive_thread() {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Record every datagram the client receives to a capture file at `path`
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_start_capture(client: *mut NeonClientHandle, path: *const c_char) -> bool {
+    if client.is_null() || path.is_null() {
+        return false;
+    }
+
+    let client = unsafe { client_mut(client) };
+    let path = match unsafe { CStr::from_ptr(path) }.to_str() {
         Ok(s) => s,
         Err(_) => return false,
     };
 
-    client.connect(session_id, addr).is_ok()
+    match client.start_capture(path) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
 }
 
-/// Process incoming packets (call this regularly, e.g. in your game tick)
-/// Returns true on success, false on failure
+/// Finish the capture in progress, writing out everything recorded
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_process_packets(client: *mut NeonClientHandle) -> bool {
+pub extern "C" fn neon_client_stop_capture(client: *mut NeonClientHandle) {
     if client.is_null() {
-        return false;
+        return;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
-    client.process_packets().is_ok()
+    let client = unsafe { client_mut(client) };
+    client.stop_capture();
 }
 
-/// Get the client's assigned ID (returns 0 if not connected)
+/// Hold game packets for `delay_ms` to deliver them in sequence order, 0 turns it off
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_get_id(client: *mut NeonClientHandle) -> u8 {
+pub extern "C" fn neon_client_set_jitter_buffer(client: *mut NeonClientHandle, delay_ms: u32) {
     if client.is_null() {
-        return 0;
+        return;
     }
 
-    let client = unsafe { &*(client as *const NeonClient) };
-    client.client_id().unwrap_or(0)
+    let client = unsafe { client_mut(client) };
+    client.set_jitter_buffer((delay_ms > 0).then(|| Duration::from_millis(delay_ms as u64)));
 }
 
-/// Get the session ID (returns 0 if not connected)
+/// Apply the host's entity snapshots, sent as game packet type `packet_type`
+/// Returns true on success, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_get_session_id(client: *mut NeonClientHandle) -> u32 {
+pub extern "C" fn neon_client_enable_replication(client: *mut NeonClientHandle, packet_type: u8) -> bool {
     if client.is_null() {
-        return 0;
+        return false;
     }
 
-    let client = unsafe { &*(client as *const NeonClient) };
-    client.session_id().unwrap_or(0)
+    let client = unsafe { client_mut(client) };
+    match client.enable_replication(packet_type) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
 }
 
-/// Check if the client is connected
+/// Set callback for replicated entity changes; state is NULL when the entity was removed
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_is_connected(client: *mut NeonClientHandle) -> bool {
+pub extern "C" fn neon_client_set_entity_callback(
+    client: *mut NeonClientHandle,
+    callback: EntityUpdateCallbackC,
+) {
     if client.is_null() {
-        return false;
+        return;
     }
 
-    let client = unsafe { &*(client as *const NeonClient) };
-    client.client_id().is_some()
+    let client = unsafe { client_mut(client) };
+    client.on_entity_update(move |entity_id, state| match state {
+        Some(state) => callback(entity_id, state.as_ptr(), state.len()),
+        None => callback(entity_id, std::ptr::null(), 0),
+    });
 }
 
-/// Manually send a ping
+/// Switch the client to queued events, drained with neon_client_poll_events
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_send_ping(client: *mut NeonClientHandle) -> bool {
-    if client.is_null() {
+pub extern "C" fn neon_client_enable_event_queue(
+    client: *mut NeonClientHandle,
+    capacity: usize,
+    slab_size: usize,
+) -> bool {
+    if client.is_null() || capacity == 0 || slab_size == 0 {
         return false;
     }
 
-    let client = unsafe { &*(client as *const NeonClient) };
-    client.send_ping().is_ok()
+    let receiver = unsafe { client_mut(client) }.enable_event_queue(capacity, slab_size);
+    unsafe { *client_events(client) = Some(receiver) };
+    true
 }
 
-/// Set auto-ping enabled/disabled
+/// Copy up to `max` queued events into `out`, returning how many were copied.
+/// Payloads of the previous batch are released by this call.
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_set_auto_ping(client: *mut NeonClientHandle, enabled: bool) {
-    if client.is_null() {
-        return;
+pub extern "C" fn neon_client_poll_events(
+    client: *mut NeonClientHandle,
+    out: *mut NeonEvent,
+    max: usize,
+) -> usize {
+    if client.is_null() || (out.is_null() && max > 0) {
+        return 0;
     }
 
-    let client = unsafe { &mut *(client as *mut NeonClient) };
-    client.set_auto_ping(enabled);
+    let Some(events) = (unsafe { client_events(client) }) else {
+        return 0;
+    };
+    let out = if max == 0 { &mut [][..] } else { unsafe { std::slice::from_raw_parts_mut(out, max) } };
+    events.poll(out)
 }
 
-/// Free the client (call when done)
+/// Payload of an event returned by the last neon_client_poll_events call
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_client_free(client: *mut NeonClientHandle) {
-    if !client.is_null() {
-        unsafe {
-            Box::from_raw(client as *mut NeonClient);
-        }
+pub extern "C" fn neon_client_event_payload(
+    client: *mut NeonClientHandle,
+    event: *const NeonEvent,
+) -> *const u8 {
+    if client.is_null() || event.is_null() {
+        return ptr::null();
+    }
+
+    match unsafe { client_events(client) } {
+        Some(events) => events.payload(unsafe { &*event }).as_ptr(),
+        None => ptr::null(),
     }
 }
 
-/// Create a new Neon host
-/// Returns null on failure
+/// Events dropped because the event queue was full
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_new(session_id: u32, relay_addr: *const c_char) -> *mut NeonHostHandle {
-    if relay_addr.is_null() {
-        return ptr::null_mut();
+pub extern "C" fn neon_client_get_dropped_events(client: *mut NeonClientHandle) -> u64 {
+    if client.is_null() {
+        return 0;
+    }
+
+    match unsafe { client_events(client) } {
+        Some(events) => events.dropped(),
+        None => 0,
+    }
+}
+
+/// Connect the client to a session
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_connect(
+    client: *mut NeonClientHandle,
+    session_id: u32,
+    relay_addr: *const c_char,
+) -> bool {
+    if client.is_null() || relay_addr.is_null() {
+        return false;
     }
 
+    let client = unsafe { client_mut(client) };
     let c_str = unsafe { CStr::from_ptr(relay_addr) };
     let addr = match c_str.to_str() {
         Ok(s) => s,
-        Err(_) => return ptr::null_mut(),
+        Err(_) => return false,
     };
 
-    match NeonHost::new(session_id, addr) {
-        Ok(host) => Box::into_raw(Box::new(host)) as *mut NeonHostHandle,
-        Err(_) => ptr::null_mut(),
+    match client.connect(session_id, addr) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
     }
 }
 
-/// Set callback for client connect events
+/// Start connecting the client to a session without blocking
+/// The attempt is driven by neon_client_process_packets and reported through the connect result callback
+/// Returns true if the request was sent, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_set_client_connect_callback(
-    host: *mut NeonHostHandle,
-    callback: ClientConnectCallbackC,
-) {
-    if host.is_null() {
-        return;
+pub extern "C" fn neon_client_connect_async(
+    client: *mut NeonClientHandle,
+    session_id: u32,
+    relay_addr: *const c_char,
+) -> bool {
+    if client.is_null() || relay_addr.is_null() {
+        return false;
     }
 
-    let host = unsafe { &mut *(host as *mut NeonHost) };
-    host.on_client_connect(move |client_id, name, session_id| {
-        let c_name = CString::new(name.as_str()).unwrap();
-        callback(client_id, c_name.as_ptr(), session_id);
-    });
+    let client = unsafe { client_mut(client) };
+    let c_str = unsafe { CStr::from_ptr(relay_addr) };
+    let addr = match c_str.to_str() {
+        Ok(s) => s,
+        Err(_) => return false,
+    };
+
+    match client.connect_async(session_id, addr) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
 }
 
-/// Set callback for client deny events
+/// Resume the current session from a fresh local socket after the network changed
+/// Returns true once the relay has moved the client, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_set_client_deny_callback(
-    host: *mut NeonHostHandle,
-    callback: ClientDenyCallbackC,
-) {
-    if host.is_null() {
-        return;
+pub extern "C" fn neon_client_resume(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
     }
 
-    let host = unsafe { &mut *(host as *mut NeonHost) };
-    host.on_client_deny(move |name, reason| {
-        let c_name = CString::new(name.as_str()).unwrap();
-        let c_reason = CString::new(reason.as_str()).unwrap();
-        callback(c_name.as_ptr(), c_reason.as_ptr());
-    });
+    let client = unsafe { client_mut(client) };
+    match client.resume() {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
 }
 
-/// Set callback for ping received events
+/// Start resuming the current session without blocking
+/// The attempt is driven by neon_client_process_packets and reported through the connect result callback
+/// Returns true if the request was sent, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_set_ping_received_callback(
-    host: *mut NeonHostHandle,
-    callback: PingReceivedCallbackC,
-) {
-    if host.is_null() {
-        return;
+pub extern "C" fn neon_client_resume_async(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
     }
 
-    let host = unsafe { &mut *(host as *mut NeonHost) };
-    host.on_ping_received(move |from_client_id| {
-        callback(from_client_id);
-    });
+    let client = unsafe { client_mut(client) };
+    match client.resume_async() {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
 }
 
-/// Set callback for unhandled packet events
+/// Check if a connect attempt is still waiting for the host
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_set_unhandled_packet_callback(
-    host: *mut NeonHostHandle,
-    callback: HostUnhandledPacketCallbackC,
-) {
-    if host.is_null() {
-        return;
+pub extern "C" fn neon_client_is_connecting(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
     }
 
-    let host = unsafe { &mut *(host as *mut NeonHost) };
-    host.on_unhandled_packet(move |packet_type, from_client_id, _addr| {
-        callback(packet_type, from_client_id);
-    });
+    let client = unsafe { &*client_mut(client) };
+    client.is_connecting()
 }
 
-/// Get the host's session ID
+/// Process incoming packets (call this regularly, e.g. in your game tick)
+/// Returns true on success, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_get_session_id(host: *mut NeonHostHandle) -> u32 {
-    if host.is_null() {
-        return 0;
+pub extern "C" fn neon_client_process_packets(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
     }
 
-    let host = unsafe { &*(host as *const NeonHost) };
-    host.session_id()
+    let client = unsafe { client_mut(client) };
+    client.process_packets().is_ok()
 }
 
-/// Get the number of connected clients
+/// Send a game packet (type 0x10+) to another peer in the session
+/// Returns true on success, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_get_client_count(host: *mut NeonHostHandle) -> usize {
-    if host.is_null() {
-        return 0;
+pub extern "C" fn neon_client_send(
+    client: *mut NeonClientHandle,
+    packet_type: u8,
+    destination_id: u8,
+    data: *const u8,
+    len: usize,
+) -> bool {
+    if client.is_null() || (data.is_null() && len > 0) {
+        return false;
     }
 
-    let host = unsafe { &*(host as *const NeonHost) };
-    host.client_count()
+    let client = unsafe { client_mut(client) };
+    let payload = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(data, len) } };
+
+    match client.send_game_packet(packet_type, destination_id, payload) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
 }
 
-/// Start the host (this blocks! Run in a separate thread)
+/// Send one game packet (type 0x10+) that the relay copies to every listed peer
 /// Returns true on success, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_start(host: *mut NeonHostHandle) -> bool {
-    if host.is_null() {
+pub extern "C" fn neon_client_send_multicast(
+    client: *mut NeonClientHandle,
+    packet_type: u8,
+    targets: *const u8,
+    target_count: usize,
+    data: *const u8,
+    len: usize,
+) -> bool {
+    if client.is_null() || (targets.is_null() && target_count > 0) || (data.is_null() && len > 0) {
         return false;
     }
 
-    let host = unsafe { &mut *(host as *mut NeonHost) };
-    host.start().is_ok()
+    let client = unsafe { client_mut(client) };
+    let targets = if target_count == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(targets, target_count) } };
+    let payload = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(data, len) } };
+
+    match client.send_multicast(packet_type, targets, payload) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
 }
 
-/// Free the host (call when done)
+/// Send a game packet (type 0x10+) on a delivery channel (see NeonChannel in project_neon.h)
+/// Returns true on success, false on failure
 #[unsafe(no_mangle)]
-pub extern "C" fn neon_host_free(host: *mut NeonHostHandle) {
-    if !host.is_null() {
+pub extern "C" fn neon_client_send_on_channel(
+    client: *mut NeonClientHandle,
+    channel: u8,
+    packet_type: u8,
+    destination_id: u8,
+    data: *const u8,
+    len: usize,
+) -> bool {
+    if client.is_null() || (data.is_null() && len > 0) {
+        return false;
+    }
+
+    let Some(channel) = Channel::from_u8(channel) else {
+        set_last_error("Unknown channel");
+        return false;
+    };
+
+    let client = unsafe { client_mut(client) };
+    let payload = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(data, len) } };
+
+    match client.send_on_channel(channel, packet_type, destination_id, payload) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Enable or disable coalescing of game and channel messages into bundles
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_set_bundling(client: *mut NeonClientHandle, enabled: bool) -> bool {
+    if client.is_null() {
+        return false;
+    }
+
+    let client = unsafe { client_mut(client) };
+    match client.set_bundling(enabled) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Send any messages waiting in the pending bundle
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_flush(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
+    }
+
+    let client = unsafe { client_mut(client) };
+    match client.flush() {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Get the client's assigned ID (returns 0 if not connected)
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_get_id(client: *mut NeonClientHandle) -> u8 {
+    if client.is_null() {
+        return 0;
+    }
+
+    let client = unsafe { &*client_mut(client) };
+    client.client_id().unwrap_or(0)
+}
+
+/// Get the session ID (returns 0 if not connected)
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_get_session_id(client: *mut NeonClientHandle) -> u32 {
+    if client.is_null() {
+        return 0;
+    }
+
+    let client = unsafe { &*client_mut(client) };
+    client.session_id().unwrap_or(0)
+}
+
+/// Get the max packet size negotiated with the host (header included)
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_get_max_packet_size(client: *mut NeonClientHandle) -> u16 {
+    if client.is_null() {
+        return 0;
+    }
+
+    let client = unsafe { &*client_mut(client) };
+    client.max_packet_size()
+}
+
+/// Fill `stats` with the link estimates for a peer
+/// Returns false if nothing has been exchanged with that peer yet
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_get_link_stats(client: *mut NeonClientHandle, peer_id: u8, stats: *mut NeonLinkStats) -> bool {
+    if client.is_null() || stats.is_null() {
+        return false;
+    }
+
+    let client = unsafe { &*client_mut(client) };
+    match client.link_stats(peer_id) {
+        Some(link) => {
+            unsafe { *stats = link.into() };
+            true
+        }
+        None => false,
+    }
+}
+
+/// Set how readily packets of a game type are shed on a congested link
+/// Returns false for an unknown priority
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_set_packet_priority(client: *mut NeonClientHandle, packet_type: u8, priority: u8) -> bool {
+    if client.is_null() {
+        return false;
+    }
+
+    let Some(priority) = Priority::from_u8(priority) else {
+        set_last_error("Unknown priority");
+        return false;
+    };
+
+    let client = unsafe { client_mut(client) };
+    client.set_packet_priority(packet_type, priority);
+    true
+}
+
+/// Check if the client is connected
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_is_connected(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
+    }
+
+    let client = unsafe { &*client_mut(client) };
+    client.client_id().is_some()
+}
+
+/// Leave the current session, telling the host so it can reuse the client id
+/// Returns false if the notice couldn't be sent; the client is disconnected either way
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_disconnect(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
+    }
+
+    let client = unsafe { client_mut(client) };
+    match client.disconnect() {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Manually send a ping
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_send_ping(client: *mut NeonClientHandle) -> bool {
+    if client.is_null() {
+        return false;
+    }
+
+    let client = unsafe { client_mut(client) };
+    client.send_ping().is_ok()
+}
+
+/// Set auto-ping enabled/disabled
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_set_auto_ping(client: *mut NeonClientHandle, enabled: bool) {
+    if client.is_null() {
+        return;
+    }
+
+    let client = unsafe { client_mut(client) };
+    client.set_auto_ping(enabled);
+}
+
+/// Free the client (call when done)
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_client_free(client: *mut NeonClientHandle) {
+    if !client.is_null() {
         unsafe {
-            Box::from_raw(host as *mut NeonHost);
+            drop(Box::from_raw(client as *mut ClientHandle));
+        }
+    }
+}
+
+/// Create a new Neon host
+/// Returns null on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_new(session_id: u32, relay_addr: *const c_char) -> *mut NeonHostHandle {
+    if relay_addr.is_null() {
+        return ptr::null_mut();
+    }
+
+    let c_str = unsafe { CStr::from_ptr(relay_addr) };
+    let addr = match c_str.to_str() {
+        Ok(s) => s,
+        Err(_) => return ptr::null_mut(),
+    };
+
+    match NeonHost::new(session_id, addr) {
+        Ok(host) => {
+            let handle = HostHandle { status: host.status(), host: UnsafeCell::new(host) };
+            Box::into_raw(Box::new(handle)) as *mut NeonHostHandle
+        }
+        Err(_) => ptr::null_mut(),
+    }
+}
+
+/// Describe a game packet type (0x10+) to clients; call before neon_host_start
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_register_packet_type(
+    host: *mut NeonHostHandle,
+    packet_type: u8,
+    name: *const c_char,
+    description: *const c_char,
+) -> bool {
+    if host.is_null() || name.is_null() || description.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    let name = unsafe { CStr::from_ptr(name) }.to_string_lossy();
+    let description = unsafe { CStr::from_ptr(description) }.to_string_lossy();
+
+    match host.register_packet_type(packet_type, &name, &description) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Compress payloads of a registered packet type whenever that saves bytes
+/// Returns true on success, false if the type isn't registered
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_packet_type_compressed(host: *mut NeonHostHandle, packet_type: u8, compressed: bool) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.set_packet_type_compressed(packet_type, compressed) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Set callback for client connect events
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_client_connect_callback(
+    host: *mut NeonHostHandle,
+    callback: ClientConnectCallbackC,
+) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.on_client_connect(move |client_id, name, session_id| {
+        let c_name = CString::new(name.as_str()).unwrap();
+        callback(client_id, c_name.as_ptr(), session_id);
+    });
+}
+
+/// Set callback for client deny events
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_client_deny_callback(
+    host: *mut NeonHostHandle,
+    callback: ClientDenyCallbackC,
+) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.on_client_deny(move |name, reason| {
+        let c_name = CString::new(name.as_str()).unwrap();
+        let c_reason = CString::new(reason.as_str()).unwrap();
+        callback(c_name.as_ptr(), c_reason.as_ptr());
+    });
+}
+
+/// Set callback for clients announcing they are leaving
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_client_disconnect_callback(
+    host: *mut NeonHostHandle,
+    callback: ClientDisconnectCallbackC,
+) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.on_client_disconnect(move |client_id, name| {
+        let c_name = CString::new(name.as_str()).unwrap();
+        callback(client_id, c_name.as_ptr());
+    });
+}
+
+/// Set callback for ping received events
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_ping_received_callback(
+    host: *mut NeonHostHandle,
+    callback: PingReceivedCallbackC,
+) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.on_ping_received(move |from_client_id| {
+        callback(from_client_id);
+    });
+}
+
+/// Set callback for game packet events (0x10+)
+/// The payload pointer is only valid for the duration of the callback
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_game_packet_callback(
+    host: *mut NeonHostHandle,
+    callback: GamePacketCallbackC,
+) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.on_game_packet(move |packet_type, from_client_id, payload| {
+        callback(packet_type, from_client_id, payload.as_ptr(), payload.len());
+    });
+}
+
+/// Set callback for unhandled packet events
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_unhandled_packet_callback(
+    host: *mut NeonHostHandle,
+    callback: HostUnhandledPacketCallbackC,
+) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.on_unhandled_packet(move |packet_type, from_client_id, _addr| {
+        callback(packet_type, from_client_id);
+    });
+}
+
+/// Get the host's session ID
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_get_session_id(host: *mut NeonHostHandle) -> u32 {
+    if host.is_null() {
+        return 0;
+    }
+
+    unsafe { host_status(host) }.session_id()
+}
+
+/// Get the number of connected clients
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_get_client_count(host: *mut NeonHostHandle) -> usize {
+    if host.is_null() {
+        return 0;
+    }
+
+    unsafe { host_status(host) }.client_count()
+}
+
+/// Fill `stats` with the link estimates for a client
+/// Returns false if nothing has been exchanged with that client yet
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_get_link_stats(host: *mut NeonHostHandle, client_id: u8, stats: *mut NeonLinkStats) -> bool {
+    if host.is_null() || stats.is_null() {
+        return false;
+    }
+
+    let host = unsafe { &*host_mut(host) };
+    match host.link_stats(client_id) {
+        Some(link) => {
+            unsafe { *stats = link.into() };
+            true
+        }
+        None => false,
+    }
+}
+
+/// Set how readily packets of a game type are shed on a congested link
+/// Returns false for an unknown priority
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_packet_priority(host: *mut NeonHostHandle, packet_type: u8, priority: u8) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let Some(priority) = Priority::from_u8(priority) else {
+        set_last_error("Unknown priority");
+        return false;
+    };
+
+    let host = unsafe { host_mut(host) };
+    host.set_packet_priority(packet_type, priority);
+    true
+}
+
+/// Forget a connected client so its id and name can be reused
+/// Returns false if no client has that id
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_remove_client(host: *mut NeonHostHandle, client_id: u8) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.remove_client(client_id)
+}
+
+/// Set the max packet size announced to joining clients (header included)
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_max_packet_size(host: *mut NeonHostHandle, size: u16) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.set_max_packet_size(size);
+}
+
+/// Set how long the relay keeps a silent client of this session
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_peer_timeout(host: *mut NeonHostHandle, timeout_ms: u32) {
+    if host.is_null() || timeout_ms == 0 {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.set_peer_timeout(Duration::from_millis(timeout_ms as u64));
+}
+
+/// Get the max packet size announced to joining clients (header included)
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_get_max_packet_size(host: *mut NeonHostHandle) -> u16 {
+    if host.is_null() {
+        return 0;
+    }
+
+    unsafe { host_status(host) }.max_packet_size()
+}
+
+/// Probe the path MTU towards the relay and use it as the max packet size
+/// Returns the applied size, or 0 on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_probe_path_mtu(host: *mut NeonHostHandle) -> u16 {
+    if host.is_null() {
+        return 0;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.probe_path_mtu() {
+        Ok(size) => size,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            0
+        }
+    }
+}
+
+/// Send a game packet (type 0x10+) to a client in the session
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_send(
+    host: *mut NeonHostHandle,
+    packet_type: u8,
+    destination_id: u8,
+    data: *const u8,
+    len: usize,
+) -> bool {
+    if host.is_null() || (data.is_null() && len > 0) {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    let payload = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(data, len) } };
+
+    match host.send_game_packet(packet_type, destination_id, payload) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Send one game packet (type 0x10+) that the relay copies to every listed client
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_send_multicast(
+    host: *mut NeonHostHandle,
+    packet_type: u8,
+    targets: *const u8,
+    target_count: usize,
+    data: *const u8,
+    len: usize,
+) -> bool {
+    if host.is_null() || (targets.is_null() && target_count > 0) || (data.is_null() && len > 0) {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    let targets = if target_count == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(targets, target_count) } };
+    let payload = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(data, len) } };
+
+    match host.send_multicast(packet_type, targets, payload) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Send a game packet (type 0x10+) on a delivery channel (see NeonChannel in project_neon.h)
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_send_on_channel(
+    host: *mut NeonHostHandle,
+    channel: u8,
+    packet_type: u8,
+    destination_id: u8,
+    data: *const u8,
+    len: usize,
+) -> bool {
+    if host.is_null() || (data.is_null() && len > 0) {
+        return false;
+    }
+
+    let Some(channel) = Channel::from_u8(channel) else {
+        set_last_error("Unknown channel");
+        return false;
+    };
+
+    let host = unsafe { host_mut(host) };
+    let payload = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(data, len) } };
+
+    match host.send_on_channel(channel, packet_type, destination_id, payload) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Replicate entities as delta snapshots of game packet type `packet_type`,
+/// each capped at `bytes_per_second` divided by the session tick rate
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_enable_replication(host: *mut NeonHostHandle, packet_type: u8, bytes_per_second: u32) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.enable_replication(packet_type, bytes_per_second) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Add a replicated entity with its initial state
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_register_entity(
+    host: *mut NeonHostHandle,
+    entity_id: u16,
+    state: *const u8,
+    len: usize,
+) -> bool {
+    if host.is_null() || (state.is_null() && len > 0) {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    let state = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(state, len) } };
+
+    match host.register_entity(entity_id, state) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Replace a registered entity's state
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_update_entity(
+    host: *mut NeonHostHandle,
+    entity_id: u16,
+    state: *const u8,
+    len: usize,
+) -> bool {
+    if host.is_null() || (state.is_null() && len > 0) {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    let state = if len == 0 { &[][..] } else { unsafe { std::slice::from_raw_parts(state, len) } };
+
+    match host.update_entity(entity_id, state) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Remove a replicated entity
+/// Returns true if it was registered
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_remove_entity(host: *mut NeonHostHandle, entity_id: u16) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.remove_entity(entity_id) {
+        Ok(removed) => removed,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Send each client a snapshot of the entities changed since its last ack, once per tick
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_flush_entities(host: *mut NeonHostHandle) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.flush_entities() {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Record every datagram the host receives to a capture file at `path`
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_start_capture(host: *mut NeonHostHandle, path: *const c_char) -> bool {
+    if host.is_null() || path.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    let path = match unsafe { CStr::from_ptr(path) }.to_str() {
+        Ok(s) => s,
+        Err(_) => return false,
+    };
+
+    match host.start_capture(path) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Finish the capture in progress, writing out everything recorded
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_stop_capture(host: *mut NeonHostHandle) {
+    if host.is_null() {
+        return;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.stop_capture();
+}
+
+/// Enable or disable coalescing of game and channel messages into bundles
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_set_bundling(host: *mut NeonHostHandle, enabled: bool) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.set_bundling(enabled) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Send any messages waiting in the pending bundle
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_flush(host: *mut NeonHostHandle) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.flush() {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Start the host (this blocks! Run in a separate thread)
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_start(host: *mut NeonHostHandle) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    host.start().is_ok()
+}
+
+/// Handle whatever I/O is ready and return, waiting up to timeout_us for a datagram
+/// Lets the game loop drive the host instead of a thread blocked in neon_host_start
+/// Returns true on success, false on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_poll(host: *mut NeonHostHandle, timeout_us: u32) -> bool {
+    if host.is_null() {
+        return false;
+    }
+
+    let host = unsafe { host_mut(host) };
+    match host.poll(Duration::from_micros(timeout_us as u64)) {
+        Ok(()) => true,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
+        }
+    }
+}
+
+/// Free the host (call when done)
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_host_free(host: *mut NeonHostHandle) {
+    if !host.is_null() {
+        unsafe {
+            drop(Box::from_raw(host as *mut HostHandle));
+        }
+    }
+}
+
+/// Set the most verbose log level that is kept (0 = off, 1 = error ... 5 = trace)
+/// Returns false for an unknown level
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_set_log_level(level: u8) -> bool {
+    match Level::from_u8(level) {
+        Some(level) => {
+            log::set_level(level);
+            true
+        }
+        None => false,
+    }
+}
+
+/// Get the current log level
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_get_log_level() -> u8 {
+    log::level() as u8
+}
+
+/// Deliver log messages to a callback instead of stdout; null restores stdout
+/// The callback runs on the library's logger thread
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_set_log_callback(callback: Option<LogCallbackC>) {
+    let Some(callback) = callback else {
+        log::set_sink(None);
+        return;
+    };
+
+    let mut buf = Vec::with_capacity(log::MESSAGE_SIZE + 1);
+    log::set_sink(Some(Box::new(move |level, message| {
+        buf.clear();
+        buf.extend_from_slice(message.as_bytes());
+        buf.push(0);
+        callback(level as u8, buf.as_ptr() as *const c_char);
+    })));
+}
+
+/// Encode a packet header into a caller-provided buffer
+/// Returns the bytes written, or 0 on failure
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_encode_header(header: *const NeonPacketHeader, out: *mut u8, out_len: usize) -> usize {
+    if header.is_null() || out.is_null() {
+        return 0;
+    }
+
+    let header = unsafe { *header };
+    let out = unsafe { std::slice::from_raw_parts_mut(out, out_len) };
+    let header = PacketHeader {
+        magic: header.magic,
+        version: header.version,
+        packet_type: header.packet_type,
+        sequence: header.sequence,
+        client_id: header.client_id,
+        destination_id: header.destination_id,
+    };
+    match header.encode(out) {
+        Ok(written) => written,
+        Err(e) => {
+            set_last_error(&e.to_string());
+            0
+        }
+    }
+}
+
+/// Decode the header at the front of a datagram; the payload follows at NEON_PACKET_HEADER_SIZE
+/// Returns false if the data is too short or not a Neon packet
+#[unsafe(no_mangle)]
+pub extern "C" fn neon_decode_header(data: *const u8, len: usize, out: *mut NeonPacketHeader) -> bool {
+    if data.is_null() || out.is_null() {
+        return false;
+    }
+
+    let data = unsafe { std::slice::from_raw_parts(data, len.min(PACKET_HEADER_SIZE)) };
+    match PacketHeader::from_bytes(data) {
+        Ok(header) => {
+            unsafe {
+                *out = NeonPacketHeader {
+                    magic: header.magic,
+                    version: header.version,
+                    packet_type: header.packet_type,
+                    sequence: header.sequence,
+                    client_id: header.client_id,
+                    destination_id: header.destination_id,
+                };
+            }
+            true
+        }
+        Err(e) => {
+            set_last_error(&e.to_string());
+            false
         }
     }
 }
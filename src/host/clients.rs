@@ -0,0 +1,75 @@
+use std::collections::{HashMap, VecDeque};
+
+/// Lowest id handed to clients; 0 addresses everyone and 1 is the host
+const FIRST_CLIENT_ID: u8 = 2;
+
+/// Clients connected to a host: a dense slot per client id, ids of departed
+/// clients kept on a free list for reuse, and a name index for duplicate checks
+pub struct ClientTable {
+    /// Slot n holds the name of client n
+    slots: Vec<Option<String>>,
+    /// Released ids, reused oldest first so a departed client's id rests as long as possible
+    free: VecDeque<u8>,
+    /// Lowest id never handed out, 256 once every id has been
+    next_id: u16,
+    names: HashMap<String, u8>,
+}
+
+impl ClientTable {
+    pub fn new() -> Self {
+        ClientTable {
+            slots: Vec::new(),
+            free: VecDeque::new(),
+            next_id: FIRST_CLIENT_ID as u16,
+            names: HashMap::new(),
+        }
+    }
+
+    /// Give `name` an id, None when all 254 client ids are in use
+    pub fn insert(&mut self, name: String) -> Option<u8> {
+        let id = match self.free.pop_front() {
+            Some(id) => id,
+            None if self.next_id <= u8::MAX as u16 => {
+                self.next_id += 1;
+                (self.next_id - 1) as u8
+            }
+            None => return None,
+        };
+
+        let slot = id as usize;
+        if slot >= self.slots.len() {
+            self.slots.resize_with(slot + 1, || None);
+        }
+        self.names.insert(name.clone(), id);
+        self.slots[slot] = Some(name);
+        Some(id)
+    }
+
+    /// Forget a client and release its id, returning its name
+    pub fn remove(&mut self, client_id: u8) -> Option<String> {
+        let name = self.slots.get_mut(client_id as usize)?.take()?;
+        self.names.remove(&name);
+        self.free.push_back(client_id);
+        Some(name)
+    }
+
+    pub fn name(&self, client_id: u8) -> Option<&str> {
+        self.slots.get(client_id as usize)?.as_deref()
+    }
+
+    pub fn contains(&self, client_id: u8) -> bool {
+        self.name(client_id).is_some()
+    }
+
+    pub fn is_name_taken(&self, name: &str) -> bool {
+        self.names.contains_key(name)
+    }
+
+    pub fn len(&self) -> usize {
+        self.names.len()
+    }
+
+    pub fn ids(&self) -> impl Iterator<Item = u8> + '_ {
+        self.slots.iter().enumerate().filter(|(_, slot)| slot.is_some()).map(|(id, _)| id as u8)
+    }
+}
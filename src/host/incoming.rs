@@ -1,53 +1,161 @@
 use std::net::{SocketAddr, UdpSocket};
-use std::io::Error;
+use std::io::{Error, ErrorKind};
 use super::types::*;
+use super::{GamePacketCallback, UnhandledPacketCallback};
+use crate::capture::CaptureWriter;
+use crate::channel::ChannelSet;
+use crate::replication::Replicator;
 
 pub struct NeonSocket {
     pub socket: UdpSocket,
+    send_buf: Vec<u8>,
+    recv_buf: Vec<u8>,
+    max_packet_size: usize,
+    /// Messages coalesced into one datagram while bundling is enabled
+    bundle: Vec<u8>,
+    bundling: bool,
+    /// Records every received datagram, when capturing
+    capture: Option<CaptureWriter>,
 }
 
 impl NeonSocket {
     pub fn new(bind_addr: &str) -> Result<Self, Error> {
         let socket = UdpSocket::bind(bind_addr)?;
         socket.set_nonblocking(true)?;
-        Ok(Self { socket })
+        Ok(Self {
+            socket,
+            send_buf: Vec::with_capacity(DEFAULT_MAX_PACKET_SIZE),
+            recv_buf: vec![0; DEFAULT_MAX_PACKET_SIZE + 1],
+            max_packet_size: DEFAULT_MAX_PACKET_SIZE,
+            bundle: Vec::with_capacity(DEFAULT_MAX_PACKET_SIZE),
+            bundling: false,
+            capture: None,
+        })
     }
 
-    pub fn send_packet(&self, packet: &NeonPacket, addr: SocketAddr) -> Result<(), Error> {
-        let header = PacketHeader {
-            magic: 0x4E45,
-            version: 1,
-            packet_type: packet.packet_type,
-            sequence: packet.sequence,
-            client_id: packet.client_id,
-            destination_id: packet.destination_id,
-        };
-        let mut bytes = header.to_bytes();
-        bytes.extend(packet.payload.to_bytes());
-        self.socket.send_to(&bytes, addr)?;
+    /// Start recording received datagrams, or stop with None
+    pub fn set_capture(&mut self, capture: Option<CaptureWriter>) {
+        self.capture = capture;
+    }
+
+    /// Coalesce send_raw messages into bundles instead of sending each on its own
+    pub fn set_bundling(&mut self, enabled: bool) {
+        self.bundling = enabled;
+    }
+
+    /// Largest datagram, header included, this socket sends or accepts
+    pub fn max_packet_size(&self) -> usize {
+        self.max_packet_size
+    }
+
+    /// Change the packet size limit and resize the receive buffer to match.
+    /// The size is clamped to what a session can negotiate.
+    pub fn set_max_packet_size(&mut self, size: usize) {
+        let size = size.clamp(MIN_PACKET_SIZE, MAX_DATAGRAM_SIZE);
+        self.max_packet_size = size;
+        // One spare byte tells an oversized datagram apart from one that fits exactly
+        self.recv_buf.resize(size + 1, 0);
+    }
+
+    /// Encode a packet into the reusable send buffer and send it
+    pub fn send_packet(&mut self, packet: &NeonPacket, addr: SocketAddr) -> Result<(), Error> {
+        self.send_buf.clear();
+        packet.write_to(&mut self.send_buf);
+        self.socket.send_to(&self.send_buf, addr)?;
         Ok(())
     }
 
-    pub fn receive_packet(&self) -> Result<(NeonPacket, SocketAddr), Error> {
-        let mut buf = [0; 1024];
-        let (size, addr) = self.socket.recv_from(&mut buf)?;
-        let header = PacketHeader::from_bytes(&buf[..8])?;
-        let payload = PacketPayload::from_bytes(header.packet_type, &buf[8..size])?;
-        Ok((
-            NeonPacket {
-                packet_type: header.packet_type,
-                sequence: header.sequence,
-                client_id: header.client_id,
-                destination_id: header.destination_id,
-                payload,
-            },
-            addr,
-        ))
+    /// Send a game packet by writing the header and payload into the reusable send buffer.
+    /// While bundling, the message is appended to the pending bundle instead, which is
+    /// sent first if the message would push it past the max packet size.
+    pub fn send_raw(&mut self, header: &PacketHeader, payload: &[u8], addr: SocketAddr) -> Result<(), Error> {
+        if PACKET_HEADER_SIZE + payload.len() > self.max_packet_size {
+            return Err(Error::new(ErrorKind::InvalidInput, "Packet exceeds maximum packet size"));
+        }
+
+        let entry_len = BUNDLE_ENTRY_HEADER_SIZE + payload.len();
+        if self.bundling && PACKET_HEADER_SIZE + entry_len <= self.max_packet_size {
+            if self.bundle.len() + entry_len > self.max_packet_size {
+                self.flush(addr)?;
+            }
+            if self.bundle.is_empty() {
+                // The relay splits bundles by entry destination, so the outer header has none
+                PacketHeader {
+                    magic: 0x4E45,
+                    version: PROTOCOL_VERSION,
+                    packet_type: PacketType::Bundle as u8,
+                    sequence: 0,
+                    client_id: header.client_id,
+                    destination_id: 0,
+                }.write_to(&mut self.bundle);
+            }
+            self.bundle.push(header.destination_id);
+            self.bundle.push(header.packet_type);
+            self.bundle.extend(&header.sequence.to_le_bytes());
+            self.bundle.extend(&(payload.len() as u16).to_le_bytes());
+            self.bundle.extend_from_slice(payload);
+            return Ok(());
+        }
+
+        // Keep ordering with anything already bundled
+        self.flush(addr)?;
+
+        self.send_buf.clear();
+        header.write_to(&mut self.send_buf);
+        self.send_buf.extend_from_slice(payload);
+        self.socket.send_to(&self.send_buf, addr)?;
+        Ok(())
+    }
+
+    /// Send a multicast packet: the peer set and inner packet type go in front of the
+    /// payload. Multicasts are never bundled since the relay rewrites them per target.
+    pub fn send_multicast(&mut self, header: &PacketHeader, targets: &[u8; PEER_SET_SIZE], packet_type: u8, payload: &[u8], addr: SocketAddr) -> Result<(), Error> {
+        if PACKET_HEADER_SIZE + PEER_SET_SIZE + 1 + payload.len() > self.max_packet_size {
+            return Err(Error::new(ErrorKind::InvalidInput, "Packet exceeds maximum packet size"));
+        }
+
+        self.flush(addr)?;
+
+        self.send_buf.clear();
+        header.write_to(&mut self.send_buf);
+        self.send_buf.extend_from_slice(targets);
+        self.send_buf.push(packet_type);
+        self.send_buf.extend_from_slice(payload);
+        self.socket.send_to(&self.send_buf, addr)?;
+        Ok(())
+    }
+
+    /// Send the pending bundle, if any
+    pub fn flush(&mut self, addr: SocketAddr) -> Result<(), Error> {
+        if self.bundle.is_empty() {
+            return Ok(());
+        }
+        let result = self.socket.send_to(&self.bundle, addr);
+        self.bundle.clear();
+        result.map(|_| ())
+    }
+
+    /// Receive a datagram into the socket's buffer and return its header plus a
+    /// borrowed view of the payload. Datagrams larger than the negotiated packet
+    /// size are dropped rather than handed over truncated.
+    pub fn receive_raw(&mut self) -> Result<(PacketHeader, &[u8], SocketAddr), Error> {
+        loop {
+            let (size, addr) = self.socket.recv_from(&mut self.recv_buf)?;
+            if let Some(capture) = &mut self.capture {
+                capture.record(std::time::Instant::now(), addr, &self.recv_buf[..size]);
+            }
+            if size > self.max_packet_size {
+                continue;
+            }
+
+            let header = PacketHeader::from_bytes(&self.recv_buf[..size])?;
+            return Ok((header, &self.recv_buf[PACKET_HEADER_SIZE..size], addr));
+        }
     }
 }
 
 pub fn handle_ping(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     host_client_id: u8,
     packet: &NeonPacket,
@@ -65,4 +173,48 @@ pub fn handle_ping(
         socket.send_packet(&pong_packet, relay_addr)?;
     }
     Ok(())
-}
\ No newline at end of file
+}
+/// Handle a game packet, compressed game packet or channel data message, whether it
+/// arrived on its own or inside a bundle
+pub fn dispatch_raw(
+    header: &PacketHeader,
+    data: &[u8],
+    addr: SocketAddr,
+    channels: &mut ChannelSet,
+    inflated: &mut Vec<u8>,
+    replication: &mut Option<Replicator>,
+    on_game_packet: &mut Option<GamePacketCallback>,
+    on_unhandled_packet: &mut Option<UnhandledPacketCallback>,
+) {
+    // Compressed game packets are inflated, then handled as if they had arrived plain
+    if header.packet_type == PacketType::Compressed as u8 {
+        let mut buffer = std::mem::take(inflated);
+        if let Some(packet_type) = crate::compress::unwrap(data, &mut buffer) {
+            let inner = PacketHeader { packet_type, ..*header };
+            dispatch_raw(&inner, &buffer, addr, channels, inflated, replication, on_game_packet, on_unhandled_packet);
+        }
+        *inflated = buffer;
+        return;
+    }
+
+    // Channel data is unwrapped by the channel layer, which delivers it in order
+    // (and only once) when the channel asks for that
+    if header.packet_type == PacketType::ChannelData as u8 {
+        channels.receive(header.client_id, header.sequence, data, &mut |packet_type, payload| {
+            if let Some(callback) = on_game_packet {
+                callback(packet_type, header.client_id, payload);
+            } else if let Some(callback) = on_unhandled_packet {
+                callback(packet_type, header.client_id, addr);
+            }
+        });
+    } else if let Some(replication) = replication.as_mut().filter(|r| r.packet_type() == header.packet_type) {
+        // Snapshot acks are consumed here rather than handed to the game
+        replication.handle_ack(header.client_id, data);
+    } else if header.packet_type >= PacketType::GamePacket as u8 {
+        if let Some(callback) = on_game_packet {
+            callback(header.packet_type, header.client_id, data);
+        } else if let Some(callback) = on_unhandled_packet {
+            callback(header.packet_type, header.client_id, addr);
+        }
+    }
+}
@@ -1,21 +1,33 @@
 mod types;
 mod incoming;
 mod outgoing;
+mod clients;
 
 use std::collections::HashMap;
 use std::io::{Error, ErrorKind};
 use std::net::SocketAddr;
-use std::thread::sleep;
+use std::sync::Arc;
 use std::time::Duration;
 use std::time::Instant;
 
 use types::*;
-use incoming::{NeonSocket, handle_ping};
+use clients::ClientTable;
+pub use types::HostStatus;
+use incoming::{NeonSocket, handle_ping, dispatch_raw};
 use outgoing::*;
+pub use crate::channel::Channel;
+use crate::capture::CaptureWriter;
+use crate::channel::{ChannelSet, CHANNEL_HEADER_SIZE};
+use crate::compress::PayloadCompression;
+pub use crate::pacing::{shed_error, LinkStats, Priority};
+use crate::replication::{EntityId, Replicator};
+use crate::timer::TimerWheel;
 
 pub type ClientConnectCallback = Box<dyn FnMut(u8, String, u32) + Send>; // (client_id, name, session_id)
 pub type ClientDenyCallback = Box<dyn FnMut(String, String) + Send>; // (name, reason)
+pub type ClientDisconnectCallback = Box<dyn FnMut(u8, String) + Send>; // (client_id, name)
 pub type PingReceivedCallback = Box<dyn FnMut(u8) + Send>; // (from_client_id)
+pub type GamePacketCallback = Box<dyn FnMut(u8, u8, &[u8]) + Send>; // (packet_type, from_client_id, payload)
 pub type UnhandledPacketCallback = Box<dyn FnMut(u8, u8, SocketAddr) + Send>; // (packet_type, from_client_id, addr)
 
 pub struct NeonHost {
@@ -23,18 +35,42 @@ pub struct NeonHost {
     relay_addr: SocketAddr,
     client_id: u8,
     session_id: u32,
-    connected_clients: HashMap<u8, String>,
-    next_client_id: u8,
+    clients: ClientTable,
     pending_acks: HashMap<u8, PendingAck>,
+    /// Deferred setups and SessionConfig retransmits
+    timers: TimerWheel<HostTimer>,
+    send_sequence: u16,
+    channels: ChannelSet,
+    /// Compresses payloads of the types flagged compressed, and holds inflated ones
+    compression: PayloadCompression,
+    inflated: Vec<u8>,
+    /// How readily each game packet type is shed when a peer's link is congested
+    priorities: [Priority; 256],
+    /// Game packet types described to clients, sorted by id, plus their encoding and version
+    packet_types: PacketTypeRegistry,
+    registry_bytes: Vec<u8>,
+    registry_version: u32,
+    /// Whether the session has been registered with the relay yet
+    registered: bool,
+    /// Idle timeout the relay applies to this session's clients, None for its default
+    peer_timeout: Option<Duration>,
+    /// Entity snapshots sent to clients, once enabled
+    replication: Option<Replicator>,
+    status: Arc<HostStatus>,
 
     on_client_connect: Option<ClientConnectCallback>,
     on_client_deny: Option<ClientDenyCallback>,
+    on_client_disconnect: Option<ClientDisconnectCallback>,
     on_ping_received: Option<PingReceivedCallback>,
+    on_game_packet: Option<GamePacketCallback>,
     on_unhandled_packet: Option<UnhandledPacketCallback>,
 }
 
-const ACK_TIMEOUT: Duration = Duration::from_secs(2);
 const MAX_RETRIES: u8 = 5;
+/// Time a client gets to register with the relay before its SessionConfig is sent
+const SETUP_DELAY: Duration = Duration::from_millis(50);
+/// Resolution of the host's timers, well below the smallest retransmit timeout
+const TIMER_TICK: Duration = Duration::from_millis(1);
 
 impl NeonHost {
     /// Create a new host with a specific session ID and relay address
@@ -47,12 +83,26 @@ impl NeonHost {
             relay_addr,
             client_id: 1,
             session_id,
-            connected_clients: HashMap::new(),
-            next_client_id: 2,
+            clients: ClientTable::new(),
             pending_acks: HashMap::new(),
+            timers: TimerWheel::new(TIMER_TICK),
+            send_sequence: 0,
+            channels: ChannelSet::new(),
+            compression: PayloadCompression::default(),
+            inflated: Vec::new(),
+            priorities: [Priority::Reliable; 256],
+            packet_types: PacketTypeRegistry { entries: Vec::new() },
+            registry_bytes: Vec::new(),
+            registry_version: 0,
+            registered: false,
+            peer_timeout: None,
+            replication: None,
+            status: Arc::new(HostStatus::new(session_id, DEFAULT_MAX_PACKET_SIZE as u16)),
             on_client_connect: None,
             on_client_deny: None,
+            on_client_disconnect: None,
             on_ping_received: None,
+            on_game_packet: None,
             on_unhandled_packet: None,
         })
     }
@@ -73,6 +123,14 @@ impl NeonHost {
         self.on_client_deny = Some(Box::new(callback));
     }
 
+    /// Set callback for when a client announces it is leaving
+    pub fn on_client_disconnect<F>(&mut self, callback: F)
+    where
+        F: FnMut(u8, String) + Send + 'static,
+    {
+        self.on_client_disconnect = Some(Box::new(callback));
+    }
+
     /// Set callback for when a ping is received
     pub fn on_ping_received<F>(&mut self, callback: F)
     where
@@ -81,6 +139,15 @@ impl NeonHost {
         self.on_ping_received = Some(Box::new(callback));
     }
 
+    /// Set callback for game packets (0x10+)
+    /// The payload slice points into the receive buffer and is only valid for the duration of the call
+    pub fn on_game_packet<F>(&mut self, callback: F)
+    where
+        F: FnMut(u8, u8, &[u8]) + Send + 'static,
+    {
+        self.on_game_packet = Some(Box::new(callback));
+    }
+
     /// Set callback for unhandled packets
     pub fn on_unhandled_packet<F>(&mut self, callback: F)
     where
@@ -101,77 +168,503 @@ impl NeonHost {
 
     /// Get connected client count
     pub fn client_count(&self) -> usize {
-        self.connected_clients.len()
+        self.clients.len()
     }
 
-    /// Start the host and begin accepting connections
-    pub fn start(&mut self) -> Result<(), Error> {
-        send_host_registration(&self.socket, self.relay_addr, self.client_id, self.session_id)?;
+    /// Get the name a connected client joined with
+    pub fn client_name(&self, client_id: u8) -> Option<&str> {
+        self.clients.name(client_id)
+    }
+
+    /// Forget a client, for instance one the game kicked or stopped hearing from,
+    /// so its id and name can be given to later clients. Returns false if no such
+    /// client is connected.
+    pub fn remove_client(&mut self, client_id: u8) -> bool {
+        self.forget_client(client_id).is_some()
+    }
+
+    /// Shared view of the session id, client count and packet size that other
+    /// threads can read while this host is running
+    pub fn status(&self) -> Arc<HostStatus> {
+        Arc::clone(&self.status)
+    }
+
+    /// Get the largest packet size, header included, announced to clients
+    pub fn max_packet_size(&self) -> u16 {
+        self.socket.max_packet_size() as u16
+    }
+
+    /// Set the largest packet size, header included, for the session.
+    /// Clients that join afterwards receive it in their SessionConfig.
+    /// Values outside 512..=65507 are clamped.
+    pub fn set_max_packet_size(&mut self, size: u16) {
+        self.socket.set_max_packet_size(size as usize);
+        self.status.set_max_packet_size(self.max_packet_size());
+    }
+
+    /// Set how long the relay may keep a silent client of this session before
+    /// dropping it. Must be set before the host starts, since it travels with the
+    /// host's registration.
+    pub fn set_peer_timeout(&mut self, timeout: Duration) {
+        self.peer_timeout = Some(timeout);
+    }
+
+    /// Ask the OS for the path MTU towards the relay and use the largest packet
+    /// size that avoids IP fragmentation. Returns the size that was applied.
+    pub fn probe_path_mtu(&mut self) -> Result<u16, Error> {
+        let size = crate::pmtu::max_udp_payload(self.relay_addr)?;
+        self.socket.set_max_packet_size(size);
+        self.status.set_max_packet_size(self.max_packet_size());
+        Ok(self.max_packet_size())
+    }
+
+    /// Send a game packet (type 0x10+) to a client in the session.
+    /// Destination BROADCAST_ID (0) reaches every client, copied by the relay.
+    /// Packets of a type given a sheddable priority, sent to a single client whose
+    /// link is congested, are shed and return `shed_error`.
+    pub fn send_game_packet(&mut self, packet_type: u8, destination_id: u8, payload: &[u8]) -> Result<(), Error> {
+        let wrapped = if is_compressed(&self.packet_types, packet_type) { self.compression.wrap(packet_type, payload) } else { None };
+        // Broadcasts aren't paced, there is no single link to measure them against
+        let priority = self.priorities[packet_type as usize];
+        let wire_len = PACKET_HEADER_SIZE + wrapped.map_or(payload.len(), <[u8]>::len);
+        if destination_id != BROADCAST_ID && !self.channels.admit(destination_id, wire_len, priority) {
+            return Err(shed_error());
+        }
+        let sequence = self.send_sequence;
+        self.send_sequence = self.send_sequence.wrapping_add(1);
+        send_game_packet(&mut self.socket, self.relay_addr, self.client_id, packet_type, destination_id, sequence, payload, wrapped)
+    }
+
+    /// Send one game packet (type 0x10+) that the relay copies to every listed client
+    pub fn send_multicast(&mut self, packet_type: u8, targets: &[u8], payload: &[u8]) -> Result<(), Error> {
+        let sequence = self.send_sequence;
+        self.send_sequence = self.send_sequence.wrapping_add(1);
+        let compression = is_compressed(&self.packet_types, packet_type).then_some(&mut self.compression);
+        send_multicast_packet(&mut self.socket, self.relay_addr, self.client_id, packet_type, targets, sequence, payload, compression)
+    }
+
+    /// Send a game packet (type 0x10+) on a channel with the given delivery guarantee
+    /// Reliable packets are resent until acknowledged; acks ride along on channel traffic.
+    /// On a congested link reliable packets wait for the pacer, unreliable ones are shed by priority.
+    pub fn send_on_channel(&mut self, channel: Channel, packet_type: u8, destination_id: u8, payload: &[u8]) -> Result<(), Error> {
+        if packet_type < PacketType::GamePacket as u8 {
+            return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+        }
+        if destination_id == BROADCAST_ID {
+            return Err(Error::new(ErrorKind::InvalidInput, "Channels need a single destination"));
+        }
+
+        let compressed = if is_compressed(&self.packet_types, packet_type) { self.compression.compress(payload) } else { None };
+        let sent = compressed.unwrap_or(payload);
+        if PACKET_HEADER_SIZE + CHANNEL_HEADER_SIZE + sent.len() > self.socket.max_packet_size() {
+            return Err(Error::new(ErrorKind::InvalidInput, "Packet exceeds maximum packet size"));
+        }
+
+        let (socket, relay_addr, client_id) = (&mut self.socket, self.relay_addr, self.client_id);
+        let priority = self.priorities[packet_type as usize];
+        self.channels.send(destination_id, channel, packet_type, sent, compressed.is_some(), priority, &mut |packet_type, destination_id, sequence, bytes| {
+            send_raw_packet(socket, relay_addr, client_id, packet_type, destination_id, sequence, bytes)
+        })
+    }
+
+    /// Coalesce game, channel and ack messages into bundles of up to max_packet_size
+    /// bytes. The host flushes pending bundles once per loop iteration; disabling
+    /// bundling flushes immediately.
+    pub fn set_bundling(&mut self, enabled: bool) -> Result<(), Error> {
+        let flushed = if enabled { Ok(()) } else { self.flush() };
+        self.socket.set_bundling(enabled);
+        flushed
+    }
+
+    /// Record every datagram received from now on to a capture file at `path`,
+    /// replacing any capture in progress
+    pub fn start_capture(&mut self, path: &str) -> Result<(), Error> {
+        self.socket.set_capture(Some(CaptureWriter::create(path)?));
+        Ok(())
+    }
+
+    /// Finish the capture in progress, writing out everything recorded
+    pub fn stop_capture(&mut self) {
+        self.socket.set_capture(None);
+    }
+
+    /// Send any messages waiting in the pending bundle
+    pub fn flush(&mut self) -> Result<(), Error> {
+        self.socket.flush(self.relay_addr)
+    }
+
+    /// Get the smoothed round trip time to a client, measured from acks
+    pub fn rtt(&self, client_id: u8) -> Option<Duration> {
+        self.channels.rtt(client_id)
+    }
+
+    /// Round trip, loss and bandwidth estimates for the link to a client, None
+    /// until something has been sent to or received from it
+    pub fn link_stats(&self, client_id: u8) -> Option<LinkStats> {
+        self.channels.link_stats(client_id)
+    }
+
+    /// Set how readily packets of a game type are shed when a client's link is congested.
+    /// Types, snapshots included, default to Priority::Reliable and are never shed;
+    /// nor are reliable channel packets, whatever their type's priority.
+    pub fn set_packet_priority(&mut self, packet_type: u8, priority: Priority) {
+        self.priorities[packet_type as usize] = priority;
+    }
+
+    /// Describe a game packet type (0x10+) to clients; registering an id again replaces
+    /// its name and description but keeps its flags.
+    /// Clients that already hold this exact registry are not sent it again.
+    pub fn register_packet_type(&mut self, packet_id: u8, name: &str, description: &str) -> Result<(), Error> {
+        if packet_id < PacketType::GamePacket as u8 {
+            return Err(Error::new(ErrorKind::InvalidInput, "Registered packet types must be 0x10 or above"));
+        }
+
+        let mut entry = PacketTypeEntry {
+            packet_id,
+            flags: 0,
+            name: name.to_string(),
+            description: description.to_string(),
+        };
+        let entries = &mut self.packet_types.entries;
+        let (index, previous) = match entries.binary_search_by_key(&packet_id, |e| e.packet_id) {
+            Ok(index) => {
+                entry.flags = entries[index].flags;
+                (index, Some(std::mem::replace(&mut entries[index], entry)))
+            }
+            Err(index) => {
+                entries.insert(index, entry);
+                (index, None)
+            }
+        };
+        self.encode_registry();
+
+        if PACKET_HEADER_SIZE + self.registry_bytes.len() > MAX_DATAGRAM_SIZE {
+            match previous {
+                Some(previous) => self.packet_types.entries[index] = previous,
+                None => { self.packet_types.entries.remove(index); }
+            }
+            self.encode_registry();
+            return Err(Error::new(ErrorKind::InvalidInput, "Packet type registry would not fit in a datagram"));
+        }
+        Ok(())
+    }
+
+    /// Replicate entities to clients as delta snapshots of game packet type `packet_type`,
+    /// each capped at `bytes_per_second` divided by the session tick rate. Clients must
+    /// enable replication with the same packet type.
+    pub fn enable_replication(&mut self, packet_type: u8, bytes_per_second: u32) -> Result<(), Error> {
+        if packet_type < PacketType::GamePacket as u8 {
+            return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+        }
+        self.replication = Some(Replicator::new(packet_type, bytes_per_second));
+        Ok(())
+    }
+
+    /// Add an entity with its initial state, sent to clients on the next flush_entities
+    pub fn register_entity(&mut self, entity_id: EntityId, state: &[u8]) -> Result<(), Error> {
+        let replication = self.replication_mut()?;
+        if replication.contains(entity_id) {
+            return Err(Error::new(ErrorKind::AlreadyExists, "Entity already registered"));
+        }
+        replication.set(entity_id, state);
+        Ok(())
+    }
+
+    /// Replace a registered entity's state
+    pub fn update_entity(&mut self, entity_id: EntityId, state: &[u8]) -> Result<(), Error> {
+        let replication = self.replication_mut()?;
+        if !replication.contains(entity_id) {
+            return Err(Error::new(ErrorKind::NotFound, "Entity not registered"));
+        }
+        replication.set(entity_id, state);
+        Ok(())
+    }
+
+    /// Remove an entity; clients drop it on the next flush_entities
+    pub fn remove_entity(&mut self, entity_id: EntityId) -> Result<bool, Error> {
+        Ok(self.replication_mut()?.remove(entity_id))
+    }
+
+    /// Send each connected client a snapshot of what changed since the last one it
+    /// acknowledged. Call once per tick.
+    pub fn flush_entities(&mut self) -> Result<(), Error> {
+        let Some(replication) = &mut self.replication else {
+            return Err(Error::new(ErrorKind::Unsupported, "Replication is not enabled"));
+        };
+        let budget = replication.tick_budget(TICK_RATE);
+        let limit = self.socket.max_packet_size() - PACKET_HEADER_SIZE;
+        let packet_type = replication.packet_type();
+        let compressed = is_compressed(&self.packet_types, packet_type);
+        let priority = self.priorities[packet_type as usize];
+
+        for client_id in self.clients.ids() {
+            let Some(snapshot) = replication.build(client_id, budget, limit) else {
+                continue;
+            };
+            let wrapped = if compressed { self.compression.wrap(packet_type, snapshot) } else { None };
+            // A shed snapshot counts as lost, the next one carries its changes
+            if !self.channels.admit(client_id, PACKET_HEADER_SIZE + wrapped.map_or(snapshot.len(), <[u8]>::len), priority) {
+                continue;
+            }
+            let sequence = self.send_sequence;
+            self.send_sequence = self.send_sequence.wrapping_add(1);
+            send_game_packet(&mut self.socket, self.relay_addr, self.client_id, packet_type, client_id, sequence, snapshot, wrapped)?;
+        }
+        Ok(())
+    }
+
+    fn replication_mut(&mut self) -> Result<&mut Replicator, Error> {
+        self.replication
+            .as_mut()
+            .ok_or_else(|| Error::new(ErrorKind::Unsupported, "Replication is not enabled"))
+    }
 
+    /// Compress payloads of a registered packet type. The host and clients holding the
+    /// registry then compress what they send of it whenever that saves bytes; every
+    /// peer can decode compressed packets, so the relay and other peers need nothing.
+    /// Set it before clients join, since clients fetch the registry when they join.
+    pub fn set_packet_type_compressed(&mut self, packet_id: u8, compressed: bool) -> Result<(), Error> {
+        let entries = &mut self.packet_types.entries;
+        let Ok(index) = entries.binary_search_by_key(&packet_id, |e| e.packet_id) else {
+            return Err(Error::new(ErrorKind::NotFound, "Packet type is not registered"));
+        };
+        let flags = &mut entries[index].flags;
+        match compressed {
+            true => *flags |= PACKET_TYPE_COMPRESSED,
+            false => *flags &= !PACKET_TYPE_COMPRESSED,
+        }
+        self.encode_registry();
+        Ok(())
+    }
+
+    fn encode_registry(&mut self) {
+        self.registry_bytes.clear();
+        self.packet_types.write_to(&mut self.registry_bytes);
+        self.registry_version = if self.packet_types.entries.is_empty() {
+            0
+        } else {
+            crate::registry::registry_version(&self.registry_bytes)
+        };
+    }
+
+    /// Start the host and begin accepting connections (blocks)
+    pub fn start(&mut self) -> Result<(), Error> {
         loop {
-            self.check_pending_acks()?;
+            self.run_once(None)?;
+        }
+    }
+
+    /// Handle whatever is ready and return, waiting at most `timeout` for a datagram.
+    /// Call this from the game loop to drive the host without a thread of its own;
+    /// the first call registers the session with the relay.
+    pub fn poll(&mut self, timeout: Duration) -> Result<(), Error> {
+        self.run_once(Some(timeout))
+    }
 
-            match self.socket.receive_packet() {
-                Ok((packet, addr)) => match packet.payload {
-                    PacketPayload::ConnectRequest(req) => {
-                        self.handle_connect_request(req, addr)?;
+    fn run_once(&mut self, max_wait: Option<Duration>) -> Result<(), Error> {
+        if !self.registered {
+            let peer_timeout_ms = self.peer_timeout.map_or(0, |timeout| timeout.as_millis().clamp(1, u32::MAX as u128) as u32);
+            send_host_registration(&mut self.socket, self.relay_addr, self.client_id, self.session_id, peer_timeout_ms)?;
+            self.registered = true;
+        }
+
+        // Sleep until a datagram arrives or the next timer is due
+        let timeout = self.next_timer_deadline()
+            .map(|deadline| deadline.saturating_duration_since(Instant::now()));
+        let timeout = match (timeout, max_wait) {
+            (Some(timeout), Some(max_wait)) => Some(timeout.min(max_wait)),
+            (timeout, max_wait) => timeout.or(max_wait),
+        };
+
+        if crate::reactor::wait_readable(&self.socket.socket, timeout)? {
+            self.receive_packets()?;
+        }
+
+        self.run_timers()?;
+        self.update_channels()?;
+        self.flush()
+    }
+
+    /// Handle every datagram currently queued on the socket
+    fn receive_packets(&mut self) -> Result<(), Error> {
+        loop {
+            match self.socket.receive_raw() {
+                Ok((header, _, addr)) if !header.is_compatible() => {
+                    log_limited!(
+                        crate::log::Level::Warn, 10,
+                        "[Host] Protocol version {} packet from {}, this host speaks {}, dropping",
+                        header.version, addr, PROTOCOL_VERSION
+                    );
+                }
+                Ok((header, data, addr)) if header.packet_type == PacketType::Bundle as u8 => {
+                    for (entry, payload) in bundle_entries(&header, data) {
+                        if entry.packet_type == PacketType::Ack as u8 {
+                            // Only channel acks are bundled, setup acks always travel on their own
+                            if let Ok(PayloadView::Ack(ack)) = PayloadView::parse(entry.packet_type, payload) {
+                                self.channels.handle_ack(entry.client_id, ack.channel, ack.sequence, ack.ack_bits);
+                            }
+                        } else {
+                            dispatch_raw(&entry, payload, addr, &mut self.channels, &mut self.inflated, &mut self.replication, &mut self.on_game_packet, &mut self.on_unhandled_packet);
+                        }
                     }
-                    PacketPayload::Ack(ack) => {
-                        self.handle_ack(packet.client_id, ack)?;
+                }
+                Ok((header, data, addr)) if header.packet_type == PacketType::ChannelData as u8
+                    || header.packet_type == PacketType::Compressed as u8
+                    || header.packet_type >= PacketType::GamePacket as u8 => {
+                    dispatch_raw(&header, data, addr, &mut self.channels, &mut self.inflated, &mut self.replication, &mut self.on_game_packet, &mut self.on_unhandled_packet);
+                }
+                Ok((header, _, _)) if header.packet_type == PacketType::PacketTypeRegistry as u8 => {
+                    self.answer_registry_request(header.client_id)?;
+                }
+                Ok((header, _, _)) if header.packet_type == PacketType::DisconnectNotice as u8 => {
+                    if let Some(name) = self.forget_client(header.client_id) {
+                        if let Some(callback) = &mut self.on_client_disconnect {
+                            callback(header.client_id, name);
+                        }
                     }
-                    PacketPayload::Ping(_) => {
-                        handle_ping(&self.socket, self.relay_addr, self.client_id, &packet)?;
+                }
+                Ok((header, data, addr)) => {
+                    let packet = NeonPacket {
+                        packet_type: header.packet_type,
+                        sequence: header.sequence,
+                        client_id: header.client_id,
+                        destination_id: header.destination_id,
+                        payload: PacketPayload::from_bytes(header.packet_type, data)?,
+                    };
+
+                    match packet.payload {
+                        PacketPayload::ConnectRequest(req) => {
+                            self.handle_connect_request(req, addr)?;
+                        }
+                        PacketPayload::Ack(ack) => {
+                            self.handle_ack(packet.client_id, ack)?;
+                        }
+                        PacketPayload::Ping(_) => {
+                            handle_ping(&mut self.socket, self.relay_addr, self.client_id, &packet)?;
                         
-                        if let Some(callback) = &mut self.on_ping_received {
-                            callback(packet.client_id);
+                            if let Some(callback) = &mut self.on_ping_received {
+                                callback(packet.client_id);
+                            }
                         }
-                    }
-                    _ => {
-                        if let Some(callback) = &mut self.on_unhandled_packet {
-                            callback(packet.packet_type, packet.client_id, addr);
+                        _ => {
+                            if let Some(callback) = &mut self.on_unhandled_packet {
+                                callback(packet.packet_type, packet.client_id, addr);
+                            }
                         }
                     }
-                },
-                Err(e) if e.kind() == ErrorKind::WouldBlock => {
-                    sleep(Duration::from_millis(10));
                 }
+                Err(e) if e.kind() == ErrorKind::WouldBlock => return Ok(()),
                 Err(e) => return Err(e),
             }
         }
     }
 
-    fn check_pending_acks(&mut self) -> Result<(), Error> {
-        let mut to_retry = Vec::new();
-        let mut to_remove = Vec::new();
+    fn next_timer_deadline(&self) -> Option<Instant> {
+        match (self.timers.next_deadline(), self.channels.next_deadline()) {
+            (Some(a), Some(b)) => Some(a.min(b)),
+            (a, b) => a.or(b),
+        }
+    }
+
+    /// Retransmit timeout for a setup packet, from the client's RTT estimate with exponential backoff
+    fn ack_timeout(&self, client_id: u8, retry_count: u8) -> Duration {
+        self.channels.rto(client_id) * (1 << retry_count.min(4))
+    }
 
-    for (client_id, pending) in &self.pending_acks {
-            if pending.sent_at.elapsed() >= ACK_TIMEOUT {
-                if pending.retry_count >= MAX_RETRIES {
-                    to_remove.push(*client_id);
-                } else {
-                    to_retry.push(*client_id);
-                }
+    /// Resend unacknowledged channel packets and send any acks still owed
+    fn update_channels(&mut self) -> Result<(), Error> {
+        let (socket, relay_addr, client_id) = (&mut self.socket, self.relay_addr, self.client_id);
+        let result = self.channels.update(&mut |packet_type, destination_id, sequence, bytes| {
+            send_raw_packet(socket, relay_addr, client_id, packet_type, destination_id, sequence, bytes)
+        });
+        match result {
+            // The socket buffer is full; whatever didn't go out is resent on its timer
+            Err(e) if e.kind() == ErrorKind::WouldBlock => Ok(()),
+            result => result,
+        }
+    }
+
+    /// Handle every timer that has come due
+    fn run_timers(&mut self) -> Result<(), Error> {
+        let now = Instant::now();
+        while let Some(timer) = self.timers.pop_expired(now) {
+            match timer {
+                HostTimer::Setup(client_id) => self.send_setup(client_id)?,
+                HostTimer::AckRetry { client_id, retry_count } => self.retry_setup(client_id, retry_count)?,
             }
         }
+        Ok(())
+    }
 
-    for client_id in to_retry {
-            if let Some(pending) = self.pending_acks.get_mut(&client_id) {
-                self.socket.send_packet(&pending.packet, self.relay_addr)?;
-                pending.sent_at = Instant::now();
-                pending.retry_count += 1;
+    /// Send SessionConfig to a client whose setup delay has passed
+    fn send_setup(&mut self, client_id: u8) -> Result<(), Error> {
+        if !self.clients.contains(client_id) {
+            return Ok(());
+        }
+
+        let sequence = 2;
+        let config_packet = send_session_config(&mut self.socket, self.relay_addr, client_id, sequence, self.registry_version)?;
+
+        let sent_at = Instant::now();
+        self.pending_acks.insert(client_id, PendingAck {
+            packet: config_packet,
+            sequence,
+            sent_at,
+            retry_count: 0,
+        });
+        self.timers.schedule(sent_at + self.ack_timeout(client_id, 0), HostTimer::AckRetry { client_id, retry_count: 0 });
+        Ok(())
+    }
+
+    /// Send the registry to a client whose SessionConfig named a version it doesn't have
+    fn answer_registry_request(&mut self, client_id: u8) -> Result<(), Error> {
+        if self.registry_version == 0 || !self.clients.contains(client_id) {
+            return Ok(());
+        }
+
+        match send_packet_type_registry(&mut self.socket, self.relay_addr, client_id, &self.registry_bytes) {
+            Err(e) if e.kind() == ErrorKind::InvalidInput => {
+                log_warn!("[Host] Packet type registry doesn't fit the session's max packet size, not sent");
+                Ok(())
             }
+            result => result,
         }
+    }
 
-        for client_id in to_remove {
+    /// Resend a SessionConfig that attempt `retry_count` didn't get acked, or give up on it.
+    /// A timer left over from before the ack arrived finds nothing to do.
+    fn retry_setup(&mut self, client_id: u8, retry_count: u8) -> Result<(), Error> {
+        let Some(pending) = self.pending_acks.get_mut(&client_id) else {
+            return Ok(());
+        };
+        if pending.retry_count != retry_count {
+            return Ok(());
+        }
+        if retry_count >= MAX_RETRIES {
             self.pending_acks.remove(&client_id);
+            return Ok(());
         }
 
+        self.socket.send_packet(&pending.packet, self.relay_addr)?;
+        pending.sent_at = Instant::now();
+        pending.retry_count += 1;
+        let (sent_at, retry_count) = (pending.sent_at, pending.retry_count);
+        self.timers.schedule(sent_at + self.ack_timeout(client_id, retry_count), HostTimer::AckRetry { client_id, retry_count });
         Ok(())
     }
 
     fn handle_ack(&mut self, client_id: u8, ack: Ack) -> Result<(), Error> {
+        if ack.channel != 0 {
+            self.channels.handle_ack(client_id, ack.channel, ack.sequence, ack.ack_bits);
+            return Ok(());
+        }
+
         if let Some(pending) = self.pending_acks.get(&client_id) {
-            if ack.acknowledged_sequences.contains(&pending.sequence) {
+            if ack.acknowledges(pending.sequence) {
+                // Only an unretried packet gives an unambiguous RTT sample
+                if pending.retry_count == 0 {
+                    self.channels.observe_rtt(client_id, pending.sent_at.elapsed());
+                }
                 self.pending_acks.remove(&client_id);
             }
         }
@@ -179,8 +672,23 @@ impl NeonHost {
         Ok(())
     }
 
-    fn is_name_taken(&self, name: &str) -> bool {
-        self.connected_clients.values().any(|n| n == name)
+    /// Drop a client's state and release its id, returning the name it had
+    fn forget_client(&mut self, client_id: u8) -> Option<String> {
+        let name = self.clients.remove(client_id)?;
+        self.pending_acks.remove(&client_id);
+        self.channels.remove_peer(client_id);
+        if let Some(replication) = &mut self.replication {
+            replication.remove_client(client_id);
+        }
+        self.status.set_client_count(self.clients.len());
+        Some(name)
+    }
+
+    fn deny(&mut self, name: String, request_nonce: u32, reason: String) -> Result<(), Error> {
+        if let Some(callback) = &mut self.on_client_deny {
+            callback(name, reason.clone());
+        }
+        send_connect_deny(&mut self.socket, self.relay_addr, request_nonce, reason)
     }
 
     fn handle_connect_request(
@@ -192,38 +700,24 @@ impl NeonHost {
             return Ok(());
         }
 
-        if self.is_name_taken(&req.desired_name) {
+        if self.clients.is_name_taken(&req.desired_name) {
             let reason = format!("Name '{}' is already in use", req.desired_name);
-            
-            if let Some(callback) = &mut self.on_client_deny {
-                callback(req.desired_name.clone(), reason.clone());
-            }
-
-            send_connect_deny(&self.socket, self.relay_addr, reason)?;
-            return Ok(());
+            return self.deny(req.desired_name, req.request_nonce, reason);
         }
 
-        let assigned_id = self.next_client_id;
-        self.next_client_id += 1;
+        let Some(assigned_id) = self.clients.insert(req.desired_name.clone()) else {
+            return self.deny(req.desired_name, req.request_nonce, "Session is full".to_string());
+        };
 
-        send_connect_accept(&self.socket, self.relay_addr, assigned_id, self.session_id)?;
+        // Lets the relay move the client to a new address later without asking the host
+        let resume_token = rand::random::<u64>().max(1);
+        send_connect_accept(&mut self.socket, self.relay_addr, assigned_id, self.session_id, req.request_nonce, resume_token)?;
 
-        // Delay is needed because the client doesn't have enough time to register otherwise
-        sleep(Duration::from_millis(50));
+        // The client still has to register with the relay, so the rest of its
+        // setup goes out from the main loop once SETUP_DELAY has passed
+        self.timers.schedule(Instant::now() + SETUP_DELAY, HostTimer::Setup(assigned_id));
 
-        let sequence = 2;
-        let config_packet = send_session_config(&self.socket, self.relay_addr, assigned_id, sequence)?;
-
-        self.pending_acks.insert(assigned_id, PendingAck {
-            packet: config_packet,
-            sequence,
-            sent_at: Instant::now(),
-            retry_count: 0,
-        });
-        
-        send_packet_type_registry(&self.socket, self.relay_addr, assigned_id)?;
-
-        self.connected_clients.insert(assigned_id, req.desired_name.clone());
+        self.status.set_client_count(self.clients.len());
         
         if let Some(callback) = &mut self.on_client_connect {
             callback(assigned_id, req.desired_name, req.target_session_id);
@@ -231,4 +725,11 @@ impl NeonHost {
 
         Ok(())
     }
-}
\ No newline at end of file
+}
+/// Whether `packet_id` is registered and flagged compressed; entries are sorted by id
+fn is_compressed(packet_types: &PacketTypeRegistry, packet_id: u8) -> bool {
+    let entries = &packet_types.entries;
+    entries
+        .binary_search_by_key(&packet_id, |e| e.packet_id)
+        .is_ok_and(|index| entries[index].flags & PACKET_TYPE_COMPRESSED != 0)
+}
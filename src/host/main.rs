@@ -27,6 +27,11 @@ fn main() {
         }
     };
 
+    // Clients receive this once and keep it cached while the registry is unchanged
+    if let Err(e) = host.register_packet_type(0x10, "GamePacket", "Application-defined packet") {
+        println!("Failed to register packet type: {}", e);
+    }
+
     println!("Host will create session ID: {}", host.session_id());
     println!();
 
@@ -1,13 +1,15 @@
 use std::net::SocketAddr;
-use std::io::Error;
+use std::io::{Error, ErrorKind};
 use super::types::*;
 use super::incoming::NeonSocket;
+use crate::compress::PayloadCompression;
 
 pub fn send_host_registration(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     host_client_id: u8,
     session_id: u32,
+    peer_timeout_ms: u32,
 ) -> Result<(), Error> {
     let host_register_packet = NeonPacket {
         packet_type: PacketType::ConnectAccept as u8,
@@ -17,6 +19,9 @@ pub fn send_host_registration(
         payload: PacketPayload::ConnectAccept(ConnectAccept {
             assigned_client_id: host_client_id,
             session_id,
+            peer_timeout_ms,
+            request_nonce: 0,
+            resume_token: 0,
         }),
     };
 
@@ -25,14 +30,19 @@ pub fn send_host_registration(
 }
 
 pub fn send_connect_accept(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     assigned_id: u8,
     session_id: u32,
+    request_nonce: u32,
+    resume_token: u64,
 ) -> Result<(), Error> {
     let accept = ConnectAccept {
         assigned_client_id: assigned_id,
         session_id,
+        peer_timeout_ms: 0,
+        request_nonce,
+        resume_token,
     };
 
     let accept_packet = NeonPacket {
@@ -44,13 +54,14 @@ pub fn send_connect_accept(
     };
 
     socket.send_packet(&accept_packet, relay_addr)?;
-    println!("[Host] Sent ConnectAccept to relay for client {}", assigned_id);
+    log_debug!("[Host] Sent ConnectAccept to relay for client {}", assigned_id);
     Ok(())
 }
 
 pub fn send_connect_deny(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
+    request_nonce: u32,
     reason: String,
 ) -> Result<(), Error> {
     let deny_packet = NeonPacket {
@@ -58,24 +69,26 @@ pub fn send_connect_deny(
         sequence: 1,
         client_id: 1,
         destination_id: 0,
-        payload: PacketPayload::ConnectDeny(ConnectDeny { reason }),
+        payload: PacketPayload::ConnectDeny(ConnectDeny { request_nonce, reason }),
     };
 
     socket.send_packet(&deny_packet, relay_addr)?;
-    println!("[Host] Sent ConnectDeny to relay");
+    log_debug!("[Host] Sent ConnectDeny to relay");
     Ok(())
 }
 
 pub fn send_session_config(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     assigned_id: u8,
     sequence: u16,
+    registry_version: u32,
 ) -> Result<NeonPacket, Error> {
     let config = SessionConfig {
         version: 1,
-        tick_rate: 60,
-        max_packet_size: 1024,
+        tick_rate: TICK_RATE,
+        max_packet_size: socket.max_packet_size() as u16,
+        registry_version,
     };
 
     let config_packet = NeonPacket {
@@ -87,34 +100,98 @@ pub fn send_session_config(
     };
 
     socket.send_packet(&config_packet, relay_addr)?;
-    println!("[Host] Sent SessionConfig to relay for client {}", assigned_id);
+    log_debug!("[Host] Sent SessionConfig to relay for client {}", assigned_id);
     Ok(config_packet)
 }
 
+/// Send the already encoded registry, so answering each joiner doesn't re-encode it
 pub fn send_packet_type_registry(
-    socket: &NeonSocket,
+    socket: &mut NeonSocket,
     relay_addr: SocketAddr,
     assigned_id: u8,
+    registry: &[u8],
 ) -> Result<(), Error> {
-    let registry = PacketTypeRegistry {
-        entries: vec![
-            PacketTypeEntry {
-                packet_id: 0x10,
-                name: "GamePacket".to_string(),
-                description: "Application-defined packet".to_string(),
-            },
-        ],
+    let header = PacketHeader::new(PacketType::PacketTypeRegistry as u8, 3, assigned_id, assigned_id);
+    socket.send_raw(&header, registry, relay_addr)?;
+    log_debug!("[Host] Sent PacketTypeRegistry to relay for client {}", assigned_id);
+    Ok(())
+}
+
+/// Send a game packet, or in its place the Compressed packet `wrapped` built for it
+/// by `PayloadCompression::wrap`
+pub fn send_game_packet(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    host_client_id: u8,
+    packet_type: u8,
+    destination_id: u8,
+    sequence: u16,
+    payload: &[u8],
+    wrapped: Option<&[u8]>,
+) -> Result<(), Error> {
+    if packet_type < PacketType::GamePacket as u8 {
+        return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+    }
+
+    if let Some(wrapped) = wrapped {
+        return send_raw_packet(socket, relay_addr, host_client_id, PacketType::Compressed as u8, destination_id, sequence, wrapped);
+    }
+    send_raw_packet(socket, relay_addr, host_client_id, packet_type, destination_id, sequence, payload)
+}
+
+/// Send one game packet that the relay copies to each client id in `targets`
+pub fn send_multicast_packet(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    host_client_id: u8,
+    packet_type: u8,
+    targets: &[u8],
+    sequence: u16,
+    payload: &[u8],
+    compression: Option<&mut PayloadCompression>,
+) -> Result<(), Error> {
+    if packet_type < PacketType::GamePacket as u8 {
+        return Err(Error::new(ErrorKind::InvalidInput, "Game packet types must be 0x10 or above"));
+    }
+
+    let mut peer_set = [0u8; PEER_SET_SIZE];
+    for &target in targets {
+        peer_set[target as usize / 8] |= 1 << (target % 8);
+    }
+
+    let header = PacketHeader {
+        magic: 0x4E45,
+        version: PROTOCOL_VERSION,
+        packet_type: PacketType::Multicast as u8,
+        sequence,
+        client_id: host_client_id,
+        destination_id: BROADCAST_ID,
     };
-    
-    let registry_packet = NeonPacket {
-        packet_type: PacketType::PacketTypeRegistry as u8,
-        sequence: 3,
-        client_id: assigned_id,
-        destination_id: assigned_id,
-        payload: PacketPayload::PacketTypeRegistry(registry),
+
+    match compression.and_then(|compression| compression.wrap(packet_type, payload)) {
+        Some(wrapped) => socket.send_multicast(&header, &peer_set, PacketType::Compressed as u8, wrapped, relay_addr),
+        None => socket.send_multicast(&header, &peer_set, packet_type, payload, relay_addr),
+    }
+}
+
+/// Send an already-encoded payload under a fresh header, used for channel data and acks
+pub fn send_raw_packet(
+    socket: &mut NeonSocket,
+    relay_addr: SocketAddr,
+    host_client_id: u8,
+    packet_type: u8,
+    destination_id: u8,
+    sequence: u16,
+    payload: &[u8],
+) -> Result<(), Error> {
+    let header = PacketHeader {
+        magic: 0x4E45,
+        version: PROTOCOL_VERSION,
+        packet_type,
+        sequence,
+        client_id: host_client_id,
+        destination_id,
     };
-    
-    socket.send_packet(&registry_packet, relay_addr)?;
-    println!("[Host] Sent PacketTypeRegistry to relay for client {}", assigned_id);
-    Ok(())
+
+    socket.send_raw(&header, payload, relay_addr)
 }
\ No newline at end of file
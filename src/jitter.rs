@@ -0,0 +1,122 @@
+//! Per-source jitter buffer for game packets.
+//!
+//! Packets are held for a fixed playout delay and released in sequence order, so
+//! a packet overtaken in flight is still delivered before the ones sent after it.
+//! Anything arriving after a newer packet from the same source was released is dropped.
+
+use std::collections::{HashMap, VecDeque};
+use std::time::{Duration, Instant};
+
+use crate::channel::sequence_newer;
+use crate::pool::BufferPool;
+
+/// When a datagram came off the socket
+#[derive(Debug, Clone, Copy)]
+pub struct Arrival {
+    pub at: Instant,
+    /// Milliseconds since the Unix epoch
+    pub unix_ms: u64,
+}
+
+impl Arrival {
+    pub fn now() -> Self {
+        Self {
+            at: Instant::now(),
+            unix_ms: std::time::SystemTime::now()
+                .duration_since(std::time::SystemTime::UNIX_EPOCH)
+                .unwrap_or_default()
+                .as_millis() as u64,
+        }
+    }
+}
+
+struct Held {
+    sequence: u16,
+    packet_type: u8,
+    arrival: Arrival,
+    payload: Vec<u8>,
+}
+
+#[derive(Default)]
+struct Source {
+    /// Last sequence released
+    released: Option<u16>,
+    /// Held packets, oldest sequence first
+    held: VecDeque<Held>,
+}
+
+pub struct JitterBuffer {
+    delay: Duration,
+    sources: HashMap<u8, Source>,
+    /// Payload buffers of released packets, reused for the next ones
+    spare: BufferPool,
+}
+
+impl JitterBuffer {
+    pub fn new(delay: Duration) -> Self {
+        Self {
+            delay,
+            sources: HashMap::new(),
+            spare: BufferPool::default(),
+        }
+    }
+
+    /// Forget every source, e.g. when joining a new session
+    pub fn clear(&mut self) {
+        for source in self.sources.values_mut() {
+            for held in source.held.drain(..) {
+                self.spare.put(held.payload);
+            }
+        }
+        self.sources.clear();
+    }
+
+    /// Hold a packet until its turn. Returns false if it was dropped as late or duplicate.
+    pub fn push(&mut self, from_client_id: u8, packet_type: u8, sequence: u16, payload: &[u8], arrival: Arrival) -> bool {
+        let source = self.sources.entry(from_client_id).or_default();
+        if source.released.is_some_and(|released| !sequence_newer(sequence, released)) {
+            return false;
+        }
+
+        // Usually in order, so search from the back
+        let mut index = source.held.len();
+        while index > 0 && sequence_newer(source.held[index - 1].sequence, sequence) {
+            index -= 1;
+        }
+        if index > 0 && source.held[index - 1].sequence == sequence {
+            return false;
+        }
+
+        let payload = self.spare.copy_of(payload);
+        source.held.insert(index, Held { sequence, packet_type, arrival, payload });
+        true
+    }
+
+    /// Deliver every packet whose turn has come: the next sequence from its source, or
+    /// anything once some packet of that source has been held for the full delay
+    pub fn release(&mut self, now: Instant, deliver: &mut dyn FnMut(u8, u8, u16, Arrival, &[u8])) {
+        for (&from_client_id, source) in self.sources.iter_mut() {
+            while let Some(front) = source.held.front() {
+                let next = source.released.is_some_and(|released| front.sequence == released.wrapping_add(1));
+                let due = source.held.iter().any(|held| now >= held.arrival.at + self.delay);
+                if !next && !due {
+                    break;
+                }
+
+                let held = source.held.pop_front().unwrap();
+                deliver(from_client_id, held.packet_type, held.sequence, held.arrival, &held.payload);
+                source.released = Some(held.sequence);
+                self.spare.put(held.payload);
+            }
+        }
+    }
+
+    /// When the next held packet is due, if any are held
+    pub fn next_deadline(&self) -> Option<Instant> {
+        self.sources
+            .values()
+            .flat_map(|source| source.held.iter())
+            .map(|held| held.arrival.at + self.delay)
+            .min()
+    }
+}
@@ -1,3 +1,19 @@
+#[macro_use]
+pub mod log;
+pub mod codec;
+pub mod registry;
+mod reactor;
+mod pmtu;
+mod channel;
+mod events;
+mod jitter;
+mod timer;
+mod pool;
+pub mod replication;
+pub mod capture;
+mod compress;
+mod pacing;
+
 pub mod client {
     include!("client/lib.rs");
 }
@@ -0,0 +1,672 @@
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+use std::hint::black_box;
+use std::io::ErrorKind;
+use std::net::{Ipv4Addr, SocketAddr, UdpSocket};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use project_neon::relay::types::*;
+use project_neon::capture::{CaptureReader, CaptureWriter, ReplayPace, RECORD_HEADER_SIZE};
+use project_neon::relay::NeonRelay;
+
+/// Counts heap allocations so the benchmarks can report them. Threads of the load
+/// generator itself opt out, which leaves only an in-process relay's allocations.
+struct CountingAllocator;
+
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+thread_local! {
+    static UNCOUNTED: Cell<bool> = const { Cell::new(false) };
+}
+
+fn count_allocation() {
+    if !UNCOUNTED.try_with(|uncounted| uncounted.get()).unwrap_or(true) {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// Stop counting allocations made by the calling thread
+fn exclude_thread() {
+    UNCOUNTED.with(|uncounted| uncounted.set(true));
+}
+
+fn allocations() -> u64 {
+    ALLOCATIONS.load(Ordering::Relaxed)
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        count_allocation();
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        count_allocation();
+        unsafe { System.alloc_zeroed(layout) }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        count_allocation();
+        unsafe { System.realloc(ptr, layout, new_size) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+/// Game packet type the simulated clients send
+const LOAD_PACKET_TYPE: u8 = 0x10;
+/// Client sequence u32 plus send time u64 at the front of every payload
+const STAMP_SIZE: usize = 12;
+
+struct Options {
+    relay_addr: SocketAddr,
+    sessions: usize,
+    clients_per_session: usize,
+    tick_rate: u32,
+    duration: Duration,
+    payload_size: usize,
+    threads: usize,
+    first_session: u32,
+    /// Run a relay inside the load generator, at relay_addr, to count its allocations
+    in_process: bool,
+}
+
+fn usage() {
+    println!("Usage: neon-loadgen [--relay <addr>] [--sessions <n>] [--clients <n per session>]");
+    println!("                    [--tick-rate <hz>] [--duration <secs>] [--payload <bytes>]");
+    println!("                    [--threads <n>] [--first-session <id>] [--in-process]");
+    println!("       neon-loadgen --bench-codec [--iterations <n>]");
+    println!("       neon-loadgen --bench-forward [--iterations <n>] [--payload <bytes>]");
+    println!("       neon-loadgen --replay <capture> [--max-speed]");
+}
+
+fn main() {
+    println!("Project Neon Protocol v0.2 - Load Generator");
+    println!("===========================================");
+
+    let mut options = Options {
+        relay_addr: "127.0.0.1:7777".parse().unwrap(),
+        sessions: 10,
+        clients_per_session: 10,
+        tick_rate: 30,
+        duration: Duration::from_secs(10),
+        payload_size: 64,
+        threads: 4,
+        first_session: 900_000,
+        in_process: false,
+    };
+    let mut bench_codec = false;
+    let mut bench_forward = false;
+    let mut iterations = None;
+    let mut replay = None;
+    let mut pace = ReplayPace::Original;
+
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+        let value = match arg.as_str() {
+            "--bench-codec" => {
+                bench_codec = true;
+                continue;
+            }
+            "--bench-forward" => {
+                bench_forward = true;
+                continue;
+            }
+            "--in-process" => {
+                options.in_process = true;
+                continue;
+            }
+            "--max-speed" => {
+                pace = ReplayPace::Max;
+                continue;
+            }
+            "--help" | "-h" => {
+                usage();
+                return;
+            }
+            _ => args.next(),
+        };
+        let Some(value) = value else {
+            println!("{} requires a value", arg);
+            usage();
+            return;
+        };
+
+        let parsed = match arg.as_str() {
+            "--relay" => value.parse().map(|addr| options.relay_addr = addr).is_ok(),
+            "--sessions" => value.parse().map(|n| options.sessions = n).is_ok(),
+            "--clients" => value.parse().map(|n| options.clients_per_session = n).is_ok(),
+            "--tick-rate" => value.parse().map(|n| options.tick_rate = n).is_ok(),
+            "--duration" => value.parse().map(|n| options.duration = Duration::from_secs(n)).is_ok(),
+            "--payload" => value.parse().map(|n| options.payload_size = n).is_ok(),
+            "--threads" => value.parse().map(|n| options.threads = n).is_ok(),
+            "--first-session" => value.parse().map(|n| options.first_session = n).is_ok(),
+            "--iterations" => value.parse().map(|n| iterations = Some(n)).is_ok(),
+            "--replay" => {
+                replay = Some(value.clone());
+                true
+            }
+            _ => {
+                println!("Unknown argument: {}", arg);
+                usage();
+                return;
+            }
+        };
+        if !parsed {
+            println!("Invalid value for {}: {}", arg, value);
+            return;
+        }
+    }
+
+    if bench_codec {
+        run_codec_bench(iterations.unwrap_or(1_000_000));
+        return;
+    }
+    if bench_forward {
+        if let Err(e) = run_forward_bench(iterations.unwrap_or(200_000), options.payload_size) {
+            println!("Forwarding benchmark failed: {}", e);
+        }
+        return;
+    }
+
+    if let Some(path) = replay {
+        if let Err(e) = run_replay(&path, pace) {
+            println!("Replay of {} failed: {}", path, e);
+        }
+        return;
+    }
+
+    if options.clients_per_session == 0 || options.clients_per_session > 254 {
+        println!("--clients must be between 1 and 254");
+        return;
+    }
+    options.threads = options.threads.clamp(1, options.sessions.max(1));
+    options.tick_rate = options.tick_rate.max(1);
+    options.payload_size = options.payload_size.max(STAMP_SIZE);
+
+    exclude_thread();
+    if options.in_process {
+        if let Err(e) = start_relay(options.relay_addr) {
+            println!("Failed to start relay on {}: {}", options.relay_addr, e);
+            return;
+        }
+    }
+
+    if let Err(e) = run_load(&options) {
+        println!("Load test failed: {}", e);
+    }
+}
+
+/// Run a relay on a background thread, the only thread whose allocations are counted
+fn start_relay(addr: SocketAddr) -> std::io::Result<()> {
+    project_neon::log::set_level(project_neon::log::Level::Warn);
+    let mut relay = NeonRelay::new(&addr.to_string())?;
+    std::thread::Builder::new().name("neon-relay".into()).spawn(move || {
+        if let Err(e) = relay.start() {
+            println!("Relay failed: {}", e);
+        }
+    })?;
+    Ok(())
+}
+
+/// Feed a relay capture through an in-process relay on this thread and report its
+/// throughput and allocations. Nothing is sent; the relay's output is only counted.
+fn run_replay(path: &str, pace: ReplayPace) -> std::io::Result<()> {
+    project_neon::log::set_level(project_neon::log::Level::Warn);
+    let mut relay = NeonRelay::new("127.0.0.1:0")?;
+    println!(
+        "Replaying {} {}",
+        path,
+        if pace == ReplayPace::Max { "as fast as possible" } else { "at the recorded pace" }
+    );
+
+    let allocations_before = allocations();
+    let stats = relay.replay(path, pace)?;
+    let relay_allocations = allocations() - allocations_before;
+    let seconds = stats.elapsed.as_secs_f64().max(f64::EPSILON);
+
+    println!();
+    println!("=== Results ===");
+    println!("In:        {} datagrams, {} bytes ({:.0} pps)", stats.datagrams_in, stats.bytes_in, stats.datagrams_in as f64 / seconds);
+    println!("Out:       {} datagrams, {} bytes ({:.0} pps)", stats.datagrams_out, stats.bytes_out, stats.datagrams_out as f64 / seconds);
+    println!("Elapsed:   {:.3}s ({:.1} ns per datagram in)", seconds, stats.elapsed.as_nanos() as f64 / stats.datagrams_in.max(1) as f64);
+    println!(
+        "Relay:     {} allocations ({:.4} per datagram in)",
+        relay_allocations,
+        relay_allocations as f64 / stats.datagrams_in.max(1) as f64
+    );
+    Ok(())
+}
+
+/// One simulated session: a host socket and one socket per client
+struct SimSession {
+    session_id: u32,
+    host: UdpSocket,
+    clients: Vec<(u8, UdpSocket)>,
+}
+
+#[derive(Default)]
+struct ThreadReport {
+    sent: u64,
+    received: u64,
+    latencies_ns: Vec<u64>,
+}
+
+fn encode(packet_type: u8, client_id: u8, destination_id: u8, sequence: u16, payload: &[u8], buf: &mut Vec<u8>) {
+    buf.clear();
+    PacketHeader {
+        magic: 0x4E45,
+        version: PROTOCOL_VERSION,
+        packet_type,
+        sequence,
+        client_id,
+        destination_id,
+    }
+    .write_to(buf);
+    buf.extend_from_slice(payload);
+}
+
+/// Register a peer with the relay the way a client confirms its ConnectAccept.
+/// This skips the host admission round trip, which the load test doesn't measure.
+fn register(socket: &UdpSocket, relay_addr: SocketAddr, session_id: u32, client_id: u8) -> std::io::Result<()> {
+    let payload = PacketPayload::ConnectAccept(ConnectAccept {
+        assigned_client_id: client_id,
+        session_id,
+        peer_timeout_ms: 0,
+        request_nonce: 0,
+        resume_token: 0,
+    })
+    .to_bytes();
+    let mut buf = Vec::new();
+    encode(CorePacketType::ConnectAccept as u8, client_id, 1, 2, &payload, &mut buf);
+    socket.send_to(&buf, relay_addr)?;
+    Ok(())
+}
+
+fn bind_peer() -> std::io::Result<UdpSocket> {
+    let socket = UdpSocket::bind("0.0.0.0:0")?;
+    socket.set_nonblocking(true)?;
+    Ok(socket)
+}
+
+fn run_load(options: &Options) -> std::io::Result<()> {
+    let total_clients = options.sessions * options.clients_per_session;
+    println!(
+        "Simulating {} clients in {} sessions at {} Hz for {}s via {} ({} byte payloads, {} threads)",
+        total_clients,
+        options.sessions,
+        options.tick_rate,
+        options.duration.as_secs(),
+        options.relay_addr,
+        options.payload_size,
+        options.threads
+    );
+
+    let mut sessions = Vec::with_capacity(options.sessions);
+    for index in 0..options.sessions {
+        let session_id = options.first_session + index as u32;
+        let host = bind_peer()?;
+        let clients = (0..options.clients_per_session)
+            .map(|client| Ok((client as u8 + 2, bind_peer()?)))
+            .collect::<std::io::Result<Vec<_>>>()?;
+        sessions.push(SimSession { session_id, host, clients });
+    }
+
+    // Registrations are fire-and-forget. Pace them so a burst doesn't overflow the
+    // relay's receive buffer, and send them twice since re-registering is harmless.
+    for _ in 0..2 {
+        for session in &sessions {
+            register(&session.host, options.relay_addr, session.session_id, 1)?;
+            for (client_id, socket) in &session.clients {
+                register(socket, options.relay_addr, session.session_id, *client_id)?;
+            }
+            std::thread::sleep(Duration::from_millis(2));
+        }
+        std::thread::sleep(Duration::from_millis(200));
+    }
+
+    let epoch = Instant::now();
+    // Registration sets up sessions, so only count what the relay allocates from here on
+    let allocations_before = allocations();
+    let per_thread = sessions.len().div_ceil(options.threads);
+    let mut handles = Vec::new();
+    while !sessions.is_empty() {
+        let chunk: Vec<SimSession> = sessions.drain(..per_thread.min(sessions.len())).collect();
+        let (relay_addr, tick_rate, duration, payload_size) =
+            (options.relay_addr, options.tick_rate, options.duration, options.payload_size);
+        handles.push(std::thread::spawn(move || {
+            exclude_thread();
+            drive(chunk, relay_addr, tick_rate, duration, payload_size, epoch)
+        }));
+    }
+
+    let mut report = ThreadReport::default();
+    for handle in handles {
+        let thread_report = handle.join().expect("load thread panicked")?;
+        report.sent += thread_report.sent;
+        report.received += thread_report.received;
+        report.latencies_ns.extend(thread_report.latencies_ns);
+    }
+
+    print_report(options, &mut report);
+    if options.in_process {
+        let relay_allocations = allocations() - allocations_before;
+        println!(
+            "Relay:     {} allocations ({:.4} per forwarded packet)",
+            relay_allocations,
+            relay_allocations as f64 / report.received.max(1) as f64
+        );
+    }
+    Ok(())
+}
+
+/// Send one packet per client per tick and measure delivery at the hosts
+fn drive(
+    sessions: Vec<SimSession>,
+    relay_addr: SocketAddr,
+    tick_rate: u32,
+    duration: Duration,
+    payload_size: usize,
+    epoch: Instant,
+) -> std::io::Result<ThreadReport> {
+    let mut report = ThreadReport::default();
+    let tick = Duration::from_secs(1) / tick_rate;
+    let mut payload = vec![0u8; payload_size];
+    let mut send_buf = Vec::with_capacity(PACKET_HEADER_SIZE + payload_size);
+    let mut recv_buf = vec![0u8; MAX_DATAGRAM_SIZE];
+
+    let start = Instant::now();
+    // Keep receiving a little after the last send so in-flight packets aren't counted as lost
+    let stop_receiving = start + duration + Duration::from_millis(500);
+    // Real clients aren't in lockstep, so spread the sessions evenly across each tick
+    let mut next_send: Vec<Instant> =
+        (0..sessions.len()).map(|index| start + tick * index as u32 / sessions.len() as u32).collect();
+    let mut sequences = vec![0u32; sessions.len()];
+
+    loop {
+        let now = Instant::now();
+        for (index, session) in sessions.iter().enumerate() {
+            if now < next_send[index] || now >= start + duration {
+                continue;
+            }
+            let sequence = sequences[index];
+            for (client_id, socket) in &session.clients {
+                let sent_at = epoch.elapsed().as_nanos() as u64;
+                payload[..4].copy_from_slice(&sequence.to_le_bytes());
+                payload[4..STAMP_SIZE].copy_from_slice(&sent_at.to_le_bytes());
+                encode(LOAD_PACKET_TYPE, *client_id, 1, sequence as u16, &payload, &mut send_buf);
+                match socket.send_to(&send_buf, relay_addr) {
+                    Ok(_) => report.sent += 1,
+                    Err(e) if e.kind() == ErrorKind::WouldBlock => {}
+                    Err(e) => return Err(e),
+                }
+            }
+            sequences[index] = sequence.wrapping_add(1);
+            next_send[index] += tick;
+        }
+
+        for session in &sessions {
+            loop {
+                match session.host.recv_from(&mut recv_buf) {
+                    Ok((size, _)) => {
+                        if size >= PACKET_HEADER_SIZE + STAMP_SIZE && recv_buf[3] == LOAD_PACKET_TYPE {
+                            let stamp = &recv_buf[PACKET_HEADER_SIZE + 4..PACKET_HEADER_SIZE + STAMP_SIZE];
+                            let sent_at = u64::from_le_bytes(stamp.try_into().unwrap());
+                            let received_at = epoch.elapsed().as_nanos() as u64;
+                            report.latencies_ns.push(received_at.saturating_sub(sent_at));
+                            report.received += 1;
+                        }
+                    }
+                    Err(e) if e.kind() == ErrorKind::WouldBlock => break,
+                    Err(e) => {
+                        println!("Host socket for session {} failed: {}", session.session_id, e);
+                        break;
+                    }
+                }
+            }
+        }
+
+        let now = Instant::now();
+        if now >= stop_receiving {
+            return Ok(report);
+        }
+        let next_tick = next_send.iter().min().copied().unwrap_or(stop_receiving);
+        let wake = if now < start + duration { next_tick.min(stop_receiving) } else { stop_receiving };
+        wait_for_hosts(&sessions, wake.saturating_duration_since(now));
+    }
+}
+
+/// Sleep until a host socket is readable or `timeout` passes
+#[cfg(unix)]
+fn wait_for_hosts(sessions: &[SimSession], timeout: Duration) {
+    use std::os::unix::io::AsRawFd;
+
+    let mut fds: Vec<libc::pollfd> = sessions
+        .iter()
+        .map(|session| libc::pollfd { fd: session.host.as_raw_fd(), events: libc::POLLIN, revents: 0 })
+        .collect();
+    let timeout_ms = timeout.as_nanos().div_ceil(1_000_000).min(i32::MAX as u128) as libc::c_int;
+    unsafe {
+        libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, timeout_ms);
+    }
+}
+
+#[cfg(not(unix))]
+fn wait_for_hosts(_sessions: &[SimSession], timeout: Duration) {
+    std::thread::sleep(timeout.min(Duration::from_millis(1)));
+}
+
+fn percentile(sorted: &[u64], fraction: f64) -> f64 {
+    if sorted.is_empty() {
+        return 0.0;
+    }
+    let index = ((sorted.len() as f64 * fraction).ceil() as usize).clamp(1, sorted.len()) - 1;
+    sorted[index] as f64 / 1000.0
+}
+
+fn print_report(options: &Options, report: &mut ThreadReport) {
+    let seconds = options.duration.as_secs_f64().max(f64::EPSILON);
+    let loss = if report.sent == 0 { 0.0 } else { 100.0 * (1.0 - report.received as f64 / report.sent as f64) };
+    report.latencies_ns.sort_unstable();
+
+    println!();
+    println!("=== Results ===");
+    println!("Sent:      {} packets ({:.0} pps)", report.sent, report.sent as f64 / seconds);
+    println!("Received:  {} packets ({:.0} pps)", report.received, report.received as f64 / seconds);
+    println!("Loss:      {:.3}%", loss.max(0.0));
+    println!(
+        "Latency:   p50 {:.1}us  p99 {:.1}us  p999 {:.1}us  max {:.1}us",
+        percentile(&report.latencies_ns, 0.50),
+        percentile(&report.latencies_ns, 0.99),
+        percentile(&report.latencies_ns, 0.999),
+        percentile(&report.latencies_ns, 1.0)
+    );
+}
+
+/// Time `iterations` runs of `op` and print the average cost and allocation count
+fn bench<T>(name: &str, iterations: u64, mut op: impl FnMut() -> T) {
+    for _ in 0..iterations / 10 {
+        black_box(op());
+    }
+    let allocations_before = allocations();
+    let start = Instant::now();
+    for _ in 0..iterations {
+        black_box(op());
+    }
+    let per_op = start.elapsed().as_nanos() as f64 / iterations as f64;
+    let allocs = (allocations() - allocations_before) as f64 / iterations.max(1) as f64;
+    println!("{:<44} {:>9.1} ns/op {:>6.2} allocs/op", name, per_op, allocs);
+}
+
+fn run_codec_bench(iterations: u64) {
+    println!("Codec micro-benchmarks, {} iterations each", iterations);
+    println!();
+
+    let header = PacketHeader {
+        magic: 0x4E45,
+        version: PROTOCOL_VERSION,
+        packet_type: LOAD_PACKET_TYPE,
+        sequence: 42,
+        client_id: 2,
+        destination_id: 1,
+    };
+    let header_bytes = header.to_bytes();
+    let mut buf = Vec::with_capacity(64);
+
+    bench("PacketHeader::to_bytes", iterations, || black_box(&header).to_bytes());
+    bench("PacketHeader::write_to (reused buf)", iterations, || {
+        buf.clear();
+        black_box(&header).write_to(&mut buf);
+        buf.len()
+    });
+    let mut out = [0u8; PACKET_HEADER_SIZE];
+    bench("PacketHeader::encode (fixed buf)", iterations, || black_box(&header).encode(&mut out).ok());
+    bench("PacketHeader::from_bytes", iterations, || PacketHeader::from_bytes(black_box(&header_bytes)).is_ok());
+
+    let payloads = [
+        ("ConnectRequest", PacketPayload::ConnectRequest(ConnectRequest {
+            client_version: PROTOCOL_VERSION,
+            desired_name: "LoadTestClient".to_string(),
+            target_session_id: 12345,
+            game_identifier: 0xC0FFEE,
+            request_nonce: 0x1234_5678,
+        })),
+        ("ConnectAccept", PacketPayload::ConnectAccept(ConnectAccept { assigned_client_id: 2, session_id: 12345, peer_timeout_ms: 0, request_nonce: 0x1234_5678, resume_token: 0x0123_4567_89AB_CDEF })),
+        ("Ack", PacketPayload::Ack(Ack { channel: 3, sequence: 100, ack_bits: 0xFFFF_0000 })),
+        ("Ping", PacketPayload::Ping(Ping { timestamp: 1_700_000_000_000 })),
+    ];
+    for (name, payload) in &payloads {
+        let packet_type = match payload {
+            PacketPayload::ConnectRequest(_) => CorePacketType::ConnectRequest as u8,
+            PacketPayload::ConnectAccept(_) => CorePacketType::ConnectAccept as u8,
+            PacketPayload::Ack(_) => CorePacketType::Ack as u8,
+            _ => CorePacketType::Ping as u8,
+        };
+        let bytes = payload.to_bytes();
+        bench(&format!("PacketPayload::to_bytes ({})", name), iterations, || black_box(payload).to_bytes());
+        bench(&format!("PacketPayload::from_bytes ({})", name), iterations, || {
+            PacketPayload::from_bytes(packet_type, black_box(&bytes)).is_ok()
+        });
+        let mut out = [0u8; 64];
+        bench(&format!("PacketPayload::encode ({})", name), iterations, || black_box(payload).encode(&mut out).ok());
+        bench(&format!("PayloadView::parse ({})", name), iterations, || {
+            PayloadView::parse(packet_type, black_box(&bytes)).is_ok()
+        });
+    }
+}
+
+/// Sessions and clients per session the forwarding benchmark runs with
+const FORWARD_CASES: [(usize, usize); 7] = [(1, 1), (1, 16), (1, 64), (1, 254), (16, 16), (256, 16), (1024, 4)];
+
+/// Time the relay's forwarding path, unicast to the host and broadcast from it,
+/// across session and peer counts. Each case replays `datagrams` synthetic
+/// datagrams through an in-process relay, so no sockets are involved.
+fn run_forward_bench(datagrams: u64, payload_size: usize) -> std::io::Result<()> {
+    project_neon::log::set_level(project_neon::log::Level::Warn);
+    println!("Relay forwarding benchmarks, {} datagrams of {} bytes per case", datagrams, payload_size);
+    println!();
+    println!("{:<10} {:>8} {:>8} {:>12} {:>12} {:>10}", "traffic", "sessions", "clients", "ns/in", "ns/out", "allocs/in");
+
+    for (sessions, clients) in FORWARD_CASES {
+        for broadcast in [false, true] {
+            bench_forward_case(sessions, clients, broadcast, datagrams, payload_size)?;
+        }
+    }
+    Ok(())
+}
+
+/// Address of a simulated peer, unique per session and client id
+fn sim_addr(session: usize, client_id: u8) -> SocketAddr {
+    SocketAddr::from((Ipv4Addr::new(10, (session >> 8) as u8, session as u8, client_id), 40_000))
+}
+
+fn bench_forward_case(sessions: usize, clients: usize, broadcast: bool, datagrams: u64, payload_size: usize) -> std::io::Result<()> {
+    let dir = std::env::temp_dir();
+    let setup_path = dir.join(format!("neon-bench-forward-{}-setup.cap", std::process::id())).to_string_lossy().into_owned();
+    let traffic_path = dir.join(format!("neon-bench-forward-{}-traffic.cap", std::process::id())).to_string_lossy().into_owned();
+
+    // Hosts register before their clients, as they would for real
+    let peers = sessions * (clients + 1);
+    write_capture(&setup_path, peers as u64, |index, buf| {
+        let (session, peer) = (index as usize / (clients + 1), (index as usize % (clients + 1)) as u8 + 1);
+        let session_id = 900_000 + session as u32;
+        let payload = PacketPayload::ConnectAccept(ConnectAccept {
+            assigned_client_id: peer,
+            session_id,
+            peer_timeout_ms: 0,
+            request_nonce: 0,
+            resume_token: 0,
+        })
+        .to_bytes();
+        encode(CorePacketType::ConnectAccept as u8, peer, 1, 0, &payload, buf);
+        sim_addr(session, peer)
+    })?;
+
+    // Every session in turn, cycling through its clients
+    let payload = vec![0u8; payload_size];
+    write_capture(&traffic_path, datagrams, |index, buf| {
+        let session = index as usize % sessions;
+        let (from, to) = if broadcast {
+            (1, BROADCAST_ID)
+        } else {
+            ((index as usize / sessions % clients) as u8 + 2, 1)
+        };
+        encode(LOAD_PACKET_TYPE, from, to, index as u16, &payload, buf);
+        sim_addr(session, from)
+    })?;
+
+    let mut relay = NeonRelay::new("127.0.0.1:0")?;
+    relay.replay(&setup_path, ReplayPace::Max)?;
+    relay.replay(&traffic_path, ReplayPace::Max)?;
+
+    // Replay times reading the capture back too, so that is timed on its own and taken out
+    let read_start = Instant::now();
+    let mut reader = CaptureReader::open(&traffic_path)?;
+    let mut datagram = Vec::with_capacity(MAX_DATAGRAM_SIZE);
+    while reader.next_record(&mut datagram)?.is_some() {
+        black_box(&datagram);
+    }
+    let read = read_start.elapsed();
+
+    let allocations_before = allocations();
+    let stats = relay.replay(&traffic_path, ReplayPace::Max)?;
+    let relay_allocations = allocations() - allocations_before;
+    let _ = std::fs::remove_file(&setup_path);
+    let _ = std::fs::remove_file(&traffic_path);
+
+    let forwarding = stats.elapsed.saturating_sub(read).as_nanos() as f64;
+    println!(
+        "{:<10} {:>8} {:>8} {:>12.1} {:>12.1} {:>10.4}",
+        if broadcast { "broadcast" } else { "to host" },
+        sessions,
+        clients,
+        forwarding / stats.datagrams_in.max(1) as f64,
+        forwarding / stats.datagrams_out.max(1) as f64,
+        relay_allocations as f64 / stats.datagrams_in.max(1) as f64
+    );
+    Ok(())
+}
+
+/// Write a capture of `count` datagrams, each built into the buffer by `datagram`,
+/// which returns the address it arrives from
+fn write_capture(path: &str, count: u64, mut datagram: impl FnMut(u64, &mut Vec<u8>) -> SocketAddr) -> std::io::Result<()> {
+    let mut buf = Vec::with_capacity(MAX_DATAGRAM_SIZE);
+    datagram(0, &mut buf);
+    // Room for every record, so none are dropped while the writer catches up
+    let mut capture = CaptureWriter::with_ring_size(path, count as usize * (RECORD_HEADER_SIZE + buf.len()))?;
+    let at = Instant::now();
+    for index in 0..count {
+        let addr = datagram(index, &mut buf);
+        capture.record(at, addr, &buf);
+    }
+    if capture.dropped() > 0 {
+        return Err(std::io::Error::other("Capture ring overflowed"));
+    }
+    Ok(())
+}
@@ -0,0 +1,382 @@
+use std::cell::UnsafeCell;
+use std::fmt::{self, Write};
+use std::io::Write as _;
+use std::sync::atomic::{AtomicBool, AtomicU8, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Mutex, OnceLock};
+use std::thread::{self, Thread};
+use std::time::{Duration, Instant};
+
+/// Severity of a log message. A message is kept when it is at or below the current level.
+#[repr(u8)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum Level {
+    /// Only valid as a filter: nothing is logged
+    Off = 0,
+    Error = 1,
+    Warn = 2,
+    Info = 3,
+    Debug = 4,
+    Trace = 5,
+}
+
+impl Level {
+    pub fn from_u8(value: u8) -> Option<Self> {
+        match value {
+            0 => Some(Level::Off),
+            1 => Some(Level::Error),
+            2 => Some(Level::Warn),
+            3 => Some(Level::Info),
+            4 => Some(Level::Debug),
+            5 => Some(Level::Trace),
+            _ => None,
+        }
+    }
+
+    pub fn from_name(name: &str) -> Option<Self> {
+        match name.to_ascii_lowercase().as_str() {
+            "off" => Some(Level::Off),
+            "error" => Some(Level::Error),
+            "warn" => Some(Level::Warn),
+            "info" => Some(Level::Info),
+            "debug" => Some(Level::Debug),
+            "trace" => Some(Level::Trace),
+            _ => None,
+        }
+    }
+
+    fn label(self) -> &'static str {
+        match self {
+            Level::Off => "OFF",
+            Level::Error => "ERROR",
+            Level::Warn => "WARN",
+            Level::Info => "INFO",
+            Level::Debug => "DEBUG",
+            Level::Trace => "TRACE",
+        }
+    }
+}
+
+/// Messages longer than this are truncated
+pub const MESSAGE_SIZE: usize = 256;
+/// Messages that can wait for the logger thread; further ones are dropped and counted
+const QUEUE_SIZE: usize = 1024;
+
+/// Receives every message on the logger thread
+pub type Sink = Box<dyn FnMut(Level, &str) + Send>;
+
+static MAX_LEVEL: AtomicU8 = AtomicU8::new(Level::Info as u8);
+static LOGGER: OnceLock<Logger> = OnceLock::new();
+static SINK: Mutex<Option<Sink>> = Mutex::new(None);
+
+/// Set the most verbose level that is logged
+pub fn set_level(level: Level) {
+    MAX_LEVEL.store(level as u8, Ordering::Relaxed);
+}
+
+pub fn level() -> Level {
+    Level::from_u8(MAX_LEVEL.load(Ordering::Relaxed)).unwrap_or(Level::Off)
+}
+
+/// Check whether a message at `level` would be kept, before paying for formatting it
+#[inline]
+pub fn enabled(level: Level) -> bool {
+    level != Level::Off && level as u8 <= MAX_LEVEL.load(Ordering::Relaxed)
+}
+
+/// Send messages to `sink` instead of stdout. `None` restores stdout.
+pub fn set_sink(sink: Option<Sink>) {
+    *SINK.lock().unwrap() = sink;
+}
+
+/// Format a message straight into a free queue slot for the logger thread.
+/// Never blocks: when the queue is full the message is dropped and counted.
+pub fn write(level: Level, args: fmt::Arguments) {
+    let logger = LOGGER.get_or_init(Logger::start);
+    if !logger.queue.push(level, args) {
+        logger.queue.dropped.fetch_add(1, Ordering::Relaxed);
+        return;
+    }
+    if logger.sleeping.swap(false, Ordering::AcqRel) {
+        logger.thread.unpark();
+    }
+}
+
+/// Wait up to `timeout` for the logger thread to hand every queued message to the sink
+pub fn flush(timeout: Duration) {
+    let Some(logger) = LOGGER.get() else {
+        return;
+    };
+    let deadline = Instant::now() + timeout;
+    while !logger.queue.is_drained() && Instant::now() < deadline {
+        logger.thread.unpark();
+        thread::sleep(Duration::from_millis(1));
+    }
+}
+
+/// Lets at most `per_second` messages through each second and counts the rest,
+/// so a flood of bad packets costs one atomic check per packet
+pub struct RateLimit {
+    per_second: u32,
+    window: AtomicU64,
+    count: AtomicU32,
+    suppressed: AtomicU32,
+}
+
+impl RateLimit {
+    pub const fn new(per_second: u32) -> Self {
+        RateLimit {
+            per_second,
+            window: AtomicU64::new(0),
+            count: AtomicU32::new(0),
+            suppressed: AtomicU32::new(0),
+        }
+    }
+
+    /// Returns the number of messages suppressed since the last one let through,
+    /// or None if this one should be suppressed too
+    pub fn check(&self) -> Option<u32> {
+        let now = epoch().elapsed().as_secs() + 1;
+        let window = self.window.load(Ordering::Relaxed);
+        if window != now && self.window.compare_exchange(window, now, Ordering::Relaxed, Ordering::Relaxed).is_ok() {
+            self.count.store(0, Ordering::Relaxed);
+        }
+
+        if self.count.fetch_add(1, Ordering::Relaxed) < self.per_second {
+            Some(self.suppressed.swap(0, Ordering::Relaxed))
+        } else {
+            self.suppressed.fetch_add(1, Ordering::Relaxed);
+            None
+        }
+    }
+}
+
+fn epoch() -> Instant {
+    static EPOCH: OnceLock<Instant> = OnceLock::new();
+    *EPOCH.get_or_init(Instant::now)
+}
+
+/// Log at `level` if it is enabled
+macro_rules! log_at {
+    ($level:expr, $($arg:tt)+) => {
+        if $crate::log::enabled($level) {
+            $crate::log::write($level, format_args!($($arg)+));
+        }
+    };
+}
+
+macro_rules! log_error {
+    ($($arg:tt)+) => { log_at!($crate::log::Level::Error, $($arg)+) };
+}
+
+macro_rules! log_warn {
+    ($($arg:tt)+) => { log_at!($crate::log::Level::Warn, $($arg)+) };
+}
+
+macro_rules! log_info {
+    ($($arg:tt)+) => { log_at!($crate::log::Level::Info, $($arg)+) };
+}
+
+macro_rules! log_debug {
+    ($($arg:tt)+) => { log_at!($crate::log::Level::Debug, $($arg)+) };
+}
+
+/// Log at `level`, letting at most `per_second` messages from this call site through
+/// each second. The next message let through reports how many were suppressed.
+macro_rules! log_limited {
+    ($level:expr, $per_second:expr, $($arg:tt)+) => {
+        if $crate::log::enabled($level) {
+            static LIMIT: $crate::log::RateLimit = $crate::log::RateLimit::new($per_second);
+            match LIMIT.check() {
+                Some(0) => $crate::log::write($level, format_args!($($arg)+)),
+                Some(suppressed) => $crate::log::write(
+                    $level,
+                    format_args!("{} ({} similar messages suppressed)", format_args!($($arg)+), suppressed),
+                ),
+                None => {}
+            }
+        }
+    };
+}
+
+struct Logger {
+    queue: Queue,
+    thread: Thread,
+    sleeping: AtomicBool,
+}
+
+impl Logger {
+    fn start() -> Logger {
+        let handle = thread::Builder::new()
+            .name("neon-log".to_string())
+            .spawn(drain_forever)
+            .expect("failed to spawn logger thread");
+
+        Logger {
+            queue: Queue::new(),
+            thread: handle.thread().clone(),
+            sleeping: AtomicBool::new(false),
+        }
+    }
+}
+
+fn drain_forever() {
+    // The logger is published once start() returns, before any message is queued
+    let logger = loop {
+        if let Some(logger) = LOGGER.get() {
+            break logger;
+        }
+        thread::park_timeout(Duration::from_millis(1));
+    };
+
+    let mut text = [0u8; MESSAGE_SIZE];
+    let mut reported_drops = 0;
+
+    loop {
+        let mut sink = SINK.lock().unwrap();
+        let stdout = std::io::stdout();
+        let mut out = stdout.lock();
+
+        while let Some((level, len)) = logger.queue.pop(&mut text) {
+            let message = std::str::from_utf8(&text[..len]).unwrap_or("<invalid log message>");
+            match sink.as_mut() {
+                Some(sink) => sink(level, message),
+                None => {
+                    let _ = writeln!(out, "[{}] {}", level.label(), message);
+                }
+            }
+        }
+
+        let dropped = logger.queue.dropped.load(Ordering::Relaxed);
+        if dropped != reported_drops {
+            let message = format!("Log queue full, dropped {} messages", dropped - reported_drops);
+            match sink.as_mut() {
+                Some(sink) => sink(Level::Warn, &message),
+                None => {
+                    let _ = writeln!(out, "[{}] {}", Level::Warn.label(), message);
+                }
+            }
+            reported_drops = dropped;
+        }
+
+        let _ = out.flush();
+        drop(out);
+        drop(sink);
+
+        logger.sleeping.store(true, Ordering::Release);
+        // A message queued before `sleeping` was set would otherwise wait for the timeout
+        if logger.queue.is_drained() {
+            thread::park_timeout(Duration::from_millis(100));
+        }
+        logger.sleeping.store(false, Ordering::Release);
+    }
+}
+
+struct Slot {
+    /// Equals the queue position when free for that position, position + 1 once filled
+    sequence: AtomicUsize,
+    level: UnsafeCell<Level>,
+    len: UnsafeCell<usize>,
+    text: UnsafeCell<[u8; MESSAGE_SIZE]>,
+}
+
+/// Bounded multi-producer, single-consumer ring of fixed-size messages.
+/// Producers claim a slot with one compare-and-swap and format into it in place.
+struct Queue {
+    slots: Box<[Slot]>,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    dropped: AtomicU64,
+}
+
+// Slots are only touched by the producer that claimed them or by the single consumer,
+// handed over through each slot's sequence number
+unsafe impl Sync for Queue {}
+
+impl Queue {
+    fn new() -> Self {
+        Queue {
+            slots: (0..QUEUE_SIZE)
+                .map(|i| Slot {
+                    sequence: AtomicUsize::new(i),
+                    level: UnsafeCell::new(Level::Off),
+                    len: UnsafeCell::new(0),
+                    text: UnsafeCell::new([0; MESSAGE_SIZE]),
+                })
+                .collect(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            dropped: AtomicU64::new(0),
+        }
+    }
+
+    fn push(&self, level: Level, args: fmt::Arguments) -> bool {
+        let mut pos = self.head.load(Ordering::Relaxed);
+        let slot = loop {
+            let slot = &self.slots[pos % QUEUE_SIZE];
+            let sequence = slot.sequence.load(Ordering::Acquire);
+
+            if sequence == pos {
+                match self.head.compare_exchange_weak(pos, pos + 1, Ordering::Relaxed, Ordering::Relaxed) {
+                    Ok(_) => break slot,
+                    Err(current) => pos = current,
+                }
+            } else if sequence < pos {
+                // The consumer hasn't freed this slot yet: the queue is full
+                return false;
+            } else {
+                pos = self.head.load(Ordering::Relaxed);
+            }
+        };
+
+        unsafe {
+            let mut writer = SlotWriter { text: &mut *slot.text.get(), len: 0 };
+            let _ = writer.write_fmt(args);
+            *slot.len.get() = writer.len;
+            *slot.level.get() = level;
+        }
+        slot.sequence.store(pos + 1, Ordering::Release);
+        true
+    }
+
+    /// Copy the oldest message into `text`, returning its level and length
+    fn pop(&self, text: &mut [u8; MESSAGE_SIZE]) -> Option<(Level, usize)> {
+        let pos = self.tail.load(Ordering::Relaxed);
+        let slot = &self.slots[pos % QUEUE_SIZE];
+        if slot.sequence.load(Ordering::Acquire) != pos + 1 {
+            return None;
+        }
+
+        let (level, len) = unsafe {
+            let len = *slot.len.get();
+            let stored = &*slot.text.get();
+            text[..len].copy_from_slice(&stored[..len]);
+            (*slot.level.get(), len)
+        };
+        slot.sequence.store(pos + QUEUE_SIZE, Ordering::Release);
+        self.tail.store(pos + 1, Ordering::Release);
+        Some((level, len))
+    }
+
+    fn is_drained(&self) -> bool {
+        self.tail.load(Ordering::Acquire) == self.head.load(Ordering::Acquire)
+    }
+}
+
+/// Formats into a slot's buffer, truncating at a character boundary when full
+struct SlotWriter<'a> {
+    text: &'a mut [u8; MESSAGE_SIZE],
+    len: usize,
+}
+
+impl Write for SlotWriter<'_> {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        let room = MESSAGE_SIZE - self.len;
+        let mut take = s.len().min(room);
+        while !s.is_char_boundary(take) {
+            take -= 1;
+        }
+        self.text[self.len..self.len + take].copy_from_slice(&s.as_bytes()[..take]);
+        self.len += take;
+        if take < s.len() { Err(fmt::Error) } else { Ok(()) }
+    }
+}
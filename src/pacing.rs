@@ -0,0 +1,186 @@
+//! Per-peer congestion control.
+//!
+//! Each peer gets a token bucket filled at the rate its link is estimated to carry.
+//! The estimate starts at INITIAL_RATE, grows while reliable traffic is acknowledged
+//! and is cut back when a reliable packet times out, at most once per round trip
+//! (AIMD). Every send is charged to the bucket; what happens when it runs dry
+//! depends on the packet's priority. Reliable traffic is never shed, only held in
+//! the channel backlog until the bucket recovers. State is shed once the bucket is
+//! empty, and cosmetic traffic as soon as it falls below half, which leaves the
+//! rest for the classes above it.
+//!
+//! Only the ack layer measures the link, so nothing is shed for a peer until some
+//! reliable traffic to it has been acknowledged or timed out; before that the rate
+//! is a guess. Game packet types are Reliable, never shed, unless given another
+//! priority.
+
+use std::io::{Error, ErrorKind};
+use std::time::{Duration, Instant};
+
+const INITIAL_RATE: u32 = 256 * 1024;
+const MIN_RATE: u32 = 16 * 1024;
+const MAX_RATE: u32 = 16 * 1024 * 1024;
+/// Bucket depth as time at the current rate: how large a burst goes out unpaced
+const BURST: Duration = Duration::from_millis(50);
+/// Smallest bucket, so a slow link still takes a few full datagrams at once
+const MIN_BURST: u32 = 4096;
+/// Share of the rate kept after a loss
+const DECREASE: f64 = 0.75;
+/// Gap between cuts when no round trip time has been measured yet
+const DEFAULT_LOSS_GAP: Duration = Duration::from_millis(100);
+
+/// How readily a packet is shed when its peer's link is congested
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+#[repr(u8)]
+pub enum Priority {
+    /// Never shed; reliable channel traffic is always this
+    Reliable = 0,
+    /// Shed once the bucket is empty, such as entity snapshots
+    State = 1,
+    /// Shed first, once less than half the bucket is left
+    Cosmetic = 2,
+}
+
+/// What a send returns when its packet was shed for lack of bandwidth
+pub fn shed_error() -> Error {
+    Error::new(ErrorKind::WouldBlock, "Packet shed, the link to the peer is congested")
+}
+
+impl Priority {
+    pub fn from_u8(value: u8) -> Option<Self> {
+        match value {
+            0 => Some(Priority::Reliable),
+            1 => Some(Priority::State),
+            2 => Some(Priority::Cosmetic),
+            _ => None,
+        }
+    }
+}
+
+/// What an endpoint knows about its link to one peer
+#[derive(Debug, Clone, Copy, Default)]
+pub struct LinkStats {
+    /// Smoothed round trip time, once a sample exists
+    pub rtt: Option<Duration>,
+    /// Smoothed share of reliable sends that timed out, 0 to 1
+    pub loss: f32,
+    /// Estimated bandwidth of the link, bytes per second. The initial guess until
+    /// reliable traffic to the peer has been acknowledged or lost.
+    pub send_rate: u32,
+    pub bytes_sent: u64,
+    /// Packets shed for lack of bandwidth, by priority
+    pub shed_state: u64,
+    pub shed_cosmetic: u64,
+}
+
+/// Token bucket and bandwidth estimate for one peer
+pub struct Pacer {
+    rate: u32,
+    /// Bytes that may go out now; negative while reliable traffic is in debt
+    tokens: f64,
+    refilled_at: Instant,
+    last_cut: Option<Instant>,
+    /// Whether the ack layer has reported on the link yet; shedding waits for it
+    measured: bool,
+    loss: f32,
+    bytes_sent: u64,
+    shed_state: u64,
+    shed_cosmetic: u64,
+}
+
+impl Pacer {
+    pub fn new() -> Self {
+        let rate = INITIAL_RATE;
+        Pacer {
+            rate,
+            tokens: burst(rate),
+            refilled_at: Instant::now(),
+            last_cut: None,
+            measured: false,
+            loss: 0.0,
+            bytes_sent: 0,
+            shed_state: 0,
+            shed_cosmetic: 0,
+        }
+    }
+
+    /// Charge a packet of `bytes` to the bucket, returning false if it should be shed
+    pub fn admit(&mut self, now: Instant, bytes: usize, priority: Priority) -> bool {
+        self.refill(now);
+        let admitted = match priority {
+            _ if !self.measured => true,
+            Priority::Reliable => true,
+            Priority::State => self.tokens > 0.0,
+            Priority::Cosmetic => self.tokens >= burst(self.rate) / 2.0,
+        };
+        if !admitted {
+            match priority {
+                Priority::Reliable => {}
+                Priority::State => self.shed_state += 1,
+                Priority::Cosmetic => self.shed_cosmetic += 1,
+            }
+            return false;
+        }
+        // Reliable debt is capped so one large burst doesn't starve the link for long
+        self.tokens = (self.tokens - bytes as f64).max(-burst(self.rate));
+        self.bytes_sent += bytes as u64;
+        true
+    }
+
+    /// Whether reliable traffic may leave now rather than wait in the backlog
+    pub fn has_tokens(&mut self, now: Instant) -> bool {
+        self.refill(now);
+        self.tokens > 0.0
+    }
+
+    /// When the bucket climbs out of debt, None if it isn't in debt
+    pub fn ready_at(&self) -> Option<Instant> {
+        (self.tokens <= 0.0).then(|| {
+            self.refilled_at + Duration::from_secs_f64((1.0 - self.tokens) / f64::from(self.rate))
+        })
+    }
+
+    /// `count` reliable packets were acknowledged: grow the rate by about one
+    /// percent per packet
+    pub fn on_delivered(&mut self, count: usize) {
+        self.measured |= count > 0;
+        self.loss *= 0.875f32.powi(count as i32);
+        let grown = f64::from(self.rate) * 1.01f64.powi(count as i32);
+        self.rate = grown.min(f64::from(MAX_RATE)) as u32;
+    }
+
+    /// A reliable packet timed out; cut the rate unless that already happened this round trip
+    pub fn on_lost(&mut self, now: Instant, rtt: Option<Duration>) {
+        self.measured = true;
+        self.loss = self.loss * 0.875 + 0.125;
+        let gap = rtt.unwrap_or(DEFAULT_LOSS_GAP);
+        if self.last_cut.is_some_and(|cut| now.duration_since(cut) < gap) {
+            return;
+        }
+        self.last_cut = Some(now);
+        self.refill(now);
+        self.rate = ((f64::from(self.rate) * DECREASE) as u32).max(MIN_RATE);
+        self.tokens = self.tokens.min(burst(self.rate));
+    }
+
+    pub fn stats(&self, rtt: Option<Duration>) -> LinkStats {
+        LinkStats {
+            rtt,
+            loss: self.loss,
+            send_rate: self.rate,
+            bytes_sent: self.bytes_sent,
+            shed_state: self.shed_state,
+            shed_cosmetic: self.shed_cosmetic,
+        }
+    }
+
+    fn refill(&mut self, now: Instant) {
+        let elapsed = now.saturating_duration_since(self.refilled_at).as_secs_f64();
+        self.tokens = (self.tokens + elapsed * f64::from(self.rate)).min(burst(self.rate));
+        self.refilled_at = now;
+    }
+}
+
+fn burst(rate: u32) -> f64 {
+    (f64::from(rate) * BURST.as_secs_f64()).max(f64::from(MIN_BURST))
+}
@@ -0,0 +1,50 @@
+use std::io::Error;
+use std::net::SocketAddr;
+
+/// IP and UDP header bytes that come out of the link MTU
+const IPV4_UDP_OVERHEAD: usize = 20 + 8;
+const IPV6_UDP_OVERHEAD: usize = 40 + 8;
+
+/// Ask the kernel for the path MTU towards `dest` and return the largest UDP
+/// payload that fits in one unfragmented datagram. A throwaway socket is
+/// connected with the don't-fragment policy so the caller's socket is untouched.
+#[cfg(target_os = "linux")]
+pub fn max_udp_payload(dest: SocketAddr) -> Result<usize, Error> {
+    use std::net::UdpSocket;
+    use std::os::unix::io::AsRawFd;
+
+    let (bind_addr, level, discover, mtu_option, overhead) = match dest {
+        SocketAddr::V4(_) => ("0.0.0.0:0", libc::IPPROTO_IP, libc::IP_MTU_DISCOVER, libc::IP_MTU, IPV4_UDP_OVERHEAD),
+        SocketAddr::V6(_) => ("[::]:0", libc::IPPROTO_IPV6, libc::IPV6_MTU_DISCOVER, libc::IPV6_MTU, IPV6_UDP_OVERHEAD),
+    };
+
+    let socket = UdpSocket::bind(bind_addr)?;
+    let fd = socket.as_raw_fd();
+    let int_len = std::mem::size_of::<libc::c_int>() as libc::socklen_t;
+
+    let policy: libc::c_int = libc::IP_PMTUDISC_DO;
+    let result = unsafe {
+        libc::setsockopt(fd, level, discover, &policy as *const _ as *const libc::c_void, int_len)
+    };
+    if result < 0 {
+        return Err(Error::last_os_error());
+    }
+
+    socket.connect(dest)?;
+
+    let mut mtu: libc::c_int = 0;
+    let mut len = int_len;
+    let result = unsafe {
+        libc::getsockopt(fd, level, mtu_option, &mut mtu as *mut _ as *mut libc::c_void, &mut len)
+    };
+    if result < 0 {
+        return Err(Error::last_os_error());
+    }
+
+    Ok((mtu as usize).saturating_sub(overhead))
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn max_udp_payload(_dest: SocketAddr) -> Result<usize, Error> {
+    Err(Error::new(std::io::ErrorKind::Unsupported, "Path MTU probing is not available on this platform"))
+}
@@ -0,0 +1,47 @@
+//! Free list of byte buffers.
+//!
+//! Frames that outlive a call (reliable packets waiting for their ack, ordered
+//! packets waiting for a gap to fill, jitter-delayed payloads) take their storage
+//! from a pool and give it back when done, so once traffic has warmed the pool up
+//! the send and receive paths stop calling the allocator.
+
+/// Buffers kept by default; more than a full window on every channel of a few peers
+pub const DEFAULT_POOL_LIMIT: usize = 256;
+
+pub struct BufferPool {
+    free: Vec<Vec<u8>>,
+    /// Most buffers kept, anything returned past this is freed
+    limit: usize,
+}
+
+impl Default for BufferPool {
+    fn default() -> Self {
+        Self::new(DEFAULT_POOL_LIMIT)
+    }
+}
+
+impl BufferPool {
+    pub fn new(limit: usize) -> Self {
+        Self { free: Vec::with_capacity(limit), limit }
+    }
+
+    /// An empty buffer, reused when one is free
+    pub fn take(&mut self) -> Vec<u8> {
+        self.free.pop().unwrap_or_default()
+    }
+
+    /// An empty buffer holding a copy of `bytes`
+    pub fn copy_of(&mut self, bytes: &[u8]) -> Vec<u8> {
+        let mut buffer = self.take();
+        buffer.extend_from_slice(bytes);
+        buffer
+    }
+
+    /// Hand a buffer back for reuse
+    pub fn put(&mut self, mut buffer: Vec<u8>) {
+        if buffer.capacity() > 0 && self.free.len() < self.limit {
+            buffer.clear();
+            self.free.push(buffer);
+        }
+    }
+}
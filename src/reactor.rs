@@ -0,0 +1,52 @@
+use std::io::Error;
+use std::net::UdpSocket;
+use std::time::Duration;
+
+/// Block until `socket` has a datagram to read or `timeout` elapses.
+/// `None` waits indefinitely. Returns true when the socket is readable.
+pub fn wait_readable(socket: &UdpSocket, timeout: Option<Duration>) -> Result<bool, Error> {
+    wait_readable_any(&[socket], timeout)
+}
+
+/// Largest number of sockets a single wait can watch
+pub const MAX_WAIT_SOCKETS: usize = 4;
+
+/// Block until any of `sockets` has a datagram to read or `timeout` elapses.
+/// Returns true when at least one socket is readable.
+#[cfg(unix)]
+pub fn wait_readable_any(sockets: &[&UdpSocket], timeout: Option<Duration>) -> Result<bool, Error> {
+    use std::os::unix::io::AsRawFd;
+
+    let timeout_ms = match timeout {
+        // Round up so a sub-millisecond deadline doesn't turn into a busy loop
+        Some(t) => t.as_nanos().div_ceil(1_000_000).min(i32::MAX as u128) as libc::c_int,
+        None => -1,
+    };
+
+    let count = sockets.len().min(MAX_WAIT_SOCKETS);
+    let mut fds = [libc::pollfd { fd: -1, events: 0, revents: 0 }; MAX_WAIT_SOCKETS];
+    for (fd, socket) in fds.iter_mut().zip(&sockets[..count]) {
+        fd.fd = socket.as_raw_fd();
+        fd.events = libc::POLLIN;
+    }
+
+    let ready = unsafe { libc::poll(fds.as_mut_ptr(), count as libc::nfds_t, timeout_ms) };
+    if ready < 0 {
+        let e = Error::last_os_error();
+        if e.kind() == std::io::ErrorKind::Interrupted {
+            return Ok(false);
+        }
+        return Err(e);
+    }
+
+    Ok(ready > 0)
+}
+
+/// Fallback for platforms without poll: sleep for at most 1 ms and let the
+/// caller's non-blocking receive find out whether anything arrived
+#[cfg(not(unix))]
+pub fn wait_readable_any(_sockets: &[&UdpSocket], timeout: Option<Duration>) -> Result<bool, Error> {
+    let step = Duration::from_millis(1);
+    std::thread::sleep(timeout.map_or(step, |t| t.min(step)));
+    Ok(true)
+}
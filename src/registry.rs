@@ -0,0 +1,168 @@
+//! Packet type registry a host describes to its clients.
+//!
+//! The host advertises a version hash of its encoded registry in SessionConfig, and
+//! a client only asks for the registry when it doesn't already hold that version.
+
+use std::ffi::{CStr, CString};
+use std::os::raw::c_char;
+
+use crate::codec::{RegistryView, PACKET_TYPE_COMPRESSED};
+
+/// Version of an encoded registry: FNV-1a of its bytes, never 0 since 0 means no registry
+pub fn registry_version(encoded: &[u8]) -> u32 {
+    let hash = encoded
+        .iter()
+        .fold(0x811C_9DC5u32, |hash, &byte| (hash ^ byte as u32).wrapping_mul(0x0100_0193));
+    hash.max(1)
+}
+
+pub struct PacketTypeInfo {
+    flags: u8,
+    name: CString,
+    description: CString,
+}
+
+impl PacketTypeInfo {
+    /// PACKET_TYPE_* flags the host set
+    pub fn flags(&self) -> u8 {
+        self.flags
+    }
+
+    pub fn name(&self) -> &str {
+        self.name.to_str().unwrap_or_default()
+    }
+
+    pub fn description(&self) -> &str {
+        self.description.to_str().unwrap_or_default()
+    }
+
+    pub fn name_c(&self) -> &CStr {
+        &self.name
+    }
+
+    pub fn description_c(&self) -> &CStr {
+        &self.description
+    }
+}
+
+/// Registry received from the host, indexed by packet id. Strings are kept
+/// NUL-terminated so C callers get pointers straight into the cache.
+pub struct PacketTypeTable {
+    entries: Box<[Option<PacketTypeInfo>; 256]>,
+    /// Registered ids in ascending order, with matching string pointers for C
+    ids: Vec<u8>,
+    names: Vec<*const c_char>,
+    descriptions: Vec<*const c_char>,
+    version: u32,
+    /// Version last asked for, so duplicate SessionConfigs don't repeat the request
+    requested: u32,
+}
+
+// The pointers refer to CStrings owned by `entries` and are rebuilt whenever those change
+unsafe impl Send for PacketTypeTable {}
+
+impl Default for PacketTypeTable {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl PacketTypeTable {
+    pub fn new() -> Self {
+        Self {
+            entries: Box::new(std::array::from_fn(|_| None)),
+            ids: Vec::new(),
+            names: Vec::new(),
+            descriptions: Vec::new(),
+            version: 0,
+            requested: 0,
+        }
+    }
+
+    /// Version of the cached registry, 0 if none has been received
+    pub fn version(&self) -> u32 {
+        self.version
+    }
+
+    /// Note that `version` is being fetched. Returns false if it already was.
+    pub fn start_request(&mut self, version: u32) -> bool {
+        std::mem::replace(&mut self.requested, version) != version
+    }
+
+    /// Forget an outstanding request, e.g. when joining a new session
+    pub fn clear_request(&mut self) {
+        self.requested = 0;
+    }
+
+    pub fn len(&self) -> usize {
+        self.ids.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.ids.is_empty()
+    }
+
+    pub fn get(&self, packet_id: u8) -> Option<&PacketTypeInfo> {
+        self.entries[packet_id as usize].as_ref()
+    }
+
+    /// Whether the host asked for payloads of `packet_id` to be compressed
+    pub fn is_compressed(&self, packet_id: u8) -> bool {
+        self.get(packet_id).is_some_and(|info| info.flags & PACKET_TYPE_COMPRESSED != 0)
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (u8, &PacketTypeInfo)> {
+        self.ids.iter().filter_map(|&id| self.get(id).map(|info| (id, info)))
+    }
+
+    /// Registered ids in ascending order
+    pub fn ids(&self) -> &[u8] {
+        &self.ids
+    }
+
+    /// Name pointers in the same order as `ids`, valid until the table changes
+    pub fn c_names(&self) -> &[*const c_char] {
+        &self.names
+    }
+
+    /// Description pointers in the same order as `ids`, valid until the table changes
+    pub fn c_descriptions(&self) -> &[*const c_char] {
+        &self.descriptions
+    }
+
+    /// Replace the cached registry with a newly received one
+    pub fn replace(&mut self, registry: RegistryView, version: u32) {
+        for id in self.ids.drain(..) {
+            self.entries[id as usize] = None;
+        }
+
+        for entry in registry.entries() {
+            let slot = &mut self.entries[entry.packet_id as usize];
+            if slot.is_none() {
+                self.ids.push(entry.packet_id);
+            }
+            *slot = Some(PacketTypeInfo {
+                flags: entry.flags,
+                name: c_string(entry.name),
+                description: c_string(entry.description),
+            });
+        }
+        self.ids.sort_unstable();
+
+        self.names.clear();
+        self.descriptions.clear();
+        for &id in &self.ids {
+            if let Some(info) = &self.entries[id as usize] {
+                self.names.push(info.name.as_ptr());
+                self.descriptions.push(info.description.as_ptr());
+            }
+        }
+        self.version = version;
+    }
+}
+
+/// Cut at an embedded NUL, which C couldn't read past anyway
+fn c_string(s: &str) -> CString {
+    let end = s.find('\0').unwrap_or(s.len());
+    CString::new(&s[..end]).unwrap_or_default()
+}
@@ -1,36 +1,130 @@
 pub mod types;
 mod socket;
 mod session;
+mod shard;
+pub mod metrics;
+mod mesh;
+mod classify;
 mod relay;
 
-use std::io::Error;
+use std::io::{Error, ErrorKind};
+use std::net::ToSocketAddrs;
 pub use relay::RelayNode;
 pub use types::{NeonPacket, PacketPayload};
+use crate::capture::{CaptureReader, CaptureWriter, ReplayPace, ReplayStats};
 
 pub struct NeonRelay {
-    relay: RelayNode,
+    workers: Vec<RelayNode>,
 }
 
 impl NeonRelay {
     /// Create a new relay server bound to the specified address
     pub fn new(bind_addr: &str) -> Result<Self, Error> {
         Ok(Self {
-            relay: RelayNode::new(bind_addr)?,
+            workers: vec![RelayNode::new(bind_addr)?],
+        })
+    }
+
+    /// Create a relay server that spreads traffic over `workers` threads,
+    /// each with its own SO_REUSEPORT socket on the specified address
+    pub fn with_workers(bind_addr: &str, workers: usize) -> Result<Self, Error> {
+        if workers <= 1 {
+            return Self::new(bind_addr);
+        }
+
+        Ok(Self {
+            workers: RelayNode::new_sharded(bind_addr, workers)?,
         })
     }
 
     /// Get the number of active sessions
     pub fn session_count(&self) -> usize {
-        self.relay.session_count()
+        self.workers.first().map_or(0, |relay| relay.session_count())
     }
 
     /// Get the total number of connected clients across all sessions
     pub fn total_client_count(&self) -> usize {
-        self.relay.total_client_count()
+        self.workers.first().map_or(0, |relay| relay.total_client_count())
+    }
+
+    /// Current metrics of every worker in the Prometheus text format
+    pub fn render_metrics(&self) -> String {
+        let workers: Vec<_> = self.workers.iter().map(|worker| worker.metrics()).collect();
+        metrics::render(&workers)
+    }
+
+    /// Serve per-worker, per-session and per-peer metrics over HTTP at `addr`
+    /// from a background thread. Call before start().
+    pub fn serve_metrics(&self, addr: &str) -> Result<(), Error> {
+        let listener = std::net::TcpListener::bind(addr)?;
+        metrics::serve(listener, self.workers.iter().map(|worker| worker.metrics()).collect())
+    }
+
+    /// Set how long a client may stay silent before it's dropped, for sessions
+    /// whose host doesn't choose its own timeout. Call before start().
+    pub fn set_peer_timeout(&mut self, timeout: std::time::Duration) {
+        for worker in &mut self.workers {
+            worker.set_peer_timeout(timeout);
+        }
+    }
+
+    /// Mesh with the relay at `addr`, which has to list this relay as a mesh peer
+    /// too. Sessions hosted on either relay can then be joined through the other,
+    /// with packets crossing between them once over the link. Only relays with a
+    /// single worker can mesh. Call before start().
+    pub fn add_mesh_peer(&mut self, addr: &str) -> Result<(), Error> {
+        let [worker] = self.workers.as_mut_slice() else {
+            return Err(Error::new(ErrorKind::Unsupported, "Mesh links need a relay with a single worker"));
+        };
+        let addr = addr.to_socket_addrs()?.next()
+            .ok_or_else(|| Error::new(ErrorKind::InvalidInput, "Mesh peer address didn't resolve"))?;
+        worker.add_mesh_peer(addr);
+        Ok(())
+    }
+
+    /// Record every datagram the relay receives to a capture file at `path`. With
+    /// several workers each writes its own file, `path` for the first and
+    /// `path.<n>` for the others. Call before start().
+    pub fn capture(&mut self, path: &str) -> Result<(), Error> {
+        for (index, worker) in self.workers.iter_mut().enumerate() {
+            let capture = match index {
+                0 => CaptureWriter::create(path)?,
+                n => CaptureWriter::create(format!("{}.{}", path, n))?,
+            };
+            worker.set_capture(capture);
+        }
+        Ok(())
     }
 
-    /// Start the relay server (blocks)
+    /// Feed the capture at `path` through the relay's packet handling without
+    /// touching the network, and report what went in and would have gone out.
+    /// Only relays with a single worker can replay.
+    pub fn replay(&mut self, path: &str, pace: ReplayPace) -> Result<ReplayStats, Error> {
+        let [worker] = self.workers.as_mut_slice() else {
+            return Err(Error::new(ErrorKind::Unsupported, "Replay needs a relay with a single worker"));
+        };
+        let mut capture = CaptureReader::open(path)?;
+        worker.replay(&mut capture, pace)
+    }
+
+    /// Start the relay server (blocks). Extra workers run on their own threads,
+    /// the first one runs on the calling thread.
     pub fn start(&mut self) -> Result<(), Error> {
-        self.relay.run()
+        let mut workers = std::mem::take(&mut self.workers).into_iter();
+        let Some(mut first) = workers.next() else {
+            return Ok(());
+        };
+
+        for (index, mut worker) in workers.enumerate() {
+            std::thread::Builder::new()
+                .name(format!("neon-relay-{}", index + 1))
+                .spawn(move || {
+                    if let Err(e) = worker.run() {
+                        log_error!("[Relay] Worker {} failed: {}", index + 1, e);
+                    }
+                })?;
+        }
+
+        first.run()
     }
-}
\ No newline at end of file
+}
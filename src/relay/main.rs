@@ -1,3 +1,4 @@
+use project_neon::log::{self, Level};
 use project_neon::relay::NeonRelay;
 
 fn main() {
@@ -6,7 +7,74 @@ fn main() {
     println!("Starting relay node...");
     println!();
 
-    let mut relay = match NeonRelay::new("0.0.0.0:7777") {
+    let mut bind_addr = String::from("0.0.0.0:7777");
+    let mut workers = 1;
+    let mut metrics_addr = None;
+    let mut peer_timeout = None;
+    let mut mesh_peers = Vec::new();
+    let mut capture_path = None;
+
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--bind" => match args.next() {
+                Some(addr) => bind_addr = addr,
+                None => {
+                    println!("--bind requires an address");
+                    return;
+                }
+            },
+            "--workers" => match args.next().and_then(|n| n.parse::<usize>().ok()) {
+                Some(n) if n > 0 => workers = n,
+                _ => {
+                    println!("--workers requires a positive number");
+                    return;
+                }
+            },
+            "--metrics" => match args.next() {
+                Some(addr) => metrics_addr = Some(addr),
+                None => {
+                    println!("--metrics requires an address");
+                    return;
+                }
+            },
+            "--peer-timeout" => match args.next().and_then(|n| n.parse::<f64>().ok()) {
+                Some(secs) if secs > 0.0 => peer_timeout = Some(std::time::Duration::from_secs_f64(secs)),
+                _ => {
+                    println!("--peer-timeout requires a positive number of seconds");
+                    return;
+                }
+            },
+            "--mesh-peer" => match args.next() {
+                Some(addr) => mesh_peers.push(addr),
+                None => {
+                    println!("--mesh-peer requires an address");
+                    return;
+                }
+            },
+            "--capture" => match args.next() {
+                Some(path) => capture_path = Some(path),
+                None => {
+                    println!("--capture requires a file path");
+                    return;
+                }
+            },
+            "--log-level" => match args.next().as_deref().and_then(Level::from_name) {
+                Some(level) => log::set_level(level),
+                None => {
+                    println!("--log-level must be one of off, error, warn, info, debug, trace");
+                    return;
+                }
+            },
+            other => {
+                println!("Unknown argument: {}", other);
+                println!("Usage: relay [--bind <addr>] [--workers <n>] [--metrics <addr>] [--peer-timeout <secs>] [--mesh-peer <addr>]... [--capture <file>] [--log-level <level>]");
+                return;
+            }
+        }
+    }
+
+    let mut relay = match NeonRelay::with_workers(&bind_addr, workers) {
         Ok(relay) => relay,
         Err(e) => {
             println!("Failed to start relay: {}", e);
@@ -14,7 +82,32 @@ fn main() {
         }
     };
 
+    if let Some(timeout) = peer_timeout {
+        relay.set_peer_timeout(timeout);
+    }
+
+    for addr in &mesh_peers {
+        if let Err(e) = relay.add_mesh_peer(addr) {
+            println!("Failed to add mesh peer {}: {}", addr, e);
+            return;
+        }
+    }
+
+    if let Some(path) = capture_path {
+        if let Err(e) = relay.capture(&path) {
+            println!("Failed to start capture to {}: {}", path, e);
+            return;
+        }
+    }
+
+    if let Some(addr) = metrics_addr {
+        if let Err(e) = relay.serve_metrics(&addr) {
+            println!("Failed to serve metrics on {}: {}", addr, e);
+            return;
+        }
+    }
+
     if let Err(e) = relay.start() {
         println!("Relay failed: {}", e);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,168 @@
+//! Links between meshed relays.
+//!
+//! A session belongs to the relay its host registered with. Clients can join it
+//! through any relay linked to that owner: the join is passed over the link, the
+//! client registers with its own relay, and from then on its packets cross to the
+//! owner once over the link. The owner sends each packet once to every other relay
+//! with targets for it, and each relay fans it out to its own clients.
+//!
+//! Frames travel in `RelayLink` datagrams, packed until the next one would grow the
+//! datagram past LINK_BATCH_SIZE. Each frame is [kind u8][session_id u32][length u16][body].
+
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr};
+
+use super::socket::SendQueue;
+use super::types::{CorePacketType, PacketHeader, MAX_DATAGRAM_SIZE, PACKET_HEADER_SIZE};
+
+/// Bytes in front of each frame: kind, session id u32, length u16
+pub const FRAME_HEADER_SIZE: usize = 7;
+/// Link datagrams are sent before they grow past this, staying under a 1500 byte MTU
+pub const LINK_BATCH_SIZE: usize = 1400;
+/// Largest encoded address: family, IPv6 address, port
+pub const MAX_ADDR_SIZE: usize = 19;
+
+/// A packet from a peer of the session, the body is the datagram as it was received
+pub const FORWARD: u8 = 1;
+/// A client asking to join a session: its address, then the ConnectRequest payload
+pub const JOIN: u8 = 2;
+/// The owner's answer to a join: the ConnectAccept or ConnectDeny datagram, carrying
+/// the nonce the JOIN's request had
+pub const REPLY: u8 = 3;
+/// A client that joined through a JOIN registered with the sending relay: client id
+pub const PEER_JOINED: u8 = 4;
+/// A client announced with PEER_JOINED left the sending relay: client id
+pub const PEER_LEFT: u8 = 5;
+
+pub struct Frame<'a> {
+    pub kind: u8,
+    pub session_id: u32,
+    pub body: &'a [u8],
+}
+
+struct Link {
+    addr: SocketAddr,
+    /// Frames waiting to be sent, behind a RelayLink header while non-empty
+    batch: Vec<u8>,
+}
+
+/// The relays this one is linked to and the frames queued for each
+#[derive(Default)]
+pub struct MeshLinks {
+    links: Vec<Link>,
+}
+
+impl MeshLinks {
+    pub fn add(&mut self, addr: SocketAddr) {
+        if !self.contains(addr) {
+            self.links.push(Link { addr, batch: Vec::with_capacity(LINK_BATCH_SIZE) });
+        }
+    }
+
+    pub fn contains(&self, addr: SocketAddr) -> bool {
+        self.links.iter().any(|link| link.addr == addr)
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.links.is_empty()
+    }
+
+    /// Queue a frame whose body is `parts` in order, sending the link's batch first
+    /// if the frame doesn't fit. Returns false for an unknown link or a frame too
+    /// large for any datagram.
+    pub fn push(&mut self, link: SocketAddr, kind: u8, session_id: u32, parts: &[&[u8]], outbound: &mut SendQueue) -> bool {
+        let Some(link) = self.links.iter_mut().find(|l| l.addr == link) else {
+            return false;
+        };
+        push_frame(link, kind, session_id, parts, outbound)
+    }
+
+    /// Queue a frame on every link, as `push` does for one
+    pub fn push_all(&mut self, kind: u8, session_id: u32, parts: &[&[u8]], outbound: &mut SendQueue) -> bool {
+        self.links.iter_mut().all(|link| push_frame(link, kind, session_id, parts, outbound))
+    }
+
+    /// Queue every link's pending frames for sending
+    pub fn flush(&mut self, outbound: &mut SendQueue) {
+        for link in &mut self.links {
+            send(link, outbound);
+        }
+    }
+}
+
+fn push_frame(link: &mut Link, kind: u8, session_id: u32, parts: &[&[u8]], outbound: &mut SendQueue) -> bool {
+    let body_len: usize = parts.iter().map(|part| part.len()).sum();
+    if body_len > MAX_DATAGRAM_SIZE - PACKET_HEADER_SIZE - FRAME_HEADER_SIZE {
+        return false;
+    }
+    if link.batch.len() + FRAME_HEADER_SIZE + body_len > LINK_BATCH_SIZE {
+        send(link, outbound);
+    }
+
+    if link.batch.is_empty() {
+        PacketHeader::new(CorePacketType::RelayLink as u8, 0, 0, 0).write_to(&mut link.batch);
+    }
+    link.batch.push(kind);
+    link.batch.extend_from_slice(&session_id.to_le_bytes());
+    link.batch.extend_from_slice(&(body_len as u16).to_le_bytes());
+    for part in parts {
+        link.batch.extend_from_slice(part);
+    }
+    true
+}
+
+fn send(link: &mut Link, outbound: &mut SendQueue) {
+    if !link.batch.is_empty() {
+        outbound.push(&link.batch, link.addr);
+        link.batch.clear();
+    }
+}
+
+/// Iterate over the frames of a RelayLink payload, stopping at the first truncated one
+pub fn frames(payload: &[u8]) -> impl Iterator<Item = Frame<'_>> {
+    let mut rest = payload;
+    std::iter::from_fn(move || {
+        if rest.len() < FRAME_HEADER_SIZE {
+            return None;
+        }
+        let len = FRAME_HEADER_SIZE + u16::from_le_bytes([rest[5], rest[6]]) as usize;
+        if rest.len() < len {
+            return None;
+        }
+        let (frame, tail) = rest.split_at(len);
+        rest = tail;
+        Some(Frame {
+            kind: frame[0],
+            session_id: u32::from_le_bytes(frame[1..5].try_into().unwrap()),
+            body: &frame[FRAME_HEADER_SIZE..],
+        })
+    })
+}
+
+/// Encode an address as [family 4 or 6][address][port u16] into `out`
+pub fn encode_addr(addr: SocketAddr, out: &mut [u8; MAX_ADDR_SIZE]) -> &[u8] {
+    let len = match addr.ip() {
+        IpAddr::V4(ip) => {
+            out[0] = 4;
+            out[1..5].copy_from_slice(&ip.octets());
+            5
+        }
+        IpAddr::V6(ip) => {
+            out[0] = 6;
+            out[1..17].copy_from_slice(&ip.octets());
+            17
+        }
+    };
+    out[len..len + 2].copy_from_slice(&addr.port().to_le_bytes());
+    &out[..len + 2]
+}
+
+/// Decode an address written by `encode_addr`, returning it and the bytes after it
+pub fn decode_addr(bytes: &[u8]) -> Option<(SocketAddr, &[u8])> {
+    let (ip, rest): (IpAddr, &[u8]) = match *bytes.first()? {
+        4 if bytes.len() >= 7 => (Ipv4Addr::from(<[u8; 4]>::try_from(&bytes[1..5]).unwrap()).into(), &bytes[5..]),
+        6 if bytes.len() >= 19 => (Ipv6Addr::from(<[u8; 16]>::try_from(&bytes[1..17]).unwrap()).into(), &bytes[17..]),
+        _ => return None,
+    };
+    let port = u16::from_le_bytes([rest[0], rest[1]]);
+    Some((SocketAddr::new(ip, port), &rest[2..]))
+}
@@ -0,0 +1,349 @@
+use std::collections::{BTreeMap, HashMap};
+use std::fmt::Write as _;
+use std::io::{Error, Read, Write};
+use std::net::{TcpListener, TcpStream, UdpSocket};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+/// Add to a counter that only one thread writes. A plain load and store avoids
+/// the locked read-modify-write of fetch_add while readers still see whole values.
+#[inline]
+fn bump(counter: &AtomicU64, amount: u64) {
+    counter.store(counter.load(Ordering::Relaxed) + amount, Ordering::Relaxed);
+}
+
+fn read(counter: &AtomicU64) -> u64 {
+    counter.load(Ordering::Relaxed)
+}
+
+/// Traffic of one peer as seen by one worker, on its own cache line
+#[repr(align(64))]
+#[derive(Debug, Default)]
+pub struct PeerCounters {
+    packets_in: AtomicU64,
+    bytes_in: AtomicU64,
+    packets_out: AtomicU64,
+    bytes_out: AtomicU64,
+    /// Packets from this peer to a destination that isn't in the session
+    dropped: AtomicU64,
+}
+
+impl PeerCounters {
+    pub fn record_in(&self, bytes: usize) {
+        bump(&self.packets_in, 1);
+        bump(&self.bytes_in, bytes as u64);
+    }
+
+    pub fn record_out(&self, bytes: usize) {
+        bump(&self.packets_out, 1);
+        bump(&self.bytes_out, bytes as u64);
+    }
+
+    pub fn record_drop(&self) {
+        bump(&self.dropped, 1);
+    }
+}
+
+/// Why the relay discarded a datagram
+#[derive(Debug, Clone, Copy)]
+pub enum DropReason {
+    UnknownSender,
+    UnknownDestination,
+    Malformed,
+    SendFailed,
+    VersionMismatch,
+}
+
+const DROP_REASONS: [(DropReason, &str); 5] = [
+    (DropReason::UnknownSender, "unknown_sender"),
+    (DropReason::UnknownDestination, "unknown_destination"),
+    (DropReason::Malformed, "malformed"),
+    (DropReason::SendFailed, "send_failed"),
+    (DropReason::VersionMismatch, "version_mismatch"),
+];
+
+/// Totals for one worker thread, on its own cache line
+#[repr(align(64))]
+#[derive(Debug, Default)]
+struct WorkerCounters {
+    packets_in: AtomicU64,
+    bytes_in: AtomicU64,
+    packets_out: AtomicU64,
+    bytes_out: AtomicU64,
+    drops: [AtomicU64; DROP_REASONS.len()],
+}
+
+/// Sub-buckets per power of two, giving 2 significant bits like a small HDR histogram
+const SUB_BUCKETS: usize = 4;
+const HISTOGRAM_BUCKETS: usize = 64 * SUB_BUCKETS;
+
+/// Log-linear histogram of durations in nanoseconds, written by one thread
+pub struct Histogram {
+    buckets: Box<[AtomicU64]>,
+    count: AtomicU64,
+    sum_ns: AtomicU64,
+}
+
+impl Histogram {
+    fn new() -> Self {
+        Histogram {
+            buckets: (0..HISTOGRAM_BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            count: AtomicU64::new(0),
+            sum_ns: AtomicU64::new(0),
+        }
+    }
+
+    fn bucket(ns: u64) -> usize {
+        if ns < SUB_BUCKETS as u64 {
+            return ns as usize;
+        }
+        let exponent = 63 - ns.leading_zeros() as usize;
+        let sub = (ns >> (exponent - 2)) as usize & (SUB_BUCKETS - 1);
+        exponent * SUB_BUCKETS + sub
+    }
+
+    /// Record `samples` observations of the same duration
+    pub fn record(&self, duration: Duration, samples: u64) {
+        let ns = duration.as_nanos().min(u64::MAX as u128) as u64;
+        bump(&self.buckets[Self::bucket(ns)], samples);
+        bump(&self.count, samples);
+        bump(&self.sum_ns, ns.saturating_mul(samples));
+    }
+}
+
+/// Everything one relay worker records, shared with the stats server
+pub struct WorkerMetrics {
+    counters: WorkerCounters,
+    /// Time from a batch leaving the socket to its forwarded datagrams being sent
+    pub forward_latency: Histogram,
+    peers: Mutex<HashMap<(u32, u8), Arc<PeerCounters>>>,
+    /// Second handle on the worker's socket, used only to sample its receive queue
+    socket: Option<UdpSocket>,
+}
+
+impl WorkerMetrics {
+    pub fn new(socket: Option<UdpSocket>) -> Self {
+        WorkerMetrics {
+            counters: WorkerCounters::default(),
+            forward_latency: Histogram::new(),
+            peers: Mutex::new(HashMap::new()),
+            socket,
+        }
+    }
+
+    pub fn record_in(&self, bytes: usize) {
+        bump(&self.counters.packets_in, 1);
+        bump(&self.counters.bytes_in, bytes as u64);
+    }
+
+    pub fn record_out(&self, packets: usize, bytes: usize) {
+        bump(&self.counters.packets_out, packets as u64);
+        bump(&self.counters.bytes_out, bytes as u64);
+    }
+
+    pub fn record_drop(&self, reason: DropReason) {
+        bump(&self.counters.drops[reason as usize], 1);
+    }
+
+    /// Counters for a peer, shared by every registration of the same session slot
+    pub fn peer(&self, session_id: u32, client_id: u8) -> Arc<PeerCounters> {
+        Arc::clone(self.peers.lock().unwrap().entry((session_id, client_id)).or_default())
+    }
+
+    pub fn forget_peer(&self, session_id: u32, client_id: u8) {
+        self.peers.lock().unwrap().remove(&(session_id, client_id));
+    }
+}
+
+/// Bytes waiting in a socket's receive queue and the queue's capacity
+#[cfg(target_os = "linux")]
+fn receive_queue(socket: &UdpSocket) -> Option<(u64, u64)> {
+    use std::os::unix::io::AsRawFd;
+
+    let mut info = [0u32; 9];
+    let mut len = std::mem::size_of_val(&info) as libc::socklen_t;
+    let result = unsafe {
+        libc::getsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_MEMINFO,
+            info.as_mut_ptr() as *mut libc::c_void,
+            &mut len,
+        )
+    };
+    if result != 0 {
+        return None;
+    }
+    Some((
+        info[libc::SK_MEMINFO_RMEM_ALLOC as usize] as u64,
+        info[libc::SK_MEMINFO_RCVBUF as usize] as u64,
+    ))
+}
+
+#[cfg(not(target_os = "linux"))]
+fn receive_queue(_socket: &UdpSocket) -> Option<(u64, u64)> {
+    None
+}
+
+/// Render every worker's metrics in the Prometheus text format. Peer counters are
+/// summed across workers, and session counters are the sum of their peers.
+pub fn render(workers: &[Arc<WorkerMetrics>]) -> String {
+    let mut out = String::new();
+
+    let worker_counter = |out: &mut String, name: &str, help: &str, value: &dyn Fn(&WorkerCounters) -> u64| {
+        let _ = writeln!(out, "# HELP {} {}\n# TYPE {} counter", name, help, name);
+        for (index, worker) in workers.iter().enumerate() {
+            let _ = writeln!(out, "{}{{worker=\"{}\"}} {}", name, index, value(&worker.counters));
+        }
+    };
+    worker_counter(&mut out, "neon_relay_packets_received_total", "Datagrams received", &|c| read(&c.packets_in));
+    worker_counter(&mut out, "neon_relay_bytes_received_total", "Bytes received", &|c| read(&c.bytes_in));
+    worker_counter(&mut out, "neon_relay_packets_sent_total", "Datagrams queued for sending", &|c| read(&c.packets_out));
+    worker_counter(&mut out, "neon_relay_bytes_sent_total", "Bytes queued for sending", &|c| read(&c.bytes_out));
+
+    let _ = writeln!(out, "# HELP neon_relay_dropped_packets_total Datagrams discarded, by reason\n# TYPE neon_relay_dropped_packets_total counter");
+    for (index, worker) in workers.iter().enumerate() {
+        for (reason, label) in DROP_REASONS {
+            let _ = writeln!(
+                out,
+                "neon_relay_dropped_packets_total{{worker=\"{}\",reason=\"{}\"}} {}",
+                index, label, read(&worker.counters.drops[reason as usize])
+            );
+        }
+    }
+
+    let queues: Vec<_> = workers.iter().map(|worker| worker.socket.as_ref().and_then(receive_queue)).collect();
+    let _ = writeln!(out, "# HELP neon_relay_receive_queue_bytes Bytes waiting in the socket receive queue\n# TYPE neon_relay_receive_queue_bytes gauge");
+    for (index, (queued, _)) in queues.iter().enumerate().filter_map(|(i, q)| q.map(|q| (i, q))) {
+        let _ = writeln!(out, "neon_relay_receive_queue_bytes{{worker=\"{}\"}} {}", index, queued);
+    }
+    let _ = writeln!(out, "# HELP neon_relay_receive_buffer_bytes Socket receive buffer size\n# TYPE neon_relay_receive_buffer_bytes gauge");
+    for (index, (_, capacity)) in queues.iter().enumerate().filter_map(|(i, q)| q.map(|q| (i, q))) {
+        let _ = writeln!(out, "neon_relay_receive_buffer_bytes{{worker=\"{}\"}} {}", index, capacity);
+    }
+
+    render_latency(&mut out, workers);
+    render_peers(&mut out, workers);
+    out
+}
+
+fn render_latency(out: &mut String, workers: &[Arc<WorkerMetrics>]) {
+    let name = "neon_relay_forward_latency_seconds";
+    let _ = writeln!(out, "# HELP {} Time from receiving a batch to sending what it forwarded\n# TYPE {} histogram", name, name);
+
+    let mut buckets = [0u64; HISTOGRAM_BUCKETS];
+    let (mut count, mut sum_ns) = (0, 0u64);
+    for worker in workers {
+        let histogram = &worker.forward_latency;
+        for (total, bucket) in buckets.iter_mut().zip(histogram.buckets.iter()) {
+            *total += read(bucket);
+        }
+        count += read(&histogram.count);
+        sum_ns = sum_ns.saturating_add(read(&histogram.sum_ns));
+    }
+
+    // Export power-of-two boundaries from 1us to about 1s; the fine buckets only keep the edges exact
+    let mut cumulative = 0;
+    let mut next = 0;
+    for exponent in 10..=30 {
+        let boundary = Histogram::bucket(1 << exponent);
+        while next < boundary {
+            cumulative += buckets[next];
+            next += 1;
+        }
+        let le = (1u64 << exponent) as f64 / 1e9;
+        let _ = writeln!(out, "{}_bucket{{le=\"{}\"}} {}", name, le, cumulative);
+    }
+    let _ = writeln!(out, "{}_bucket{{le=\"+Inf\"}} {}", name, count);
+    let _ = writeln!(out, "{}_sum {}", name, sum_ns as f64 / 1e9);
+    let _ = writeln!(out, "{}_count {}", name, count);
+}
+
+fn render_peers(out: &mut String, workers: &[Arc<WorkerMetrics>]) {
+    // [packets_in, bytes_in, packets_out, bytes_out, dropped]
+    let mut peers: BTreeMap<(u32, u8), [u64; 5]> = BTreeMap::new();
+    for worker in workers {
+        for (key, counters) in worker.peers.lock().unwrap().iter() {
+            let totals = peers.entry(*key).or_default();
+            totals[0] += read(&counters.packets_in);
+            totals[1] += read(&counters.bytes_in);
+            totals[2] += read(&counters.packets_out);
+            totals[3] += read(&counters.bytes_out);
+            totals[4] += read(&counters.dropped);
+        }
+    }
+
+    let mut sessions: BTreeMap<u32, [u64; 5]> = BTreeMap::new();
+    for ((session_id, _), totals) in &peers {
+        let session = sessions.entry(*session_id).or_default();
+        for (sum, value) in session.iter_mut().zip(totals) {
+            *sum += value;
+        }
+    }
+
+    const SERIES: [(&str, &str); 5] = [
+        ("packets_received_total", "Datagrams received from"),
+        ("bytes_received_total", "Bytes received from"),
+        ("packets_sent_total", "Datagrams forwarded to"),
+        ("bytes_sent_total", "Bytes forwarded to"),
+        ("dropped_packets_total", "Datagrams dropped for a missing destination, sent by"),
+    ];
+
+    for (index, (suffix, help)) in SERIES.iter().enumerate() {
+        let name = format!("neon_relay_session_{}", suffix);
+        let _ = writeln!(out, "# HELP {} {} the session's peers\n# TYPE {} counter", name, help, name);
+        for (session_id, totals) in &sessions {
+            let _ = writeln!(out, "{}{{session=\"{}\"}} {}", name, session_id, totals[index]);
+        }
+
+        let name = format!("neon_relay_peer_{}", suffix);
+        let _ = writeln!(out, "# HELP {} {} the peer\n# TYPE {} counter", name, help, name);
+        for ((session_id, client_id), totals) in &peers {
+            let _ = writeln!(out, "{}{{session=\"{}\",client=\"{}\"}} {}", name, session_id, client_id, totals[index]);
+        }
+    }
+
+    let _ = writeln!(out, "# HELP neon_relay_sessions Sessions with at least one registered peer\n# TYPE neon_relay_sessions gauge");
+    let _ = writeln!(out, "neon_relay_sessions {}", sessions.len());
+}
+
+/// Serve the metrics of `workers` over HTTP on `listener`, answering every request
+/// with the Prometheus text format. Runs on its own thread.
+pub fn serve(listener: TcpListener, workers: Vec<Arc<WorkerMetrics>>) -> Result<(), Error> {
+    log_info!("[Relay] Serving metrics on http://{}/metrics", listener.local_addr()?);
+
+    std::thread::Builder::new()
+        .name("neon-metrics".to_string())
+        .spawn(move || {
+            for stream in listener.incoming() {
+                match stream {
+                    Ok(stream) => {
+                        if let Err(e) = respond(stream, &workers) {
+                            log_debug!("[Relay] Metrics request failed: {}", e);
+                        }
+                    }
+                    Err(e) => log_warn!("[Relay] Metrics listener error: {}", e),
+                }
+            }
+        })?;
+
+    Ok(())
+}
+
+fn respond(mut stream: TcpStream, workers: &[Arc<WorkerMetrics>]) -> Result<(), Error> {
+    stream.set_read_timeout(Some(Duration::from_secs(1)))?;
+    stream.set_write_timeout(Some(Duration::from_secs(1)))?;
+
+    // Any request gets the metrics; read it only so the client sees a clean close
+    let mut request = [0u8; 1024];
+    let _ = stream.read(&mut request)?;
+
+    let body = render(workers);
+    write!(
+        stream,
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+        body.len()
+    )?;
+    stream.write_all(body.as_bytes())
+}
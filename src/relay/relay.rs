@@ -1,281 +1,876 @@
-use std::collections::HashMap;
 use std::io::{Error, ErrorKind};
 use std::net::SocketAddr;
-use std::thread::sleep;
+use std::sync::{Arc, Mutex};
 use std::time::{Duration, Instant};
 
-use super::socket::NeonSocket;
-use super::session::SessionManager;
+use super::classify::BatchClass;
+use super::mesh::{self, MeshLinks, FRAME_HEADER_SIZE, MAX_ADDR_SIZE};
+use super::metrics::{DropReason, WorkerMetrics};
+use super::socket::{NeonSocket, RecvBatch, SendQueue, BATCH_SIZE};
+use super::session::{Origin, Route, SessionManager};
+use super::shard::{ShardEvent, ShardLink, SharedPending};
 use super::types::*;
+use crate::capture::{CaptureReader, CaptureWriter, ReplayPace, ReplayStats};
+use crate::log::Level;
+use crate::timer::TimerWheel;
+
+/// How long a join waits for the host's answer, as long as a client waits to connect
+const PENDING_TIMEOUT: Duration = Duration::from_secs(10);
+/// Resolution of pending join timeouts
+const PENDING_TIMER_TICK: Duration = Duration::from_millis(100);
 
 pub struct RelayNode {
     socket: NeonSocket,
+    outbound: SendQueue,
     session_manager: SessionManager,
-    pending_connections: HashMap<SocketAddr, PendingConnection>,
+    pending_connections: SharedPending,
+    /// Timeouts of the joins this worker forwarded, by nonce
+    pending_timers: TimerWheel<u32>,
+    shard: Option<ShardLink>,
+    /// Targets of the packet being fanned out, reused across packets
+    fan_out: Vec<(u8, SocketAddr)>,
+    /// Relays this one is meshed with
+    mesh: MeshLinks,
+    /// Mesh links the packet being fanned out goes over, reused across packets
+    mesh_targets: Vec<SocketAddr>,
+    metrics: Arc<WorkerMetrics>,
+    /// Records every received datagram, when capturing
+    capture: Option<CaptureWriter>,
 }
 
 impl RelayNode {
     pub fn new(bind_addr: &str) -> Result<Self, Error> {
+        let socket = NeonSocket::new(bind_addr)?;
+        let metrics = Arc::new(WorkerMetrics::new(socket.try_clone().ok()));
         Ok(RelayNode {
-            socket: NeonSocket::new(bind_addr)?,
-            session_manager: SessionManager::new(),
-            pending_connections: HashMap::new(),
+            socket,
+            outbound: SendQueue::new(),
+            session_manager: SessionManager::new(Arc::clone(&metrics)),
+            pending_connections: Arc::new(Mutex::new(PendingJoins::default())),
+            pending_timers: TimerWheel::new(PENDING_TIMER_TICK),
+            shard: None,
+            fan_out: Vec::new(),
+            mesh: MeshLinks::default(),
+            mesh_targets: Vec::new(),
+            metrics,
+            capture: None,
         })
     }
 
+    /// Create `workers` relay nodes sharing one address through SO_REUSEPORT.
+    /// Each keeps a replica of the session table and tells the others about
+    /// registrations it handles, so any worker can forward for any peer.
+    pub fn new_sharded(bind_addr: &str, workers: usize) -> Result<Vec<Self>, Error> {
+        let first = NeonSocket::bind_reuseport(bind_addr)?;
+        // Bind the rest to the resolved address so port 0 still yields one shared port
+        let addr = first.local_addr()?.to_string();
+        let pending: SharedPending = Arc::new(Mutex::new(PendingJoins::default()));
+
+        let mut sockets = vec![first];
+        for _ in 1..workers {
+            sockets.push(NeonSocket::bind_reuseport(&addr)?);
+        }
+
+        Ok(sockets
+            .into_iter()
+            .zip(ShardLink::create(workers)?)
+            .map(|(socket, shard)| {
+                let metrics = Arc::new(WorkerMetrics::new(socket.try_clone().ok()));
+                RelayNode {
+                    socket,
+                    outbound: SendQueue::new(),
+                    session_manager: SessionManager::new(Arc::clone(&metrics)),
+                    pending_connections: Arc::clone(&pending),
+                    pending_timers: TimerWheel::new(PENDING_TIMER_TICK),
+                    shard: Some(shard),
+                    fan_out: Vec::new(),
+                    mesh: MeshLinks::default(),
+                    mesh_targets: Vec::new(),
+                    metrics,
+                    capture: None,
+                }
+            })
+            .collect())
+    }
+
+    /// Counters and histograms this worker records, for the metrics endpoint
+    pub fn metrics(&self) -> Arc<WorkerMetrics> {
+        Arc::clone(&self.metrics)
+    }
+
+    /// Idle timeout for clients of sessions whose host doesn't set one. Call before run().
+    pub fn set_peer_timeout(&mut self, timeout: Duration) {
+        self.session_manager.set_default_timeout(timeout);
+    }
+
+    /// Mesh with the relay at `addr`, which must list this relay too. Clients here
+    /// can then join sessions hosted there and the other way round. Call before run().
+    pub fn add_mesh_peer(&mut self, addr: SocketAddr) {
+        self.mesh.add(addr);
+    }
+
+    /// Record every datagram this worker receives from now on
+    pub fn set_capture(&mut self, capture: CaptureWriter) {
+        self.capture = Some(capture);
+    }
+
+    /// Feed a capture through the packet handler as if its datagrams were arriving
+    /// now. What the relay would send is counted and discarded, so the captured
+    /// addresses are never contacted. For benchmarks and debugging, not a live relay.
+    pub fn replay(&mut self, capture: &mut CaptureReader, pace: ReplayPace) -> Result<ReplayStats, Error> {
+        let mut stats = ReplayStats::default();
+        let mut datagram = Vec::with_capacity(MAX_DATAGRAM_SIZE);
+        // Datagrams are fed in batches, as drain_socket would receive them
+        let mut batch = RecvBatch::new();
+        let start = Instant::now();
+
+        while let Some(record) = capture.next_record(&mut datagram)? {
+            if pace == ReplayPace::Original {
+                let due = start + record.offset;
+                let now = Instant::now();
+                if due > now {
+                    self.replay_batch(&mut batch, &mut stats)?;
+                    std::thread::sleep(due - now);
+                    self.expire(Instant::now());
+                }
+            }
+
+            stats.datagrams_in += 1;
+            stats.bytes_in += datagram.len() as u64;
+            if !batch.push(&datagram, record.addr) {
+                self.replay_batch(&mut batch, &mut stats)?;
+                batch.push(&datagram, record.addr);
+            }
+        }
+
+        self.replay_batch(&mut batch, &mut stats)?;
+        stats.elapsed = start.elapsed();
+        Ok(stats)
+    }
+
+    /// Count and drop everything queued instead of sending it
+    fn discard_outbound(&mut self, stats: &mut ReplayStats) {
+        self.mesh.flush(&mut self.outbound);
+        stats.datagrams_out += self.outbound.len() as u64;
+        stats.bytes_out += self.outbound.bytes() as u64;
+        self.outbound.clear();
+    }
+
     pub fn run(&mut self) -> Result<(), Error> {
-        println!("Relay node listening on {}...", "0.0.0.0:7777");
-        println!("Protocol Version: 0.2");
-        println!();
+        log_info!("Relay node listening on {} (protocol version 0.2)", self.socket.local_addr()?);
         
         self.socket.set_nonblocking(true)?;
         
-        let mut last_cleanup = Instant::now();
-        let cleanup_interval = Duration::from_secs(5);
+        let mut batch = RecvBatch::new();
 
         loop {
-            match self.socket.receive_packet() {
-                Ok((packet, addr)) => {
-                    self.handle_packet(packet, addr)?;
+            // Sleep until traffic arrives or the next idle or join timer is due
+            let deadline = match (self.session_manager.next_timeout(), self.pending_timers.next_deadline()) {
+                (Some(idle), Some(join)) => Some(idle.min(join)),
+                (idle, join) => idle.or(join),
+            };
+            let timeout = deadline.map(|deadline| deadline.saturating_duration_since(Instant::now()));
+
+            let readable = match &self.shard {
+                Some(shard) => self.socket.wait_readable_with(shard.waker(), timeout)?,
+                None => self.socket.wait_readable(timeout)?,
+            };
+
+            if readable {
+                // Apply other workers' registrations first so packets from
+                // peers that just joined can already be routed
+                self.apply_shard_events()?;
+                self.drain_socket(&mut batch)?;
+            }
+
+            self.expire(Instant::now());
+            self.flush_outbound();
+        }
+    }
+
+    /// Drop joins the host never answered and peers that went silent
+    fn expire(&mut self, now: Instant) {
+        self.expire_pending(now);
+        for (peer, owner) in self.session_manager.expire_peers(now) {
+            self.broadcast(ShardEvent::PeerRemoved {
+                session_id: peer.session_id,
+                client_id: peer.client_id,
+                addr: peer.addr,
+            });
+            if let Some(link) = owner {
+                self.mesh.push(link, mesh::PEER_LEFT, peer.session_id, &[&[peer.client_id]], &mut self.outbound);
+            }
+        }
+    }
+
+    fn apply_shard_events(&mut self) -> Result<(), Error> {
+        let Some(shard) = &self.shard else {
+            return Ok(());
+        };
+
+        for event in shard.drain()? {
+            match event {
+                ShardEvent::HostRegistered { session_id, addr, peer_timeout } => {
+                    self.session_manager.register_remote_peer(session_id, 1, addr, true, peer_timeout, 0);
                 }
-                Err(e) if e.kind() == ErrorKind::WouldBlock => {
-                    // No packets available
+                ShardEvent::ClientRegistered { session_id, client_id, addr, resume_token } => {
+                    self.session_manager.register_remote_peer(session_id, client_id, addr, false, None, resume_token);
                 }
+                ShardEvent::PeerRemoved { session_id, client_id, addr } => {
+                    self.session_manager.remove_remote_peer(session_id, client_id, addr);
+                }
+            }
+        }
+        Ok(())
+    }
+
+    fn broadcast(&self, event: ShardEvent) {
+        if let Some(shard) = &self.shard {
+            shard.broadcast(event);
+        }
+    }
+
+    /// Receive and route batches until the socket runs dry, flushing the
+    /// outbound queue after each batch
+    fn drain_socket(&mut self, batch: &mut RecvBatch) -> Result<(), Error> {
+        loop {
+            let received = match self.socket.receive_batch(batch) {
+                Ok(count) => count,
+                Err(e) if e.kind() == ErrorKind::WouldBlock => 0,
                 Err(e) => return Err(e),
+            };
+
+            let received_at = Instant::now();
+
+            if let Some(capture) = &mut self.capture {
+                for i in 0..received {
+                    let (bytes, addr) = batch.get(i);
+                    capture.record(received_at, addr, bytes);
+                }
             }
+            self.receive_batch(batch, received)?;
 
-            if last_cleanup.elapsed() >= cleanup_interval {
-                self.session_manager.cleanup_dead_connections();
-                last_cleanup = Instant::now();
+            let queued = self.flush_outbound();
+            if queued > 0 {
+                self.metrics.forward_latency.record(received_at.elapsed(), queued as u64);
             }
 
-            sleep(Duration::from_millis(1));
+            if received < BATCH_SIZE {
+                return Ok(());
+            }
         }
     }
 
-    fn handle_packet(&mut self, packet: NeonPacket, addr: SocketAddr) -> Result<(), Error> {
-        if packet.packet_type < 0x10 {
-            self.handle_core_packet(packet, addr)
-        } else {
-            self.handle_game_packet(packet, addr)
+    /// Route the first `count` datagrams of a batch in arrival order, validated
+    /// together up front
+    fn receive_batch(&mut self, batch: &RecvBatch, count: usize) -> Result<(), Error> {
+        let class = BatchClass::of(batch, count);
+        for i in 0..count {
+            let (bytes, addr) = batch.get(i);
+            self.metrics.record_in(bytes.len());
+
+            let bit = 1 << i;
+            if class.valid & bit == 0 {
+                self.metrics.record_drop(DropReason::Malformed);
+                log_limited!(Level::Warn, 10, "[Relay] Malformed packet from {}, dropping", addr);
+                continue;
+            }
+            let header = class.header(i);
+            if class.local & bit != 0 {
+                self.handle_packet(&header, bytes, addr)?;
+            } else {
+                self.forward(&header, bytes, Origin::Peer(addr))?;
+            }
         }
+        Ok(())
     }
 
-    fn handle_core_packet(&mut self, packet: NeonPacket, addr: SocketAddr) -> Result<(), Error> {
-        match packet.packet_type {
-            x if x == CorePacketType::ConnectRequest as u8 => {
-                if let PacketPayload::ConnectRequest(req) = packet.payload {
-                    self.handle_connect_request(req, addr)?;
+    /// Route a batch being replayed, then count and drop what it would have sent
+    fn replay_batch(&mut self, batch: &mut RecvBatch, stats: &mut ReplayStats) -> Result<(), Error> {
+        if batch.len() > 0 {
+            self.receive_batch(batch, batch.len())?;
+            batch.clear();
+        }
+        self.discard_outbound(stats);
+        Ok(())
+    }
+
+    /// Send everything queued, frames waiting on mesh links included, returning
+    /// how many datagrams went out
+    fn flush_outbound(&mut self) -> usize {
+        self.mesh.flush(&mut self.outbound);
+        if self.outbound.is_empty() {
+            return 0;
+        }
+
+        let queued = self.outbound.len();
+        self.metrics.record_out(queued, self.outbound.bytes());
+        if let Err(e) = self.socket.flush(&mut self.outbound) {
+            self.metrics.record_drop(DropReason::SendFailed);
+            log_limited!(Level::Warn, 10, "[Relay] Failed to send queued packets: {}", e);
+        }
+        queued
+    }
+
+    /// Route a validated datagram. Only connection management packets have their
+    /// payload decoded, everything else is forwarded as the original bytes.
+    fn handle_packet(&mut self, header: &PacketHeader, bytes: &[u8], addr: SocketAddr) -> Result<(), Error> {
+        if !header.is_compatible() {
+            self.refuse_version(header, addr);
+            return Ok(());
+        }
+        match header.packet_type {
+            x if x == CorePacketType::ConnectRequest as u8
+                || x == CorePacketType::ConnectAccept as u8
+                || x == CorePacketType::ConnectDeny as u8
+                || x == CorePacketType::Resume as u8 =>
+            {
+                let payload = &bytes[PACKET_HEADER_SIZE..];
+                match PayloadView::parse(header.packet_type, payload) {
+                    Ok(view) => self.handle_core_packet(header, view, payload, addr),
+                    Err(e) => {
+                        self.metrics.record_drop(DropReason::Malformed);
+                        log_limited!(Level::Warn, 10, "[Relay] Failed to decode packet from {}: {}", addr, e);
+                        Ok(())
+                    }
                 }
             }
-            x if x == CorePacketType::ConnectAccept as u8 => {
-                if let PacketPayload::ConnectAccept(accept) = packet.payload.clone() {
-                    if let Some(host_addr) = self.session_manager.hosts.get(&accept.session_id) {
-                        if addr == *host_addr && packet.client_id != 1 {
-                            self.route_connect_accept_to_client(accept, packet.client_id)?;
-                            return Ok(());
-                        }
-                    }
+            x if x == CorePacketType::RelayLink as u8 => self.handle_link(bytes, addr),
+            _ => self.forward(header, bytes, Origin::Peer(addr)),
+        }
+    }
+
+    /// Drop connection management from a peer on another protocol version, whose
+    /// payload can't be decoded. A client asking to join is told why, though one
+    /// older than the request nonce reads the reason with the nonce in front of it.
+    fn refuse_version(&mut self, header: &PacketHeader, addr: SocketAddr) {
+        self.metrics.record_drop(DropReason::VersionMismatch);
+        log_limited!(
+            Level::Warn, 10,
+            "[Relay] Protocol version {} packet from {}, this relay speaks {}, dropping",
+            header.version, addr, PROTOCOL_VERSION
+        );
+        if header.packet_type == CorePacketType::ConnectRequest as u8 {
+            let deny = PacketHeader::new(CorePacketType::ConnectDeny as u8, 1, 0, 0);
+            self.outbound.push_with(addr, |buf| {
+                deny.write_to(buf);
+                buf.extend_from_slice(&0u32.to_le_bytes());
+                buf.extend_from_slice(b"Protocol version mismatch");
+            });
+        }
+    }
+
+    /// Send a packet that isn't connection management on to its destinations
+    fn forward(&mut self, header: &PacketHeader, bytes: &[u8], origin: Origin) -> Result<(), Error> {
+        match header.packet_type {
+            x if x == CorePacketType::Bundle as u8 => self.forward_bundle(header, bytes, origin),
+            x if x == CorePacketType::Multicast as u8 => self.forward_multicast(header, bytes, origin),
+            _ => self.forward_to_peers(header, bytes, origin),
+        }
+    }
+
+    /// Handle a batch of frames from a meshed relay
+    fn handle_link(&mut self, bytes: &[u8], link: SocketAddr) -> Result<(), Error> {
+        if !self.mesh.contains(link) {
+            self.metrics.record_drop(DropReason::UnknownSender);
+            log_limited!(Level::Warn, 10, "[Relay] Relay link packet from {}, which isn't a mesh peer, dropping", link);
+            return Ok(());
+        }
+
+        let payload = &bytes[PACKET_HEADER_SIZE..];
+        let frames_len: usize = mesh::frames(payload).map(|frame| FRAME_HEADER_SIZE + frame.body.len()).sum();
+        if frames_len != payload.len() {
+            self.metrics.record_drop(DropReason::Malformed);
+            log_limited!(Level::Warn, 10, "[Relay] Malformed relay link packet from {}, dropping", link);
+            return Ok(());
+        }
 
-                    if packet.client_id == 1 {
-                        self.session_manager.register_host(accept.session_id, addr);
-                    } else {
-                        self.session_manager.register_client(accept.session_id, packet.client_id, addr);
+        for frame in mesh::frames(payload) {
+            match frame.kind {
+                mesh::FORWARD => self.forward_from_link(frame.session_id, frame.body, link)?,
+                mesh::JOIN => self.handle_mesh_join(frame.session_id, frame.body, link)?,
+                mesh::REPLY => self.handle_mesh_reply(frame.session_id, frame.body, link)?,
+                mesh::PEER_JOINED => {
+                    if let Some(&client_id) = frame.body.first() {
+                        self.session_manager.register_mesh_peer(frame.session_id, client_id, link);
                     }
                 }
-            }
-            x if x == CorePacketType::ConnectDeny as u8 => {
-                if let PacketPayload::ConnectDeny(deny) = packet.payload {
-                    self.handle_connect_deny(deny, addr)?;
+                mesh::PEER_LEFT => {
+                    if let Some(&client_id) = frame.body.first() {
+                        self.session_manager.remove_remote_peer(frame.session_id, client_id, link);
+                    }
                 }
+                _ => {}
             }
+        }
+        Ok(())
+    }
+
+    /// Deliver a packet another relay forwarded for a peer of `session_id`
+    fn forward_from_link(&mut self, session_id: u32, datagram: &[u8], link: SocketAddr) -> Result<(), Error> {
+        let header = match PacketHeader::from_bytes(datagram) {
+            // Connection management is carried by JOIN and REPLY frames, never forwarded
+            Ok(header) if !matches!(header.packet_type, 0x01..=0x03 | 0x0A) && header.packet_type != CorePacketType::RelayLink as u8 => header,
             _ => {
-                self.forward_to_peers(&packet, addr)?;
-                if let Some(session_id) = self.session_manager.find_session_for_addr(addr) {
-                    self.session_manager.update_client_activity(packet.client_id, session_id);
-                }
+                self.metrics.record_drop(DropReason::Malformed);
+                log_limited!(Level::Warn, 10, "[Relay] Malformed packet forwarded by relay {}, dropping", link);
+                return Ok(());
+            }
+        };
+
+        let origin = Origin::Link { link, session_id, client_id: header.client_id };
+        self.forward(&header, datagram, origin)
+    }
+
+    /// A client of another relay asking to join `session_id`, which is only answered
+    /// if the session's host is here
+    fn handle_mesh_join(&mut self, session_id: u32, body: &[u8], link: SocketAddr) -> Result<(), Error> {
+        let request = mesh::decode_addr(body).and_then(|(client_addr, payload)| {
+            match PayloadView::parse(CorePacketType::ConnectRequest as u8, payload) {
+                Ok(PayloadView::ConnectRequest(req)) if req.target_session_id == session_id => Some((client_addr, req, payload)),
+                _ => None,
             }
+        });
+        let Some((client_addr, req, payload)) = request else {
+            self.metrics.record_drop(DropReason::Malformed);
+            log_limited!(Level::Warn, 10, "[Relay] Malformed join forwarded by relay {}, dropping", link);
+            return Ok(());
+        };
+
+        if self.session_manager.hosts.contains_key(&session_id) {
+            self.handle_connect_request(req, payload, client_addr, Some(link))?;
         }
         Ok(())
     }
 
-    fn handle_game_packet(&mut self, packet: NeonPacket, addr: SocketAddr) -> Result<(), Error> {
-        self.forward_to_peers(&packet, addr)?;
-        if let Some(session_id) = self.session_manager.find_session_for_addr(addr) {
-            self.session_manager.update_client_activity(packet.client_id, session_id);
+    /// The answer to a join this relay passed on, from the relay hosting the session
+    fn handle_mesh_reply(&mut self, session_id: u32, datagram: &[u8], link: SocketAddr) -> Result<(), Error> {
+        let reply = PacketHeader::from_bytes(datagram).ok().filter(PacketHeader::is_compatible).and_then(|header| {
+            match PayloadView::parse(header.packet_type, &datagram[PACKET_HEADER_SIZE..]) {
+                Ok(view @ (PayloadView::ConnectAccept(_) | PayloadView::ConnectDeny(_))) => Some((header, view)),
+                _ => None,
+            }
+        });
+
+        match reply {
+            Some((header, PayloadView::ConnectAccept(accept))) if accept.session_id == session_id => {
+                self.route_connect_accept_to_client(accept, header.client_id, Some(link))
+            }
+            Some((_, PayloadView::ConnectDeny(deny))) => self.route_connect_deny_to_client(deny, session_id),
+            _ => {
+                self.metrics.record_drop(DropReason::Malformed);
+                log_limited!(Level::Warn, 10, "[Relay] Malformed join reply from relay {}, dropping", link);
+                Ok(())
+            }
+        }
+    }
+
+    /// Handle a decoded connection management packet. `payload` is the encoded form,
+    /// which requests and denials are forwarded as without re-encoding them.
+    fn handle_core_packet(&mut self, header: &PacketHeader, view: PayloadView, payload: &[u8], addr: SocketAddr) -> Result<(), Error> {
+        match view {
+            PayloadView::ConnectRequest(req) => {
+                self.handle_connect_request(req, payload, addr, None)?;
+            }
+            PayloadView::ConnectAccept(accept) => {
+                if let Some(host_addr) = self.session_manager.hosts.get(&accept.session_id) {
+                    if addr == *host_addr && header.client_id != 1 {
+                        self.route_connect_accept_to_client(accept, header.client_id, None)?;
+                        return Ok(());
+                    }
+                }
+
+                if header.client_id == 1 {
+                    let peer_timeout = (accept.peer_timeout_ms != 0)
+                        .then(|| Duration::from_millis(accept.peer_timeout_ms as u64));
+                    self.session_manager.register_host(accept.session_id, addr, peer_timeout);
+                    self.broadcast(ShardEvent::HostRegistered {
+                        session_id: accept.session_id,
+                        addr,
+                        peer_timeout,
+                    });
+                } else {
+                    // Use the token the host's accept carried, not the one echoed here;
+                    // a repeated confirmation keeps the one already registered
+                    let resume_token = self
+                        .pending_connections
+                        .lock()
+                        .unwrap()
+                        .take_token(accept.session_id, header.client_id)
+                        .or_else(|| {
+                            let session = self.session_manager.sessions.get(&accept.session_id)?;
+                            session.get(header.client_id).map(|peer| peer.resume_token)
+                        })
+                        .unwrap_or(0);
+                    self.session_manager.register_client(accept.session_id, header.client_id, addr, resume_token);
+                    self.broadcast(ShardEvent::ClientRegistered {
+                        session_id: accept.session_id,
+                        client_id: header.client_id,
+                        addr,
+                        resume_token,
+                    });
+                    if let Some(link) = self.session_manager.remote_owner(accept.session_id) {
+                        self.mesh.push(link, mesh::PEER_JOINED, accept.session_id, &[&[header.client_id]], &mut self.outbound);
+                    }
+                }
+            }
+            PayloadView::ConnectDeny(deny) => match self.session_manager.host_session(addr) {
+                Some(session_id) => self.route_connect_deny_to_client(deny, session_id)?,
+                None => log_warn!("[Relay] ConnectDeny from {}, which hosts no session", addr),
+            },
+            PayloadView::Resume(resume) => self.handle_resume(header.client_id, resume, addr),
+            _ => {}
         }
         Ok(())
     }
 
+    /// Move a client whose address changed to `addr` and answer it here, without a
+    /// round trip to the host. The client keeps its id and, since the host isn't
+    /// involved, the SessionConfig and registry it already has. A Resume that isn't
+    /// recognized is denied, and the client joins again with a ConnectRequest.
+    fn handle_resume(&mut self, client_id: u8, resume: Resume, addr: SocketAddr) {
+        let session_id = resume.session_id;
+        if !self.session_manager.resume_client(session_id, client_id, resume.resume_token, addr) {
+            log_limited!(
+                Level::Warn, 10,
+                "[Relay] Resume of client {} in session {} from {} not recognized",
+                client_id, session_id, addr
+            );
+            let header = PacketHeader::new(CorePacketType::ConnectDeny as u8, 1, 0, 0);
+            self.outbound.push_with(addr, |buf| {
+                header.write_to(buf);
+                buf.extend_from_slice(&resume.request_nonce.to_le_bytes());
+                buf.extend_from_slice(b"Resume not recognized");
+            });
+            return;
+        }
+
+        self.broadcast(ShardEvent::ClientRegistered { session_id, client_id, addr, resume_token: resume.resume_token });
+
+        let response_packet = NeonPacket {
+            packet_type: CorePacketType::ConnectAccept as u8,
+            sequence: 1,
+            client_id,
+            destination_id: client_id,
+            payload: PacketPayload::ConnectAccept(ConnectAccept {
+                assigned_client_id: client_id,
+                session_id,
+                peer_timeout_ms: 0,
+                request_nonce: resume.request_nonce,
+                resume_token: resume.resume_token,
+            }),
+        };
+        self.outbound.push_with(addr, |buf| response_packet.write_to(buf));
+    }
+
+    /// Pass a join request to the session's host, or over the mesh when the host is
+    /// on another relay. `via` is the link a request from another relay came over.
+    /// The request goes on with a nonce of this relay's choosing, which the answer
+    /// carries back to find the join again.
     fn handle_connect_request(
         &mut self,
-        req: ConnectRequest,
+        req: ConnectRequestView,
+        payload: &[u8],
         client_addr: SocketAddr,
+        via: Option<SocketAddr>,
     ) -> Result<(), Error> {
         let target_session = req.target_session_id;
 
-        println!(
+        log_info!(
             "[Relay] Client '{}' from {} requesting to join session {}",
             req.desired_name, client_addr, target_session
         );
         
-        if let Some(game_id) = req.game_identifier {
-            println!("[Relay]   Game ID: 0x{:08X}", game_id);
+        if req.game_identifier != 0 {
+            log_debug!("[Relay]   Game ID: 0x{:08X}", req.game_identifier);
         }
 
-        if let Some(host_addr) = self.session_manager.hosts.get(&target_session) {
-            println!(
+        let host_addr = self.session_manager.hosts.get(&target_session).copied();
+        let over_mesh = host_addr.is_none() && via.is_none() && !self.mesh.is_empty();
+        if host_addr.is_none() && !over_mesh {
+            log_warn!(
+                "[Relay] Session {} not found (no host registered)",
+                target_session
+            );
+            return Ok(());
+        }
+
+        let nonce = self.pending_connections.lock().unwrap().insert(PendingConnection {
+            client_addr,
+            session_id: target_session,
+            client_name: req.desired_name.to_string(),
+            via,
+            client_nonce: req.request_nonce,
+        });
+        self.pending_timers.schedule(Instant::now() + PENDING_TIMEOUT, nonce);
+
+        if let Some(host_addr) = host_addr {
+            log_debug!(
                 "[Relay] Forwarding connection request to host at {}",
                 host_addr
             );
 
-            self.pending_connections.insert(
-                client_addr,
-                PendingConnection {
-                    client_addr,
-                    session_id: target_session,
-                    client_name: req.desired_name.clone(),
-                },
-            );
+            let header = PacketHeader::new(CorePacketType::ConnectRequest as u8, 1, 0, 1);
+            self.outbound.push_with(host_addr, |buf| {
+                header.write_to(buf);
+                write_connect_request_with_nonce(payload, nonce, buf);
+            });
+        } else {
+            // Ask the relay known to host the session, or every meshed relay if none is
+            let owner = self.session_manager.remote_owner(target_session);
+            log_debug!("[Relay] Session {} isn't hosted here, passing the request over the mesh", target_session);
 
-            let forward_packet = NeonPacket {
-                packet_type: CorePacketType::ConnectRequest as u8,
-                sequence: 1,
-                client_id: 0,
-                destination_id: 1,
-                payload: PacketPayload::ConnectRequest(req.clone()),
+            let mut addr = [0; MAX_ADDR_SIZE];
+            let addr = mesh::encode_addr(client_addr, &mut addr);
+            let mut request = Vec::with_capacity(payload.len());
+            write_connect_request_with_nonce(payload, nonce, &mut request);
+            match owner {
+                Some(link) => self.mesh.push(link, mesh::JOIN, target_session, &[addr, &request], &mut self.outbound),
+                None => self.mesh.push_all(mesh::JOIN, target_session, &[addr, &request], &mut self.outbound),
             };
-
-            self.socket.send_packet(&forward_packet, *host_addr)?;
-        } else {
-            println!(
-                "[Relay] Session {} not found (no host registered)",
-                target_session
-            );
         }
 
         Ok(())
     }
 
-    fn handle_connect_deny(
-        &mut self,
-        deny: ConnectDeny,
-        host_addr: SocketAddr,
-    ) -> Result<(), Error> {
-        let mut client_addr_to_send = None;
-        
-        for (session_id, host) in &self.session_manager.hosts {
-            if *host == host_addr {
-                for (addr, pending) in &self.pending_connections {
-                    if pending.session_id == *session_id {
-                        client_addr_to_send = Some(*addr);
-                        break;
-                    }
-                }
-                break;
+    /// Drop joins the host never answered
+    fn expire_pending(&mut self, now: Instant) {
+        while let Some(nonce) = self.pending_timers.pop_expired(now) {
+            if let Some(pending) = self.pending_connections.lock().unwrap().remove(nonce) {
+                log_debug!(
+                    "[Relay] Join of '{}' from {} to session {} got no answer, dropping it",
+                    pending.client_name, pending.client_addr, pending.session_id
+                );
             }
         }
-        
-        if let Some(client_addr) = client_addr_to_send {
-            println!(
-                "[Relay] Routing ConnectDeny back to {}",
-                client_addr
-            );
-            
-            let deny_packet = NeonPacket {
-                packet_type: CorePacketType::ConnectDeny as u8,
-                sequence: 1,
-                client_id: 0,
-                destination_id: 0,
-                payload: PacketPayload::ConnectDeny(deny),
-            };
-            
-            self.socket.send_packet(&deny_packet, client_addr)?;
-            self.pending_connections.remove(&client_addr);
-        } else {
-            println!("[Relay] No pending connection found for ConnectDeny");
+    }
+
+    /// Send the host's answer to a join back the way the request came, either to the
+    /// client or over the mesh link it arrived on
+    fn send_join_reply(&mut self, pending: &PendingConnection, write: impl FnOnce(&mut Vec<u8>)) {
+        match pending.via {
+            Some(link) => {
+                let mut datagram = Vec::new();
+                write(&mut datagram);
+                self.mesh.push(link, mesh::REPLY, pending.session_id, &[&datagram], &mut self.outbound);
+            }
+            None => self.outbound.push_with(pending.client_addr, write),
         }
-        
+    }
+
+    fn route_connect_deny_to_client(
+        &mut self,
+        deny: ConnectDenyView,
+        session_id: u32,
+    ) -> Result<(), Error> {
+        let Some(pending) = self.pending_connections.lock().unwrap().take(deny.request_nonce, session_id) else {
+            log_warn!("[Relay] No pending connection found for ConnectDeny");
+            return Ok(());
+        };
+
+        log_debug!(
+            "[Relay] Routing ConnectDeny back to {}",
+            pending.client_addr
+        );
+
+        let header = PacketHeader::new(CorePacketType::ConnectDeny as u8, 1, 0, 0);
+        self.send_join_reply(&pending, |buf| {
+            header.write_to(buf);
+            buf.extend_from_slice(&pending.client_nonce.to_le_bytes());
+            buf.extend_from_slice(deny.reason.as_bytes());
+        });
+
         Ok(())
     }
 
+    /// Route a host's ConnectAccept to the client waiting on it. `from_link` is the
+    /// mesh link it came over, whose relay then hosts the client's session.
     fn route_connect_accept_to_client(
         &mut self,
         accept: ConnectAccept,
         client_id: u8,
+        from_link: Option<SocketAddr>,
     ) -> Result<(), Error> {
-        let mut client_addr_to_send = None;
+        let mut pending_connections = self.pending_connections.lock().unwrap();
+        let Some(pending) = pending_connections.take(accept.request_nonce, accept.session_id) else {
+            log_warn!("[Relay] No pending connection found for ConnectAccept");
+            return Ok(());
+        };
+        // The client registers here, and can't be trusted to echo its token back
+        if pending.via.is_none() {
+            pending_connections.issue_token(accept.session_id, client_id, accept.resume_token);
+        }
+        drop(pending_connections);
 
-        for (addr, pending) in &self.pending_connections {
-            if pending.session_id == accept.session_id {
-                client_addr_to_send = Some(*addr);
-                break;
-            }
+        log_debug!(
+            "[Relay] Routing ConnectAccept for client {} back to {}",
+            client_id, pending.client_addr
+        );
+        if let Some(link) = from_link {
+            self.session_manager.set_remote_owner(accept.session_id, link);
         }
 
-        if let Some(client_addr) = client_addr_to_send {
-            println!(
-                "[Relay] Routing ConnectAccept for client {} back to {}",
-                client_id, client_addr
-            );
+        let response_packet = NeonPacket {
+            packet_type: CorePacketType::ConnectAccept as u8,
+            sequence: 1,
+            client_id,
+            destination_id: client_id,
+            payload: PacketPayload::ConnectAccept(ConnectAccept {
+                request_nonce: pending.client_nonce,
+                ..accept
+            }),
+        };
+        self.send_join_reply(&pending, |buf| response_packet.write_to(buf));
 
-            let response_packet = NeonPacket {
-                packet_type: CorePacketType::ConnectAccept as u8,
-                sequence: 1,
-                client_id,
-                destination_id: client_id,
-                payload: PacketPayload::ConnectAccept(accept),
-            };
+        Ok(())
+    }
 
-            self.socket.send_packet(&response_packet, client_addr)?;
-            self.pending_connections.remove(&client_addr);
-        } else {
-            println!("[Relay] No pending connection found for ConnectAccept");
+    fn forward_to_peers(&mut self, header: &PacketHeader, bytes: &[u8], origin: Origin) -> Result<(), Error> {
+        if header.destination_id == BROADCAST_ID {
+            return self.fan_out(bytes, &PeerSet::all(), origin);
+        }
+
+        match self.session_manager.route(origin, header.destination_id, bytes.len()) {
+            Route::Forward(dest_addr) => {
+                self.outbound.push(bytes, dest_addr);
+            }
+            Route::Mesh { link, session_id } => {
+                self.mesh.push(link, mesh::FORWARD, session_id, &[bytes], &mut self.outbound);
+            }
+            Route::Loopback => {}
+            Route::UnknownDestination => {
+                self.metrics.record_drop(DropReason::UnknownDestination);
+                log_limited!(
+                    Level::Warn, 10,
+                    "[Relay] Destination client {} not found in session, dropping packet from {}",
+                    header.destination_id, origin
+                );
+            }
+            Route::UnknownSender => {
+                self.metrics.record_drop(DropReason::UnknownSender);
+                log_limited!(Level::Warn, 10, "[Relay] Unknown sender: {}, dropping packet", origin);
+            }
         }
 
         Ok(())
     }
 
-    fn forward_to_peers(&self, packet: &NeonPacket, sender_addr: SocketAddr) -> Result<(), Error> {
-        for (_session_id, peers) in &self.session_manager.sessions {
-            if let Some(_sender) = peers.iter().find(|p| p.addr == sender_addr) {
-                if let Some(dest_peer) = peers.iter().find(|p| p.client_id == packet.destination_id) {
-                    if dest_peer.addr != sender_addr {
-                        match self.socket.send_packet(packet, dest_peer.addr) {
-                            Ok(()) => {
-                                // Successfully forwarded
-                            }
-                            Err(e) => {
-                                println!(
-                                    "[Relay] Failed to forward packet from {} to client {} at {}: {}",
-                                    sender_addr, packet.destination_id, dest_peer.addr, e
-                                );
-                            }
-                        }
-                    }
-                } else {
-                    println!(
-                        "[Relay] Destination client {} not found in session, dropping packet from {}",
-                        packet.destination_id, sender_addr
-                    );
-                    println!("{:?}", packet)
+    /// Split a bundle by entry destination and forward one bundle to each destination,
+    /// with the outer header addressed to that peer. Broadcast entries go in every bundle.
+    /// Relays on the mesh get the whole bundle and split it for their own peers.
+    fn forward_bundle(&mut self, header: &PacketHeader, bytes: &[u8], origin: Origin) -> Result<(), Error> {
+        let payload = &bytes[PACKET_HEADER_SIZE..];
+        let entries_len: usize = raw_bundle_entries(payload).map(|(_, entry)| entry.len()).sum();
+        if entries_len != payload.len() {
+            self.metrics.record_drop(DropReason::Malformed);
+            log_limited!(Level::Warn, 10, "[Relay] Malformed bundle from {}, dropping packet", origin);
+            return Ok(());
+        }
+
+        let mut targets = PeerSet::default();
+        for (destination_id, _) in raw_bundle_entries(payload) {
+            targets.insert(destination_id);
+        }
+        if targets.contains(BROADCAST_ID) {
+            targets = PeerSet::all();
+        }
+
+        let bundle_len = |destination_id: u8| {
+            PACKET_HEADER_SIZE + raw_bundle_entries(payload)
+                .filter(|(dest, _)| *dest == destination_id || *dest == BROADCAST_ID)
+                .map(|(_, entry)| entry.len())
+                .sum::<usize>()
+        };
+        let Some(session_id) = self.session_manager.route_set(origin, bytes.len(), &targets, bundle_len, &mut self.fan_out, &mut self.mesh_targets) else {
+            self.metrics.record_drop(DropReason::UnknownSender);
+            log_limited!(Level::Warn, 10, "[Relay] Unknown sender: {}, dropping bundle", origin);
+            return Ok(());
+        };
+
+        for &(destination_id, dest_addr) in &self.fan_out {
+            self.outbound.push_with(dest_addr, |buf| {
+                PacketHeader { destination_id, ..*header }.write_to(buf);
+                for (_, entry) in raw_bundle_entries(payload).filter(|(dest, _)| *dest == destination_id || *dest == BROADCAST_ID) {
+                    buf.extend_from_slice(entry);
                 }
-                
-                return Ok(());
+            });
+        }
+        self.forward_over_mesh(session_id, bytes);
+
+        Ok(())
+    }
+
+    /// Unwrap a multicast packet once and send the resulting game packet, addressed
+    /// to BROADCAST_ID, to every peer in its peer set. Relays on the mesh get the
+    /// multicast as it is and unwrap it for their own peers.
+    fn forward_multicast(&mut self, header: &PacketHeader, bytes: &[u8], origin: Origin) -> Result<(), Error> {
+        let payload = &bytes[PACKET_HEADER_SIZE..];
+        let Some(targets) = PeerSet::from_bytes(payload).filter(|_| payload.len() > PEER_SET_SIZE) else {
+            self.metrics.record_drop(DropReason::Malformed);
+            log_limited!(Level::Warn, 10, "[Relay] Malformed multicast from {}, dropping packet", origin);
+            return Ok(());
+        };
+
+        let out_len = bytes.len() - PEER_SET_SIZE - 1;
+        let Some(session_id) = self.session_manager.route_set(origin, bytes.len(), &targets, |_| out_len, &mut self.fan_out, &mut self.mesh_targets) else {
+            self.metrics.record_drop(DropReason::UnknownSender);
+            log_limited!(Level::Warn, 10, "[Relay] Unknown sender: {}, dropping packet", origin);
+            return Ok(());
+        };
+
+        let mut targets = self.fan_out.iter();
+        if let Some(&(_, first)) = targets.next() {
+            self.outbound.push_with(first, |buf| {
+                PacketHeader {
+                    packet_type: payload[PEER_SET_SIZE],
+                    destination_id: BROADCAST_ID,
+                    ..*header
+                }.write_to(buf);
+                buf.extend_from_slice(&payload[PEER_SET_SIZE + 1..]);
+            });
+            for &(_, dest_addr) in targets {
+                self.outbound.push_repeat(dest_addr);
+            }
+        }
+        self.forward_over_mesh(session_id, bytes);
+
+        Ok(())
+    }
+
+    /// Send one already-encoded datagram to every peer in `targets` but the sender
+    fn fan_out(&mut self, bytes: &[u8], targets: &PeerSet, origin: Origin) -> Result<(), Error> {
+        let Some(session_id) = self.session_manager.route_set(origin, bytes.len(), targets, |_| bytes.len(), &mut self.fan_out, &mut self.mesh_targets) else {
+            self.metrics.record_drop(DropReason::UnknownSender);
+            log_limited!(Level::Warn, 10, "[Relay] Unknown sender: {}, dropping packet", origin);
+            return Ok(());
+        };
+
+        let mut targets = self.fan_out.iter();
+        if let Some(&(_, first)) = targets.next() {
+            self.outbound.push(bytes, first);
+            for &(_, dest_addr) in targets {
+                self.outbound.push_repeat(dest_addr);
             }
         }
+        self.forward_over_mesh(session_id, bytes);
 
-        println!("[Relay] Unknown sender: {}, dropping packet", sender_addr);
         Ok(())
     }
 
+    /// Send the datagram being fanned out once over each mesh link route_set picked
+    fn forward_over_mesh(&mut self, session_id: u32, bytes: &[u8]) {
+        for &link in &self.mesh_targets {
+            self.mesh.push(link, mesh::FORWARD, session_id, &[bytes], &mut self.outbound);
+        }
+    }
+
     pub fn session_count(&self) -> usize {
         self.session_manager.sessions.len()
     }
 
     pub fn total_client_count(&self) -> usize {
         self.session_manager.sessions.values()
-            .map(|peers| peers.len())
+            .map(|session| session.len())
             .sum()
     }
 }
\ No newline at end of file
@@ -1,146 +1,561 @@
 use std::collections::HashMap;
+use std::fmt;
 use std::net::SocketAddr;
+use std::sync::Arc;
 use std::time::{Duration, Instant};
-use super::types::PeerInfo;
+use super::metrics::WorkerMetrics;
+use super::types::{PeerInfo, PeerSet};
+use crate::timer::TimerWheel;
+
+/// Idle timeout for sessions whose host didn't ask for one
+pub const DEFAULT_PEER_TIMEOUT: Duration = Duration::from_secs(15);
+/// Resolution of peer timeouts; they're measured in seconds, so this is plenty
+const TIMER_TICK: Duration = Duration::from_millis(100);
+
+/// A local client's idle timer
+#[derive(Debug, Clone, Copy)]
+struct PeerTimer {
+    session_id: u32,
+    client_id: u8,
+    timer_id: u64,
+}
+
+/// Where a packet being routed came from
+#[derive(Debug, Clone, Copy)]
+pub enum Origin {
+    /// Straight from a peer's address
+    Peer(SocketAddr),
+    /// Over the mesh link at `link`, sent by `client_id` of `session_id`
+    Link { link: SocketAddr, session_id: u32, client_id: u8 },
+}
+
+impl Origin {
+    fn link(&self) -> Option<SocketAddr> {
+        match *self {
+            Origin::Peer(_) => None,
+            Origin::Link { link, .. } => Some(link),
+        }
+    }
+}
+
+impl fmt::Display for Origin {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Origin::Peer(addr) => write!(f, "{}", addr),
+            Origin::Link { link, client_id, .. } => write!(f, "client {} via relay {}", client_id, link),
+        }
+    }
+}
+
+/// Outcome of routing a packet from a known sender to a destination client id
+pub enum Route {
+    Forward(SocketAddr),
+    /// Send over the mesh link to the relay the destination is reached through
+    Mesh { link: SocketAddr, session_id: u32 },
+    Loopback,
+    UnknownSender,
+    UnknownDestination,
+}
+
+/// Dense peer table for one session, indexed directly by client_id
+pub struct Session {
+    peers: Vec<Option<PeerInfo>>,
+    peer_count: usize,
+    /// How long a local client may stay silent before it's dropped
+    timeout: Duration,
+}
+
+impl Session {
+    fn new(timeout: Duration) -> Self {
+        Session {
+            peers: Vec::new(),
+            peer_count: 0,
+            timeout,
+        }
+    }
+
+    pub fn get(&self, client_id: u8) -> Option<&PeerInfo> {
+        self.peers.get(client_id as usize).and_then(|p| p.as_ref())
+    }
+
+    fn get_mut(&mut self, client_id: u8) -> Option<&mut PeerInfo> {
+        self.peers.get_mut(client_id as usize).and_then(|p| p.as_mut())
+    }
+
+    /// Insert a peer into its slot, returning the peer it replaced
+    fn insert(&mut self, peer: PeerInfo) -> Option<PeerInfo> {
+        let slot = peer.client_id as usize;
+        if slot >= self.peers.len() {
+            self.peers.resize_with(slot + 1, || None);
+        }
+
+        let previous = self.peers[slot].replace(peer);
+        if previous.is_none() {
+            self.peer_count += 1;
+        }
+        previous
+    }
+
+    fn remove(&mut self, client_id: u8) -> Option<PeerInfo> {
+        let previous = self.peers.get_mut(client_id as usize).and_then(|p| p.take());
+        if previous.is_some() {
+            self.peer_count -= 1;
+        }
+        previous
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &PeerInfo> {
+        self.peers.iter().filter_map(|p| p.as_ref())
+    }
+
+    pub fn len(&self) -> usize {
+        self.peer_count
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.peer_count == 0
+    }
+}
 
 pub struct SessionManager {
-    pub sessions: HashMap<u32, Vec<PeerInfo>>,
+    pub sessions: HashMap<u32, Session>,
     pub hosts: HashMap<u32, SocketAddr>,
+    /// Session each host address registered, the reverse of `hosts`
+    host_sessions: HashMap<SocketAddr, u32>,
+    addr_index: HashMap<SocketAddr, (u32, u8)>,
+    /// Mesh link of the relay hosting each session whose host isn't on this one
+    remote_owners: HashMap<u32, SocketAddr>,
+    metrics: Arc<WorkerMetrics>,
+    /// Idle timers of local clients. Activity only updates last_seen; a timer that
+    /// fires for a peer seen since is scheduled again for the new deadline.
+    timers: TimerWheel<PeerTimer>,
+    next_timer_id: u64,
+    default_timeout: Duration,
 }
 
 impl SessionManager {
-    pub fn new() -> Self {
+    pub fn new(metrics: Arc<WorkerMetrics>) -> Self {
         SessionManager {
             sessions: HashMap::new(),
             hosts: HashMap::new(),
+            host_sessions: HashMap::new(),
+            addr_index: HashMap::new(),
+            remote_owners: HashMap::new(),
+            metrics,
+            timers: TimerWheel::new(TIMER_TICK),
+            next_timer_id: 1,
+            default_timeout: DEFAULT_PEER_TIMEOUT,
         }
     }
 
-    pub fn cleanup_dead_connections(&mut self) {
-        let timeout = Duration::from_secs(15);
-        let now = Instant::now();
+    /// Idle timeout for sessions created from now on whose host doesn't set one
+    pub fn set_default_timeout(&mut self, timeout: Duration) {
+        self.default_timeout = timeout;
+    }
 
-        let mut sessions_to_remove: Vec<u32> = Vec::new();
+    /// When the next idle timer may fire
+    pub fn next_timeout(&self) -> Option<Instant> {
+        self.timers.next_deadline()
+    }
 
-        for (session_id, peers) in &mut self.sessions {
-            peers.retain(|peer| {
-                if !peer.is_host {
-                    let is_alive = now.duration_since(peer.last_seen) < timeout;
-                    if !is_alive {
-                        println!(
-                            "[Relay] Client {} in session {} timed out",
-                            peer.client_id, session_id
-                        );
-                    }
-                    is_alive
-                } else {
-                    true
-                }
-            });
+    /// Drop local clients that have been silent past their session's timeout and
+    /// sessions left empty, returning the removed peers with the mesh link of their
+    /// session's owner when it is hosted on another relay. Only due timers are looked at.
+    pub fn expire_peers(&mut self, now: Instant) -> Vec<(PeerInfo, Option<SocketAddr>)> {
+        let mut removed = Vec::new();
 
-            if peers.is_empty() {
-                sessions_to_remove.push(*session_id);
+        while let Some(timer) = self.timers.pop_expired(now) {
+            let Some(session) = self.sessions.get_mut(&timer.session_id) else {
+                continue;
+            };
+            let timeout = session.timeout;
+            let Some(peer) = session.get(timer.client_id).filter(|peer| peer.timer_id == timer.timer_id) else {
+                continue;
+            };
+
+            let deadline = peer.last_seen + timeout;
+            if deadline > now {
+                self.timers.schedule(deadline, timer);
+                continue;
+            }
+
+            if let Some(peer) = session.remove(timer.client_id) {
+                self.addr_index.remove(&peer.addr);
+                self.metrics.forget_peer(timer.session_id, timer.client_id);
+                log_info!(
+                    "[Relay] Client {} in session {} timed out",
+                    peer.client_id, timer.session_id
+                );
+                removed.push((peer, self.remote_owners.get(&timer.session_id).copied()));
             }
+            self.remove_if_empty(timer.session_id);
         }
 
-        for session_id in sessions_to_remove {
+        removed
+    }
+
+    fn remove_if_empty(&mut self, session_id: u32) {
+        if self.sessions.get(&session_id).is_some_and(|session| session.is_empty()) {
             self.sessions.remove(&session_id);
-            self.hosts.remove(&session_id);
-            println!("[Relay] Removed empty session {}", session_id)
+            self.remove_host(session_id);
+            self.remote_owners.remove(&session_id);
+            log_info!("[Relay] Removed empty session {}", session_id);
+        }
+    }
+
+    /// Session and client id of a packet's sender, None if it may not send through
+    /// this relay. Packets over a link must come from a peer reached through that
+    /// link or from the relay hosting the session.
+    fn resolve(&self, origin: Origin) -> Option<(u32, u8)> {
+        match origin {
+            Origin::Peer(addr) => self.addr_index.get(&addr).copied(),
+            Origin::Link { link, session_id, client_id } => {
+                let via_link = self.sessions.get(&session_id)
+                    .and_then(|session| session.get(client_id))
+                    .is_some_and(|peer| peer.via_link && peer.addr == link);
+                (via_link || self.remote_owners.get(&session_id) == Some(&link))
+                    .then_some((session_id, client_id))
+            }
         }
     }
 
-    pub fn update_client_activity(&mut self, client_id: u8, session_id: u32) {
-        if let Some(peers) = self.sessions.get_mut(&session_id) {
-            for peer in peers.iter_mut() {
-                if peer.client_id == client_id {
-                    peer.last_seen = Instant::now();
-                    break;
+    /// Resolve the destination for a `len` byte packet from `origin`, mark the
+    /// sender as active and count the packet, using a single sender lookup and
+    /// direct slot accesses
+    pub fn route(&mut self, origin: Origin, destination_id: u8, len: usize) -> Route {
+        let Some((session_id, sender_id)) = self.resolve(origin) else {
+            return Route::UnknownSender;
+        };
+        let owner = self.remote_owners.get(&session_id).copied();
+        let Some(session) = self.sessions.get_mut(&session_id) else {
+            return Route::UnknownSender;
+        };
+
+        if let Some(sender) = session.get_mut(sender_id) {
+            sender.last_seen = Instant::now();
+            sender.counters.record_in(len);
+        }
+
+        match session.get(destination_id) {
+            Some(dest) if dest.client_id == sender_id || (dest.via_link && Some(dest.addr) == origin.link()) => {
+                Route::Loopback
+            }
+            Some(dest) => {
+                dest.counters.record_out(len);
+                if dest.via_link {
+                    Route::Mesh { link: dest.addr, session_id }
+                } else {
+                    Route::Forward(dest.addr)
                 }
             }
+            None => match owner {
+                // Peers of a session hosted elsewhere that aren't here are the owner's to find
+                Some(link) if origin.link().is_none() => Route::Mesh { link, session_id },
+                _ => {
+                    if let Some(sender) = session.get(sender_id) {
+                        sender.counters.record_drop();
+                    }
+                    Route::UnknownDestination
+                }
+            },
         }
     }
 
-    pub fn find_session_for_addr(&self, addr: SocketAddr) -> Option<u32> {
-        for (session_id, peers) in &self.sessions {
-            if peers.iter().any(|p| p.addr == addr) {
-                return Some(*session_id);
+    /// Resolve every peer in the sender's session that is in `targets`, skipping the
+    /// sender itself, mark the sender as active and count the traffic. `out_len` gives
+    /// the bytes each target will be sent. Peers reached through the mesh add their
+    /// link to `links` once, except the link the packet came over, and a packet from
+    /// a local peer of a session hosted elsewhere goes to the owner's link too.
+    /// Returns the session id, None for an unknown sender.
+    pub fn route_set(
+        &mut self,
+        origin: Origin,
+        len: usize,
+        targets: &PeerSet,
+        out_len: impl Fn(u8) -> usize,
+        out: &mut Vec<(u8, SocketAddr)>,
+        links: &mut Vec<SocketAddr>,
+    ) -> Option<u32> {
+        out.clear();
+        links.clear();
+        let (session_id, sender_id) = self.resolve(origin)?;
+        let owner = self.remote_owners.get(&session_id).copied();
+        let session = self.sessions.get_mut(&session_id)?;
+
+        if let Some(sender) = session.get_mut(sender_id) {
+            sender.last_seen = Instant::now();
+            sender.counters.record_in(len);
+        }
+
+        for peer in session.iter() {
+            if !targets.contains(peer.client_id) || peer.client_id == sender_id {
+                continue;
+            }
+            if peer.via_link {
+                if Some(peer.addr) == origin.link() {
+                    continue;
+                }
+                if !links.contains(&peer.addr) {
+                    links.push(peer.addr);
+                }
+            } else {
+                out.push((peer.client_id, peer.addr));
             }
+            peer.counters.record_out(out_len(peer.client_id));
         }
-        None
+
+        if let (Some(owner), None) = (owner, origin.link()) {
+            links.push(owner);
+        }
+        Some(session_id)
     }
 
-    pub fn register_host(&mut self, session_id: u32, addr: SocketAddr) {
-        self.hosts.insert(session_id, addr);
+    /// Register a session's host. `peer_timeout` is the idle timeout the host asked
+    /// for its clients, None for the relay's default.
+    pub fn register_host(&mut self, session_id: u32, addr: SocketAddr, peer_timeout: Option<Duration>) {
+        self.insert_host(session_id, addr);
 
         let peer = PeerInfo {
             addr,
             client_id: 1,
             session_id,
             is_host: true,
+            is_local: true,
+            via_link: false,
             last_seen: Instant::now(),
+            timer_id: 0,
+            resume_token: 0,
+            counters: self.metrics.peer(session_id, 1),
         };
+        self.insert_peer(peer);
+        self.set_session_timeout(session_id, peer_timeout);
 
-        self.sessions
-            .entry(session_id)
-            .or_insert_with(Vec::new)
-            .retain(|p| p.client_id != 1);
-        self.sessions.get_mut(&session_id).unwrap().push(peer);
-
-        println!(
+        log_info!(
             "[Relay] Host registered for session {} at {}",
             session_id, addr
         );
         self.print_active_sessions();
     }
 
-    pub fn register_client(&mut self, session_id: u32, client_id: u8, addr: SocketAddr) {
+    /// Register a client at `addr`; `resume_token` is the one its host issued it
+    pub fn register_client(&mut self, session_id: u32, client_id: u8, addr: SocketAddr, resume_token: u64) {
         let peer = PeerInfo {
             addr,
             client_id,
             session_id,
             is_host: false,
+            is_local: true,
+            via_link: false,
             last_seen: Instant::now(),
+            timer_id: self.next_timer_id,
+            resume_token,
+            counters: self.metrics.peer(session_id, client_id),
         };
+        let (timer_id, last_seen) = (peer.timer_id, peer.last_seen);
+        self.next_timer_id += 1;
+        self.insert_peer(peer);
 
-        self.sessions
-            .entry(session_id)
-            .or_insert_with(Vec::new)
-            .retain(|p| p.client_id != client_id);
-        self.sessions.get_mut(&session_id).unwrap().push(peer);
+        let timeout = self.sessions.get(&session_id).map_or(self.default_timeout, |session| session.timeout);
+        self.timers.schedule(last_seen + timeout, PeerTimer { session_id, client_id, timer_id });
 
-        println!(
+        log_info!(
             "[Relay] Client {} registered to session {} from {}",
             client_id, session_id, addr
         );
         self.print_session_info(session_id);
     }
 
+    /// Move a client to `addr` if `resume_token` is the one it registered with,
+    /// keeping its client id. Returns false for a client that isn't known here,
+    /// presents the wrong token, or is reached through a mesh link.
+    pub fn resume_client(&mut self, session_id: u32, client_id: u8, resume_token: u64, addr: SocketAddr) -> bool {
+        let resumable = self.sessions.get(&session_id).and_then(|session| session.get(client_id)).is_some_and(|peer| {
+            !peer.is_host && !peer.via_link && peer.resume_token != 0 && peer.resume_token == resume_token
+        });
+        if resumable {
+            self.register_client(session_id, client_id, addr, resume_token);
+        }
+        resumable
+    }
+
+    /// Mirror a registration made by another relay worker. A host brings its
+    /// session's peer timeout along, which this worker applies to its own clients.
+    pub fn register_remote_peer(
+        &mut self,
+        session_id: u32,
+        client_id: u8,
+        addr: SocketAddr,
+        is_host: bool,
+        peer_timeout: Option<Duration>,
+        resume_token: u64,
+    ) {
+        if is_host {
+            self.insert_host(session_id, addr);
+        }
+
+        self.insert_peer(PeerInfo {
+            addr,
+            client_id,
+            session_id,
+            is_host,
+            is_local: false,
+            via_link: false,
+            last_seen: Instant::now(),
+            timer_id: 0,
+            resume_token,
+            counters: self.metrics.peer(session_id, client_id),
+        });
+        if is_host {
+            self.set_session_timeout(session_id, peer_timeout);
+        }
+    }
+
+    /// Mirror a client that joined one of this relay's sessions through the relay at
+    /// `link`. Its traffic arrives over the link and that relay owns its timeout.
+    /// Returns false if the session isn't hosted here.
+    pub fn register_mesh_peer(&mut self, session_id: u32, client_id: u8, link: SocketAddr) -> bool {
+        if !self.hosts.contains_key(&session_id) {
+            return false;
+        }
+
+        self.insert_peer(PeerInfo {
+            addr: link,
+            client_id,
+            session_id,
+            is_host: false,
+            is_local: false,
+            via_link: true,
+            last_seen: Instant::now(),
+            timer_id: 0,
+            resume_token: 0,
+            counters: self.metrics.peer(session_id, client_id),
+        });
+
+        log_info!(
+            "[Relay] Client {} registered to session {} through relay {}",
+            client_id, session_id, link
+        );
+        self.print_session_info(session_id);
+        true
+    }
+
+    /// Record that the relay at `link` hosts a session this relay has clients joining
+    pub fn set_remote_owner(&mut self, session_id: u32, link: SocketAddr) {
+        self.remote_owners.insert(session_id, link);
+    }
+
+    /// Mesh link of the relay hosting a session, None if it's hosted here or unknown
+    pub fn remote_owner(&self, session_id: u32) -> Option<SocketAddr> {
+        self.remote_owners.get(&session_id).copied()
+    }
+
+    /// Session hosted from `addr`, if any
+    pub fn host_session(&self, addr: SocketAddr) -> Option<u32> {
+        self.host_sessions.get(&addr).copied()
+    }
+
+    fn insert_host(&mut self, session_id: u32, addr: SocketAddr) {
+        if let Some(previous) = self.hosts.insert(session_id, addr) {
+            if previous != addr && self.host_sessions.get(&previous) == Some(&session_id) {
+                self.host_sessions.remove(&previous);
+            }
+        }
+        self.host_sessions.insert(addr, session_id);
+    }
+
+    fn remove_host(&mut self, session_id: u32) {
+        if let Some(addr) = self.hosts.remove(&session_id) {
+            if self.host_sessions.get(&addr) == Some(&session_id) {
+                self.host_sessions.remove(&addr);
+            }
+        }
+    }
+
+    /// Apply a host's timeout, or the default, to its session. Timers already
+    /// running pick it up when they next fire.
+    fn set_session_timeout(&mut self, session_id: u32, peer_timeout: Option<Duration>) {
+        let timeout = peer_timeout.unwrap_or(self.default_timeout);
+        if let Some(session) = self.sessions.get_mut(&session_id) {
+            session.timeout = timeout;
+        }
+    }
+
+    /// Remove a peer that another relay worker or a meshed relay timed out, if it is
+    /// still bound to `addr`
+    pub fn remove_remote_peer(&mut self, session_id: u32, client_id: u8, addr: SocketAddr) {
+        let Some(session) = self.sessions.get_mut(&session_id) else {
+            return;
+        };
+
+        if session.get(client_id).is_some_and(|peer| peer.addr == addr) {
+            if let Some(peer) = session.remove(client_id) {
+                if !peer.via_link {
+                    self.addr_index.remove(&addr);
+                }
+            }
+            self.metrics.forget_peer(session_id, client_id);
+        }
+
+        if session.is_empty() {
+            self.sessions.remove(&session_id);
+            self.remove_host(session_id);
+            self.remote_owners.remove(&session_id);
+        }
+    }
+
+    /// Place a peer in its session slot and keep the address index consistent,
+    /// evicting whatever previously owned the slot or the address. Peers reached
+    /// through a mesh link share its address and stay out of the index.
+    fn insert_peer(&mut self, peer: PeerInfo) {
+        let (addr, session_id, client_id) = (peer.addr, peer.session_id, peer.client_id);
+
+        let previous = if peer.via_link { None } else { self.addr_index.insert(addr, (session_id, client_id)) };
+        if let Some((old_session, old_client)) = previous {
+            if (old_session, old_client) != (session_id, client_id) {
+                if let Some(session) = self.sessions.get_mut(&old_session) {
+                    session.remove(old_client);
+                }
+                self.metrics.forget_peer(old_session, old_client);
+                if old_session != session_id {
+                    self.remove_if_empty(old_session);
+                }
+            }
+        }
+
+        let default_timeout = self.default_timeout;
+        let session = self.sessions.entry(session_id).or_insert_with(|| Session::new(default_timeout));
+        if let Some(replaced) = session.insert(peer) {
+            if replaced.addr != addr && !replaced.via_link {
+                self.addr_index.remove(&replaced.addr);
+            }
+        }
+    }
+
     pub fn print_active_sessions(&self) {
-        println!("\n=== Active Sessions ===");
+        if !crate::log::enabled(crate::log::Level::Debug) {
+            return;
+        }
         if self.sessions.is_empty() {
-            println!("No active sessions");
-        } else {
-            for (session_id, peers) in &self.sessions {
-                let host_count = peers.iter().filter(|p| p.is_host).count();
-                let client_count = peers.iter().filter(|p| !p.is_host).count();
-                println!(
-                    "Session {}: {} host(s), {} client(s)",
-                    session_id, host_count, client_count
-                );
-            }
+            log_debug!("[Relay] No active sessions");
+        }
+        for (session_id, session) in &self.sessions {
+            let host_count = session.iter().filter(|p| p.is_host).count();
+            let client_count = session.iter().filter(|p| !p.is_host).count();
+            log_debug!(
+                "[Relay] Session {}: {} host(s), {} client(s)",
+                session_id, host_count, client_count
+            );
         }
-        println!("========================\n");
     }
 
     fn print_session_info(&self, session_id: u32) {
-        if let Some(peers) = self.sessions.get(&session_id) {
-            let clients: Vec<_> = peers.iter().filter(|p| !p.is_host).collect();
-            println!(
-                "  Session {} now has {} client(s) connected",
+        if let Some(session) = self.sessions.get(&session_id) {
+            let clients = session.iter().filter(|p| !p.is_host).count();
+            log_debug!(
+                "[Relay] Session {} now has {} client(s) connected",
                 session_id,
-                clients.len()
+                clients
             );
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,88 @@
+use std::io::{Error, ErrorKind};
+use std::net::{SocketAddr, UdpSocket};
+use std::sync::mpsc::{channel, Receiver, Sender};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+use super::types::PendingJoins;
+
+/// Registration changes one worker announces to the others.
+/// Only connect/register traffic produces these, forwarding never does.
+#[derive(Debug, Clone)]
+pub enum ShardEvent {
+    HostRegistered { session_id: u32, addr: SocketAddr, peer_timeout: Option<Duration> },
+    ClientRegistered { session_id: u32, client_id: u8, addr: SocketAddr, resume_token: u64 },
+    PeerRemoved { session_id: u32, client_id: u8, addr: SocketAddr },
+}
+
+/// Pending joins are looked up by whichever worker receives the host's reply,
+/// so they live in one table shared by every worker
+pub type SharedPending = Arc<Mutex<PendingJoins>>;
+
+/// A worker's connection to the other workers of a sharded relay
+pub struct ShardLink {
+    inbox: Receiver<ShardEvent>,
+    waker: UdpSocket,
+    peers: Vec<(Sender<ShardEvent>, SocketAddr)>,
+}
+
+impl ShardLink {
+    /// Build fully connected links for `workers` workers
+    pub fn create(workers: usize) -> Result<Vec<ShardLink>, Error> {
+        let mut wakers = Vec::with_capacity(workers);
+        let mut senders = Vec::with_capacity(workers);
+        let mut inboxes = Vec::with_capacity(workers);
+
+        for _ in 0..workers {
+            let waker = UdpSocket::bind("127.0.0.1:0")?;
+            waker.set_nonblocking(true)?;
+            let (tx, rx) = channel();
+            senders.push((tx, waker.local_addr()?));
+            wakers.push(waker);
+            inboxes.push(rx);
+        }
+
+        Ok(wakers
+            .into_iter()
+            .zip(inboxes)
+            .enumerate()
+            .map(|(index, (waker, inbox))| ShardLink {
+                inbox,
+                waker,
+                peers: senders
+                    .iter()
+                    .enumerate()
+                    .filter(|(other, _)| *other != index)
+                    .map(|(_, peer)| peer.clone())
+                    .collect(),
+            })
+            .collect())
+    }
+
+    /// Socket that becomes readable whenever another worker sends an event
+    pub fn waker(&self) -> &UdpSocket {
+        &self.waker
+    }
+
+    /// Send an event to every other worker and wake them up
+    pub fn broadcast(&self, event: ShardEvent) {
+        for (sender, waker_addr) in &self.peers {
+            if sender.send(event.clone()).is_ok() {
+                let _ = self.waker.send_to(&[0], waker_addr);
+            }
+        }
+    }
+
+    /// Collect every event delivered since the last call
+    pub fn drain(&self) -> Result<Vec<ShardEvent>, Error> {
+        let mut buf = [0; 1];
+        loop {
+            match self.waker.recv_from(&mut buf) {
+                Ok(_) => {}
+                Err(e) if e.kind() == ErrorKind::WouldBlock => break,
+                Err(e) => return Err(e),
+            }
+        }
+        Ok(self.inbox.try_iter().collect())
+    }
+}
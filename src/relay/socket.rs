@@ -1,50 +1,355 @@
-use std::io::Error;
-use std::net::{SocketAddr, UdpSocket};
-use super::types::{NeonPacket, PacketHeader, PacketPayload};
+use std::io::{Error, ErrorKind};
+use std::net::{Ipv4Addr, SocketAddr, UdpSocket};
+use std::time::Duration;
+use super::types::{DEFAULT_MAX_PACKET_SIZE, MAX_DATAGRAM_SIZE};
+
+/// Maximum number of datagrams moved per receive or transmit syscall
+pub const BATCH_SIZE: usize = 32;
 
 pub struct NeonSocket {
     socket: UdpSocket,
 }
 
+/// Fixed set of receive buffers filled by a single `receive_batch` call
+pub struct RecvBatch {
+    bufs: Vec<[u8; MAX_DATAGRAM_SIZE]>,
+    lens: [usize; BATCH_SIZE],
+    addrs: [SocketAddr; BATCH_SIZE],
+    count: usize,
+}
+
+impl RecvBatch {
+    pub fn new() -> Self {
+        RecvBatch {
+            bufs: vec![[0; MAX_DATAGRAM_SIZE]; BATCH_SIZE],
+            lens: [0; BATCH_SIZE],
+            addrs: [SocketAddr::from((Ipv4Addr::UNSPECIFIED, 0)); BATCH_SIZE],
+            count: 0,
+        }
+    }
+
+    /// Get the bytes and source address of the datagram at `index`
+    pub fn get(&self, index: usize) -> (&[u8], SocketAddr) {
+        (&self.bufs[index][..self.lens[index]], self.addrs[index])
+    }
+
+    /// Length of the datagram at `index`
+    pub fn datagram_len(&self, index: usize) -> usize {
+        self.lens[index]
+    }
+
+    /// First 8 bytes of the buffer at `index` as a little endian word, whatever was received
+    pub fn header_word(&self, index: usize) -> u64 {
+        u64::from_le_bytes(self.bufs[index][..8].try_into().unwrap())
+    }
+
+    /// Datagrams in the batch
+    pub fn len(&self) -> usize {
+        self.count
+    }
+
+    /// Empty the batch, to fill it with `push` rather than from the socket
+    pub fn clear(&mut self) {
+        self.count = 0;
+    }
+
+    /// Add a datagram that didn't come from the socket, returning false when the batch is full
+    pub fn push(&mut self, bytes: &[u8], addr: SocketAddr) -> bool {
+        if self.count == BATCH_SIZE || bytes.len() > MAX_DATAGRAM_SIZE {
+            return false;
+        }
+        self.bufs[self.count][..bytes.len()].copy_from_slice(bytes);
+        self.lens[self.count] = bytes.len();
+        self.addrs[self.count] = addr;
+        self.count += 1;
+        true
+    }
+}
+
+/// Outbound datagrams queued during one loop iteration and flushed together
+pub struct SendQueue {
+    data: Vec<u8>,
+    entries: Vec<(usize, usize, SocketAddr)>,
+}
+
+impl SendQueue {
+    pub fn new() -> Self {
+        SendQueue {
+            data: Vec::with_capacity(BATCH_SIZE * DEFAULT_MAX_PACKET_SIZE),
+            entries: Vec::with_capacity(BATCH_SIZE),
+        }
+    }
+
+    /// Queue an already-encoded datagram unchanged
+    pub fn push(&mut self, bytes: &[u8], addr: SocketAddr) {
+        let offset = self.data.len();
+        self.data.extend_from_slice(bytes);
+        self.entries.push((offset, bytes.len(), addr));
+    }
+
+    /// Build a datagram in place; `write` appends its bytes to the queue buffer
+    pub fn push_with(&mut self, addr: SocketAddr, write: impl FnOnce(&mut Vec<u8>)) {
+        let offset = self.data.len();
+        write(&mut self.data);
+        self.entries.push((offset, self.data.len() - offset, addr));
+    }
+
+    /// Queue the most recently pushed datagram again for another address,
+    /// sharing its bytes instead of copying them
+    pub fn push_repeat(&mut self, addr: SocketAddr) {
+        if let Some(&(offset, len, _)) = self.entries.last() {
+            self.entries.push((offset, len, addr));
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Total bytes of the queued datagrams, repeats included
+    pub fn bytes(&self) -> usize {
+        self.entries.iter().map(|&(_, len, _)| len).sum()
+    }
+
+    pub fn clear(&mut self) {
+        self.data.clear();
+        self.entries.clear();
+    }
+}
+
 impl NeonSocket {
     pub fn new(addr: &str) -> Result<Self, Error> {
         let socket = UdpSocket::bind(addr)?;
         Ok(NeonSocket { socket })
     }
 
+    /// Bind with SO_REUSEPORT so several workers can share one address,
+    /// the kernel spreading datagrams between them by source address
+    #[cfg(unix)]
+    pub fn bind_reuseport(addr: &str) -> Result<Self, Error> {
+        use socket2::{Domain, Protocol, Socket, Type};
+        use std::net::ToSocketAddrs;
+
+        let addr = addr
+            .to_socket_addrs()?
+            .next()
+            .ok_or_else(|| Error::new(ErrorKind::InvalidInput, "Bind address did not resolve"))?;
+
+        let socket = Socket::new(Domain::for_address(addr), Type::DGRAM, Some(Protocol::UDP))?;
+        socket.set_reuse_port(true)?;
+        socket.bind(&addr.into())?;
+        Ok(NeonSocket { socket: socket.into() })
+    }
+
+    #[cfg(not(unix))]
+    pub fn bind_reuseport(_addr: &str) -> Result<Self, Error> {
+        Err(Error::new(ErrorKind::Unsupported, "SO_REUSEPORT is not available on this platform"))
+    }
+
+    pub fn local_addr(&self) -> Result<SocketAddr, Error> {
+        self.socket.local_addr()
+    }
+
+    /// Another handle to the same socket, for reading its state from other threads
+    pub fn try_clone(&self) -> Result<UdpSocket, Error> {
+        self.socket.try_clone()
+    }
+
     pub fn set_nonblocking(&self, nonblocking: bool) -> Result<(), Error> {
         self.socket.set_nonblocking(nonblocking)
     }
 
-    pub fn send_packet(&self, packet: &NeonPacket, addr: SocketAddr) -> Result<(), Error> {
-        let header = PacketHeader {
-            magic: 0x4E45,
-            version: 1,
-            packet_type: packet.packet_type,
-            sequence: packet.sequence,
-            client_id: packet.client_id,
-            destination_id: packet.destination_id,
+    /// Block until a datagram is available or `timeout` elapses
+    pub fn wait_readable(&self, timeout: Option<Duration>) -> Result<bool, Error> {
+        crate::reactor::wait_readable(&self.socket, timeout)
+    }
+
+    /// Block until this socket or `other` is readable, or `timeout` elapses
+    pub fn wait_readable_with(&self, other: &UdpSocket, timeout: Option<Duration>) -> Result<bool, Error> {
+        crate::reactor::wait_readable_any(&[&self.socket, other], timeout)
+    }
+
+    /// Receive up to `BATCH_SIZE` datagrams with a single recvmmsg call
+    #[cfg(target_os = "linux")]
+    pub fn receive_batch(&self, batch: &mut RecvBatch) -> Result<usize, Error> {
+        use std::os::unix::io::AsRawFd;
+
+        let mut names: [libc::sockaddr_storage; BATCH_SIZE] = unsafe { std::mem::zeroed() };
+        let mut iovecs: [libc::iovec; BATCH_SIZE] = unsafe { std::mem::zeroed() };
+        let mut msgs: [libc::mmsghdr; BATCH_SIZE] = unsafe { std::mem::zeroed() };
+
+        for i in 0..BATCH_SIZE {
+            iovecs[i].iov_base = batch.bufs[i].as_mut_ptr() as *mut libc::c_void;
+            iovecs[i].iov_len = MAX_DATAGRAM_SIZE;
+            msgs[i].msg_hdr.msg_name = &mut names[i] as *mut _ as *mut libc::c_void;
+            msgs[i].msg_hdr.msg_namelen = std::mem::size_of::<libc::sockaddr_storage>() as libc::socklen_t;
+            msgs[i].msg_hdr.msg_iov = &mut iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        let received = unsafe {
+            libc::recvmmsg(
+                self.socket.as_raw_fd(),
+                msgs.as_mut_ptr(),
+                BATCH_SIZE as libc::c_uint,
+                libc::MSG_DONTWAIT,
+                std::ptr::null_mut(),
+            )
         };
-        let mut bytes = header.to_bytes();
-        bytes.extend(packet.payload.to_bytes());
-        self.socket.send_to(&bytes, addr)?;
-        Ok(())
-    }
-
-    pub fn receive_packet(&self) -> Result<(NeonPacket, SocketAddr), Error> {
-        let mut buf = [0; 1024];
-        let (size, addr) = self.socket.recv_from(&mut buf)?;
-        let header = PacketHeader::from_bytes(&buf[..8])?;
-        let payload = PacketPayload::from_bytes(header.packet_type, &buf[8..size])?;
-        Ok((
-            NeonPacket {
-                packet_type: header.packet_type,
-                sequence: header.sequence,
-                client_id: header.client_id,
-                destination_id: header.destination_id,
-                payload,
-            },  
-            addr,
-        ))
-    }
-}
\ No newline at end of file
+        if received < 0 {
+            batch.count = 0;
+            return Err(Error::last_os_error());
+        }
+
+        batch.count = received as usize;
+        for i in 0..batch.count {
+            match sockaddr_to_std(&names[i]) {
+                Some(addr) => {
+                    batch.lens[i] = msgs[i].msg_len as usize;
+                    batch.addrs[i] = addr;
+                }
+                // Unknown address family, an empty datagram is dropped by header validation
+                None => batch.lens[i] = 0,
+            }
+        }
+        Ok(batch.count)
+    }
+
+    /// Receive up to `BATCH_SIZE` datagrams, one recv_from call each
+    #[cfg(not(target_os = "linux"))]
+    pub fn receive_batch(&self, batch: &mut RecvBatch) -> Result<usize, Error> {
+        batch.count = 0;
+        while batch.count < BATCH_SIZE {
+            match self.socket.recv_from(&mut batch.bufs[batch.count]) {
+                Ok((size, addr)) => {
+                    batch.lens[batch.count] = size;
+                    batch.addrs[batch.count] = addr;
+                    batch.count += 1;
+                }
+                Err(e) if e.kind() == ErrorKind::WouldBlock && batch.count > 0 => break,
+                Err(e) => return Err(e),
+            }
+        }
+        Ok(batch.count)
+    }
+
+    /// Send every queued datagram using sendmmsg, `BATCH_SIZE` at a time.
+    /// A datagram that fails is skipped so the rest still go out, and the first
+    /// error is returned once the queue has been drained. The queue is always cleared.
+    #[cfg(target_os = "linux")]
+    pub fn flush(&self, queue: &mut SendQueue) -> Result<(), Error> {
+        use std::os::unix::io::AsRawFd;
+
+        let mut first_error = None;
+        let mut start = 0;
+
+        while start < queue.entries.len() {
+            let chunk = &queue.entries[start..(start + BATCH_SIZE).min(queue.entries.len())];
+
+            let mut names: [libc::sockaddr_storage; BATCH_SIZE] = unsafe { std::mem::zeroed() };
+            let mut iovecs: [libc::iovec; BATCH_SIZE] = unsafe { std::mem::zeroed() };
+            let mut msgs: [libc::mmsghdr; BATCH_SIZE] = unsafe { std::mem::zeroed() };
+
+            for (i, &(offset, len, addr)) in chunk.iter().enumerate() {
+                iovecs[i].iov_base = queue.data[offset..].as_ptr() as *mut libc::c_void;
+                iovecs[i].iov_len = len;
+                msgs[i].msg_hdr.msg_namelen = std_to_sockaddr(&addr, &mut names[i]);
+                msgs[i].msg_hdr.msg_name = &mut names[i] as *mut _ as *mut libc::c_void;
+                msgs[i].msg_hdr.msg_iov = &mut iovecs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            let sent = unsafe {
+                libc::sendmmsg(
+                    self.socket.as_raw_fd(),
+                    msgs.as_mut_ptr(),
+                    chunk.len() as libc::c_uint,
+                    libc::MSG_DONTWAIT,
+                )
+            };
+
+            if sent < 0 {
+                let e = Error::last_os_error();
+                if e.kind() == ErrorKind::WouldBlock {
+                    // Socket buffer is full, drop the remainder rather than stall the relay
+                    first_error.get_or_insert(e);
+                    break;
+                }
+                first_error.get_or_insert(e);
+                start += 1;
+            } else {
+                start += sent as usize;
+            }
+        }
+
+        queue.clear();
+        first_error.map_or(Ok(()), Err)
+    }
+
+    /// Send every queued datagram, one send_to call each
+    #[cfg(not(target_os = "linux"))]
+    pub fn flush(&self, queue: &mut SendQueue) -> Result<(), Error> {
+        let mut first_error = None;
+
+        for &(offset, len, addr) in &queue.entries {
+            if let Err(e) = self.socket.send_to(&queue.data[offset..offset + len], addr) {
+                first_error.get_or_insert(e);
+            }
+        }
+
+        queue.clear();
+        first_error.map_or(Ok(()), Err)
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn sockaddr_to_std(storage: &libc::sockaddr_storage) -> Option<SocketAddr> {
+    use std::net::{Ipv6Addr, SocketAddrV4, SocketAddrV6};
+
+    match storage.ss_family as libc::c_int {
+        libc::AF_INET => {
+            let sin = unsafe { &*(storage as *const _ as *const libc::sockaddr_in) };
+            let ip = Ipv4Addr::from(sin.sin_addr.s_addr.to_ne_bytes());
+            Some(SocketAddr::V4(SocketAddrV4::new(ip, u16::from_be(sin.sin_port))))
+        }
+        libc::AF_INET6 => {
+            let sin6 = unsafe { &*(storage as *const _ as *const libc::sockaddr_in6) };
+            let ip = Ipv6Addr::from(sin6.sin6_addr.s6_addr);
+            Some(SocketAddr::V6(SocketAddrV6::new(
+                ip,
+                u16::from_be(sin6.sin6_port),
+                sin6.sin6_flowinfo,
+                sin6.sin6_scope_id,
+            )))
+        }
+        _ => None,
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn std_to_sockaddr(addr: &SocketAddr, storage: &mut libc::sockaddr_storage) -> libc::socklen_t {
+    match addr {
+        SocketAddr::V4(a) => {
+            let sin = unsafe { &mut *(storage as *mut _ as *mut libc::sockaddr_in) };
+            sin.sin_family = libc::AF_INET as libc::sa_family_t;
+            sin.sin_port = a.port().to_be();
+            sin.sin_addr = libc::in_addr {
+                s_addr: u32::from_ne_bytes(a.ip().octets()),
+            };
+            std::mem::size_of::<libc::sockaddr_in>() as libc::socklen_t
+        }
+        SocketAddr::V6(a) => {
+            let sin6 = unsafe { &mut *(storage as *mut _ as *mut libc::sockaddr_in6) };
+            sin6.sin6_family = libc::AF_INET6 as libc::sa_family_t;
+            sin6.sin6_port = a.port().to_be();
+            sin6.sin6_flowinfo = a.flowinfo();
+            sin6.sin6_addr.s6_addr = a.ip().octets();
+            sin6.sin6_scope_id = a.scope_id();
+            std::mem::size_of::<libc::sockaddr_in6>() as libc::socklen_t
+        }
+    }
+}
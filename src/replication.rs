@@ -0,0 +1,564 @@
+//! Delta-compressed snapshot replication, layered on game packets.
+//!
+//! The host registers entities as opaque byte blobs and flushes once per tick. Each
+//! client is sent a snapshot encoded against the newest snapshot it acknowledged:
+//! entities it already holds unchanged cost nothing, changed ones cost a bitmask of
+//! the bytes that differ plus their XOR with the baseline. Snapshots travel as plain
+//! game packets, so a lost one is never resent; the client acks what it applies and
+//! the host simply encodes the next one against that. A per-tick byte budget caps
+//! each snapshot. A snapshot the budget cut short is marked partial: the client only
+//! applies the entities it carries and keeps what it already shows for the rest, since
+//! those may be newer in a snapshot it got after the baseline.
+//!
+//! Snapshot: kind u8 (1), sequence u16, baseline u16, flags u8 (bit 0: has baseline,
+//! bit 1: partial),
+//! entry count u16, then per entry: entity id u16, op u8 and
+//!   full:   length u16, state
+//!   delta:  length u16, changed-byte bitmask (length / 8 rounded up), XOR of each changed byte
+//!   remove: nothing
+//! Ack: kind u8 (2), sequence u16
+
+use std::collections::{BTreeMap, HashMap, VecDeque};
+
+use crate::channel::sequence_newer;
+use crate::pool::BufferPool;
+
+pub type EntityId = u16;
+
+const KIND_SNAPSHOT: u8 = 1;
+const KIND_ACK: u8 = 2;
+const HAS_BASELINE: u8 = 0x01;
+const PARTIAL: u8 = 0x02;
+const OP_FULL: u8 = 1;
+const OP_DELTA: u8 = 2;
+const OP_REMOVE: u8 = 3;
+
+const SNAPSHOT_HEADER_SIZE: usize = 8;
+const ENTRY_HEADER_SIZE: usize = 3;
+pub const ACK_SIZE: usize = 3;
+
+/// Snapshots the host sends past a client's baseline before starting over from scratch.
+/// Clients keep twice as many, so the baseline is always still there.
+const MAX_UNACKED: usize = 32;
+const HISTORY: usize = MAX_UNACKED * 2;
+/// Entity state buffers each side keeps for reuse
+const POOL_LIMIT: usize = 4096;
+
+/// Entity states sorted by id
+type View = Vec<(EntityId, Vec<u8>)>;
+
+struct Snapshot {
+    sequence: u16,
+    view: View,
+}
+
+fn copy_view(view: &View, pool: &mut BufferPool) -> View {
+    view.iter().map(|(id, state)| (*id, pool.copy_of(state))).collect()
+}
+
+fn release_view(view: View, pool: &mut BufferPool) {
+    for (_, state) in view {
+        pool.put(state);
+    }
+}
+
+fn set_state(view: &mut View, id: EntityId, state: &[u8], pool: &mut BufferPool) {
+    match view.binary_search_by_key(&id, |(entity, _)| *entity) {
+        Ok(index) => {
+            let current = &mut view[index].1;
+            current.clear();
+            current.extend_from_slice(state);
+        }
+        Err(index) => view.insert(index, (id, pool.copy_of(state))),
+    }
+}
+
+fn remove_state(view: &mut View, id: EntityId, pool: &mut BufferPool) {
+    if let Ok(index) = view.binary_search_by_key(&id, |(entity, _)| *entity) {
+        pool.put(view.remove(index).1);
+    }
+}
+
+/// Bytes a delta of `state` against `base` takes, entry header included
+fn delta_size(base: &[u8], state: &[u8]) -> usize {
+    let changed = base.iter().zip(state).filter(|(a, b)| a != b).count();
+    ENTRY_HEADER_SIZE + 2 + state.len().div_ceil(8) + changed
+}
+
+/// What a snapshot entry does to an entity
+#[derive(Clone, Copy)]
+enum Change {
+    Full,
+    Delta,
+    Remove,
+}
+
+/// Host side: the authoritative entities and what each client has acknowledged
+pub struct Replicator {
+    packet_type: u8,
+    bytes_per_second: u32,
+    entities: BTreeMap<EntityId, Vec<u8>>,
+    clients: HashMap<u8, ClientReplica>,
+    pool: BufferPool,
+    /// Entities that differ from a client's baseline, reused across clients and ticks
+    changes: Vec<(EntityId, Change)>,
+    /// Encoded snapshot, reused for every client
+    out: Vec<u8>,
+}
+
+struct ClientReplica {
+    next_sequence: u16,
+    /// Newest snapshot the client acknowledged
+    baseline: Option<Snapshot>,
+    /// Snapshots sent since, oldest first
+    sent: VecDeque<Snapshot>,
+    /// Changes after this entity go first when the budget cuts a snapshot short
+    cursor: EntityId,
+}
+
+impl Replicator {
+    pub fn new(packet_type: u8, bytes_per_second: u32) -> Self {
+        Self {
+            packet_type,
+            bytes_per_second,
+            entities: BTreeMap::new(),
+            clients: HashMap::new(),
+            pool: BufferPool::new(POOL_LIMIT),
+            changes: Vec::new(),
+            out: Vec::new(),
+        }
+    }
+
+    /// Game packet type snapshots and acks travel as
+    pub fn packet_type(&self) -> u8 {
+        self.packet_type
+    }
+
+    /// Bytes each snapshot may use at `tick_rate` snapshots per second
+    pub fn tick_budget(&self, tick_rate: u16) -> usize {
+        (self.bytes_per_second / tick_rate.max(1) as u32) as usize
+    }
+
+    pub fn contains(&self, id: EntityId) -> bool {
+        self.entities.contains_key(&id)
+    }
+
+    /// Set an entity's state, adding it if it's new
+    pub fn set(&mut self, id: EntityId, state: &[u8]) {
+        match self.entities.get_mut(&id) {
+            Some(current) => {
+                current.clear();
+                current.extend_from_slice(state);
+            }
+            None => {
+                let state = self.pool.copy_of(state);
+                self.entities.insert(id, state);
+            }
+        }
+    }
+
+    pub fn remove(&mut self, id: EntityId) -> bool {
+        match self.entities.remove(&id) {
+            Some(state) => {
+                self.pool.put(state);
+                true
+            }
+            None => false,
+        }
+    }
+
+    /// Encode the next snapshot for `client_id`, using about `budget` bytes and never
+    /// more than `limit`. Returns None when the client is already up to date.
+    pub fn build(&mut self, client_id: u8, budget: usize, limit: usize) -> Option<&[u8]> {
+        let client = self.clients.entry(client_id).or_insert_with(|| ClientReplica {
+            next_sequence: 0,
+            baseline: None,
+            sent: VecDeque::new(),
+            cursor: 0,
+        });
+
+        // Too long without an ack: the client may no longer hold the baseline
+        if client.sent.len() >= MAX_UNACKED {
+            for snapshot in client.baseline.take().into_iter().chain(client.sent.drain(..)) {
+                release_view(snapshot.view, &mut self.pool);
+            }
+        }
+
+        let empty = View::new();
+        let base = client.baseline.as_ref().map_or(&empty, |snapshot| &snapshot.view);
+
+        // Merge the baseline with the entities to find what changed, in id order
+        self.changes.clear();
+        let mut base_iter = base.iter().peekable();
+        for (&id, state) in &self.entities {
+            while let Some((removed, _)) = base_iter.next_if(|(entity, _)| *entity < id) {
+                self.changes.push((*removed, Change::Remove));
+            }
+            match base_iter.next_if(|(entity, _)| *entity == id) {
+                Some((_, held)) if held == state => {}
+                Some((_, held)) if held.len() == state.len() => {
+                    let change = if delta_size(held, state) < ENTRY_HEADER_SIZE + 2 + state.len() { Change::Delta } else { Change::Full };
+                    self.changes.push((id, change));
+                }
+                _ => self.changes.push((id, Change::Full)),
+            }
+        }
+        self.changes.extend(base_iter.map(|(removed, _)| (*removed, Change::Remove)));
+
+        if self.changes.is_empty() && client.baseline.is_some() {
+            return None;
+        }
+
+        let sequence = client.next_sequence;
+        client.next_sequence = client.next_sequence.wrapping_add(1);
+
+        let out = &mut self.out;
+        out.clear();
+        out.push(KIND_SNAPSHOT);
+        out.extend_from_slice(&sequence.to_le_bytes());
+        match &client.baseline {
+            Some(baseline) => {
+                out.extend_from_slice(&baseline.sequence.to_le_bytes());
+                out.push(HAS_BASELINE);
+            }
+            None => out.extend_from_slice(&[0, 0, 0]),
+        }
+        out.extend_from_slice(&[0, 0]);
+
+        // Start after the last entity sent when the budget ran out, so none starve
+        let start = self.changes.iter().position(|(id, _)| *id > client.cursor).unwrap_or(0);
+        let mut view = copy_view(base, &mut self.pool);
+        let mut count: u16 = 0;
+        for index in (start..self.changes.len()).chain(0..start) {
+            let (id, change) = self.changes[index];
+            let state = self.entities.get(&id).map(Vec::as_slice).unwrap_or_default();
+            let held = base
+                .binary_search_by_key(&id, |(entity, _)| *entity)
+                .map_or(&[][..], |index| &base[index].1);
+            let size = match change {
+                Change::Full => ENTRY_HEADER_SIZE + 2 + state.len(),
+                Change::Delta => delta_size(held, state),
+                Change::Remove => ENTRY_HEADER_SIZE,
+            };
+
+            // The first entry always goes out so one large entity can't stall the rest
+            if out.len() + size > limit || (count > 0 && out.len() + size > budget) {
+                if out.len() + size > limit && count == 0 {
+                    log_limited!(crate::log::Level::Warn, 1, "[Host] Entity {} is too large to replicate", id);
+                    continue;
+                }
+                break;
+            }
+
+            out.extend_from_slice(&id.to_le_bytes());
+            match change {
+                Change::Full => {
+                    out.push(OP_FULL);
+                    out.extend_from_slice(&(state.len() as u16).to_le_bytes());
+                    out.extend_from_slice(state);
+                    set_state(&mut view, id, state, &mut self.pool);
+                }
+                Change::Delta => {
+                    out.push(OP_DELTA);
+                    out.extend_from_slice(&(state.len() as u16).to_le_bytes());
+                    let mask_start = out.len();
+                    out.resize(mask_start + state.len().div_ceil(8), 0);
+                    for (byte, (old, new)) in held.iter().zip(state).enumerate() {
+                        if old != new {
+                            out[mask_start + byte / 8] |= 1 << (byte % 8);
+                            out.push(old ^ new);
+                        }
+                    }
+                    set_state(&mut view, id, state, &mut self.pool);
+                }
+                Change::Remove => {
+                    out.push(OP_REMOVE);
+                    remove_state(&mut view, id, &mut self.pool);
+                }
+            }
+            count += 1;
+            client.cursor = id;
+        }
+        out[6..8].copy_from_slice(&count.to_le_bytes());
+        if (count as usize) < self.changes.len() {
+            out[5] |= PARTIAL;
+        }
+
+        client.sent.push_back(Snapshot { sequence, view });
+        Some(out)
+    }
+
+    /// Forget a client that left; one reusing its id starts from a full snapshot
+    pub fn remove_client(&mut self, client_id: u8) {
+        let Some(client) = self.clients.remove(&client_id) else {
+            return;
+        };
+        for snapshot in client.sent.into_iter().chain(client.baseline) {
+            release_view(snapshot.view, &mut self.pool);
+        }
+    }
+
+    /// Handle a client's ack, moving its baseline up to the snapshot it names
+    pub fn handle_ack(&mut self, client_id: u8, data: &[u8]) {
+        if data.len() < ACK_SIZE || data[0] != KIND_ACK {
+            return;
+        }
+        let sequence = u16::from_le_bytes([data[1], data[2]]);
+        let Some(client) = self.clients.get_mut(&client_id) else {
+            return;
+        };
+        let Some(position) = client.sent.iter().position(|snapshot| snapshot.sequence == sequence) else {
+            return;
+        };
+
+        for snapshot in client.sent.drain(..position).chain(client.baseline.take()) {
+            release_view(snapshot.view, &mut self.pool);
+        }
+        client.baseline = client.sent.pop_front();
+    }
+}
+
+/// Client side: rebuilds the host's entities from snapshots and acks them
+pub struct SnapshotReceiver {
+    packet_type: u8,
+    /// Recently applied snapshots, any of which the host may use as a baseline
+    history: VecDeque<Snapshot>,
+    /// What the game sees: the newest snapshot applied, and for entities a partial one
+    /// left out, whatever they showed before it
+    current: View,
+    latest: Option<u16>,
+    /// Entities the last decoded snapshot carried entries for
+    carried: Vec<EntityId>,
+    /// Newest sequence applied since the last ack went out
+    pending_ack: Option<u16>,
+    pool: BufferPool,
+}
+
+impl SnapshotReceiver {
+    pub fn new(packet_type: u8) -> Self {
+        Self {
+            packet_type,
+            history: VecDeque::new(),
+            current: View::new(),
+            latest: None,
+            carried: Vec::new(),
+            pending_ack: None,
+            pool: BufferPool::new(POOL_LIMIT),
+        }
+    }
+
+    pub fn packet_type(&self) -> u8 {
+        self.packet_type
+    }
+
+    /// Forget every snapshot, e.g. when joining a new session
+    pub fn clear(&mut self) {
+        for snapshot in self.history.drain(..) {
+            release_view(snapshot.view, &mut self.pool);
+        }
+        release_view(std::mem::take(&mut self.current), &mut self.pool);
+        self.latest = None;
+        self.pending_ack = None;
+    }
+
+    /// State of an entity as of the newest snapshot
+    pub fn entity(&self, id: EntityId) -> Option<&[u8]> {
+        self.current
+            .binary_search_by_key(&id, |(entity, _)| *entity)
+            .ok()
+            .map(|index| self.current[index].1.as_slice())
+    }
+
+    /// Apply a snapshot. If it's the newest yet, `on_entity` is called with each entity
+    /// that changed since the previous one, and with None for each that was removed.
+    /// A partial snapshot only touches the entities it carries.
+    pub fn receive(&mut self, data: &[u8], on_entity: &mut dyn FnMut(EntityId, Option<&[u8]>)) {
+        let Some((snapshot, partial)) = self.decode(data) else {
+            log_limited!(crate::log::Level::Debug, 10, "[Client] Dropping snapshot without a usable baseline");
+            return;
+        };
+        let sequence = snapshot.sequence;
+
+        let newest = self.latest.is_none_or(|latest| sequence_newer(sequence, latest));
+        if newest && partial {
+            // Anything left out keeps its current state rather than the baseline's
+            for &id in &self.carried {
+                match snapshot.view.binary_search_by_key(&id, |(entity, _)| *entity) {
+                    Ok(index) => {
+                        let state = &snapshot.view[index].1;
+                        if self.entity(id) != Some(state.as_slice()) {
+                            set_state(&mut self.current, id, state, &mut self.pool);
+                            on_entity(id, Some(state));
+                        }
+                    }
+                    Err(_) if self.entity(id).is_some() => {
+                        remove_state(&mut self.current, id, &mut self.pool);
+                        on_entity(id, None);
+                    }
+                    Err(_) => {}
+                }
+            }
+        } else if newest {
+            let mut old = self.current.iter().peekable();
+            for (id, state) in &snapshot.view {
+                while let Some((removed, _)) = old.next_if(|(entity, _)| entity < id) {
+                    on_entity(*removed, None);
+                }
+                match old.next_if(|(entity, _)| entity == id) {
+                    Some((_, held)) if held == state => {}
+                    _ => on_entity(*id, Some(state)),
+                }
+            }
+            for (removed, _) in old {
+                on_entity(*removed, None);
+            }
+
+            let view = copy_view(&snapshot.view, &mut self.pool);
+            release_view(std::mem::replace(&mut self.current, view), &mut self.pool);
+        }
+        if newest {
+            self.latest = Some(sequence);
+        }
+
+        if self.pending_ack.is_none_or(|pending| sequence_newer(sequence, pending)) {
+            self.pending_ack = Some(sequence);
+        }
+        if self.history.len() >= HISTORY {
+            if let Some(evicted) = self.history.pop_front() {
+                release_view(evicted.view, &mut self.pool);
+            }
+        }
+        self.history.push_back(snapshot);
+    }
+
+    /// Ack message for the newest snapshot applied since the last call, if any
+    pub fn take_ack(&mut self) -> Option<[u8; ACK_SIZE]> {
+        let sequence = self.pending_ack.take()?;
+        let [low, high] = sequence.to_le_bytes();
+        Some([KIND_ACK, low, high])
+    }
+
+    /// Rebuild the snapshot's full view and whether it's partial, or None if it's
+    /// malformed, a duplicate or its baseline is gone. Fills `carried`.
+    fn decode(&mut self, data: &[u8]) -> Option<(Snapshot, bool)> {
+        if data.len() < SNAPSHOT_HEADER_SIZE || data[0] != KIND_SNAPSHOT {
+            return None;
+        }
+        let sequence = u16::from_le_bytes([data[1], data[2]]);
+        let baseline = u16::from_le_bytes([data[3], data[4]]);
+        let count = u16::from_le_bytes([data[6], data[7]]);
+        if self.history.iter().any(|snapshot| snapshot.sequence == sequence) {
+            return None;
+        }
+
+        let mut view = if data[5] & HAS_BASELINE != 0 {
+            let base = self.history.iter().find(|snapshot| snapshot.sequence == baseline)?;
+            copy_view(&base.view, &mut self.pool)
+        } else {
+            View::new()
+        };
+
+        self.carried.clear();
+        let mut rest = &data[SNAPSHOT_HEADER_SIZE..];
+        for _ in 0..count {
+            match self.apply_entry(&mut view, rest) {
+                Some(len) => {
+                    self.carried.push(u16::from_le_bytes([rest[0], rest[1]]));
+                    rest = &rest[len..];
+                }
+                None => {
+                    release_view(view, &mut self.pool);
+                    return None;
+                }
+            }
+        }
+        Some((Snapshot { sequence, view }, data[5] & PARTIAL != 0))
+    }
+
+    /// Apply one entry to `view` and return its encoded length
+    fn apply_entry(&mut self, view: &mut View, entry: &[u8]) -> Option<usize> {
+        let header = entry.get(..ENTRY_HEADER_SIZE)?;
+        let id = u16::from_le_bytes([header[0], header[1]]);
+        if header[2] == OP_REMOVE {
+            remove_state(view, id, &mut self.pool);
+            return Some(ENTRY_HEADER_SIZE);
+        }
+
+        let len_bytes = entry.get(ENTRY_HEADER_SIZE..ENTRY_HEADER_SIZE + 2)?;
+        let len = u16::from_le_bytes([len_bytes[0], len_bytes[1]]) as usize;
+        let body = &entry[ENTRY_HEADER_SIZE + 2..];
+        match header[2] {
+            OP_FULL => {
+                set_state(view, id, body.get(..len)?, &mut self.pool);
+                Some(ENTRY_HEADER_SIZE + 2 + len)
+            }
+            OP_DELTA => {
+                let index = view.binary_search_by_key(&id, |(entity, _)| *entity).ok()?;
+                let state = &mut view[index].1;
+                if state.len() != len {
+                    return None;
+                }
+                let mask = body.get(..len.div_ceil(8))?;
+                let mut xor = body[mask.len()..].iter();
+                for (byte, value) in state.iter_mut().enumerate() {
+                    if mask[byte / 8] & (1 << (byte % 8)) != 0 {
+                        *value ^= xor.next()?;
+                    }
+                }
+                Some(ENTRY_HEADER_SIZE + 2 + body.len() - xor.len())
+            }
+            _ => None,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const ENTITIES: u16 = 8;
+
+    fn tick(replicator: &mut Replicator, value: u32) {
+        for id in 0..ENTITIES {
+            replicator.set(id, &value.to_le_bytes());
+        }
+    }
+
+    #[test]
+    fn budget_cut_snapshots_never_move_an_entity_backwards() {
+        let mut replicator = Replicator::new(1, 0);
+        let mut receiver = SnapshotReceiver::new(1);
+        let mut seen = [0u32; ENTITIES as usize];
+        let mut on_entity = |id: EntityId, state: Option<&[u8]>| {
+            let state = state.unwrap_or_else(|| panic!("entity {id} reported removed"));
+            let value = u32::from_le_bytes(state.try_into().unwrap());
+            assert!(value >= seen[id as usize], "entity {id} went from {} back to {value}", seen[id as usize]);
+            seen[id as usize] = value;
+        };
+
+        tick(&mut replicator, 1);
+        let full = replicator.build(7, 1200, 1200).unwrap().to_vec();
+        receiver.receive(&full, &mut on_entity);
+        replicator.handle_ack(7, &receiver.take_ack().unwrap());
+
+        // Room for about two entities a tick and no acks, past the point the host
+        // gives up on the baseline and starts over without one
+        for value in 2..MAX_UNACKED as u32 + 10 {
+            tick(&mut replicator, value);
+            let snapshot = replicator.build(7, SNAPSHOT_HEADER_SIZE + 16, 1200).unwrap().to_vec();
+            receiver.receive(&snapshot, &mut on_entity);
+            receiver.take_ack();
+        }
+
+        loop {
+            let Some(snapshot) = replicator.build(7, 1200, 1200).map(<[u8]>::to_vec) else {
+                break;
+            };
+            receiver.receive(&snapshot, &mut on_entity);
+            replicator.handle_ack(7, &receiver.take_ack().unwrap());
+        }
+        for id in 0..ENTITIES {
+            assert_eq!(receiver.entity(id), replicator.entities.get(&id).map(Vec::as_slice));
+        }
+    }
+}
@@ -0,0 +1,165 @@
+//! Hierarchical timer wheel shared by the relay, host and client.
+//!
+//! Four levels of 64 slots: level 0 has one slot per tick, each level above covers
+//! 64 times the span of the one below. Scheduling is O(1), and advancing only
+//! touches slots that hold timers, so expiring costs O(expired) instead of a scan
+//! over every connection. Timers can't be cancelled; owners re-check state when one
+//! fires and schedule again if it came too early, which keeps the common case
+//! (activity pushing a deadline back) free of wheel operations.
+
+use std::time::{Duration, Instant};
+
+const SLOT_BITS: u32 = 6;
+const SLOTS: usize = 1 << SLOT_BITS;
+const SLOT_MASK: u64 = SLOTS as u64 - 1;
+const LEVELS: usize = 4;
+
+struct Level<T> {
+    slots: Vec<Vec<(u64, T)>>,
+    /// Bit n set when slot n holds timers
+    occupied: u64,
+}
+
+pub struct TimerWheel<T> {
+    start: Instant,
+    tick: Duration,
+    /// Next tick to process
+    current: u64,
+    levels: [Level<T>; LEVELS],
+    /// Timers that have expired but not been popped yet
+    ready: Vec<T>,
+    /// Slot contents being cascaded, kept to reuse its allocation
+    scratch: Vec<(u64, T)>,
+}
+
+impl<T> TimerWheel<T> {
+    /// Wheel with the given resolution; deadlines are rounded up to whole ticks
+    pub fn new(tick: Duration) -> Self {
+        Self {
+            start: Instant::now(),
+            tick: tick.max(Duration::from_micros(1)),
+            current: 0,
+            levels: std::array::from_fn(|_| Level {
+                slots: (0..SLOTS).map(|_| Vec::new()).collect(),
+                occupied: 0,
+            }),
+            ready: Vec::new(),
+            scratch: Vec::new(),
+        }
+    }
+
+    /// Fire `value` at `deadline`. Deadlines past the wheel's span fire early at the
+    /// end of it, and deadlines already passed fire on the next `pop_expired`.
+    pub fn schedule(&mut self, deadline: Instant, value: T) {
+        let tick = deadline
+            .saturating_duration_since(self.start)
+            .as_nanos()
+            .div_ceil(self.tick.as_nanos()) as u64;
+        self.insert(tick, value);
+    }
+
+    fn insert(&mut self, tick: u64, value: T) {
+        if tick < self.current {
+            self.ready.push(value);
+            return;
+        }
+
+        let delta = tick - self.current;
+        let level = (0..LEVELS)
+            .find(|&level| delta < 1 << (SLOT_BITS * (level as u32 + 1)))
+            .unwrap_or(LEVELS - 1);
+        let max = self.current + (1 << (SLOT_BITS * LEVELS as u32)) - 1;
+        let tick = tick.min(max);
+        let slot = ((tick >> (SLOT_BITS * level as u32)) & SLOT_MASK) as usize;
+
+        let level = &mut self.levels[level];
+        level.slots[slot].push((tick, value));
+        level.occupied |= 1 << slot;
+    }
+
+    /// Take the next timer due by `now`, in no particular order among those due
+    pub fn pop_expired(&mut self, now: Instant) -> Option<T> {
+        if self.ready.is_empty() {
+            self.advance(now);
+        }
+        self.ready.pop()
+    }
+
+    /// Process every tick up to `now`, skipping runs of empty slots
+    fn advance(&mut self, now: Instant) {
+        let target = (now.saturating_duration_since(self.start).as_nanos() / self.tick.as_nanos()) as u64;
+
+        while self.current <= target && self.ready.is_empty() {
+            let tick = self.current;
+            if tick & SLOT_MASK == 0 {
+                self.cascade(tick);
+            }
+
+            let slot = (tick & SLOT_MASK) as usize;
+            let level = &mut self.levels[0];
+            if level.occupied & (1 << slot) != 0 {
+                level.occupied &= !(1 << slot);
+                self.ready.extend(level.slots[slot].drain(..).map(|(_, value)| value));
+            }
+
+            // Jump to the next occupied level 0 slot or the next cascade, whichever is
+            // first, but not past `now` or timers scheduled later would land behind us
+            let pending = self.levels[0].occupied >> slot >> 1;
+            let next = if pending != 0 && slot + 1 < SLOTS {
+                tick + 1 + pending.trailing_zeros() as u64
+            } else {
+                (tick | SLOT_MASK) + 1
+            };
+            self.current = next.min(target + 1);
+        }
+    }
+
+    /// Move the timers of every higher level slot that starts at `tick` down a level
+    fn cascade(&mut self, tick: u64) {
+        for level in (1..LEVELS).rev() {
+            let shift = SLOT_BITS * level as u32;
+            if tick & ((1 << shift) - 1) != 0 {
+                continue;
+            }
+
+            let slot = ((tick >> shift) & SLOT_MASK) as usize;
+            if self.levels[level].occupied & (1 << slot) == 0 {
+                continue;
+            }
+            self.levels[level].occupied &= !(1 << slot);
+            std::mem::swap(&mut self.scratch, &mut self.levels[level].slots[slot]);
+            let mut entries = std::mem::take(&mut self.scratch);
+            for (deadline, value) in entries.drain(..) {
+                self.insert(deadline, value);
+            }
+            self.scratch = entries;
+        }
+    }
+
+    /// Earliest time a timer may be due, for sizing a poll timeout. Timers on the
+    /// higher levels report when their slot is next cascaded, which is never late.
+    pub fn next_deadline(&self) -> Option<Instant> {
+        if !self.ready.is_empty() {
+            return Some(self.start);
+        }
+
+        let mut next: Option<u64> = None;
+        let position = (self.current & SLOT_MASK) as u32;
+        let occupied = self.levels[0].occupied;
+        if occupied != 0 {
+            // Level 0 slots hold the next 64 ticks, counted from the current slot
+            let distance = occupied.rotate_right(position).trailing_zeros() as u64;
+            next = Some(self.current + distance);
+        }
+        for level in 1..LEVELS {
+            if self.levels[level].occupied != 0 {
+                let span = 1u64 << (SLOT_BITS * level as u32);
+                let boundary = (self.current + span - 1) / span * span;
+                next = Some(next.map_or(boundary, |next| next.min(boundary)));
+                break;
+            }
+        }
+
+        next.map(|tick| self.start + Duration::from_nanos((self.tick.as_nanos() as u64).saturating_mul(tick)))
+    }
+}
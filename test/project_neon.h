@@ -12,6 +12,108 @@ extern "C" {
 typedef struct NeonClientHandle NeonClientHandle;
 typedef struct NeonHostHandle NeonHostHandle;
 
+/**
+ * Log levels for neon_set_log_level; a message is kept when its level is at or below the current one
+ */
+typedef enum NeonLogLevel {
+    NEON_LOG_OFF = 0,
+    NEON_LOG_ERROR = 1,
+    NEON_LOG_WARN = 2,
+    NEON_LOG_INFO = 3,    /* Default */
+    NEON_LOG_DEBUG = 4,
+    NEON_LOG_TRACE = 5
+} NeonLogLevel;
+
+/**
+ * Receives library log messages
+ * @param level One of NeonLogLevel
+ * @param message NUL-terminated message, valid only for the duration of the call
+ */
+typedef void (*NeonLogCallback)(uint8_t level, const char* message);
+
+/**
+ * Delivery guarantees for neon_client_send_on_channel / neon_host_send_on_channel
+ * Channel state is kept per peer; acks are piggybacked on channel traffic
+ */
+typedef enum NeonChannel {
+    NEON_CHANNEL_UNRELIABLE_SEQUENCED = 1, /**< Latest wins: late packets are dropped, nothing is resent */
+    NEON_CHANNEL_RELIABLE_UNORDERED = 2,   /**< Resent until acknowledged, delivered once in any order */
+    NEON_CHANNEL_RELIABLE_ORDERED = 3,     /**< Resent until acknowledged, delivered once in send order */
+} NeonChannel;
+
+/**
+ * How readily a game packet type is shed when a peer's link is congested
+ * Each peer's send rate is estimated from reliable channel acks and paced with a
+ * token bucket; reliable channel packets wait for it instead of being shed.
+ * Nothing is shed to a peer until its rate has been measured this way.
+ * A shed send returns false and neon_get_last_error reads "Packet shed, the link to the peer is congested".
+ */
+typedef enum NeonPriority {
+    NEON_PRIORITY_RELIABLE = 0, /**< Never shed (default) */
+    NEON_PRIORITY_STATE = 1,    /**< Shed once the peer's budget is spent */
+    NEON_PRIORITY_COSMETIC = 2, /**< Shed first, once half the peer's budget is spent */
+} NeonPriority;
+
+/**
+ * Link estimates for one peer, see neon_client_get_link_stats / neon_host_get_link_stats
+ */
+typedef struct NeonLinkStats {
+    uint32_t rtt_us;         /**< Smoothed round trip time, 0 until measured */
+    float loss;              /**< Smoothed share of reliable packets that timed out, 0 to 1 */
+    uint32_t send_rate;      /**< Estimated bandwidth, bytes per second */
+    uint32_t reserved;
+    uint64_t bytes_sent;     /**< Bytes charged to the peer's pacer, headers included */
+    uint64_t shed_state;     /**< NEON_PRIORITY_STATE packets shed */
+    uint64_t shed_cosmetic;  /**< NEON_PRIORITY_COSMETIC packets shed */
+} NeonLinkStats;
+
+/** Size in bytes of an encoded packet header */
+#define NEON_PACKET_HEADER_SIZE 8
+
+/**
+ * Packet header, for engines that do their own I/O with neon_encode_header / neon_decode_header
+ * Multi-byte fields are host order here and little endian on the wire
+ */
+typedef struct NeonPacketHeader {
+    uint16_t magic;          /**< 0x4E45 */
+    uint8_t version;         /**< Protocol version, currently 2 */
+    uint8_t packet_type;
+    uint16_t sequence;
+    uint8_t client_id;       /**< Sender */
+    uint8_t destination_id;  /**< 0 broadcasts to the session */
+} NeonPacketHeader;
+
+/**
+ * Kinds of NeonEvent, see neon_client_enable_event_queue
+ */
+typedef enum NeonEventKind {
+    NEON_EVENT_GAME_PACKET = 1,          /**< packet_type, from_client_id, sequence, payload and arrival timestamp */
+    NEON_EVENT_PONG = 2,                 /**< response_time_ms and timestamp */
+    NEON_EVENT_SESSION_CONFIG = 3,       /**< version, tick_rate and max_packet_size */
+    NEON_EVENT_PACKET_TYPE_REGISTRY = 4, /**< Registry cached, read it with neon_client_lookup_packet_type */
+    NEON_EVENT_UNHANDLED_PACKET = 5,     /**< packet_type and from_client_id */
+    NEON_EVENT_WRONG_DESTINATION = 6,    /**< destination_id */
+} NeonEventKind;
+
+/**
+ * One queued client event; fields not used by its kind are zero
+ */
+typedef struct NeonEvent {
+    uint8_t kind;            /**< One of NeonEventKind */
+    uint8_t packet_type;
+    uint8_t from_client_id;
+    uint8_t destination_id;
+    uint16_t sequence;
+    uint16_t tick_rate;
+    uint16_t max_packet_size;
+    uint8_t version;
+    uint8_t reserved;
+    uint32_t payload_offset; /**< Position in the event slab, use neon_client_event_payload */
+    uint32_t payload_len;
+    uint64_t response_time_ms;
+    uint64_t timestamp;
+} NeonEvent;
+
 /**
  * Called when a pong response is received
  * @param response_time_ms Round-trip time in milliseconds
@@ -28,7 +130,10 @@ typedef void (*PongCallback)(uint64_t response_time_ms, uint64_t timestamp);
 typedef void (*SessionConfigCallback)(uint8_t version, uint16_t tick_rate, uint16_t max_packet_size);
 
 /**
- * Called when packet type registry is received from the host
+ * Called when the session's packet type registry is known: received from the host,
+ * or already cached because an earlier session used the same registry version
+ * The arrays and strings point into the client's cache and stay valid until the next
+ * registry arrives or the client is freed
  * @param count Number of packet types in the registry
  * @param ids Array of packet IDs (length = count)
  * @param names Array of packet names as null-terminated strings (length = count)
@@ -36,6 +141,17 @@ typedef void (*SessionConfigCallback)(uint8_t version, uint16_t tick_rate, uint1
  */
 typedef void (*PacketTypeRegistryCallback)(size_t count, const uint8_t* ids, const char** names, const char** descriptions);
 
+/**
+ * Called when a game packet (type 0x10+) is received
+ * The payload pointer refers to the library's receive buffer and is only valid
+ * for the duration of the callback - copy it if you need to keep it
+ * @param packet_type The game-defined packet type
+ * @param from_client_id Client ID that sent the packet
+ * @param payload Pointer to the packet payload (excluding the header)
+ * @param len Payload length in bytes
+ */
+typedef void (*GamePacketCallback)(uint8_t packet_type, uint8_t from_client_id, const uint8_t* payload, size_t len);
+
 /**
  * Called when an unhandled/unknown packet type is received
  * @param packet_type The type ID of the unhandled packet
@@ -50,6 +166,24 @@ typedef void (*UnhandledPacketCallback)(uint8_t packet_type, uint8_t from_client
  */
 typedef void (*WrongDestinationCallback)(uint8_t my_id, uint8_t packet_destination_id);
 
+/**
+ * Called when a connect attempt finishes
+ * @param success true if the host accepted the client
+ * @param client_id Assigned client ID (0 on failure)
+ * @param session_id Session the client tried to join
+ * @param reason Empty on success, otherwise why the attempt failed (only valid during the call)
+ */
+typedef void (*ConnectResultCallback)(bool success, uint8_t client_id, uint32_t session_id, const char* reason);
+
+/**
+ * Called for each replicated entity that changed in the newest snapshot from the host
+ * The state pointer is only valid for the duration of the callback
+ * @param entity_id Entity the host registered
+ * @param state New entity state, NULL if the host removed the entity
+ * @param len State length in bytes (0 when removed)
+ */
+typedef void (*EntityUpdateCallback)(uint16_t entity_id, const uint8_t* state, size_t len);
+
 /**
  * Called when a client successfully connects to the session
  * @param client_id The assigned client ID
@@ -65,6 +199,13 @@ typedef void (*ClientConnectCallback)(uint8_t client_id, const char* name, uint3
  */
 typedef void (*ClientDenyCallback)(const char* name, const char* reason);
 
+/**
+ * Called when a client announces it is leaving; its id may be given to a later client
+ * @param client_id The client's ID
+ * @param name The client's name (null-terminated string)
+ */
+typedef void (*ClientDisconnectCallback)(uint8_t client_id, const char* name);
+
 /**
  * Called when a ping packet is received from a client
  * @param from_client_id The client ID that sent the ping
@@ -109,6 +250,25 @@ void neon_client_set_session_config_callback(NeonClientHandle* client, SessionCo
  */
 void neon_client_set_packet_type_registry_callback(NeonClientHandle* client, PacketTypeRegistryCallback callback);
 
+/**
+ * Look up a packet type in the client's cached registry
+ * @param client Client handle
+ * @param packet_type Packet type to look up
+ * @param name Receives the name, may be NULL
+ * @param description Receives the description, may be NULL
+ * @return true if the host described this packet type, false otherwise
+ * Note: The strings stay valid until the next registry arrives or the client is freed
+ */
+bool neon_client_lookup_packet_type(NeonClientHandle* client, uint8_t packet_type, const char** name, const char** description);
+
+/**
+ * Set callback for game packet events (0x10+)
+ * When no game packet callback is set, game packets go to the unhandled packet callback
+ * @param client Client handle
+ * @param callback Callback function pointer
+ */
+void neon_client_set_game_packet_callback(NeonClientHandle* client, GamePacketCallback callback);
+
 /**
  * Set callback for unhandled packet events
  * @param client Client handle
@@ -124,7 +284,106 @@ void neon_client_set_unhandled_packet_callback(NeonClientHandle* client, Unhandl
 void neon_client_set_wrong_destination_callback(NeonClientHandle* client, WrongDestinationCallback callback);
 
 /**
- * Connect the client to a session through a relay
+ * Set callback for the outcome of a connect attempt
+ * Fires for neon_client_connect, neon_client_connect_async and the resume calls
+ * @param client Client handle
+ * @param callback Callback function pointer
+ */
+void neon_client_set_connect_result_callback(NeonClientHandle* client, ConnectResultCallback callback);
+
+/**
+ * Read the socket on a background thread from now on
+ * Datagrams are timestamped as they arrive, so pong RTTs don't include frame time,
+ * and the kernel buffer keeps draining during hitches. Handling, callbacks included,
+ * still happens in neon_client_process_packets.
+ * @param client Client handle
+ * @return true on success, false on failure
+ */
+bool neon_client_start_receive_thread(NeonClientHandle* client);
+
+/**
+ * Record every datagram the client receives, with its arrival time and source, to a
+ * capture file at path, replacing the file and any capture in progress. A background
+ * thread writes the file; datagrams it can't keep up with are left out.
+ * The file format is described in the README
+ * @param client Client handle
+ * @param path File path
+ * @return true on success, false on failure
+ */
+bool neon_client_start_capture(NeonClientHandle* client, const char* path);
+
+/**
+ * Finish the capture in progress, writing out everything recorded
+ * @param client Client handle
+ */
+void neon_client_stop_capture(NeonClientHandle* client);
+
+/**
+ * Hold game packets for a playout delay and deliver each sender's packets in sequence order
+ * Packets arriving after a newer one from the same sender was delivered are dropped.
+ * Channel packets are unaffected.
+ * @param client Client handle
+ * @param delay_ms Playout delay in milliseconds, 0 to turn the buffer off (default)
+ */
+void neon_client_set_jitter_buffer(NeonClientHandle* client, uint32_t delay_ms);
+
+/**
+ * Apply entity snapshots from the host instead of delivering them as game packets
+ * Each applied snapshot is acknowledged, so the host encodes the next one against it.
+ * @param client Client handle
+ * @param packet_type Packet type the host passed to neon_host_enable_replication
+ * @return true on success, false on failure
+ */
+bool neon_client_enable_replication(NeonClientHandle* client, uint8_t packet_type);
+
+/**
+ * Set callback for replicated entity changes
+ * Runs in neon_client_process_packets, even when the event queue is enabled
+ * @param client Client handle
+ * @param callback Callback function pointer
+ */
+void neon_client_set_entity_callback(NeonClientHandle* client, EntityUpdateCallback callback);
+
+/**
+ * Queue events instead of calling the callbacks above (the connect result callback still fires)
+ * Packets are still read by neon_client_process_packets, which may run on a network thread
+ * while one other thread drains the queue with neon_client_poll_events. Nothing locks.
+ * Events that arrive while the queue is full are dropped and counted.
+ * Call before the client is shared between threads.
+ * @param client Client handle
+ * @param capacity Events the queue holds
+ * @param slab_size Bytes of payload the queue holds
+ * @return true on success, false on failure
+ */
+bool neon_client_enable_event_queue(NeonClientHandle* client, size_t capacity, size_t slab_size);
+
+/**
+ * Take queued events in arrival order
+ * Payloads of the events returned by the previous call are released
+ * @param client Client handle
+ * @param out Array receiving the events
+ * @param max Length of out
+ * @return Number of events written to out
+ */
+size_t neon_client_poll_events(NeonClientHandle* client, NeonEvent* out, size_t max);
+
+/**
+ * Get the payload of an event, valid until the next neon_client_poll_events call
+ * @param client Client handle
+ * @param event Event returned by the last neon_client_poll_events call
+ * @return Pointer to event->payload_len bytes, or NULL when the queue isn't enabled
+ */
+const uint8_t* neon_client_event_payload(NeonClientHandle* client, const NeonEvent* event);
+
+/**
+ * Get the number of events dropped because the queue was full
+ * @param client Client handle
+ * @return Dropped event count
+ */
+uint64_t neon_client_get_dropped_events(NeonClientHandle* client);
+
+/**
+ * Connect the client to a session through a relay (BLOCKS until answered or timed out)
  * @param client Client handle
  * @param session_id Session ID to connect to
  * @param relay_addr Relay address (e.g. "127.0.0.1:7777")
@@ -132,6 +391,45 @@ void neon_client_set_wrong_destination_callback(NeonClientHandle* client, WrongD
  */
 bool neon_client_connect(NeonClientHandle* client, uint32_t session_id, const char* relay_addr);
 
+/**
+ * Start connecting to a session without blocking
+ * Keep calling neon_client_process_packets; the connect result callback reports the outcome
+ * The attempt fails if the host has not answered within 10 seconds
+ * @param client Client handle
+ * @param session_id Session ID to connect to
+ * @param relay_addr Relay address (e.g. "127.0.0.1:7777")
+ * @return true if the request was sent, false on failure
+ */
+bool neon_client_connect_async(NeonClientHandle* client, uint32_t session_id, const char* relay_addr);
+
+/**
+ * Resume the current session after the client's network changed
+ * Opens a fresh local socket and asks the relay to move the client to it, which takes
+ * one round trip instead of a full connect. The client keeps its ID, its channels and
+ * the session config and registry it was sent.
+ * If the relay no longer knows the client, the client is left disconnected and
+ * has to connect again.
+ * @param client Client handle
+ * @return true once the relay has moved the client, false on failure
+ */
+bool neon_client_resume(NeonClientHandle* client);
+
+/**
+ * Start resuming the current session without blocking
+ * Keep calling neon_client_process_packets; the connect result callback reports the outcome
+ * The attempt fails if the relay has not answered within 2 seconds
+ * @param client Client handle
+ * @return true if the request was sent, false on failure
+ */
+bool neon_client_resume_async(NeonClientHandle* client);
+
+/**
+ * Check if a connect attempt is still waiting for the host
+ * @param client Client handle
+ * @return true while connecting, false otherwise
+ */
+bool neon_client_is_connecting(NeonClientHandle* client);
+
 /**
  * Process incoming packets
  * Call this regularly in your game loop (e.g. every tick/frame)
@@ -141,6 +439,63 @@ bool neon_client_connect(NeonClientHandle* client, uint32_t session_id, const ch
  */
 bool neon_client_process_packets(NeonClientHandle* client);
 
+/**
+ * Send a game packet to another peer in the session
+ * The header and payload are written into a reusable send buffer, no allocation is made
+ * @param client Client handle
+ * @param packet_type Game-defined packet type (must be 0x10 or above)
+ * @param destination_id Target client ID (1 = host, 0 = every other peer)
+ * @param data Payload bytes (may be NULL if len is 0)
+ * @param len Payload length in bytes
+ * @return true on success, false on failure or if the packet was shed (see NeonPriority)
+ */
+bool neon_client_send(NeonClientHandle* client, uint8_t packet_type, uint8_t destination_id, const uint8_t* data, size_t len);
+
+/**
+ * Send one game packet that the relay copies to every listed peer
+ * Only one copy leaves this machine; the relay fans it out
+ * @param client Client handle
+ * @param packet_type Game-defined packet type (must be 0x10 or above)
+ * @param targets Client IDs to deliver to (may be NULL if target_count is 0)
+ * @param target_count Number of entries in targets
+ * @param data Payload bytes (may be NULL if len is 0)
+ * @param len Payload length in bytes (33 bytes less than plain sends allow)
+ * @return true on success, false on failure
+ */
+bool neon_client_send_multicast(NeonClientHandle* client, uint8_t packet_type, const uint8_t* targets, size_t target_count, const uint8_t* data, size_t len);
+
+/**
+ * Send a game packet to another peer in the session on a delivery channel
+ * Reliable packets are resent with RTT-based timeouts until acknowledged. Up to 256 per
+ * channel wait while the peer falls behind; past that the send fails.
+ * @param client Client handle
+ * @param channel One of NeonChannel
+ * @param packet_type Game-defined packet type (must be 0x10 or above)
+ * @param destination_id Target client ID
+ * @param data Payload bytes (may be NULL if len is 0)
+ * @param len Payload length in bytes (8 bytes less than plain sends allow)
+ * @return true on success, false on failure or if the packet was shed (see NeonPriority)
+ */
+bool neon_client_send_on_channel(NeonClientHandle* client, uint8_t channel, uint8_t packet_type, uint8_t destination_id, const uint8_t* data, size_t len);
+
+/**
+ * Enable or disable packet bundling. While enabled, game, channel and ack
+ * messages are coalesced into datagrams of up to the max packet size; the
+ * relay splits bundles by destination. Call neon_client_flush once per tick to send them.
+ * Disabling bundling flushes anything pending.
+ * @param client Client handle
+ * @param enabled true to bundle outgoing messages
+ * @return true on success, false on failure
+ */
+bool neon_client_set_bundling(NeonClientHandle* client, bool enabled);
+
+/**
+ * Send the pending bundle, if any
+ * @param client Client handle
+ * @return true on success, false on failure
+ */
+bool neon_client_flush(NeonClientHandle* client);
+
 /**
  * Get the client's assigned ID
  * @param client Client handle
@@ -155,6 +510,33 @@ uint8_t neon_client_get_id(NeonClientHandle* client);
  */
 uint32_t neon_client_get_session_id(NeonClientHandle* client);
 
+/**
+ * Get the max packet size negotiated with the host
+ * Starts at 1024 and is updated when the session config arrives
+ * @param client Client handle
+ * @return Max packet size in bytes, header included
+ */
+uint16_t neon_client_get_max_packet_size(NeonClientHandle* client);
+
+/**
+ * Get the link estimates for a peer; the host's RTT also folds in pongs
+ * @param client Client handle
+ * @param peer_id Peer to query, usually 1 for the host
+ * @param stats Filled in on success
+ * @return true on success, false if nothing has been exchanged with that peer yet
+ */
+bool neon_client_get_link_stats(NeonClientHandle* client, uint8_t peer_id, NeonLinkStats* stats);
+
+/**
+ * Set how readily packets of a game type are shed when a peer's link is congested
+ * Broadcasts and multicasts are never paced
+ * @param client Client handle
+ * @param packet_type Game packet type (0x10+)
+ * @param priority One of NeonPriority
+ * @return true on success, false for an unknown priority
+ */
+bool neon_client_set_packet_priority(NeonClientHandle* client, uint8_t packet_type, uint8_t priority);
+
 /**
  * Check if the client is connected
  * @param client Client handle
@@ -162,6 +544,14 @@ uint32_t neon_client_get_session_id(NeonClientHandle* client);
  */
 bool neon_client_is_connected(NeonClientHandle* client);
 
+/**
+ * Leave the current session, telling the host so it can reuse the client ID
+ * A connect attempt still in progress is abandoned
+ * @param client Client handle
+ * @return true on success, false if the notice couldn't be sent (the client is disconnected either way)
+ */
+bool neon_client_disconnect(NeonClientHandle* client);
+
 /**
  * Manually send a ping packet
  * @param client Client handle
@@ -191,6 +581,30 @@ void neon_client_free(NeonClientHandle* client);
  */
 NeonHostHandle* neon_host_new(uint32_t session_id, const char* relay_addr);
 
+/**
+ * Describe a game packet type to clients; registering the same type again replaces it
+ * Clients receive the registry once and skip it while it stays unchanged
+ * Call before neon_host_start
+ * @param host Host handle
+ * @param packet_type Game packet type (0x10+)
+ * @param name Short name (truncated to 255 bytes)
+ * @param description Description (truncated to 255 bytes)
+ * @return true on success, false on failure
+ */
+bool neon_host_register_packet_type(NeonHostHandle* host, uint8_t packet_type, const char* name, const char* description);
+
+/**
+ * Compress payloads of a registered packet type
+ * The host and clients then send the type's packets LZ4 compressed whenever that
+ * makes them smaller; receivers inflate them before they reach any callback
+ * Call after neon_host_register_packet_type and before clients join
+ * @param host Host handle
+ * @param packet_type Registered game packet type
+ * @param compressed Whether to compress the type
+ * @return true on success, false if the type isn't registered
+ */
+bool neon_host_set_packet_type_compressed(NeonHostHandle* host, uint8_t packet_type, bool compressed);
+
 /**
  * Set callback for client connect events
  * @param host Host handle
@@ -205,6 +619,13 @@ void neon_host_set_client_connect_callback(NeonHostHandle* host, ClientConnectCa
  */
 void neon_host_set_client_deny_callback(NeonHostHandle* host, ClientDenyCallback callback);
 
+/**
+ * Set callback for client disconnect events
+ * @param host Host handle
+ * @param callback Callback function pointer
+ */
+void neon_host_set_client_disconnect_callback(NeonHostHandle* host, ClientDisconnectCallback callback);
+
 /**
  * Set callback for ping received events
  * @param host Host handle
@@ -212,6 +633,14 @@ void neon_host_set_client_deny_callback(NeonHostHandle* host, ClientDenyCallback
  */
 void neon_host_set_ping_received_callback(NeonHostHandle* host, PingReceivedCallback callback);
 
+/**
+ * Set callback for game packet events (0x10+)
+ * When no game packet callback is set, game packets go to the unhandled packet callback
+ * @param host Host handle
+ * @param callback Callback function pointer
+ */
+void neon_host_set_game_packet_callback(NeonHostHandle* host, GamePacketCallback callback);
+
 /**
  * Set callback for unhandled packet events
  * @param host Host handle
@@ -221,6 +650,7 @@ void neon_host_set_unhandled_packet_callback(NeonHostHandle* host, HostUnhandled
 
 /**
  * Get the host's session ID
+ * Safe to call from any thread, including while the host is running
  * @param host Host handle
  * @return Session ID
  */
@@ -228,11 +658,195 @@ uint32_t neon_host_get_session_id(NeonHostHandle* host);
 
 /**
  * Get the number of connected clients
+ * Safe to call from any thread, including while the host is running
  * @param host Host handle
  * @return Number of connected clients
  */
 size_t neon_host_get_client_count(NeonHostHandle* host);
 
+/**
+ * Forget a connected client, e.g. one the game kicked, so its ID and name can be reused
+ * Call from the thread polling the host, not while neon_host_start is running
+ * @param host Host handle
+ * @param client_id Client ID to remove
+ * @return true if the client was connected, false otherwise
+ */
+bool neon_host_remove_client(NeonHostHandle* host, uint8_t client_id);
+
+/**
+ * Set the max packet size for the session (call before neon_host_start)
+ * Clients receive it in their session config; values outside 512-65507 are clamped
+ * @param host Host handle
+ * @param size Max packet size in bytes, header included
+ */
+void neon_host_set_max_packet_size(NeonHostHandle* host, uint16_t size);
+
+/**
+ * Set how long the relay keeps a client of this session that has gone silent
+ * (call before neon_host_start or the first neon_host_poll, it is sent with the registration)
+ * @param host Host handle
+ * @param timeout_ms Idle timeout in milliseconds; 0 keeps the relay's default (15 s unless configured)
+ */
+void neon_host_set_peer_timeout(NeonHostHandle* host, uint32_t timeout_ms);
+
+/**
+ * Get the max packet size announced to joining clients
+ * Safe to call from any thread, including while the host is running
+ * @param host Host handle
+ * @return Max packet size in bytes, header included
+ */
+uint16_t neon_host_get_max_packet_size(NeonHostHandle* host);
+
+/**
+ * Get the link estimates for a client
+ * @param host Host handle
+ * @param client_id Client to query
+ * @param stats Filled in on success
+ * @return true on success, false if nothing has been exchanged with that client yet
+ */
+bool neon_host_get_link_stats(NeonHostHandle* host, uint8_t client_id, NeonLinkStats* stats);
+
+/**
+ * Set how readily packets of a game type are shed when a client's link is congested
+ * Entity snapshots use their packet type's priority; broadcasts and multicasts are never paced
+ * @param host Host handle
+ * @param packet_type Game packet type (0x10+)
+ * @param priority One of NeonPriority
+ * @return true on success, false for an unknown priority
+ */
+bool neon_host_set_packet_priority(NeonHostHandle* host, uint8_t packet_type, uint8_t priority);
+
+/**
+ * Ask the OS for the path MTU towards the relay and use the largest packet
+ * size that avoids IP fragmentation (Linux only)
+ * @param host Host handle
+ * @return The applied max packet size, or 0 on failure (see neon_get_last_error)
+ */
+uint16_t neon_host_probe_path_mtu(NeonHostHandle* host);
+
+/**
+ * Send a game packet to a client in the session
+ * The header and payload are written into a reusable send buffer, no allocation is made
+ * @param host Host handle
+ * @param packet_type Game-defined packet type (must be 0x10 or above)
+ * @param destination_id Target client ID (0 = every client)
+ * @param data Payload bytes (may be NULL if len is 0)
+ * @param len Payload length in bytes
+ * @return true on success, false on failure or if the packet was shed (see NeonPriority)
+ */
+bool neon_host_send(NeonHostHandle* host, uint8_t packet_type, uint8_t destination_id, const uint8_t* data, size_t len);
+
+/**
+ * Send one game packet that the relay copies to every listed client
+ * Only one copy leaves this machine; the relay fans it out
+ * @param host Host handle
+ * @param packet_type Game-defined packet type (must be 0x10 or above)
+ * @param targets Client IDs to deliver to (may be NULL if target_count is 0)
+ * @param target_count Number of entries in targets
+ * @param data Payload bytes (may be NULL if len is 0)
+ * @param len Payload length in bytes (33 bytes less than plain sends allow)
+ * @return true on success, false on failure
+ */
+bool neon_host_send_multicast(NeonHostHandle* host, uint8_t packet_type, const uint8_t* targets, size_t target_count, const uint8_t* data, size_t len);
+
+/**
+ * Send a game packet to a client in the session on a delivery channel
+ * Reliable packets are resent with RTT-based timeouts until acknowledged. Up to 256 per
+ * channel wait while the peer falls behind; past that the send fails.
+ * @param host Host handle
+ * @param channel One of NeonChannel
+ * @param packet_type Game-defined packet type (must be 0x10 or above)
+ * @param destination_id Target client ID
+ * @param data Payload bytes (may be NULL if len is 0)
+ * @param len Payload length in bytes (8 bytes less than plain sends allow)
+ * @return true on success, false on failure or if the packet was shed (see NeonPriority)
+ */
+bool neon_host_send_on_channel(NeonHostHandle* host, uint8_t channel, uint8_t packet_type, uint8_t destination_id, const uint8_t* data, size_t len);
+
+/**
+ * Replicate entities to clients as delta-compressed snapshots
+ * Entities are opaque byte blobs. Each client gets what changed since the last
+ * snapshot it acknowledged: a bitmask of changed bytes plus their XOR with that
+ * baseline. Entities that don't fit the budget keep their old state until a later tick.
+ * @param host Host handle
+ * @param packet_type Game packet type snapshots travel as (must be 0x10 or above)
+ * @param bytes_per_second Downstream budget per client; each snapshot gets this divided by the tick rate
+ * @return true on success, false on failure
+ */
+bool neon_host_enable_replication(NeonHostHandle* host, uint8_t packet_type, uint32_t bytes_per_second);
+
+/**
+ * Add a replicated entity, sent to clients on the next neon_host_flush_entities
+ * @param host Host handle
+ * @param entity_id Game-defined entity ID (must not be registered yet)
+ * @param state Entity state (may be NULL if len is 0)
+ * @param len State length in bytes
+ * @return true on success, false on failure
+ */
+bool neon_host_register_entity(NeonHostHandle* host, uint16_t entity_id, const uint8_t* state, size_t len);
+
+/**
+ * Replace a registered entity's state
+ * Keeping the length the same lets clients receive only the changed bytes
+ * @param host Host handle
+ * @param entity_id Registered entity ID
+ * @param state Entity state (may be NULL if len is 0)
+ * @param len State length in bytes
+ * @return true on success, false on failure
+ */
+bool neon_host_update_entity(NeonHostHandle* host, uint16_t entity_id, const uint8_t* state, size_t len);
+
+/**
+ * Remove a replicated entity; clients are told on the next neon_host_flush_entities
+ * @param host Host handle
+ * @param entity_id Registered entity ID
+ * @return true if the entity was registered
+ */
+bool neon_host_remove_entity(NeonHostHandle* host, uint16_t entity_id);
+
+/**
+ * Send every connected client a snapshot of its changed entities; call once per tick
+ * Clients that are already up to date are sent nothing.
+ * @param host Host handle
+ * @return true on success, false on failure
+ */
+bool neon_host_flush_entities(NeonHostHandle* host);
+
+/**
+ * Enable or disable packet bundling. While enabled, game, channel and ack
+ * messages are coalesced into datagrams of up to the max packet size; the
+ * relay splits bundles by destination. A running host flushes after each loop iteration.
+ * Disabling bundling flushes anything pending.
+ * @param host Host handle
+ * @param enabled true to bundle outgoing messages
+ * @return true on success, false on failure
+ */
+bool neon_host_set_bundling(NeonHostHandle* host, bool enabled);
+
+/**
+ * Record every datagram the host receives, with its arrival time and source, to a
+ * capture file at path, replacing the file and any capture in progress. A background
+ * thread writes the file; datagrams it can't keep up with are left out.
+ * The file format is described in the README
+ * @param host Host handle
+ * @param path File path
+ * @return true on success, false on failure
+ */
+bool neon_host_start_capture(NeonHostHandle* host, const char* path);
+
+/**
+ * Finish the capture in progress, writing out everything recorded
+ * @param host Host handle
+ */
+void neon_host_stop_capture(NeonHostHandle* host);
+
+/**
+ * Send the pending bundle, if any
+ * @param host Host handle
+ * @return true on success, false on failure
+ */
+bool neon_host_flush(NeonHostHandle* host);
+
 /**
  * Start the host (BLOCKING CALL - run in a separate thread!)
  * This function will block until an error occurs
@@ -242,12 +856,64 @@ size_t neon_host_get_client_count(NeonHostHandle* host);
  */
 bool neon_host_start(NeonHostHandle* host);
 
+/**
+ * Handle whatever I/O is ready, then return: the non-blocking alternative to neon_host_start
+ * Call it every game tick; callbacks run on the calling thread. The first call
+ * registers the session with the relay. Other host functions, apart from the
+ * getters above, must be called from the thread that polls.
+ * @param host Host handle
+ * @param timeout_us Longest time to wait for a datagram (0 = don't wait, rounded up to milliseconds)
+ * @return true on success, false on failure
+ */
+bool neon_host_poll(NeonHostHandle* host, uint32_t timeout_us);
+
 /**
  * Free the host and release resources
  * @param host Host handle
  */
 void neon_host_free(NeonHostHandle* host);
 
+/**
+ * Set the most verbose log level that is kept
+ * Messages are formatted into a lock-free queue and written by a background thread,
+ * so logging never blocks the networking code; repeated per-packet warnings are rate limited
+ * @param level One of NeonLogLevel
+ * @return true on success, false for an unknown level
+ */
+bool neon_set_log_level(uint8_t level);
+
+/**
+ * Get the current log level
+ * @return One of NeonLogLevel
+ */
+uint8_t neon_get_log_level(void);
+
+/**
+ * Send log messages to a callback instead of stdout
+ * The callback runs on the library's logger thread and must not call neon_set_log_callback
+ * @param callback Callback to receive messages, or NULL to restore stdout
+ */
+void neon_set_log_callback(NeonLogCallback callback);
+
+/**
+ * Encode a packet header into a caller-provided buffer
+ * @param header Header to encode
+ * @param out Buffer to write to
+ * @param out_len Size of the buffer, at least NEON_PACKET_HEADER_SIZE
+ * @return Bytes written (NEON_PACKET_HEADER_SIZE), or 0 on failure
+ */
+size_t neon_encode_header(const NeonPacketHeader* header, uint8_t* out, size_t out_len);
+
+/**
+ * Decode the header at the front of a received datagram
+ * The payload starts NEON_PACKET_HEADER_SIZE bytes into data
+ * @param data Received bytes
+ * @param len Number of bytes received
+ * @param out Header to fill in
+ * @return true on success, false if the data is too short or the magic number is wrong
+ */
+bool neon_decode_header(const uint8_t* data, size_t len, NeonPacketHeader* out);
+
 /**
  * Get the last error message
  * @return Error message, or NULL if no error
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include "project_neon.h"
@@ -22,6 +23,11 @@ void on_packet_type_registry(size_t count, const uint8_t* ids, const char** name
     }
 }
 
+void on_game_packet(uint8_t packet_type, uint8_t from_client_id, const uint8_t* payload, size_t len) {
+    printf("[Client Callback] Game packet type 0x%02X from client %u (%zu bytes): %.*s\n",
+           packet_type, from_client_id, len, (int)len, (const char*)payload);
+}
+
 void on_unhandled_packet(uint8_t packet_type, uint8_t from_client_id) {
     printf("[Client Callback] Unhandled packet type %u from client %u\n", 
            packet_type, from_client_id);
@@ -32,7 +38,63 @@ void on_wrong_destination(uint8_t my_id, uint8_t packet_destination_id) {
            my_id, packet_destination_id);
 }
 
+void on_connect_result(bool success, uint8_t client_id, uint32_t session_id, const char* reason) {
+    if (success) {
+        printf("[Client Callback] Connected to session %u as client %u\n", session_id, client_id);
+    } else {
+        printf("[Client Callback] Connect to session %u failed: %s\n", session_id, reason);
+    }
+}
+
+// Client 1 keeps the newest replicated state of entity 1
+static char entity_state[32];
+static int entity_updates = 0;
+
+void on_entity_update(uint16_t entity_id, const uint8_t* state, size_t len) {
+    if (entity_id == 1 && state && len < sizeof(entity_state)) {
+        memcpy(entity_state, state, len);
+        entity_state[len] = '\0';
+        entity_updates++;
+    }
+}
+
+// Client 2 takes its events from the queue instead, in batches
+void drain_events(NeonClientHandle* client) {
+    NeonEvent events[32];
+    size_t count;
+    while ((count = neon_client_poll_events(client, events, 32)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            const NeonEvent* event = &events[i];
+            switch (event->kind) {
+                case NEON_EVENT_GAME_PACKET:
+                    on_game_packet(event->packet_type, event->from_client_id,
+                                   neon_client_event_payload(client, event), event->payload_len);
+                    break;
+                case NEON_EVENT_PONG:
+                    on_pong(event->response_time_ms, event->timestamp);
+                    break;
+                case NEON_EVENT_SESSION_CONFIG:
+                    on_session_config(event->version, event->tick_rate, event->max_packet_size);
+                    break;
+                case NEON_EVENT_PACKET_TYPE_REGISTRY:
+                    printf("[Client Events] Packet Type Registry cached\n");
+                    break;
+                case NEON_EVENT_UNHANDLED_PACKET:
+                    on_unhandled_packet(event->packet_type, event->from_client_id);
+                    break;
+                case NEON_EVENT_WRONG_DESTINATION:
+                    on_wrong_destination(neon_client_get_id(client), event->destination_id);
+                    break;
+            }
+        }
+    }
+}
+
 // Host callbacks
+void on_log(uint8_t level, const char* message) {
+    printf("[Log %u] %s\n", level, message);
+}
+
 void on_client_connect(uint8_t client_id, const char* name, uint32_t session_id) {
     printf("[Host Callback] Client connected! ID: %u, Name: %s, Session: %u\n",
            client_id, name, session_id);
@@ -43,23 +105,46 @@ void on_client_deny(const char* name, const char* reason) {
            name, reason);
 }
 
+void on_client_disconnect(uint8_t client_id, const char* name) {
+    printf("[Host Callback] Client disconnected! ID: %u, Name: %s\n", client_id, name);
+}
+
 void on_ping_received(uint8_t from_client_id) {
     printf("[Host Callback] Ping received from client %u\n", from_client_id);
 }
 
+void on_host_game_packet(uint8_t packet_type, uint8_t from_client_id, const uint8_t* payload, size_t len) {
+    printf("[Host Callback] Game packet type 0x%02X from client %u (%zu bytes): %.*s\n",
+           packet_type, from_client_id, len, (int)len, (const char*)payload);
+}
+
 void on_host_unhandled_packet(uint8_t packet_type, uint8_t from_client_id) {
     printf("[Host Callback] Unhandled packet type %u from client %u\n",
            packet_type, from_client_id);
 }
 
+// Stands in for a game loop driving the host each tick
+static volatile bool host_running = true;
+
 void* host_thread_func(void* arg) {
     NeonHostHandle* host = (NeonHostHandle*)arg;
-    printf("[Host Thread] Starting host...\n");
+    printf("[Host Thread] Polling host...\n");
     
-    if (!neon_host_start(host)) {
-        printf("[Host Thread] Failed to start host\n");
-        const char* err = neon_get_last_error();
-        if (err) printf("[Host Thread] Error: %s\n", err);
+    uint32_t tick = 0;
+    while (host_running) {
+        if (!neon_host_poll(host, 10000)) {
+            printf("[Host Thread] Host poll failed\n");
+            const char* err = neon_get_last_error();
+            if (err) printf("[Host Thread] Error: %s\n", err);
+            break;
+        }
+        // Replicate a changing entity every tenth poll
+        if (++tick % 10 == 0) {
+            char state[16];
+            snprintf(state, sizeof(state), "tick %08u", tick / 10);
+            neon_host_update_entity(host, 1, (const uint8_t*)state, strlen(state));
+            neon_host_flush_entities(host);
+        }
     }
     
     return NULL;
@@ -68,9 +153,25 @@ void* host_thread_func(void* arg) {
 int main() {
     const char* relay_addr = "127.0.0.1:7777";
     uint32_t session_id = 12345;
+
+    // Library logs come through the callback on the logger thread
+    neon_set_log_callback(on_log);
+    neon_set_log_level(NEON_LOG_DEBUG);
     
     printf("=== Project Neon Callback Test ===\n");
     printf("Make sure relay is running at %s\n\n", relay_addr);
+
+    // Header codec for engines doing their own I/O
+    NeonPacketHeader header = { 0x4E45, 1, 0x10, 513, 2, 1 };
+    uint8_t wire[NEON_PACKET_HEADER_SIZE];
+    NeonPacketHeader decoded;
+    if (neon_encode_header(&header, wire, sizeof(wire)) != NEON_PACKET_HEADER_SIZE
+        || !neon_decode_header(wire, sizeof(wire), &decoded)
+        || decoded.sequence != 513 || decoded.packet_type != 0x10 || decoded.destination_id != 1) {
+        printf("[Main] Header encode/decode round trip failed\n");
+        return 1;
+    }
+    printf("[Main] Header codec round trip OK\n");
     
     // Create and configure host
     printf("[Main] Creating host for session %u...\n", session_id);
@@ -87,8 +188,21 @@ int main() {
     printf("[Main] Registering host callbacks...\n");
     neon_host_set_client_connect_callback(host, on_client_connect);
     neon_host_set_client_deny_callback(host, on_client_deny);
+    neon_host_set_client_disconnect_callback(host, on_client_disconnect);
     neon_host_set_ping_received_callback(host, on_ping_received);
+    neon_host_set_game_packet_callback(host, on_host_game_packet);
     neon_host_set_unhandled_packet_callback(host, on_host_unhandled_packet);
+    neon_host_set_max_packet_size(host, 1400);
+    neon_host_set_peer_timeout(host, 20000);
+    printf("[Main] Host max packet size: %u bytes\n", neon_host_get_max_packet_size(host));
+    neon_host_register_packet_type(host, 0x10, "Greeting", "Text sent to the host");
+    neon_host_register_packet_type(host, 0x11, "Reply", "Text sent to a client");
+    neon_host_register_packet_type(host, 0x13, "Shout", "Text broadcast to the session");
+    const char* initial_state = "tick 00000000";
+    if (!neon_host_enable_replication(host, 0x30, 16 * 1024)
+        || !neon_host_register_entity(host, 1, (const uint8_t*)initial_state, strlen(initial_state))) {
+        printf("[Main] Failed to set up entity replication\n");
+    }
     
     // Start host in separate thread
     pthread_t host_thread;
@@ -119,15 +233,30 @@ int main() {
     neon_client_set_pong_callback(client1, on_pong);
     neon_client_set_session_config_callback(client1, on_session_config);
     neon_client_set_packet_type_registry_callback(client1, on_packet_type_registry);
+    neon_client_set_game_packet_callback(client1, on_game_packet);
     neon_client_set_unhandled_packet_callback(client1, on_unhandled_packet);
     neon_client_set_wrong_destination_callback(client1, on_wrong_destination);
+    // Client 1 reads on a background thread and reorders game packets
+    if (!neon_client_start_receive_thread(client1)) {
+        printf("[Main] Failed to start client 1 receive thread\n");
+    }
+    neon_client_set_jitter_buffer(client1, 20);
+    neon_client_enable_replication(client1, 0x30);
+    neon_client_set_entity_callback(client1, on_entity_update);
     
     printf("[Main] Registering client 2 callbacks...\n");
     neon_client_set_pong_callback(client2, on_pong);
     neon_client_set_session_config_callback(client2, on_session_config);
     neon_client_set_packet_type_registry_callback(client2, on_packet_type_registry);
+    neon_client_set_game_packet_callback(client2, on_game_packet);
     neon_client_set_unhandled_packet_callback(client2, on_unhandled_packet);
     neon_client_set_wrong_destination_callback(client2, on_wrong_destination);
+    neon_client_set_connect_result_callback(client2, on_connect_result);
+    if (!neon_client_enable_event_queue(client2, 256, 64 * 1024)) {
+        printf("[Main] Failed to enable client 2 event queue\n");
+    }
+    // Client 2 applies snapshots too, it just doesn't watch for changes
+    neon_client_enable_replication(client2, 0x30);
     
     // Connect client 1
     printf("\n[Main] Connecting client 1...\n");
@@ -141,12 +270,18 @@ int main() {
     
     sleep(1);
     
-    // Connect client 2
-    printf("\n[Main] Connecting client 2...\n");
-    if (neon_client_connect(client2, session_id, relay_addr)) {
-        printf("[Main] Client 2 connected! ID: %u\n", neon_client_get_id(client2));
+    // Connect client 2 without blocking, polling until the host answers
+    printf("\n[Main] Connecting client 2 asynchronously...\n");
+    if (neon_client_connect_async(client2, session_id, relay_addr)) {
+        while (neon_client_is_connecting(client2)) {
+            neon_client_process_packets(client2);
+            usleep(10000); // 10ms
+        }
+        if (neon_client_is_connected(client2)) {
+            printf("[Main] Client 2 connected! ID: %u\n", neon_client_get_id(client2));
+        }
     } else {
-        printf("[Main] Client 2 failed to connect\n");
+        printf("[Main] Client 2 failed to start connecting\n");
         const char* err = neon_get_last_error();
         if (err) printf("[Main] Error: %s\n", err);
     }
@@ -171,6 +306,38 @@ int main() {
         printf("[Main] Failed to send ping from client 2\n");
     }
     
+    // Test game packets
+    printf("\n[Main] Testing game packets...\n");
+    // Client 1 bundles its sends; the relay splits the bundle between host and client 2
+    neon_client_set_bundling(client1, true);
+    const char* to_host = "hello host";
+    if (!neon_client_send(client1, 0x10, 1, (const uint8_t*)to_host, strlen(to_host))) {
+        printf("[Main] Failed to send game packet to host\n");
+    }
+    const char* to_peer = "hello client 2";
+    if (!neon_client_send(client1, 0x11, neon_client_get_id(client2), (const uint8_t*)to_peer, strlen(to_peer))) {
+        printf("[Main] Failed to send game packet to client 2\n");
+    }
+    const char* ordered[] = { "ordered 1", "ordered 2", "ordered 3" };
+    for (int i = 0; i < 3; i++) {
+        if (!neon_client_send_on_channel(client1, NEON_CHANNEL_RELIABLE_ORDERED, 0x12, 1,
+                                         (const uint8_t*)ordered[i], strlen(ordered[i]))) {
+            printf("[Main] Failed to send reliable packet to host\n");
+        }
+    }
+    const char* to_all = "hello everyone";
+    if (!neon_client_send(client1, 0x13, 0, (const uint8_t*)to_all, strlen(to_all))) {
+        printf("[Main] Failed to broadcast game packet\n");
+    }
+    const uint8_t group[] = { 1, neon_client_get_id(client1) };
+    const char* to_group = "hello group";
+    if (!neon_client_send_multicast(client2, 0x14, group, 2, (const uint8_t*)to_group, strlen(to_group))) {
+        printf("[Main] Failed to multicast game packet\n");
+    }
+    if (!neon_client_flush(client1)) {
+        printf("[Main] Failed to flush client 1 bundle\n");
+    }
+    
     // Run main processing loop
     printf("\n[Main] Running clients for 15 seconds...\n");
     printf("[Main] Auto-ping is enabled by default (every 5 seconds)\n\n");
@@ -180,11 +347,13 @@ int main() {
             if (!neon_client_process_packets(client1)) {
                 printf("[Main] Client 1 process_packets failed\n");
             }
+            neon_client_flush(client1);
         }
         if (neon_client_is_connected(client2)) {
             if (!neon_client_process_packets(client2)) {
                 printf("[Main] Client 2 process_packets failed\n");
             }
+            drain_events(client2);
         }
         usleep(100000); // 100ms
         
@@ -198,15 +367,44 @@ int main() {
         }
     }
     
+    printf("\n[Main] Client 1 max packet size: %u bytes\n", neon_client_get_max_packet_size(client1));
+    printf("[Main] Client 1 entity 1 is \"%s\" after %d updates\n", entity_state, entity_updates);
+    NeonLinkStats link;
+    if (neon_client_get_link_stats(client1, 1, &link)) {
+        printf("[Main] Client 1 link to host: rtt %u us, loss %.2f, %u bytes/s, %llu bytes sent\n",
+               link.rtt_us, link.loss, link.send_rate, (unsigned long long)link.bytes_sent);
+    }
+    // A new socket stands in for a changed address; the relay moves client 1 without the host
+    if (neon_client_resume(client1)) {
+        printf("[Main] Client 1 resumed on a new socket as client %u\n", neon_client_get_id(client1));
+    } else {
+        const char* err = neon_get_last_error();
+        printf("[Main] Client 1 failed to resume: %s\n", err ? err : "unknown error");
+    }
+    // Registry lookups read the client's cached copy
+    const char* type_name = NULL;
+    if (neon_client_lookup_packet_type(client2, 0x13, &type_name, NULL)) {
+        printf("[Main] Client 2 knows packet 0x13 as %s\n", type_name);
+    } else {
+        printf("[Main] Client 2 has no registry entry for 0x13\n");
+    }
+
+    // Leaving frees client 2's id on the host for whoever joins next
+    if (!neon_client_disconnect(client2)) {
+        printf("[Main] Client 2 failed to disconnect\n");
+    }
+    usleep(200000);
+    printf("[Main] Host has %zu client(s) after client 2 left\n", neon_host_get_client_count(host));
+
     printf("\n[Main] Cleaning up...\n");
     neon_client_free(client1);
     neon_client_free(client2);
     
-    printf("[Main] Test complete!\n");
-    printf("[Main] Press Ctrl+C to exit (host thread still running)\n");
-    
+    host_running = false;
     pthread_join(host_thread, NULL);
     neon_host_free(host);
     
+    printf("[Main] Test complete!\n");
+    
     return 0;
 }
\ No newline at end of file